@@ -0,0 +1,382 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Runs a NeulandWindow on top of the fake tox backend, which makes up
+   contacts and incoming events at the given rates, and reports how
+   the main loop keeps up: the lag of the tox event queue, the time
+   spent painting frames and the growth of the resident memory. */
+
+#include <unistd.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include "neuland-window.h"
+#include "neuland-tox-fake.h"
+
+#define PROBE_INTERVAL 10 /* milliseconds */
+#define FRAME_BUDGET 16667 /* microseconds, one frame at 60 Hz */
+
+/* The integer fields are set from the options below in on_activate () */
+static NeulandToxFakeConfig config = {
+  0,                    /* n_contacts */
+  0.5,                  /* online_share */
+  100,                  /* message_rate */
+  100,                  /* status_rate */
+  0,                    /* request_rate */
+  0,                    /* n_incoming_files */
+  0,                    /* incoming_file_size */
+  0,                    /* incoming_file_rate */
+  0,                    /* seed */
+};
+static gint n_contacts = 1000;
+static gint n_files = 0;
+static gint64 file_size = 16 * 1024 * 1024;
+static gint64 file_rate = 0;
+static gint seed = 1;
+static gint duration = 30;
+
+static GOptionEntry entries[] = {
+  { "contacts", 'c', 0, G_OPTION_ARG_INT, &n_contacts, "Number of contacts", "N" },
+  { "online", 'o', 0, G_OPTION_ARG_DOUBLE, &config.online_share,
+    "Share of the contacts online at the start", "0..1" },
+  { "messages", 'm', 0, G_OPTION_ARG_DOUBLE, &config.message_rate,
+    "Incoming messages per second", "RATE" },
+  { "status", 's', 0, G_OPTION_ARG_DOUBLE, &config.status_rate,
+    "Contact status changes per second", "RATE" },
+  { "requests", 'r', 0, G_OPTION_ARG_DOUBLE, &config.request_rate,
+    "Contact requests per second", "RATE" },
+  { "files", 'f', 0, G_OPTION_ARG_INT, &n_files, "Incoming files, accepted right away", "N" },
+  { "file-size", 0, 0, G_OPTION_ARG_INT64, &file_size,
+    "Size of each incoming file in bytes", "BYTES" },
+  { "file-rate", 0, 0, G_OPTION_ARG_INT64, &file_rate,
+    "Bytes per second and incoming file, 0 for no limit", "RATE" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Seed of the fake events", "N" },
+  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Seconds to run", "SECONDS" },
+  { NULL }
+};
+
+typedef struct
+{
+  GtkApplication *application;
+  NeulandTox *tox;
+  GtkWidget *window;
+  gchar *dir;
+
+  gint64 start_time;
+  gint64 last_probe;
+  gint64 max_lag;
+  gint64 total_lag;
+  guint n_probes;
+
+  gint64 paint_start;
+  GArray *paint_times;      /* gint64 microseconds per frame */
+
+  gsize start_rss;
+  gsize loaded_rss;
+  gsize max_rss;
+} Benchmark;
+
+static gsize
+get_resident_size (void)
+{
+  gchar *contents;
+  gsize resident = 0;
+
+  /* The second field is the resident set size in pages. */
+  if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+    {
+      gchar **fields = g_strsplit (contents, " ", 3);
+
+      if (g_strv_length (fields) >= 2)
+        resident = g_ascii_strtoull (fields[1], NULL, 10) * sysconf (_SC_PAGESIZE);
+
+      g_strfreev (fields);
+      g_free (contents);
+    }
+
+  return resident;
+}
+
+static void
+remove_dir (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *file_path = g_build_filename (path, name, NULL);
+
+      g_unlink (file_path);
+      g_free (file_path);
+    }
+
+  if (dir != NULL)
+    g_dir_close (dir);
+  g_rmdir (path);
+}
+
+static gboolean
+on_probe (gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  gint64 now = g_get_monotonic_time ();
+  gint64 lag = now - benchmark->last_probe - PROBE_INTERVAL * 1000;
+
+  lag = MAX (lag, 0);
+  benchmark->max_lag = MAX (benchmark->max_lag, lag);
+  benchmark->total_lag += lag;
+  benchmark->n_probes++;
+  benchmark->last_probe = now;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_sample_memory (gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  benchmark->max_rss = MAX (benchmark->max_rss, get_resident_size ());
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+on_before_paint (GdkFrameClock *frame_clock,
+                 gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  benchmark->paint_start = g_get_monotonic_time ();
+}
+
+static void
+on_after_paint (GdkFrameClock *frame_clock,
+                gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  gint64 paint_time = g_get_monotonic_time () - benchmark->paint_start;
+
+  if (benchmark->paint_start > 0)
+    g_array_append_val (benchmark->paint_times, paint_time);
+}
+
+static void
+on_new_transfer (NeulandContact *contact,
+                 NeulandFileTransfer *file_transfer,
+                 gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  gchar *name;
+  gchar *path;
+  GFile *file;
+
+  if (neuland_file_transfer_get_direction (file_transfer) !=
+      NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
+    return;
+
+  name = g_strdup_printf ("%p-%s", file_transfer,
+                          neuland_file_transfer_get_file_name (file_transfer));
+  path = g_build_filename (benchmark->dir, name, NULL);
+  file = g_file_new_for_path (path);
+
+  neuland_file_transfer_set_file (file_transfer, file);
+  neuland_file_transfer_set_requested_state (file_transfer,
+                                             NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS);
+  g_object_unref (file);
+  g_free (path);
+  g_free (name);
+}
+
+static void
+on_contact_add (NeulandTox *tox,
+                NeulandContact *contact,
+                gpointer user_data)
+{
+  g_signal_connect (contact, "new-transfer", G_CALLBACK (on_new_transfer), user_data);
+}
+
+static gint
+compare_times (gconstpointer a,
+               gconstpointer b)
+{
+  gint64 time_a = *(const gint64 *)a;
+  gint64 time_b = *(const gint64 *)b;
+
+  return time_a < time_b ? -1 : time_a > time_b;
+}
+
+static void
+print_results (Benchmark *benchmark)
+{
+  NeulandToxEventStats stats;
+  GArray *paint_times = benchmark->paint_times;
+  gdouble seconds = (g_get_monotonic_time () - benchmark->start_time) / 1e6;
+  gsize end_rss = get_resident_size ();
+  gint64 total_paint_time = 0;
+  guint n_slow_frames = 0;
+  gchar *start_rss, *loaded_rss, *max_rss, *rss;
+  guint i;
+
+  neuland_tox_get_event_stats (benchmark->tox, &stats);
+  g_print ("Tox events: %" G_GUINT64_FORMAT " handled in %.1f s (%.0f/s), "
+           "%.2f ms average and %.2f ms max lag, %i max queued\n",
+           stats.drained, seconds, stats.drained / seconds,
+           stats.drained > 0 ? stats.total_latency / 1e3 / stats.drained : 0,
+           stats.max_latency / 1e3, stats.max_depth);
+
+  g_print ("Main loop lag: %.2f ms average, %.2f ms max\n",
+           benchmark->n_probes > 0 ? benchmark->total_lag / 1e3 / benchmark->n_probes : 0,
+           benchmark->max_lag / 1e3);
+
+  g_array_sort (paint_times, compare_times);
+  for (i = 0; i < paint_times->len; i++)
+    {
+      gint64 paint_time = g_array_index (paint_times, gint64, i);
+
+      total_paint_time += paint_time;
+      if (paint_time > FRAME_BUDGET)
+        n_slow_frames++;
+    }
+
+  if (paint_times->len > 0)
+    g_print ("Frames: %u painted, %.2f ms average, %.2f ms 95th percentile, "
+             "%.2f ms max, %u over %.1f ms\n",
+             paint_times->len,
+             total_paint_time / 1e3 / paint_times->len,
+             g_array_index (paint_times, gint64, paint_times->len * 95 / 100) / 1e3,
+             g_array_index (paint_times, gint64, paint_times->len - 1) / 1e3,
+             n_slow_frames, FRAME_BUDGET / 1e3);
+  else
+    g_print ("Frames: none painted\n");
+
+  benchmark->max_rss = MAX (benchmark->max_rss, end_rss);
+  start_rss = g_format_size (benchmark->start_rss);
+  loaded_rss = g_format_size (benchmark->loaded_rss);
+  max_rss = g_format_size (benchmark->max_rss);
+  rss = g_format_size (end_rss > benchmark->loaded_rss ? end_rss - benchmark->loaded_rss : 0);
+  g_print ("Resident memory: %s at start, %s with the window, %s max, %s growth "
+           "while running\n",
+           start_rss, loaded_rss, max_rss, rss);
+
+  g_free (start_rss);
+  g_free (loaded_rss);
+  g_free (max_rss);
+  g_free (rss);
+}
+
+static gboolean
+on_duration_over (gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  print_results (benchmark);
+  gtk_widget_destroy (benchmark->window);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_activate (GApplication *application,
+             gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  GdkFrameClock *frame_clock;
+  GList *contacts, *l;
+
+  benchmark->start_rss = get_resident_size ();
+
+  config.n_contacts = n_contacts;
+  config.n_incoming_files = n_files;
+  config.incoming_file_size = file_size;
+  config.incoming_file_rate = file_rate;
+  config.seed = seed;
+
+  benchmark->tox = neuland_tox_new_with_backend (neuland_tox_fake_get_backend (), &config);
+
+  contacts = neuland_tox_get_contacts (benchmark->tox);
+  for (l = contacts; l != NULL; l = l->next)
+    on_contact_add (benchmark->tox, l->data, benchmark);
+  g_list_free (contacts);
+  g_signal_connect (benchmark->tox, "contact-add", G_CALLBACK (on_contact_add), benchmark);
+
+  benchmark->window = neuland_window_new (benchmark->tox);
+  g_object_unref (benchmark->tox); // window now holds the only reference to tox
+  gtk_application_add_window (GTK_APPLICATION (application), GTK_WINDOW (benchmark->window));
+  gtk_widget_show_all (benchmark->window);
+
+  frame_clock = gtk_widget_get_frame_clock (benchmark->window);
+  g_signal_connect (frame_clock, "before-paint", G_CALLBACK (on_before_paint), benchmark);
+  g_signal_connect (frame_clock, "after-paint", G_CALLBACK (on_after_paint), benchmark);
+
+  benchmark->loaded_rss = benchmark->max_rss = get_resident_size ();
+  benchmark->start_time = benchmark->last_probe = g_get_monotonic_time ();
+  g_timeout_add (PROBE_INTERVAL, on_probe, benchmark);
+  g_timeout_add_seconds (1, on_sample_memory, benchmark);
+  g_timeout_add_seconds (duration, on_duration_over, benchmark);
+
+  g_print ("Running for %i seconds with %i contacts, %.0f messages, %.0f status changes "
+           "and %.0f requests per second, %i incoming files\n",
+           duration, n_contacts, config.message_rate, config.status_rate,
+           config.request_rate, n_files);
+}
+
+int
+main (int argc, char *argv[])
+{
+  Benchmark benchmark = { 0, };
+  GOptionContext *context;
+  GError *error = NULL;
+  gint ret;
+
+  context = g_option_context_new ("- benchmark the window under a simulated load");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gtk_get_option_group (TRUE));
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  benchmark.dir = g_dir_make_tmp ("neuland-benchmark-XXXXXX", &error);
+  if (benchmark.dir == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  benchmark.paint_times = g_array_new (FALSE, FALSE, sizeof (gint64));
+  benchmark.application = gtk_application_new ("org.tox.neuland.BenchmarkLoad",
+                                               G_APPLICATION_NON_UNIQUE);
+  g_signal_connect (benchmark.application, "activate", G_CALLBACK (on_activate), &benchmark);
+
+  ret = g_application_run (G_APPLICATION (benchmark.application), 1, argv);
+
+  /* Destroying the window dropped the last reference to the tox */
+  g_object_unref (benchmark.application);
+  g_array_free (benchmark.paint_times, TRUE);
+  remove_dir (benchmark.dir);
+  g_free (benchmark.dir);
+
+  return ret;
+}
@@ -0,0 +1,414 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sends files between two NeulandTox instances in this process, which
+   only know each other over 127.0.0.1, and reports the throughput,
+   the CPU time used and the latency of the main loop meanwhile. */
+
+#include <sys/resource.h>
+#include <glib/gstdio.h>
+
+#include "neuland-tox.h"
+
+/* toxcore binds the first free UDP port from FIRST_PORT on, and there
+   is no way to ask it which one, so we bootstrap to a few. */
+#define FIRST_PORT 33445
+#define N_PORTS 8
+
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+#define PROBE_INTERVAL 10 /* milliseconds */
+
+static gint64 file_size = 64 * 1024 * 1024;
+static gint n_files = 1;
+static gint timeout = 600;
+
+static GOptionEntry entries[] = {
+  { "size", 's', 0, G_OPTION_ARG_INT64, &file_size, "Size of each file in bytes", "BYTES" },
+  { "count", 'n', 0, G_OPTION_ARG_INT, &n_files, "Number of files sent at once", "N" },
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout, "Give up after this many seconds", "SECONDS" },
+  { NULL }
+};
+
+typedef struct
+{
+  GMainLoop *loop;
+  gchar *dir;
+  NeulandTox *sender;
+  NeulandTox *receiver;
+  gboolean started;
+  gint n_done;                  /* transfers of both sides */
+  gint n_failed;
+  GHashTable *checksums;        /* file name -> SHA-256 of the sent file */
+  gint n_mismatches;
+
+  gint64 start_time;
+  gint64 end_time;
+  struct rusage start_usage;
+  struct rusage end_usage;
+
+  gint64 last_probe;
+  gint64 max_latency;
+  gint64 total_latency;
+  guint n_probes;
+} Benchmark;
+
+static gdouble
+timeval_to_seconds (struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static gboolean
+create_file (const gchar *path,
+             GRand *rand)
+{
+  GFile *file = g_file_new_for_path (path);
+  GFileOutputStream *stream;
+  GError *error = NULL;
+  guint32 *block = g_malloc (WRITE_BLOCK_SIZE);
+  gint64 left = file_size;
+
+  stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
+
+  while (stream != NULL && left > 0 && error == NULL)
+    {
+      gsize length = MIN (left, WRITE_BLOCK_SIZE);
+      gint i;
+
+      for (i = 0; i < WRITE_BLOCK_SIZE / sizeof (guint32); i++)
+        block[i] = g_rand_int (rand);
+
+      g_output_stream_write_all (G_OUTPUT_STREAM (stream), block, length,
+                                 NULL, NULL, &error);
+      left -= length;
+    }
+
+  if (stream != NULL && error == NULL)
+    g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, &error);
+
+  if (error != NULL)
+    {
+      g_printerr ("Creating \"%s\" failed: %s\n", path, error->message);
+      g_error_free (error);
+    }
+
+  g_clear_object (&stream);
+  g_object_unref (file);
+  g_free (block);
+
+  return left == 0 && error == NULL;
+}
+
+static void
+remove_dir (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *file_path = g_build_filename (path, name, NULL);
+
+      g_unlink (file_path);
+      g_free (file_path);
+    }
+
+  if (dir != NULL)
+    g_dir_close (dir);
+  g_rmdir (path);
+}
+
+static gboolean
+on_probe (gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  gint64 now = g_get_monotonic_time ();
+  gint64 latency = now - benchmark->last_probe - PROBE_INTERVAL * 1000;
+
+  latency = MAX (latency, 0);
+  benchmark->max_latency = MAX (benchmark->max_latency, latency);
+  benchmark->total_latency += latency;
+  benchmark->n_probes++;
+  benchmark->last_probe = now;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_timeout (gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  g_printerr ("Timed out after %i seconds\n", timeout);
+  benchmark->n_failed++;
+  g_main_loop_quit (benchmark->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_file_transfer_state_changed (GObject *gobject,
+                                GParamSpec *pspec,
+                                gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (gobject);
+  const gchar *name = neuland_file_transfer_get_file_name (file_transfer);
+  const gchar *checksum = neuland_file_transfer_get_checksum (file_transfer);
+
+  switch (neuland_file_transfer_get_state (file_transfer))
+    {
+    case NEULAND_FILE_TRANSFER_STATE_FINISHED_CONFIRMED:
+      /* Whichever side finishes first leaves its checksum for the
+         other to compare. */
+      if (!g_hash_table_contains (benchmark->checksums, name))
+        g_hash_table_insert (benchmark->checksums, g_strdup (name), g_strdup (checksum));
+      else if (g_strcmp0 (g_hash_table_lookup (benchmark->checksums, name), checksum) != 0)
+        {
+          g_printerr ("Checksum mismatch for \"%s\"\n", name);
+          benchmark->n_mismatches++;
+        }
+      break;
+
+    case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US: /* fall through */
+    case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_CONTACT: /* fall through */
+    case NEULAND_FILE_TRANSFER_STATE_ERROR:
+      g_printerr ("Transfer of \"%s\" failed\n", name);
+      benchmark->n_failed++;
+      break;
+
+    default:
+      return;
+    }
+
+  if (++benchmark->n_done < 2 * n_files)
+    return;
+
+  benchmark->end_time = g_get_monotonic_time ();
+  getrusage (RUSAGE_SELF, &benchmark->end_usage);
+  g_main_loop_quit (benchmark->loop);
+}
+
+static void
+on_new_transfer (NeulandContact *contact,
+                 NeulandFileTransfer *file_transfer,
+                 gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  g_signal_connect (file_transfer, "notify::state",
+                    G_CALLBACK (on_file_transfer_state_changed), benchmark);
+
+  if (neuland_file_transfer_get_direction (file_transfer) ==
+      NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
+    {
+      gchar *name = g_strconcat ("received-",
+                                 neuland_file_transfer_get_file_name (file_transfer), NULL);
+      gchar *path = g_build_filename (benchmark->dir, name, NULL);
+      GFile *file = g_file_new_for_path (path);
+
+      neuland_file_transfer_set_file (file_transfer, file);
+      neuland_file_transfer_set_requested_state (file_transfer,
+                                                 NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS);
+      g_object_unref (file);
+      g_free (path);
+      g_free (name);
+    }
+}
+
+static void
+start_transfers (Benchmark *benchmark,
+                 NeulandContact *contact)
+{
+  gint i;
+
+  g_print ("Connected, sending %i file(s) of %" G_GINT64_FORMAT " bytes\n",
+           n_files, file_size);
+
+  benchmark->started = TRUE;
+  benchmark->start_time = benchmark->last_probe = g_get_monotonic_time ();
+  getrusage (RUSAGE_SELF, &benchmark->start_usage);
+  g_timeout_add (PROBE_INTERVAL, on_probe, benchmark);
+
+  for (i = 0; i < n_files; i++)
+    {
+      gchar *name = g_strdup_printf ("file-%i", i);
+      gchar *path = g_build_filename (benchmark->dir, name, NULL);
+      GFile *file = g_file_new_for_path (path);
+
+      neuland_tox_add_file_transfer (benchmark->sender,
+                                     neuland_file_transfer_new_sending
+                                     (neuland_contact_get_number (contact), file));
+      g_object_unref (file);
+      g_free (path);
+      g_free (name);
+    }
+}
+
+static void
+on_contact_connected (GObject *gobject,
+                      GParamSpec *pspec,
+                      gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+  NeulandContact *contact = NEULAND_CONTACT (gobject);
+
+  if (neuland_contact_get_connected (contact) && !benchmark->started)
+    start_transfers (benchmark, contact);
+}
+
+static void
+on_contact_add (NeulandTox *tox,
+                NeulandContact *contact,
+                gpointer user_data)
+{
+  Benchmark *benchmark = user_data;
+
+  g_signal_connect (contact, "new-transfer", G_CALLBACK (on_new_transfer), benchmark);
+
+  if (neuland_contact_is_request (contact))
+    {
+      GList *contacts = g_list_prepend (NULL, contact);
+
+      neuland_tox_accept_contact_requests (tox, contacts);
+      g_list_free (contacts);
+    }
+  else if (tox == benchmark->sender)
+    g_signal_connect (contact, "notify::connected",
+                      G_CALLBACK (on_contact_connected), benchmark);
+}
+
+static void
+bootstrap_to (NeulandTox *tox,
+              NeulandTox *other)
+{
+  /* The DHT key is the first part of the tox ID. */
+  gchar *pub_key = g_strndup (neuland_tox_get_tox_id_hex (other), TOX_CLIENT_ID_SIZE * 2);
+  gint i;
+
+  for (i = 0; i < N_PORTS; i++)
+    neuland_tox_add_bootstrap_node (tox, "127.0.0.1", FIRST_PORT + i, pub_key);
+
+  g_free (pub_key);
+}
+
+static void
+print_results (Benchmark *benchmark)
+{
+  NeulandToxEventStats stats;
+  gdouble seconds = (benchmark->end_time - benchmark->start_time) / 1e6;
+  gdouble user = timeval_to_seconds (&benchmark->end_usage.ru_utime) -
+    timeval_to_seconds (&benchmark->start_usage.ru_utime);
+  gdouble system = timeval_to_seconds (&benchmark->end_usage.ru_stime) -
+    timeval_to_seconds (&benchmark->start_usage.ru_stime);
+  gchar *size = g_format_size (file_size * n_files);
+
+  g_print ("Transferred %s in %.2f s: %.2f MB/s\n",
+           size, seconds, file_size * n_files / 1e6 / seconds);
+  g_print ("CPU time: %.2f s user, %.2f s system (%.0f%% of one core)\n",
+           user, system, 100 * (user + system) / seconds);
+  g_print ("Main loop latency: %.2f ms average, %.2f ms max\n",
+           benchmark->n_probes > 0 ? benchmark->total_latency / 1e3 / benchmark->n_probes : 0,
+           benchmark->max_latency / 1e3);
+
+  neuland_tox_get_event_stats (benchmark->receiver, &stats);
+  g_print ("Receiver events: %" G_GUINT64_FORMAT " handled, %.2f ms average "
+           "and %.2f ms max latency, %i max queued\n",
+           stats.drained,
+           stats.drained > 0 ? stats.total_latency / 1e3 / stats.drained : 0,
+           stats.max_latency / 1e3, stats.max_depth);
+
+  g_free (size);
+}
+
+int
+main (int argc, char *argv[])
+{
+  Benchmark benchmark = { 0, };
+  GOptionContext *context;
+  GError *error = NULL;
+  GRand *rand;
+  gint i;
+  gint ret;
+
+  context = g_option_context_new ("- benchmark file transfers over loopback");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  benchmark.dir = g_dir_make_tmp ("neuland-benchmark-XXXXXX", &error);
+  if (benchmark.dir == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  /* Same data on every run */
+  rand = g_rand_new_with_seed (1);
+  for (i = 0; i < n_files; i++)
+    {
+      gchar *name = g_strdup_printf ("file-%i", i);
+      gchar *path = g_build_filename (benchmark.dir, name, NULL);
+      gboolean created = create_file (path, rand);
+
+      g_free (path);
+      g_free (name);
+      if (!created)
+        {
+          remove_dir (benchmark.dir);
+          return 1;
+        }
+    }
+  g_rand_free (rand);
+
+  benchmark.loop = g_main_loop_new (NULL, FALSE);
+  benchmark.checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  benchmark.sender = neuland_tox_new_full (NULL, FALSE);
+  benchmark.receiver = neuland_tox_new_full (NULL, FALSE);
+
+  g_signal_connect (benchmark.sender, "contact-add", G_CALLBACK (on_contact_add), &benchmark);
+  g_signal_connect (benchmark.receiver, "contact-add", G_CALLBACK (on_contact_add), &benchmark);
+
+  bootstrap_to (benchmark.sender, benchmark.receiver);
+  bootstrap_to (benchmark.receiver, benchmark.sender);
+  neuland_tox_add_contact_from_hex_address (benchmark.sender,
+                                            neuland_tox_get_tox_id_hex (benchmark.receiver),
+                                            "Neuland benchmark");
+
+  g_timeout_add_seconds (timeout, on_timeout, &benchmark);
+  g_main_loop_run (benchmark.loop);
+
+  ret = benchmark.n_failed > 0 || benchmark.n_mismatches > 0;
+  if (benchmark.n_failed == 0)
+    print_results (&benchmark);
+
+  g_object_unref (benchmark.sender);
+  g_object_unref (benchmark.receiver);
+  g_hash_table_destroy (benchmark.checksums);
+  g_main_loop_unref (benchmark.loop);
+  remove_dir (benchmark.dir);
+  g_free (benchmark.dir);
+
+  return ret;
+}
@@ -192,7 +192,8 @@ neuland_application_startup (GApplication *application)
     { "app.new-transient-identity", { "<Primary>t", NULL } },
     { "app.quit"                  , { "<Primary>q", NULL } },
     { "win.create-request"        , { "<Primary>n", NULL } },
-    { "win.send-file"             , { "<Primary>s", NULL } }
+    { "win.send-file"             , { "<Primary>s", NULL } },
+    { "win.search"                , { "<Primary>f", NULL } }
   };
 
   int i;
@@ -0,0 +1,714 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A NeulandChatLog keeps the chat history with one contact in an
+   append-only file of records, each prefixed with its length. Every
+   INDEX_INTERVAL-th record has its offset stored in a second, sparse
+   index file, so that reading the last few records of a long history
+   only touches the end of the log, which is mapped into memory
+   rather than read. Appending only queues the record, a single
+   writer thread shared by all logs writes them out in batches. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "neuland-chat-log.h"
+
+#define INDEX_INTERVAL 64
+
+/* guint32 record length (including this header), guint8 type,
+   guint8 flags, 2 bytes reserved, gint64 time; all big endian and
+   followed by the UTF-8 text without a terminating NUL. */
+#define RECORD_HEADER_SIZE 16
+#define RECORD_FLAG_OUTGOING 1
+
+struct _NeulandChatLogPrivate
+{
+  gchar *path;
+  gchar *index_path;
+
+  /* Only used by the writer thread */
+  gint fd;
+  gint index_fd;
+
+  /* The rest is protected by @mutex. Offsets and @n_entries count
+     records as if they were written already once the writer took
+     them from @pending to @in_flight; @written_size is what is on
+     disk. Records in @pending are not indexed yet. */
+  GMutex mutex;
+  GCond cond;
+  gboolean loaded;
+  gboolean write_scheduled;
+  GByteArray *pending;
+  guint n_pending;
+  GByteArray *in_flight;
+  GArray *index;
+  guint64 n_entries;
+  guint64 size;
+  guint64 written_size;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (NeulandChatLog, neuland_chat_log, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_PATH,
+  PROP_N
+};
+
+static GParamSpec *properties[PROP_N] = {NULL, };
+
+static guint32
+read_uint32 (const guint8 *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, sizeof (value));
+
+  return GUINT32_FROM_BE (value);
+}
+
+static gint64
+read_int64 (const guint8 *data)
+{
+  gint64 value;
+
+  memcpy (&value, data, sizeof (value));
+
+  return GINT64_FROM_BE (value);
+}
+
+/* Returns the length of the record at @data, or 0 if there is no
+   complete record in the @available bytes. */
+static guint32
+get_record_length (const guint8 *data,
+                   gsize available)
+{
+  guint32 length;
+
+  if (available < RECORD_HEADER_SIZE)
+    return 0;
+
+  length = read_uint32 (data);
+  if (length < RECORD_HEADER_SIZE || length > available)
+    return 0;
+
+  return length;
+}
+
+static NeulandChatLogEntry *
+parse_record (const guint8 *data,
+              guint32 length)
+{
+  NeulandChatLogEntry *entry = g_slice_new0 (NeulandChatLogEntry);
+
+  entry->type = data[4];
+  entry->outgoing = (data[5] & RECORD_FLAG_OUTGOING) != 0;
+  entry->time = read_int64 (data + 8);
+  entry->text = g_strndup ((const gchar *)data + RECORD_HEADER_SIZE,
+                           length - RECORD_HEADER_SIZE);
+
+  return entry;
+}
+
+void
+neuland_chat_log_entry_free (NeulandChatLogEntry *entry)
+{
+  g_free (entry->text);
+  g_slice_free (NeulandChatLogEntry, entry);
+}
+
+static gboolean
+write_all (gint fd,
+           const guint8 *data,
+           gsize length)
+{
+  while (length > 0)
+    {
+      gssize ret = write (fd, data, length);
+
+      if (ret == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return FALSE;
+        }
+
+      data += ret;
+      length -= ret;
+    }
+
+  return TRUE;
+}
+
+static void
+neuland_chat_log_save_index (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv = chat_log->priv;
+  GByteArray *bytes = g_byte_array_sized_new (priv->index->len * sizeof (guint64));
+  GError *error = NULL;
+  guint i;
+
+  for (i = 0; i < priv->index->len; i++)
+    {
+      guint64 offset = GUINT64_TO_BE (g_array_index (priv->index, guint64, i));
+
+      g_byte_array_append (bytes, (guint8 *)&offset, sizeof (offset));
+    }
+
+  if (!g_file_set_contents (priv->index_path, (gchar *)bytes->data, bytes->len, &error))
+    {
+      g_warning ("Could not save chat log index \"%s\": %s",
+                 priv->index_path, error->message);
+      g_error_free (error);
+    }
+
+  g_byte_array_unref (bytes);
+}
+
+/* Reads the index and checks the records after the last indexed
+   one, indexing them if needed and cutting off a record that was
+   only partly written when we crashed. Called with the mutex held,
+   and never while a write is in flight. */
+static void
+neuland_chat_log_load (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv = chat_log->priv;
+  GMappedFile *map;
+  const guint8 *data = NULL;
+  gsize size = 0;
+  gchar *contents;
+  gsize length = 0;
+  guint64 offset = 0;
+  guint64 n_entries = 0;
+  gboolean index_changed = FALSE;
+  GError *error = NULL;
+
+  priv->loaded = TRUE;
+  g_array_set_size (priv->index, 0);
+
+  map = g_mapped_file_new (priv->path, FALSE, &error);
+  if (map != NULL)
+    {
+      data = (const guint8 *)g_mapped_file_get_contents (map);
+      size = g_mapped_file_get_length (map);
+    }
+  else
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Could not open chat log \"%s\": %s", priv->path, error->message);
+      g_error_free (error);
+    }
+
+  if (g_file_get_contents (priv->index_path, &contents, &length, NULL))
+    {
+      gsize i;
+
+      /* Offsets must start at 0 and increase; anything after the
+         first one that doesn't is rebuilt below. */
+      for (i = 0; i + sizeof (guint64) <= length; i += sizeof (guint64))
+        {
+          guint64 entry = (guint64) read_int64 ((guint8 *)contents + i);
+
+          if (entry >= size ||
+              (priv->index->len == 0 && entry != 0) ||
+              (priv->index->len > 0 &&
+               entry <= g_array_index (priv->index, guint64, priv->index->len - 1)))
+            break;
+
+          g_array_append_val (priv->index, entry);
+        }
+
+      g_free (contents);
+    }
+
+  index_changed = priv->index->len * sizeof (guint64) != length;
+
+  if (priv->index->len > 0)
+    {
+      offset = g_array_index (priv->index, guint64, priv->index->len - 1);
+      n_entries = (guint64) (priv->index->len - 1) * INDEX_INTERVAL;
+    }
+
+  while (offset < size)
+    {
+      guint32 record_length = get_record_length (data + offset, size - offset);
+
+      if (record_length == 0)
+        break;
+
+      if (n_entries % INDEX_INTERVAL == 0 && n_entries / INDEX_INTERVAL == priv->index->len)
+        {
+          g_array_append_val (priv->index, offset);
+          index_changed = TRUE;
+        }
+
+      offset += record_length;
+      n_entries++;
+    }
+
+  if (map != NULL)
+    g_mapped_file_unref (map);
+
+  if (offset < size)
+    {
+      g_warning ("Cutting off %" G_GUINT64_FORMAT " bytes of incomplete data "
+                 "at the end of chat log \"%s\"", size - offset, priv->path);
+      if (truncate (priv->path, offset) == -1)
+        g_warning ("Could not truncate chat log \"%s\": %s",
+                   priv->path, g_strerror (errno));
+    }
+
+  if (index_changed)
+    neuland_chat_log_save_index (chat_log);
+
+  priv->n_entries = n_entries;
+  priv->size = priv->written_size = offset;
+}
+
+static gboolean
+neuland_chat_log_open_files (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv = chat_log->priv;
+
+  if (priv->fd == -1)
+    {
+      gchar *dir = g_path_get_dirname (priv->path);
+
+      g_mkdir_with_parents (dir, 0700);
+      g_free (dir);
+
+      priv->fd = g_open (priv->path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    }
+
+  if (priv->index_fd == -1)
+    priv->index_fd = g_open (priv->index_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+
+  return priv->fd != -1 && priv->index_fd != -1;
+}
+
+/* Runs in the writer thread, which writes out the records appended
+   since the last run in one go. */
+static void
+neuland_chat_log_write_func (gpointer data,
+                             gpointer user_data)
+{
+  NeulandChatLog *chat_log = data;
+  NeulandChatLogPrivate *priv = chat_log->priv;
+  GByteArray *index_bytes = g_byte_array_new ();
+  GByteArray *records;
+  gsize offset;
+  gboolean written;
+  gint saved_errno;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->loaded)
+    neuland_chat_log_load (chat_log);
+
+  records = priv->in_flight = priv->pending;
+  priv->pending = g_byte_array_new ();
+  priv->n_pending = 0;
+  priv->write_scheduled = FALSE;
+
+  for (offset = 0; offset < records->len; offset += read_uint32 (records->data + offset))
+    {
+      if (priv->n_entries % INDEX_INTERVAL == 0)
+        {
+          guint64 entry = GUINT64_TO_BE (priv->size);
+
+          g_array_append_val (priv->index, priv->size);
+          g_byte_array_append (index_bytes, (guint8 *)&entry, sizeof (entry));
+        }
+
+      priv->size += read_uint32 (records->data + offset);
+      priv->n_entries++;
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  written = neuland_chat_log_open_files (chat_log) &&
+    write_all (priv->fd, records->data, records->len);
+  saved_errno = errno;
+
+  /* A missing index entry is only a performance problem, it is
+     added again the next time the log is loaded. */
+  if (written && !write_all (priv->index_fd, index_bytes->data, index_bytes->len))
+    g_warning ("Could not write to chat log index \"%s\": %s",
+               priv->index_path, g_strerror (errno));
+
+  g_mutex_lock (&priv->mutex);
+
+  if (written)
+    priv->written_size += records->len;
+  else
+    {
+      /* Start over from what made it to disk. */
+      g_warning ("Could not write to chat log \"%s\", %u bytes are lost: %s",
+                 priv->path, records->len, g_strerror (saved_errno));
+      priv->loaded = FALSE;
+
+      /* Loading may replace the index file, don't append to the old
+         one. */
+      if (priv->index_fd != -1)
+        {
+          close (priv->index_fd);
+          priv->index_fd = -1;
+        }
+    }
+
+  priv->in_flight = NULL;
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->mutex);
+
+  g_byte_array_unref (records);
+  g_byte_array_unref (index_bytes);
+  g_object_unref (chat_log);
+}
+
+static GThreadPool *
+get_writer_pool (void)
+{
+  static gsize pool = 0;
+
+  /* One thread for all logs, so that batches of different contacts
+     don't compete for the disk. */
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, (gsize) g_thread_pool_new (neuland_chat_log_write_func, NULL,
+                                                         1, FALSE, NULL));
+
+  return (GThreadPool *) pool;
+}
+
+/* Queues a record for writing; this never blocks on disk I/O. @time
+   is in microseconds since the epoch, as returned by
+   g_get_real_time (). */
+void
+neuland_chat_log_append (NeulandChatLog *chat_log,
+                         NeulandChatLogEntryType type,
+                         gboolean outgoing,
+                         gint64 time,
+                         const gchar *text)
+{
+  NeulandChatLogPrivate *priv;
+  gsize text_length;
+  guint32 length;
+  guint8 header[RECORD_HEADER_SIZE] = { 0, };
+  gint64 time_be = GINT64_TO_BE (time);
+
+  g_return_if_fail (NEULAND_IS_CHAT_LOG (chat_log));
+  g_return_if_fail (text != NULL);
+
+  priv = chat_log->priv;
+
+  text_length = strlen (text);
+  length = GUINT32_TO_BE (RECORD_HEADER_SIZE + text_length);
+  memcpy (header, &length, sizeof (length));
+  header[4] = type;
+  header[5] = outgoing ? RECORD_FLAG_OUTGOING : 0;
+  memcpy (header + 8, &time_be, sizeof (time_be));
+
+  g_mutex_lock (&priv->mutex);
+
+  g_byte_array_append (priv->pending, header, RECORD_HEADER_SIZE);
+  g_byte_array_append (priv->pending, (const guint8 *)text, text_length);
+  priv->n_pending++;
+
+  if (!priv->write_scheduled)
+    {
+      priv->write_scheduled = TRUE;
+      g_thread_pool_push (get_writer_pool (), g_object_ref (chat_log), NULL);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/* Returns the number of entries, including those not written yet. */
+guint64
+neuland_chat_log_get_n_entries (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv;
+  guint64 n_entries;
+
+  g_return_val_if_fail (NEULAND_IS_CHAT_LOG (chat_log), 0);
+
+  priv = chat_log->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->loaded)
+    neuland_chat_log_load (chat_log);
+  n_entries = priv->n_entries + priv->n_pending;
+
+  g_mutex_unlock (&priv->mutex);
+
+  return n_entries;
+}
+
+/* Returns an array of up to @n_entries NeulandChatLogEntry, starting
+   with entry number @first (0 is the oldest one). Only the part of
+   the log from the closest indexed entry before @first on is
+   touched. */
+GPtrArray *
+neuland_chat_log_read (NeulandChatLog *chat_log,
+                       guint64 first,
+                       guint n_entries)
+{
+  NeulandChatLogPrivate *priv;
+  GPtrArray *entries;
+  GMappedFile *map = NULL;
+  const guint8 *data = NULL;
+  GByteArray *tail;
+  guint64 total;
+  guint64 written_size;
+  guint64 offset = 0;
+  guint64 number = 0;
+
+  g_return_val_if_fail (NEULAND_IS_CHAT_LOG (chat_log), NULL);
+
+  priv = chat_log->priv;
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) neuland_chat_log_entry_free);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->loaded)
+    neuland_chat_log_load (chat_log);
+
+  total = priv->n_entries + priv->n_pending;
+  if (first >= total)
+    {
+      g_mutex_unlock (&priv->mutex);
+      return entries;
+    }
+  n_entries = MIN (n_entries, total - first);
+
+  if (priv->index->len > 0)
+    {
+      guint i = MIN (first / INDEX_INTERVAL, priv->index->len - 1);
+
+      offset = g_array_index (priv->index, guint64, i);
+      number = (guint64) i * INDEX_INTERVAL;
+    }
+
+  /* Whatever isn't on disk yet follows right after what is. */
+  written_size = priv->written_size;
+  tail = g_byte_array_new ();
+  if (priv->in_flight != NULL)
+    g_byte_array_append (tail, priv->in_flight->data, priv->in_flight->len);
+  g_byte_array_append (tail, priv->pending->data, priv->pending->len);
+
+  g_mutex_unlock (&priv->mutex);
+
+  if (offset < written_size)
+    {
+      GError *error = NULL;
+
+      map = g_mapped_file_new (priv->path, FALSE, &error);
+      if (map == NULL)
+        {
+          g_warning ("Could not open chat log \"%s\": %s", priv->path, error->message);
+          g_error_free (error);
+          g_byte_array_unref (tail);
+          return entries;
+        }
+
+      data = (const guint8 *)g_mapped_file_get_contents (map);
+      written_size = MIN (written_size, g_mapped_file_get_length (map));
+    }
+
+  while (entries->len < n_entries)
+    {
+      const guint8 *record;
+      gsize available;
+      guint32 length;
+
+      if (offset < written_size)
+        {
+          record = data + offset;
+          available = written_size - offset;
+        }
+      else if (offset - written_size < tail->len)
+        {
+          record = tail->data + (offset - written_size);
+          available = tail->len - (offset - written_size);
+        }
+      else
+        break;
+
+      length = get_record_length (record, available);
+      if (length == 0)
+        {
+          g_warning ("Chat log \"%s\" is corrupt at offset %" G_GUINT64_FORMAT,
+                     priv->path, offset);
+          break;
+        }
+
+      if (number >= first)
+        g_ptr_array_add (entries, parse_record (record, length));
+
+      offset += length;
+      number++;
+    }
+
+  if (map != NULL)
+    g_mapped_file_unref (map);
+  g_byte_array_unref (tail);
+
+  return entries;
+}
+
+/* Blocks until everything appended so far is written. */
+void
+neuland_chat_log_flush (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_CHAT_LOG (chat_log));
+
+  priv = chat_log->priv;
+
+  g_mutex_lock (&priv->mutex);
+  while (priv->write_scheduled || priv->in_flight != NULL)
+    g_cond_wait (&priv->cond, &priv->mutex);
+  g_mutex_unlock (&priv->mutex);
+}
+
+const gchar *
+neuland_chat_log_get_path (NeulandChatLog *chat_log)
+{
+  g_return_val_if_fail (NEULAND_IS_CHAT_LOG (chat_log), NULL);
+
+  return chat_log->priv->path;
+}
+
+static void
+neuland_chat_log_set_property (GObject *object,
+                               guint property_id,
+                               const GValue *value,
+                               GParamSpec *pspec)
+{
+  NeulandChatLog *chat_log = NEULAND_CHAT_LOG (object);
+  NeulandChatLogPrivate *priv = chat_log->priv;
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      priv->path = g_value_dup_string (value);
+      priv->index_path = g_strconcat (priv->path, ".idx", NULL);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+neuland_chat_log_get_property (GObject *object,
+                               guint property_id,
+                               GValue *value,
+                               GParamSpec *pspec)
+{
+  NeulandChatLog *chat_log = NEULAND_CHAT_LOG (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, chat_log->priv->path);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+neuland_chat_log_finalize (GObject *object)
+{
+  NeulandChatLog *chat_log = NEULAND_CHAT_LOG (object);
+  NeulandChatLogPrivate *priv = chat_log->priv;
+
+  /* The writer holds a reference while it has work for us, so
+     everything is written by now. */
+  if (priv->fd != -1)
+    close (priv->fd);
+  if (priv->index_fd != -1)
+    close (priv->index_fd);
+
+  g_free (priv->path);
+  g_free (priv->index_path);
+  g_byte_array_unref (priv->pending);
+  g_array_free (priv->index, TRUE);
+  g_mutex_clear (&priv->mutex);
+  g_cond_clear (&priv->cond);
+
+  G_OBJECT_CLASS (neuland_chat_log_parent_class)->finalize (object);
+}
+
+static void
+neuland_chat_log_class_init (NeulandChatLogClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = neuland_chat_log_set_property;
+  gobject_class->get_property = neuland_chat_log_get_property;
+  gobject_class->finalize = neuland_chat_log_finalize;
+
+  properties[PROP_PATH] =
+    g_param_spec_string ("path",
+                         "Path",
+                         "Path of the log file, the index is next to it",
+                         NULL,
+                         G_PARAM_READWRITE |
+                         G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (gobject_class, PROP_N, properties);
+}
+
+static void
+neuland_chat_log_init (NeulandChatLog *chat_log)
+{
+  NeulandChatLogPrivate *priv;
+
+  chat_log->priv = neuland_chat_log_get_instance_private (chat_log);
+  priv = chat_log->priv;
+
+  priv->fd = -1;
+  priv->index_fd = -1;
+  g_mutex_init (&priv->mutex);
+  g_cond_init (&priv->cond);
+  priv->pending = g_byte_array_new ();
+  priv->index = g_array_new (FALSE, FALSE, sizeof (guint64));
+}
+
+/* Nothing is read or created before the log is first used. */
+NeulandChatLog *
+neuland_chat_log_new (const gchar *path)
+{
+  g_return_val_if_fail (path != NULL, NULL);
+
+  return g_object_new (NEULAND_TYPE_CHAT_LOG,
+                       "path", path,
+                       NULL);
+}
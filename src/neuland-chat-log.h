@@ -0,0 +1,87 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __NEULAND_CHAT_LOG_H__
+#define __NEULAND_CHAT_LOG_H__
+
+#include <glib-object.h>
+
+#define NEULAND_TYPE_CHAT_LOG            (neuland_chat_log_get_type ())
+#define NEULAND_CHAT_LOG(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), NEULAND_TYPE_CHAT_LOG, NeulandChatLog))
+#define NEULAND_CHAT_LOG_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), NEULAND_TYPE_CHAT_LOG, NeulandChatLogClass))
+#define NEULAND_IS_CHAT_LOG(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), NEULAND_TYPE_CHAT_LOG))
+#define NEULAND_IS_CHAT_LOG_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), NEULAND_TYPE_CHAT_LOG))
+#define NEULAND_CHAT_LOG_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), NEULAND_TYPE_CHAT_LOG, NeulandChatLogClass))
+
+typedef struct _NeulandChatLog        NeulandChatLog;
+typedef struct _NeulandChatLogPrivate NeulandChatLogPrivate;
+typedef struct _NeulandChatLogClass   NeulandChatLogClass;
+
+typedef enum {
+  NEULAND_CHAT_LOG_ENTRY_MESSAGE,
+  NEULAND_CHAT_LOG_ENTRY_ACTION
+} NeulandChatLogEntryType;
+
+typedef struct
+{
+  NeulandChatLogEntryType type;
+  gboolean outgoing;
+  gint64 time;   /* microseconds since the epoch */
+  gchar *text;
+} NeulandChatLogEntry;
+
+struct _NeulandChatLog
+{
+  GObject parent_instance;
+
+  NeulandChatLogPrivate *priv;
+};
+
+struct _NeulandChatLogClass
+{
+  GObjectClass parent_class;
+};
+
+GType neuland_chat_log_get_type (void) G_GNUC_CONST;
+
+NeulandChatLog *
+neuland_chat_log_new (const gchar *path);
+
+const gchar *
+neuland_chat_log_get_path (NeulandChatLog *chat_log);
+
+void
+neuland_chat_log_append (NeulandChatLog *chat_log, NeulandChatLogEntryType type,
+                         gboolean outgoing, gint64 time, const gchar *text);
+
+guint64
+neuland_chat_log_get_n_entries (NeulandChatLog *chat_log);
+
+GPtrArray *
+neuland_chat_log_read (NeulandChatLog *chat_log, guint64 first, guint n_entries);
+
+void
+neuland_chat_log_flush (NeulandChatLog *chat_log);
+
+void
+neuland_chat_log_entry_free (NeulandChatLogEntry *entry);
+
+#endif /* __NEULAND_CHAT_LOG_H__ */
@@ -25,6 +25,9 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#define HISTORY_LENGTH 50             /* Chat log entries read at a time */
+#define DEFAULT_SCROLLBACK_LIMIT 1000 /* Blocks of text kept in the buffer */
+
 typedef enum {
   DIRECTION_IN,
   DIRECTION_OUT,
@@ -36,6 +39,24 @@ typedef enum {
   TEXT_TYPE_INFO,
 } TextType;
 
+/* What one message, action or notice added to the buffer */
+typedef struct
+{
+  GtkTextMark *mark; /* start of the block, owned by text_buffer */
+  gboolean logged;   /* TRUE if it is an entry of the chat log */
+  guint64 serial;    /* outgoing serial while undelivered, else 0 */
+} TextBlock;
+
+/* Text waiting for the next flush into the buffer */
+typedef struct
+{
+  gchar *text;
+  MessageDirection direction;
+  TextType type;
+  gint64 time;
+  guint64 serial;
+} PendingText;
+
 struct _NeulandChatWidgetPrivate {
   NeulandTox *tox;
   NeulandContact *contact;
@@ -54,15 +75,36 @@ struct _NeulandChatWidgetPrivate {
   GtkTextTag *action_tag;
   GtkTextTag *info_tag;
   GtkTextTag *time_tag;
+  GtkTextTag *undelivered_tag;
 
   GtkTextView *entry_text_view;
   GtkTextBuffer *entry_text_buffer;
 
   GtkInfoBar *info_bar;
 
-  GDateTime *last_insert_time;
+  gint64 last_insert_time; /* seconds since the epoch, 0 if none yet */
   MessageDirection last_direction;
   TextType last_type;
+
+  /* Blocks are cut off at the head beyond @scrollback_limit (0 for
+     no limit). @first_logged_entry is the number of the oldest chat
+     log entry still in the buffer. */
+  GQueue blocks;
+  guint scrollback_limit;
+  guint64 first_logged_entry;
+  gdouble last_scroll_value;
+  gboolean changing_history;
+
+  /* Outgoing text without a read receipt yet, shown with
+     @undelivered_tag. Key: serial -> value: TextBlock in @blocks. */
+  GHashTable *undelivered_ht;
+
+  /* Incoming text is queued and inserted once per frame, so that a
+     burst of messages only lays out and scrolls the view once. Chats
+     that aren't shown get no frames, they are flushed when idle. */
+  GQueue pending;
+  guint flush_tick_id;
+  guint flush_idle_id;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (NeulandChatWidget, neuland_chat_widget, GTK_TYPE_BOX)
@@ -71,6 +113,7 @@ enum {
   PROP_0,
   PROP_TOX,
   PROP_CONTACT,
+  PROP_SCROLLBACK_LIMIT,
   PROP_N
 };
 
@@ -83,9 +126,34 @@ neuland_chat_widget_dispose (GObject *object)
   NeulandChatWidget *widget = NEULAND_CHAT_WIDGET (object);
   NeulandChatWidgetPrivate *priv = widget->priv;
 
+  if (priv->flush_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (widget), priv->flush_tick_id);
+      priv->flush_tick_id = 0;
+    }
+
+  if (priv->flush_idle_id != 0)
+    {
+      g_source_remove (priv->flush_idle_id);
+      priv->flush_idle_id = 0;
+    }
+
   G_OBJECT_CLASS (neuland_chat_widget_parent_class)->dispose (object);
 }
 
+static void
+text_block_free (TextBlock *block)
+{
+  g_slice_free (TextBlock, block);
+}
+
+static void
+pending_text_free (PendingText *pending_text)
+{
+  g_free (pending_text->text);
+  g_slice_free (PendingText, pending_text);
+}
+
 static void
 neuland_chat_widget_finalize (GObject *object)
 {
@@ -93,11 +161,15 @@ neuland_chat_widget_finalize (GObject *object)
   NeulandChatWidget *widget = NEULAND_CHAT_WIDGET (object);
   NeulandChatWidgetPrivate *priv = widget->priv;
 
-  if (priv->last_insert_time != NULL)
-    g_date_time_unref (widget->priv->last_insert_time);
-
   g_free (priv->last_used_name);
 
+  g_hash_table_destroy (priv->undelivered_ht);
+  g_queue_foreach (&priv->blocks, (GFunc) text_block_free, NULL);
+  g_queue_clear (&priv->blocks);
+
+  g_queue_foreach (&priv->pending, (GFunc) pending_text_free, NULL);
+  g_queue_clear (&priv->pending);
+
   G_OBJECT_CLASS (neuland_chat_widget_parent_class)->finalize (object);
 }
 
@@ -149,24 +221,30 @@ neuland_chat_widget_set_show_contact_is_typing (NeulandChatWidget *chat_widget,
   g_free (name);
 }
 
+/* Inserts @text at @iter, with a time stamp and name in front of it
+   unless the text inserted before it, as described by @last_time,
+   @last_direction and @last_type, makes them redundant. Those are
+   updated for the next call. */
 static void
-insert_text (NeulandChatWidget *widget,
-             const gchar* text,
-             MessageDirection direction,
-             TextType type)
+insert_text_at (NeulandChatWidget *widget,
+                GtkTextIter *iter,
+                const gchar* text,
+                MessageDirection direction,
+                TextType type,
+                gint64 time,
+                gint64 *last_time,
+                MessageDirection *last_direction,
+                TextType *last_type)
 {
   NeulandChatWidgetPrivate *priv = widget->priv;
   GtkTextBuffer *text_buffer = priv->text_buffer;
   NeulandTox *tox = priv->tox;
   NeulandContact *contact = priv->contact;
-  GtkTextIter iter;
   GtkTextTag *name_tag;
   const gchar *name;
-  gchar *time_string;
   gchar *prefix;
   gboolean insert_time_stamp;
   gboolean insert_nick;
-  GDateTime *time_now = g_date_time_new_now_local ();
 
   switch (direction)
     {
@@ -180,50 +258,33 @@ insert_text (NeulandChatWidget *widget,
       break;
     }
 
-  if (priv->last_insert_time == NULL)
+  if (*last_time == 0)
     {
       insert_time_stamp = TRUE;
       insert_nick = TRUE;
     }
   else
     {
-      GTimeSpan time_span = g_date_time_difference (time_now,
-                                                    priv->last_insert_time);
-      insert_time_stamp = (time_span > G_TIME_SPAN_MINUTE)
-        || g_date_time_get_minute (time_now) != g_date_time_get_minute (priv->last_insert_time);
-      insert_nick = (direction != priv->last_direction)
-        || (priv->last_type == TEXT_TYPE_ACTION);
+      insert_time_stamp = time / 60 != *last_time / 60;
+      insert_nick = (direction != *last_direction)
+        || (*last_type == TEXT_TYPE_ACTION);
     }
 
-  neuland_chat_widget_set_show_contact_is_typing (widget, FALSE);
-
-  gtk_text_buffer_get_end_iter (text_buffer, &iter);
-
   if (insert_time_stamp)
     {
-      if (neuland_use_24h_time_format ())
-        /* Translators: This is the hour and minute timestamp shown
-           the chat view in 24h format followed by a newline */
-        time_string = g_date_time_format (time_now, "%H:%M\n");
-      else
-        /* Translators: This is the hour and minute timestamp shown
-           the chat view in 12h format followed by a newline */
-        time_string = g_date_time_format (time_now, "%l:%M %p\n");
-
-      gtk_text_buffer_insert_with_tags (text_buffer, &iter, time_string, -1,
+      gtk_text_buffer_insert_with_tags (text_buffer, iter,
+                                        neuland_format_time_of_day (time), -1,
+                                        priv->time_tag, NULL);
+      gtk_text_buffer_insert_with_tags (text_buffer, iter, "\n", -1,
                                         priv->time_tag, NULL);
 
-      if (priv->last_insert_time)
-        g_date_time_unref (priv->last_insert_time);
-      priv->last_insert_time = g_date_time_ref (time_now);
-
-      g_free (time_string);
+      *last_time = time;
     }
 
   if (type == TEXT_TYPE_ACTION)
     {
       prefix = g_strdup_printf (_("* %s %s"), name, text);
-      gtk_text_buffer_insert_with_tags (text_buffer, &iter, prefix, -1,
+      gtk_text_buffer_insert_with_tags (text_buffer, iter, prefix, -1,
                                         priv->action_tag,
                                         NULL);
       g_free (prefix);
@@ -233,50 +294,267 @@ insert_text (NeulandChatWidget *widget,
       if (insert_nick)
         {
           prefix = g_strdup_printf (_("%s: "), name);
-          gtk_text_buffer_insert_with_tags (text_buffer, &iter, prefix, -1,
+          gtk_text_buffer_insert_with_tags (text_buffer, iter, prefix, -1,
                                             name_tag, NULL);
           g_free (prefix);
         }
 
-      gtk_text_buffer_insert (text_buffer, &iter, text, -1);
+      gtk_text_buffer_insert (text_buffer, iter, text, -1);
     }
   else if (type == TEXT_TYPE_INFO)
 
     {
       gchar *text_with_name = g_strdup_printf (text, name);
-      gtk_text_buffer_insert_with_tags (text_buffer, &iter,
+      gtk_text_buffer_insert_with_tags (text_buffer, iter,
                                         text_with_name, -1,
                                         priv->info_tag, NULL);
 
       g_free (text_with_name);
     }
 
-  gtk_text_buffer_insert (text_buffer, &iter, "\n", -1);
+  gtk_text_buffer_insert (text_buffer, iter, "\n", -1);
+
+  *last_direction = direction;
+  *last_type = type;
+}
+
+static TextBlock *
+text_block_new (NeulandChatWidget *widget,
+                gint offset,
+                TextType type)
+{
+  TextBlock *block = g_slice_new (TextBlock);
+  GtkTextIter iter;
+
+  gtk_text_buffer_get_iter_at_offset (widget->priv->text_buffer, &iter, offset);
+  block->mark = gtk_text_buffer_create_mark (widget->priv->text_buffer, NULL, &iter, TRUE);
+  block->logged = (type != TEXT_TYPE_INFO);
+  block->serial = 0;
+
+  return block;
+}
+
+static gboolean
+neuland_chat_widget_is_at_bottom (NeulandChatWidget *widget)
+{
+  GtkAdjustment *adjustment =
+    gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (widget->priv->text_view));
+
+  return gtk_adjustment_get_value (adjustment) + gtk_adjustment_get_page_size (adjustment)
+    >= gtk_adjustment_get_upper (adjustment) - 1;
+}
+
+/* Cuts off the oldest blocks beyond the scrollback limit, they can
+   be read back from the chat log by scrolling up. */
+static void
+neuland_chat_widget_trim_scrollback (NeulandChatWidget *widget)
+{
+  NeulandChatWidgetPrivate *priv = widget->priv;
+  GtkTextIter start_iter;
+  GtkTextIter end_iter;
+  TextBlock *block;
 
-  if (direction == DIRECTION_OUT)
-    neuland_chat_widget_set_show_contact_is_typing (widget, neuland_contact_get_is_typing (contact));
+  if (priv->scrollback_limit == 0 || priv->blocks.length <= priv->scrollback_limit)
+    return;
 
-  priv->last_direction = direction;
-  priv->last_type = type;
-  neuland_chat_widget_scroll_to_bottom (widget);
+  while (priv->blocks.length > priv->scrollback_limit)
+    {
+      block = g_queue_pop_head (&priv->blocks);
+      if (block->logged)
+        priv->first_logged_entry++;
+      if (block->serial != 0)
+        g_hash_table_remove (priv->undelivered_ht, &block->serial);
+      gtk_text_buffer_delete_mark (priv->text_buffer, block->mark);
+      text_block_free (block);
+    }
 
-  g_date_time_unref (time_now);
+  block = g_queue_peek_head (&priv->blocks);
+  gtk_text_buffer_get_start_iter (priv->text_buffer, &start_iter);
+  gtk_text_buffer_get_iter_at_mark (priv->text_buffer, &end_iter, block->mark);
+  gtk_text_buffer_delete (priv->text_buffer, &start_iter, &end_iter);
 }
 
 static void
-insert_message (NeulandChatWidget *widget,
-                const gchar* message,
-                MessageDirection direction)
+queue_text (NeulandChatWidget *widget,
+            const gchar* text,
+            MessageDirection direction,
+            TextType type,
+            gint64 time,
+            guint64 serial)
 {
-  insert_text (widget, message, direction, TEXT_TYPE_TEXT);
+  PendingText *pending_text = g_slice_new (PendingText);
+
+  pending_text->text = g_strdup (text);
+  pending_text->direction = direction;
+  pending_text->type = type;
+  pending_text->time = time;
+  pending_text->serial = serial;
+
+  g_queue_push_tail (&widget->priv->pending, pending_text);
 }
 
+/* Appends all queued text in one user action. The view only follows
+   if it was scrolled to the bottom, so that reading older messages
+   isn't interrupted. Nobody reads a chat that isn't shown, so that
+   one follows as well and keeps to the scrollback limit. */
 static void
-insert_action (NeulandChatWidget *widget,
-               const gchar* message,
-               MessageDirection direction)
+neuland_chat_widget_flush_pending (NeulandChatWidget *widget)
 {
-  insert_text (widget, message, direction, TEXT_TYPE_ACTION);
+  NeulandChatWidgetPrivate *priv = widget->priv;
+  PendingText *pending_text;
+  TextBlock *block;
+  GtkTextIter start_iter;
+  GtkTextIter iter;
+  gboolean at_bottom;
+  gint offset;
+
+  if (priv->flush_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (widget), priv->flush_tick_id);
+      priv->flush_tick_id = 0;
+    }
+
+  if (priv->flush_idle_id != 0)
+    {
+      g_source_remove (priv->flush_idle_id);
+      priv->flush_idle_id = 0;
+    }
+
+  if (g_queue_is_empty (&priv->pending))
+    return;
+
+  at_bottom = !gtk_widget_get_mapped (GTK_WIDGET (widget)) ||
+    neuland_chat_widget_is_at_bottom (widget);
+
+  gtk_text_buffer_begin_user_action (priv->text_buffer);
+  neuland_chat_widget_set_show_contact_is_typing (widget, FALSE);
+
+  while ((pending_text = g_queue_pop_head (&priv->pending)) != NULL)
+    {
+      gtk_text_buffer_get_end_iter (priv->text_buffer, &iter);
+      offset = gtk_text_iter_get_offset (&iter);
+
+      insert_text_at (widget, &iter, pending_text->text, pending_text->direction,
+                      pending_text->type, pending_text->time,
+                      &priv->last_insert_time, &priv->last_direction, &priv->last_type);
+      block = text_block_new (widget, offset, pending_text->type);
+      g_queue_push_tail (&priv->blocks, block);
+
+      if (pending_text->serial != 0)
+        {
+          block->serial = pending_text->serial;
+          gtk_text_buffer_get_iter_at_offset (priv->text_buffer, &start_iter, offset);
+          gtk_text_buffer_get_end_iter (priv->text_buffer, &iter);
+          gtk_text_buffer_apply_tag (priv->text_buffer, priv->undelivered_tag,
+                                     &start_iter, &iter);
+          g_hash_table_insert (priv->undelivered_ht, &block->serial, block);
+        }
+
+      pending_text_free (pending_text);
+    }
+
+  if (priv->last_direction == DIRECTION_OUT)
+    neuland_chat_widget_set_show_contact_is_typing (widget, neuland_contact_get_is_typing (priv->contact));
+  gtk_text_buffer_end_user_action (priv->text_buffer);
+
+  if (at_bottom)
+    {
+      neuland_chat_widget_trim_scrollback (widget);
+      neuland_chat_widget_scroll_to_bottom (widget);
+    }
+}
+
+static gboolean
+flush_pending_tick_cb (GtkWidget *widget,
+                       GdkFrameClock *frame_clock,
+                       gpointer user_data)
+{
+  NeulandChatWidget *chat_widget = NEULAND_CHAT_WIDGET (widget);
+
+  chat_widget->priv->flush_tick_id = 0;
+  neuland_chat_widget_flush_pending (chat_widget);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+flush_pending_idle_cb (gpointer user_data)
+{
+  NeulandChatWidget *chat_widget = NEULAND_CHAT_WIDGET (user_data);
+
+  chat_widget->priv->flush_idle_id = 0;
+  neuland_chat_widget_flush_pending (chat_widget);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* A tick callback added before the widget was hidden doesn't run
+   anymore, so the text it was waiting for goes in now. */
+static void
+neuland_chat_widget_unmap (GtkWidget *widget)
+{
+  NeulandChatWidget *chat_widget = NEULAND_CHAT_WIDGET (widget);
+
+  GTK_WIDGET_CLASS (neuland_chat_widget_parent_class)->unmap (widget);
+
+  if (chat_widget->priv->flush_tick_id != 0)
+    neuland_chat_widget_flush_pending (chat_widget);
+}
+
+/* Appends @text right away, after anything still queued */
+static void
+insert_text (NeulandChatWidget *widget,
+             const gchar* text,
+             MessageDirection direction,
+             TextType type,
+             gint64 time,
+             guint64 serial)
+{
+  queue_text (widget, text, direction, type, time, serial);
+  neuland_chat_widget_flush_pending (widget);
+}
+
+/* Appends @text with the next frame, see flush_pending_tick_cb(), or
+   when idle if the widget isn't shown and gets no frames. */
+static void
+insert_text_later (NeulandChatWidget *widget,
+                   const gchar* text,
+                   MessageDirection direction,
+                   TextType type)
+{
+  NeulandChatWidgetPrivate *priv = widget->priv;
+
+  queue_text (widget, text, direction, type, g_get_real_time () / G_USEC_PER_SEC, 0);
+
+  if (priv->flush_tick_id != 0 || priv->flush_idle_id != 0)
+    return;
+
+  if (gtk_widget_get_mapped (GTK_WIDGET (widget)))
+    priv->flush_tick_id =
+      gtk_widget_add_tick_callback (GTK_WIDGET (widget), flush_pending_tick_cb, NULL, NULL);
+  else
+    priv->flush_idle_id = g_idle_add (flush_pending_idle_cb, widget);
+}
+
+static void
+insert_text_now (NeulandChatWidget *widget,
+                 const gchar* text,
+                 MessageDirection direction,
+                 TextType type)
+{
+  insert_text (widget, text, direction, type, g_get_real_time () / G_USEC_PER_SEC, 0);
+}
+
+/* Appends our own @text, shown as undelivered until the contact's
+   read receipt for @serial arrives. */
+static void
+insert_outgoing (NeulandChatWidget *widget,
+                 const gchar* text,
+                 TextType type,
+                 guint64 serial)
+{
+  insert_text (widget, text, DIRECTION_OUT, type,
+               g_get_real_time () / G_USEC_PER_SEC, serial);
 }
 
 static void
@@ -284,25 +562,167 @@ insert_info (NeulandChatWidget *widget,
              const gchar* message,
              MessageDirection direction)
 {
-  insert_text (widget, message, direction, TEXT_TYPE_INFO);
+  insert_text_now (widget, message, direction, TEXT_TYPE_INFO);
+}
+
+/* Shows the end of the contact's chat log, only the last
+   HISTORY_LENGTH entries are read from disk. */
+static void
+neuland_chat_widget_load_history (NeulandChatWidget *widget)
+{
+  NeulandChatLog *chat_log = neuland_contact_get_chat_log (widget->priv->contact);
+  GPtrArray *entries;
+  guint64 n_entries;
+  guint i;
+
+  if (chat_log == NULL)
+    return;
+
+  n_entries = neuland_chat_log_get_n_entries (chat_log);
+  widget->priv->first_logged_entry = n_entries - MIN (n_entries, HISTORY_LENGTH);
+  entries = neuland_chat_log_read (chat_log, widget->priv->first_logged_entry, HISTORY_LENGTH);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      NeulandChatLogEntry *entry = g_ptr_array_index (entries, i);
+
+      queue_text (widget, entry->text,
+                  entry->outgoing ? DIRECTION_OUT : DIRECTION_IN,
+                  entry->type == NEULAND_CHAT_LOG_ENTRY_ACTION ? TEXT_TYPE_ACTION : TEXT_TYPE_TEXT,
+                  entry->time / G_USEC_PER_SEC, 0);
+    }
+  neuland_chat_widget_flush_pending (widget);
+
+  g_ptr_array_unref (entries);
+}
+
+/* Puts up to HISTORY_LENGTH chat log entries from before the oldest
+   one shown in front of the buffer, without moving the view. */
+static void
+neuland_chat_widget_load_older_history (NeulandChatWidget *widget)
+{
+  NeulandChatWidgetPrivate *priv = widget->priv;
+  NeulandChatLog *chat_log = neuland_contact_get_chat_log (priv->contact);
+  TextBlock *old_head = g_queue_peek_head (&priv->blocks);
+  gint64 last_time = 0;
+  MessageDirection last_direction = DIRECTION_IN;
+  TextType last_type = TEXT_TYPE_INFO;
+  GtkTextMark *anchor;
+  GtkTextIter iter;
+  GdkRectangle rect;
+  GPtrArray *entries;
+  guint64 first;
+  guint i;
+
+  if (chat_log == NULL || priv->first_logged_entry == 0)
+    return;
+
+  first = priv->first_logged_entry - MIN (priv->first_logged_entry, HISTORY_LENGTH);
+  entries = neuland_chat_log_read (chat_log, first, priv->first_logged_entry - first);
+
+  g_debug ("Loading %u older chat log entries for contact %p", entries->len, priv->contact);
+
+  gtk_text_view_get_visible_rect (priv->text_view, &rect);
+  gtk_text_view_get_line_at_y (priv->text_view, &iter, rect.y, NULL);
+  anchor = gtk_text_buffer_create_mark (priv->text_buffer, NULL, &iter, FALSE);
+
+  gtk_text_buffer_get_start_iter (priv->text_buffer, &iter);
+  for (i = 0; i < entries->len; i++)
+    {
+      NeulandChatLogEntry *entry = g_ptr_array_index (entries, i);
+      TextType type = entry->type == NEULAND_CHAT_LOG_ENTRY_ACTION ? TEXT_TYPE_ACTION : TEXT_TYPE_TEXT;
+      gint offset = gtk_text_iter_get_offset (&iter);
+
+      insert_text_at (widget, &iter, entry->text,
+                      entry->outgoing ? DIRECTION_OUT : DIRECTION_IN, type,
+                      entry->time / G_USEC_PER_SEC,
+                      &last_time, &last_direction, &last_type);
+      g_queue_push_nth (&priv->blocks, text_block_new (widget, offset, type), i);
+    }
+
+  /* The old first block's mark stayed at the start of the buffer */
+  if (old_head != NULL)
+    gtk_text_buffer_move_mark (priv->text_buffer, old_head->mark, &iter);
+
+  priv->first_logged_entry = first;
+  gtk_text_view_scroll_to_mark (priv->text_view, anchor, 0, TRUE, 0, 0);
+  gtk_text_buffer_delete_mark (priv->text_buffer, anchor);
+
+  g_ptr_array_unref (entries);
+}
+
+/* Older history is paged in when scrolling up close to the top, and
+   the scrollback is trimmed again once back at the bottom. */
+static void
+on_text_view_value_changed (NeulandChatWidget *widget,
+                            GtkAdjustment *adjustment)
+{
+  NeulandChatWidgetPrivate *priv = widget->priv;
+  gdouble value = gtk_adjustment_get_value (adjustment);
+  gboolean scrolling_up = value < priv->last_scroll_value;
+
+  priv->last_scroll_value = value;
+
+  /* Both change the buffer, which changes the adjustment */
+  if (priv->changing_history)
+    return;
+  priv->changing_history = TRUE;
+
+  if (scrolling_up && value < gtk_adjustment_get_page_size (adjustment) / 2)
+    neuland_chat_widget_load_older_history (widget);
+  else if (neuland_chat_widget_is_at_bottom (widget))
+    neuland_chat_widget_trim_scrollback (widget);
+
+  priv->changing_history = FALSE;
 }
 
 static void
 on_outgoing_message_cb (NeulandChatWidget *widget,
                         const gchar *message,
+                        guint64 serial,
                         gpointer user_data)
 {
   g_debug ("on_outgoing_message_cb");
-  insert_message (widget, message, DIRECTION_OUT);
+  insert_outgoing (widget, message, TEXT_TYPE_TEXT, serial);
 }
 
 static void
 on_outgoing_action_cb (NeulandChatWidget *widget,
                        const gchar *action,
+                       guint64 serial,
                        gpointer user_data)
 {
   g_debug ("on_outgoing_action_cb");
-  insert_action (widget, action, DIRECTION_OUT);
+  insert_outgoing (widget, action, TEXT_TYPE_ACTION, serial);
+}
+
+static void
+on_outgoing_delivered_cb (NeulandChatWidget *widget,
+                          guint64 serial,
+                          gpointer user_data)
+{
+  NeulandChatWidgetPrivate *priv = widget->priv;
+  TextBlock *block = g_hash_table_lookup (priv->undelivered_ht, &serial);
+  GtkTextIter start_iter;
+  GtkTextIter end_iter;
+  GList *link;
+
+  if (block == NULL)
+    return;
+
+  /* A block ends where the next one starts */
+  link = g_queue_find (&priv->blocks, block);
+  gtk_text_buffer_get_iter_at_mark (priv->text_buffer, &start_iter, block->mark);
+  if (link != NULL && link->next != NULL)
+    gtk_text_buffer_get_iter_at_mark (priv->text_buffer, &end_iter,
+                                      ((TextBlock *)link->next->data)->mark);
+  else
+    gtk_text_buffer_get_end_iter (priv->text_buffer, &end_iter);
+  gtk_text_buffer_remove_tag (priv->text_buffer, priv->undelivered_tag,
+                              &start_iter, &end_iter);
+
+  g_hash_table_remove (priv->undelivered_ht, &serial);
+  block->serial = 0;
 }
 
 static void
@@ -311,7 +731,7 @@ on_incoming_message_cb (NeulandChatWidget *widget,
                         gpointer user_data)
 {
   g_debug ("on_incoming_message_cb");
-  insert_message (widget, message, DIRECTION_IN);
+  insert_text_later (widget, message, DIRECTION_IN, TEXT_TYPE_TEXT);
 }
 
 static void
@@ -320,7 +740,7 @@ on_incoming_action_cb (NeulandChatWidget *widget,
                        gpointer user_data)
 {
   g_debug ("on_incoming_action_cb");
-  insert_action (widget, action, DIRECTION_IN);
+  insert_text_later (widget, action, DIRECTION_IN, TEXT_TYPE_ACTION);
 }
 
 static void
@@ -364,7 +784,6 @@ neuland_chat_widget_process_input (NeulandChatWidget *widget)
 {
   NeulandChatWidgetPrivate *priv = widget->priv;
   gboolean connected = neuland_contact_get_connected (priv->contact);
-  gboolean clear_entry = TRUE;
   GtkTextIter start_iter;
   GtkTextIter end_iter;
   gchar *string;
@@ -382,13 +801,9 @@ neuland_chat_widget_process_input (NeulandChatWidget *widget)
       if (g_ascii_strncasecmp (string, "/me ", 4) == 0)
         {
           g_debug ("/me command recognized");
-          if (connected)
-            neuland_contact_send_action (priv->contact, string+4);
-          else
-            {
-              neuland_chat_widget_show_offline_info (widget, TRUE);
-              clear_entry = FALSE;
-            }
+          neuland_contact_send_action (priv->contact, string+4);
+          if (!connected)
+            neuland_chat_widget_show_offline_info (widget, TRUE);
         }
       else if (g_ascii_strncasecmp (string, "/message ", 9) == 0)
         {
@@ -410,25 +825,21 @@ neuland_chat_widget_process_input (NeulandChatWidget *widget)
       else
         g_message ("Unknown command: %s", string);
     }
-  else if (connected)
+  else
     {
-      /* string is not a command and contact is connected  */
+      /* string is not a command; if the contact is not connected,
+         it's queued until it is */
 
       if (g_ascii_strncasecmp (string, "//", 2) == 0)
         neuland_contact_send_message (priv->contact, string+1);
       else
         neuland_contact_send_message (priv->contact, string);
-    }
-  else
-    {
-      /* string is not a command and contact is not connected */
 
-      neuland_chat_widget_show_offline_info (widget, TRUE);
-      clear_entry = FALSE;
+      if (!connected)
+        neuland_chat_widget_show_offline_info (widget, TRUE);
     }
 
-  if (clear_entry)
-    gtk_text_buffer_delete (priv->entry_text_buffer, &start_iter, &end_iter);
+  gtk_text_buffer_delete (priv->entry_text_buffer, &start_iter, &end_iter);
 
   g_free (string);
 }
@@ -554,8 +965,10 @@ neuland_chat_widget_set_contact (NeulandChatWidget *widget,
                     "swapped-signal::incoming-action", on_incoming_action_cb, widget,
                     "swapped-signal::outgoing-message", on_outgoing_message_cb, widget,
                     "swapped-signal::outgoing-action", on_outgoing_action_cb, widget,
+                    "swapped-signal::outgoing-delivered", on_outgoing_delivered_cb, widget,
                     "swapped-signal::new-transfer", on_new_transfer_cb, widget,
                     NULL);
+  neuland_chat_widget_load_history (widget);
   neuland_contact_set_has_chat_widget (contact, TRUE);
 }
 
@@ -593,6 +1006,29 @@ neuland_chat_widget_set_text_entry_min_height (NeulandChatWidget *widget,
                                -1, text_entry_min_height);
 }
 
+/* Sets how many blocks of text (messages, actions and notices) are
+   kept in the chat view, 0 for no limit. */
+void
+neuland_chat_widget_set_scrollback_limit (NeulandChatWidget *widget,
+                                          guint scrollback_limit)
+{
+  g_return_if_fail (NEULAND_IS_CHAT_WIDGET (widget));
+
+  widget->priv->scrollback_limit = scrollback_limit;
+  if (neuland_chat_widget_is_at_bottom (widget))
+    neuland_chat_widget_trim_scrollback (widget);
+
+  g_object_notify_by_pspec (G_OBJECT (widget), properties[PROP_SCROLLBACK_LIMIT]);
+}
+
+guint
+neuland_chat_widget_get_scrollback_limit (NeulandChatWidget *widget)
+{
+  g_return_val_if_fail (NEULAND_IS_CHAT_WIDGET (widget), 0);
+
+  return widget->priv->scrollback_limit;
+}
+
 static void
 neuland_chat_widget_set_property (GObject *object,
                                   guint property_id,
@@ -609,6 +1045,9 @@ neuland_chat_widget_set_property (GObject *object,
     case PROP_CONTACT:
       neuland_chat_widget_set_contact (widget, g_value_get_object (value));
       break;
+    case PROP_SCROLLBACK_LIMIT:
+      neuland_chat_widget_set_scrollback_limit (widget, g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -631,6 +1070,9 @@ neuland_chat_widget_get_property (GObject *object,
     case PROP_CONTACT:
       g_value_set_object (value, neuland_chat_widget_get_contact (widget));
       break;
+    case PROP_SCROLLBACK_LIMIT:
+      g_value_set_uint (value, neuland_chat_widget_get_scrollback_limit (widget));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -655,6 +1097,7 @@ neuland_chat_widget_class_init (NeulandChatWidgetClass *klass)
   gtk_widget_class_bind_template_child_private (widget_class, NeulandChatWidget, my_name_tag);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandChatWidget, info_tag);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandChatWidget, time_tag);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandChatWidget, undelivered_tag);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandChatWidget, info_bar);
   gtk_widget_class_bind_template_callback (widget_class, entry_text_view_key_press_event_cb);
   gtk_widget_class_bind_template_callback (widget_class, entry_text_buffer_changed_cb);
@@ -665,6 +1108,8 @@ neuland_chat_widget_class_init (NeulandChatWidgetClass *klass)
   gobject_class->dispose = neuland_chat_widget_dispose;
   gobject_class->finalize = neuland_chat_widget_finalize;
 
+  widget_class->unmap = neuland_chat_widget_unmap;
+
   properties[PROP_TOX] =
     g_param_spec_object ("tox",
                          "Tox",
@@ -681,6 +1126,15 @@ neuland_chat_widget_class_init (NeulandChatWidgetClass *klass)
                          G_PARAM_READWRITE |
                          G_PARAM_CONSTRUCT_ONLY);
 
+  properties[PROP_SCROLLBACK_LIMIT] =
+    g_param_spec_uint ("scrollback-limit",
+                       "Scrollback limit",
+                       "Blocks of text kept in the chat view, 0 for no limit",
+                       0,
+                       G_MAXUINT,
+                       DEFAULT_SCROLLBACK_LIMIT,
+                       G_PARAM_READWRITE);
+
   g_object_class_install_properties (gobject_class,
                                      PROP_N,
                                      properties);
@@ -696,7 +1150,12 @@ neuland_chat_widget_init (NeulandChatWidget *chat_widget)
   GtkTextIter iter;
   gtk_text_buffer_get_end_iter (priv->text_buffer, &iter);
   priv->scroll_mark = gtk_text_buffer_create_mark (priv->text_buffer, "scroll", &iter, TRUE);
-  priv->last_insert_time = NULL;
+  priv->last_insert_time = 0;
+  priv->scrollback_limit = DEFAULT_SCROLLBACK_LIMIT;
+  priv->undelivered_ht = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+  g_signal_connect_swapped (gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (priv->text_view)),
+                            "value-changed", G_CALLBACK (on_text_view_value_changed), chat_widget);
 
   gtk_list_box_set_header_func (priv->transfers_list_box, list_box_header_func, NULL, NULL);
 }
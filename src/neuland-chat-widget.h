@@ -61,4 +61,10 @@ neuland_chat_widget_get_contact (NeulandChatWidget *widget);
 void
 neuland_chat_widget_set_text_entry_min_height (NeulandChatWidget *widget, gint text_entry_min_height);
 
+void
+neuland_chat_widget_set_scrollback_limit (NeulandChatWidget *widget, guint scrollback_limit);
+
+guint
+neuland_chat_widget_get_scrollback_limit (NeulandChatWidget *widget);
+
 #endif /* __NEULAND_CHAT_WIDGET__ */
@@ -27,6 +27,7 @@
 
 #define NEULAND_CONTACT_SHOW_TYPING_TIMEOUT 3 /* Seconds */
 #define MAX_PREFERRED_NAME_LENGTH 12          /* UTF-8 chars, not bytes */
+#define FILE_NUMBER_SLOTS 256                 /* toxcore file numbers are guint8 */
 
 struct _NeulandContactPrivate
 {
@@ -36,6 +37,7 @@ struct _NeulandContactPrivate
   gchar *status_message;
   gchar *request_message;
   gchar *last_seen;
+  NeulandTimeAge last_seen_age;
 
   gpointer tox_id;
   guint unread_messages;
@@ -47,9 +49,16 @@ struct _NeulandContactPrivate
   gboolean has_chat_widget;
   NeulandContactStatus status;
 
-  GHashTable *file_transfers_send;
-  GHashTable *file_transfers_receive;
+  /* Indexed by file number, looked up for every file data package */
+  NeulandFileTransfer *file_transfers_send[FILE_NUMBER_SLOTS];
+  NeulandFileTransfer *file_transfers_receive[FILE_NUMBER_SLOTS];
   GHashTable *file_transfers_all;
+
+  NeulandChatLog *chat_log;
+
+  /* Text sent while the contact was offline, oldest first */
+  GQueue outgoing_queue;
+  guint64 last_outgoing_serial;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (NeulandContact, neuland_contact, G_TYPE_OBJECT)
@@ -79,6 +88,7 @@ enum {
   INCOMING_ACTION,
   OUTGOING_MESSAGE,
   OUTGOING_ACTION,
+  OUTGOING_DELIVERED,
   NEW_TRANSFER,
   LAST_SIGNAL
 };
@@ -86,6 +96,12 @@ enum {
 static GParamSpec *properties[PROP_N] = {NULL, };
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* All contacts share one timer that refreshes their last seen
+   strings when the day changes, see last_seen_timeout_cb() */
+static GList *all_contacts = NULL;
+static guint last_seen_timeout_id = 0;
+static gint64 last_seen_start_of_today = 0;
+
 static void
 neuland_contact_update_preferred_name (NeulandContact *contact)
 {
@@ -227,99 +243,70 @@ neuland_contact_update_last_seen (NeulandContact *contact)
       else
         {
           gchar *format;
-          gint y_now, m_now, d_now;  /* year, month, day */
-          GDateTime *now = g_date_time_new_now_local ();
           GDateTime *last = g_date_time_new_from_unix_local (last_connected_change);
-          GDateTime *start_today;
-          GDateTime *start_yesterday;
-          GDateTime *start_6_days_ago;
-          GDateTime *start_year;
-
-          g_date_time_get_ymd (now, &y_now, &m_now, &d_now);
 
-          start_today = g_date_time_new_local (y_now, m_now, d_now, 0, 0, 0);
-          start_yesterday = g_date_time_add_days (start_today, -1);
-          start_6_days_ago = g_date_time_add_days (start_today, -6);
-          start_year = g_date_time_new_local (y_now, 1, 1, 0, 0, 0);
+          priv->last_seen_age = neuland_get_time_age (last_connected_change);
 
           if (neuland_use_24h_time_format ())
-            {
-              if (g_date_time_compare (start_today, last) != 1)
-                /* start_today <= last */
-
+            switch (priv->last_seen_age)
+              {
+              case NEULAND_TIME_AGE_TODAY:
                 /* Translators: Time in 24h format */
                 format = _("%H:%M");
-
-              else if (g_date_time_compare (start_yesterday, last) != 1)
-                /* start_yesterday <= last */
-
+                break;
+              case NEULAND_TIME_AGE_YESTERDAY:
                 /* Translators: This is "Yesterday" followed by a time string in 24h format */
                 format = _("Yesterday, %H:%M");
-
-              else if (g_date_time_compare (start_6_days_ago, last) != 1)
-                /* 6 or less days ago (not 7 days ago, because we don't want
-                   to show Monday 10:12 when today is Monday, too). */
-
+                break;
+              case NEULAND_TIME_AGE_WEEK:
                 /* Translators: This is a abbreviated week day name
                    followed by a time string in 24h format */
                 format = _("%a, %H:%M");
-
-              else if (g_date_time_compare (start_year, last) != 1)
-                /* start_year <= last */
-
+                break;
+              case NEULAND_TIME_AGE_YEAR:
                 /* Translators: This is the abbreviated month name and day
                    number followed by a time string in 24h format */
                 format = _("%b %d, %H:%M");
-
-              else
-                /* last < start_year */
-
+                break;
+              default:
                 /* Translators: This is the abbreviated month name, day
                    number, year number followed by a time string in 24h
                    format */
                 format = _("%b %d %Y, %H:%M");
-            }
+                break;
+              }
           else
-            {
-              if (g_date_time_compare (start_today, last) != 1)
-                /* start_today <= last */
+            switch (priv->last_seen_age)
+              {
+              case NEULAND_TIME_AGE_TODAY:
                 /* Translators: Time in 12h format */
                 format = _("%l:%M %p");
-              else if (g_date_time_compare (start_yesterday, last) != 1)
-                /* start_yesterday <= last */
+                break;
+              case NEULAND_TIME_AGE_YESTERDAY:
                 /* Translators: This is "Yesterday" followed by a time string in 12h format */
                 format = _("Yesterday, %l:%M %p");
-
-              else if (g_date_time_compare (start_6_days_ago, last) != 1)
-                /* 6 or less days ago (not 7 days ago, because we don't want
-                   to show Monday 10:12 when today is Monday, too). */
-
+                break;
+              case NEULAND_TIME_AGE_WEEK:
                 /* Translators: This is a abbreviated week day name
                    followed by a time string in 12h format */
                 format = _("%a, %l:%M %p");
-
-              else if (g_date_time_compare (start_year, last) != 1)
-                /* start_year <= last */
+                break;
+              case NEULAND_TIME_AGE_YEAR:
                 /* Translators: This is the abbreviated month name, day
                    number followed by a time string in 12h format */
                 format = _("%b %d, %l:%M %p");
-
-              else
-                /* last < start_year */
+                break;
+              default:
                 /* Translators: This is the abbreviated month name, day
                    number, year number followed by a time string in 12h
                    format. */
                 format = _("%b %d %Y, %l:%M %p");
-            }
+                break;
+              }
 
           priv->last_seen = g_date_time_format (last, format);
 
-          g_date_time_unref (now);
           g_date_time_unref (last);
-          g_date_time_unref (start_today);
-          g_date_time_unref (start_yesterday);
-          g_date_time_unref (start_6_days_ago);
-          g_date_time_unref (start_year);
         }
     }
 
@@ -327,6 +314,36 @@ neuland_contact_update_last_seen (NeulandContact *contact)
                             properties[PROP_LAST_SEEN]);
 }
 
+/* Runs at the start of every minute, and only does work when the day
+   changed: "Yesterday, 10:12" must become a week day then. Only the
+   contacts whose string actually changes are updated and notified. */
+static gboolean
+last_seen_timeout_cb (gpointer user_data)
+{
+  gint64 start_of_today = neuland_get_start_of_today ();
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  GList *l;
+
+  if (start_of_today != last_seen_start_of_today)
+    {
+      last_seen_start_of_today = start_of_today;
+
+      for (l = all_contacts; l != NULL; l = l->next)
+        {
+          NeulandContact *contact = l->data;
+          NeulandContactPrivate *priv = contact->priv;
+
+          if (!priv->connected && priv->last_connected_change != 0 &&
+              neuland_get_time_age (priv->last_connected_change) != priv->last_seen_age)
+            neuland_contact_update_last_seen (contact);
+        }
+    }
+
+  last_seen_timeout_id = g_timeout_add_seconds (60 - now % 60, last_seen_timeout_cb, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 neuland_contact_set_last_connected_change (NeulandContact *contact,
                                            guint64 last_connected_change)
@@ -502,26 +519,23 @@ neuland_contact_add_file_transfer (NeulandContact *contact,
 {
   NeulandContactPrivate *priv;
   NeulandFileTransferDirection direction;
+  gint file_number;
 
   g_return_if_fail (NEULAND_IS_CONTACT (contact));
   g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
-  g_return_if_fail (neuland_file_transfer_get_file_number (file_transfer) != -1);
+
+  file_number = neuland_file_transfer_get_file_number (file_transfer);
+  g_return_if_fail (file_number >= 0 && file_number < FILE_NUMBER_SLOTS);
 
   priv = contact->priv;
   direction = neuland_file_transfer_get_direction (file_transfer);
 
+  /* toxcore reuses file numbers once a transfer is over, so a new
+     transfer simply takes over the slot of an old one. */
   if (direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
-    {
-      g_hash_table_insert (priv->file_transfers_receive,
-                           GINT_TO_POINTER (neuland_file_transfer_get_file_number
-                                            (file_transfer)), file_transfer);
-    }
+    priv->file_transfers_receive[file_number] = file_transfer;
   else if (direction == NEULAND_FILE_TRANSFER_DIRECTION_SEND)
-    {
-      g_hash_table_insert (priv->file_transfers_send,
-                           GINT_TO_POINTER (neuland_file_transfer_get_file_number
-                                            (file_transfer)), file_transfer);
-    }
+    priv->file_transfers_send[file_number] = file_transfer;
   else
     g_warn_if_reached ();
 
@@ -540,17 +554,17 @@ neuland_contact_get_file_transfer (NeulandContact *contact,
                                    gint file_number)
 {
   NeulandContactPrivate *priv;
-  GHashTable *table;
 
   g_return_val_if_fail (NEULAND_IS_CONTACT (contact), NULL);
 
-  priv = contact->priv;
+  if (file_number < 0 || file_number >= FILE_NUMBER_SLOTS)
+    return NULL;
 
-  table = direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE ?
-    priv->file_transfers_receive :
-    priv->file_transfers_send;
+  priv = contact->priv;
 
-  return g_hash_table_lookup (table, GINT_TO_POINTER (file_number));
+  return direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE ?
+    priv->file_transfers_receive[file_number] :
+    priv->file_transfers_send[file_number];
 }
 
 /* free returned list with g_list_free() */
@@ -559,10 +573,86 @@ neuland_contact_get_file_transfers (NeulandContact *contact)
 {
   g_return_val_if_fail (NEULAND_IS_CONTACT (contact), NULL);
 
-  g_hash_table_get_values (contact->priv->file_transfers_all);
+  return g_hash_table_get_values (contact->priv->file_transfers_all);
 }
 
 
+void
+neuland_contact_set_chat_log (NeulandContact *contact,
+                              NeulandChatLog *chat_log)
+{
+  NeulandContactPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_CONTACT (contact));
+  g_return_if_fail (chat_log == NULL || NEULAND_IS_CHAT_LOG (chat_log));
+
+  priv = contact->priv;
+
+  if (chat_log != NULL)
+    g_object_ref (chat_log);
+  g_clear_object (&priv->chat_log);
+  priv->chat_log = chat_log;
+}
+
+/* Returns the contact's chat log, or NULL if the history isn't
+   kept. The log is owned by @contact. */
+NeulandChatLog *
+neuland_contact_get_chat_log (NeulandContact *contact)
+{
+  g_return_val_if_fail (NEULAND_IS_CONTACT (contact), NULL);
+
+  return contact->priv->chat_log;
+}
+
+void
+neuland_outgoing_free (NeulandOutgoing *outgoing)
+{
+  g_free (outgoing->text);
+  g_slice_free (NeulandOutgoing, outgoing);
+}
+
+/* Queues @text to be sent once @contact is online again, see
+   neuland_contact_pop_outgoing(). @serial is the one @text was sent
+   with, or 0 if nobody waits for its delivery. */
+void
+neuland_contact_queue_outgoing (NeulandContact *contact,
+                                NeulandChatLogEntryType type,
+                                guint64 serial,
+                                const gchar *text)
+{
+  NeulandOutgoing *outgoing;
+
+  g_return_if_fail (NEULAND_IS_CONTACT (contact));
+  g_return_if_fail (text != NULL);
+
+  outgoing = g_slice_new0 (NeulandOutgoing);
+  outgoing->type = type;
+  outgoing->serial = serial;
+  outgoing->text = g_strdup (text);
+
+  g_queue_push_tail (&contact->priv->outgoing_queue, outgoing);
+}
+
+/* Returns: the oldest queued text or NULL, free it with
+   neuland_outgoing_free(). */
+NeulandOutgoing *
+neuland_contact_pop_outgoing (NeulandContact *contact)
+{
+  g_return_val_if_fail (NEULAND_IS_CONTACT (contact), NULL);
+
+  return g_queue_pop_head (&contact->priv->outgoing_queue);
+}
+
+/* Returns: the queued text, oldest first, as a list of
+   NeulandOutgoing owned by @contact. */
+GList *
+neuland_contact_get_outgoing (NeulandContact *contact)
+{
+  g_return_val_if_fail (NEULAND_IS_CONTACT (contact), NULL);
+
+  return contact->priv->outgoing_queue.head;
+}
+
 /* Returns the preferred name (truncated to 12 chars) for
    contact. String is owned by @contact, don't free it. */
 const gchar *
@@ -707,6 +797,18 @@ neuland_contact_reset_unread_messages (NeulandContact *contact)
   g_object_notify_by_pspec (G_OBJECT (contact), properties[PROP_UNREAD_MESSAGES]);
 }
 
+/* Each outgoing message and action gets a serial number, the
+   "outgoing-delivered" signal tells which one arrived. Text sent
+   without going through the signals, like queued text reloaded after
+   a restart, takes its serial from here as well. */
+guint64
+neuland_contact_next_outgoing_serial (NeulandContact *contact)
+{
+  g_return_val_if_fail (NEULAND_IS_CONTACT (contact), 0);
+
+  return ++contact->priv->last_outgoing_serial;
+}
+
 void
 neuland_contact_send_message (NeulandContact *contact, const gchar *outgoing_message)
 {
@@ -715,7 +817,8 @@ neuland_contact_send_message (NeulandContact *contact, const gchar *outgoing_mes
   g_signal_emit (contact,
                  signals[OUTGOING_MESSAGE],
                  0,
-                 outgoing_message);
+                 outgoing_message,
+                 neuland_contact_next_outgoing_serial (contact));
 }
 
 void
@@ -726,7 +829,19 @@ neuland_contact_send_action (NeulandContact *contact, gchar *outgoing_action)
   g_signal_emit (contact,
                  signals[OUTGOING_ACTION],
                  0,
-                 outgoing_action);
+                 outgoing_action,
+                 neuland_contact_next_outgoing_serial (contact));
+}
+
+void
+neuland_contact_signal_outgoing_delivered (NeulandContact *contact, guint64 serial)
+{
+  g_return_if_fail (NEULAND_IS_CONTACT (contact));
+
+  g_signal_emit (contact,
+                 signals[OUTGOING_DELIVERED],
+                 0,
+                 serial);
 }
 
 void
@@ -802,9 +917,18 @@ neuland_contact_finalize (GObject *object)
   g_free (priv->tox_id_hex);
   g_free (priv->last_seen);
 
+  all_contacts = g_list_remove (all_contacts, contact);
+  if (all_contacts == NULL && last_seen_timeout_id != 0)
+    {
+      g_source_remove (last_seen_timeout_id);
+      last_seen_timeout_id = 0;
+    }
+
   g_hash_table_destroy (priv->file_transfers_all);
-  g_hash_table_destroy (priv->file_transfers_send);
-  g_hash_table_destroy (priv->file_transfers_receive);
+  g_clear_object (&priv->chat_log);
+
+  g_queue_foreach (&priv->outgoing_queue, (GFunc) neuland_outgoing_free, NULL);
+  g_queue_clear (&priv->outgoing_queue);
 
   G_OBJECT_CLASS (neuland_contact_parent_class)->finalize (object);
 }
@@ -972,10 +1096,11 @@ neuland_contact_class_init (NeulandContactClass *klass)
                   G_SIGNAL_RUN_FIRST,
                   0,
                   NULL, NULL,
-                  g_cclosure_marshal_VOID__STRING,
+                  g_cclosure_marshal_generic,
                   G_TYPE_NONE,
-                  1,
-                  G_TYPE_STRING);
+                  2,
+                  G_TYPE_STRING,
+                  G_TYPE_UINT64);
 
   signals[OUTGOING_ACTION] =
     g_signal_new ("outgoing-action",
@@ -983,10 +1108,22 @@ neuland_contact_class_init (NeulandContactClass *klass)
                   G_SIGNAL_RUN_FIRST,
                   0,
                   NULL, NULL,
-                  g_cclosure_marshal_VOID__STRING,
+                  g_cclosure_marshal_generic,
+                  G_TYPE_NONE,
+                  2,
+                  G_TYPE_STRING,
+                  G_TYPE_UINT64);
+
+  signals[OUTGOING_DELIVERED] =
+    g_signal_new ("outgoing-delivered",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_FIRST,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_generic,
                   G_TYPE_NONE,
                   1,
-                  G_TYPE_STRING);
+                  G_TYPE_UINT64);
 
   signals[ENSURE_CHAT_WIDGET] =
     g_signal_new ("ensure-chat-widget",
@@ -1020,9 +1157,16 @@ neuland_contact_init (NeulandContact *contact)
   contact->priv = neuland_contact_get_instance_private (contact);
   priv = contact->priv;
 
-  priv->file_transfers_receive = g_hash_table_new (NULL, NULL);
-  priv->file_transfers_send = g_hash_table_new (NULL, NULL);
   priv->file_transfers_all = g_hash_table_new (NULL, NULL);
+
+  all_contacts = g_list_prepend (all_contacts, contact);
+  if (last_seen_timeout_id == 0)
+    {
+      last_seen_start_of_today = neuland_get_start_of_today ();
+      last_seen_timeout_id =
+        g_timeout_add_seconds (60 - (g_get_real_time () / G_USEC_PER_SEC) % 60,
+                               last_seen_timeout_cb, NULL);
+    }
 }
 
 NeulandContact *
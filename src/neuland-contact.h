@@ -23,6 +23,7 @@
 
 #include <glib-object.h>
 
+#include "neuland-chat-log.h"
 #include "neuland-file-transfer.h"
 
 #define NEULAND_TYPE_CONTACT            (neuland_contact_get_type ())
@@ -38,6 +39,14 @@ typedef enum {
   NEULAND_CONTACT_STATUS_BUSY
 } NeulandContactStatus;
 
+/* Text waiting to be sent, see neuland_contact_queue_outgoing() */
+typedef struct
+{
+  NeulandChatLogEntryType type;
+  guint64 serial;
+  gchar *text;
+} NeulandOutgoing;
+
 typedef struct _NeulandContact        NeulandContact;
 typedef struct _NeulandContactPrivate NeulandContactPrivate;
 typedef struct _NeulandContactClass   NeulandContactClass;
@@ -69,9 +78,18 @@ neuland_contact_increase_unread_messages (NeulandContact *contact);
 void
 neuland_contact_reset_unread_messages (NeulandContact *contact);
 
+guint64
+neuland_contact_next_outgoing_serial (NeulandContact *contact);
+
 void
 neuland_contact_send_message (NeulandContact *contact, const gchar *outgoing_message);
 
+void
+neuland_contact_send_action (NeulandContact *contact, gchar *outgoing_action);
+
+void
+neuland_contact_signal_outgoing_delivered (NeulandContact *contact, guint64 serial);
+
 void
 neuland_contact_signal_incoming_message (NeulandContact *contact, const gchar *incoming_message);
 
@@ -156,4 +174,23 @@ neuland_contact_get_file_transfer (NeulandContact *contact, NeulandFileTransferD
 GList *
 neuland_contact_get_file_transfers (NeulandContact *contact);
 
+void
+neuland_contact_set_chat_log (NeulandContact *contact, NeulandChatLog *chat_log);
+
+NeulandChatLog *
+neuland_contact_get_chat_log (NeulandContact *contact);
+
+void
+neuland_outgoing_free (NeulandOutgoing *outgoing);
+
+void
+neuland_contact_queue_outgoing (NeulandContact *contact, NeulandChatLogEntryType type,
+                                guint64 serial, const gchar *text);
+
+NeulandOutgoing *
+neuland_contact_pop_outgoing (NeulandContact *contact);
+
+GList *
+neuland_contact_get_outgoing (NeulandContact *contact);
+
 #endif /* __NEULAND_CONTACT_H__ */
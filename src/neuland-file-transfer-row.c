@@ -23,11 +23,16 @@
 
 #include "neuland-file-transfer-row.h"
 
+/* Progress is sampled at most this often per second by default,
+   0 means once per frame. */
+#define DEFAULT_UPDATE_RATE 10
+
 struct _NeulandFileTransferRowPrivate {
   NeulandFileTransfer *file_transfer;
   GtkLabel *file_name_label;
   GtkLabel *progress_label;
   GtkLabel *state_label;
+  GtkLabel *checksum_label;
 
   GtkProgressBar *progress_bar;
 
@@ -37,6 +42,10 @@ struct _NeulandFileTransferRowPrivate {
   GtkWidget *close_button;
   GtkImage *direction_image;
   gchar *total_size_string;
+
+  guint update_rate;
+  guint tick_id;
+  gint64 last_update_time;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (NeulandFileTransferRow, neuland_file_transfer_row, GTK_TYPE_LIST_BOX_ROW)
@@ -44,6 +53,7 @@ G_DEFINE_TYPE_WITH_PRIVATE (NeulandFileTransferRow, neuland_file_transfer_row, G
 enum {
   PROP_0,
   PROP_FILE_TRANSFER,
+  PROP_UPDATE_RATE,
   PROP_N
 };
 
@@ -53,9 +63,16 @@ static void
 neuland_file_transfer_row_dispose (GObject *object)
 {
   NeulandFileTransferRow *widget = NEULAND_FILE_TRANSFER_ROW (object);
+  NeulandFileTransferRowPrivate *priv = widget->priv;
 
   g_debug ("neuland_file_transfer_row_dispose (%p)", object);
 
+  if (priv->tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (widget), priv->tick_id);
+      priv->tick_id = 0;
+    }
+
   G_OBJECT_CLASS (neuland_file_transfer_row_parent_class)->dispose (object);
 }
 
@@ -96,6 +113,135 @@ on_file_transfer_transferred_size_changed_cb (GObject *gobject,
   g_free (text);
 }
 
+static gchar *
+format_eta (gint64 eta)
+{
+  if (eta < 60)
+    /* Translators: Time left for a file transfer, in seconds */
+    return g_strdup_printf (_("%i s left"), (gint)eta);
+  else if (eta < 60 * 60)
+    /* Translators: Time left for a file transfer, as "minutes:seconds" */
+    return g_strdup_printf (_("%i:%02i left"), (gint)(eta / 60), (gint)(eta % 60));
+  else
+    /* Translators: Time left for a file transfer, as "hours:minutes:seconds" */
+    return g_strdup_printf (_("%i:%02i:%02i left"), (gint)(eta / 3600),
+                            (gint)(eta / 60 % 60), (gint)(eta % 60));
+}
+
+static void
+on_file_transfer_rate_changed_cb (GObject *gobject,
+                                  GParamSpec *pspec,
+                                  gpointer user_data)
+{
+  NeulandFileTransferRow *file_transfer_row = NEULAND_FILE_TRANSFER_ROW (gobject);
+  NeulandFileTransferRowPrivate *priv = file_transfer_row->priv;
+  NeulandFileTransfer *file_transfer = priv->file_transfer;
+  NeulandFileTransferStats stats;
+  gdouble rate = neuland_file_transfer_get_rate (file_transfer);
+  gint64 eta = neuland_file_transfer_get_eta (file_transfer);
+  gchar *rate_string, *min_string, *avg_string, *max_string;
+  gchar *text;
+
+  if (neuland_file_transfer_get_state (file_transfer) != NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS)
+    return;
+
+  rate_string = g_format_size ((guint64)rate);
+  if (eta >= 0)
+    {
+      gchar *eta_string = format_eta (eta);
+
+      /* Translators: Speed and time left of a file transfer, like: "1.2 MB/s, 2:05 left" */
+      text = g_strdup_printf (_("%s/s, %s"), rate_string, eta_string);
+      g_free (eta_string);
+    }
+  else
+    text = g_strdup_printf (_("%s/s"), rate_string);
+  gtk_label_set_text (priv->state_label, text);
+  g_free (text);
+
+  neuland_file_transfer_get_stats (file_transfer, &stats);
+  min_string = g_format_size ((guint64)MAX (stats.min_rate, 0));
+  avg_string = g_format_size ((guint64)stats.avg_rate);
+  max_string = g_format_size ((guint64)stats.max_rate);
+  text = g_strdup_printf (_("Speed: %s/s min, %s/s average, %s/s max\n"
+                            "Stalled %u times"),
+                          min_string, avg_string, max_string, stats.n_stalls);
+  gtk_widget_set_tooltip_text (GTK_WIDGET (file_transfer_row), text);
+
+  g_free (rate_string);
+  g_free (min_string);
+  g_free (avg_string);
+  g_free (max_string);
+  g_free (text);
+}
+
+static void
+on_file_transfer_checksum_changed_cb (GObject *gobject,
+                                      GParamSpec *pspec,
+                                      gpointer user_data)
+{
+  NeulandFileTransferRow *file_transfer_row = NEULAND_FILE_TRANSFER_ROW (gobject);
+  NeulandFileTransferRowPrivate *priv = file_transfer_row->priv;
+  const gchar *checksum = neuland_file_transfer_get_checksum (priv->file_transfer);
+  gchar *text;
+
+  if (checksum == NULL)
+    return;
+
+  /* Translators: The checksum of a transferred file, shown once it is done */
+  text = g_strdup_printf (_("SHA-256: %s"), checksum);
+  gtk_label_set_text (priv->checksum_label, text);
+  gtk_widget_show (GTK_WIDGET (priv->checksum_label));
+
+  g_free (text);
+}
+
+/* The transfer only counts the bytes going through it, we show them
+   here. Since this runs per frame instead of per packet, the cost of
+   showing progress doesn't grow with the transfer rate. Sampling for
+   the rate and stats is up to NeulandTox, whether we are shown or
+   not. */
+static gboolean
+neuland_file_transfer_row_tick (GtkWidget *widget,
+                                GdkFrameClock *frame_clock,
+                                gpointer user_data)
+{
+  NeulandFileTransferRow *row = NEULAND_FILE_TRANSFER_ROW (widget);
+  NeulandFileTransferRowPrivate *priv = row->priv;
+  gint64 now = gdk_frame_clock_get_frame_time (frame_clock);
+
+  if (priv->update_rate > 0 &&
+      now - priv->last_update_time < G_USEC_PER_SEC / priv->update_rate)
+    return G_SOURCE_CONTINUE;
+
+  priv->last_update_time = now;
+  on_file_transfer_transferred_size_changed_cb (G_OBJECT (row), NULL, priv->file_transfer);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Only transfers in progress need sampling; setting the state
+   samples one last time anyway. */
+static void
+neuland_file_transfer_row_update_ticking (NeulandFileTransferRow *row,
+                                          NeulandFileTransferState state)
+{
+  NeulandFileTransferRowPrivate *priv = row->priv;
+
+  if (state == NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS)
+    {
+      if (priv->tick_id == 0)
+        priv->tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (row),
+                                                      neuland_file_transfer_row_tick,
+                                                      NULL, NULL);
+    }
+  else if (priv->tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (row), priv->tick_id);
+      priv->tick_id = 0;
+    }
+}
+
 static void
 on_file_transfer_state_changed_cb (GObject *gobject,
                                    GParamSpec *pspec,
@@ -108,6 +254,10 @@ on_file_transfer_state_changed_cb (GObject *gobject,
   NeulandFileTransferDirection direction = neuland_file_transfer_get_direction (file_transfer);
   GtkStyleContext *start_button_context = gtk_widget_get_style_context (priv->start_button);
 
+  neuland_file_transfer_row_update_ticking (file_transfer_row, state);
+
+  /* Clear the rate shown while in progress */
+  gtk_label_set_text (priv->state_label, "");
   gtk_style_context_remove_class (start_button_context, "suggested-action");
 
   switch (state)
@@ -140,7 +290,6 @@ on_file_transfer_state_changed_cb (GObject *gobject,
                                     "media-playback-pause-symbolic",
                                     GTK_ICON_SIZE_MENU);
       gtk_widget_set_sensitive (priv->start_button, TRUE);
-      gtk_label_set_text (priv->state_label, "");
       break;
 
     case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT:
@@ -165,7 +314,9 @@ on_file_transfer_state_changed_cb (GObject *gobject,
       gtk_widget_set_sensitive (priv->start_button, FALSE);
       break;
 
-    case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US:
+    case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US: /* fall through */
+    case NEULAND_FILE_TRANSFER_STATE_BROKEN:
+      /* A broken transfer is continued by a new one with its own row. */
       gtk_widget_destroy (GTK_WIDGET (file_transfer_row));
       break;
 
@@ -311,6 +462,12 @@ neuland_file_transfer_row_set_file_transfer (NeulandFileTransferRow *row,
                     on_file_transfer_state_changed_cb, row,
                     "swapped-signal::notify::transferred-size",
                     on_file_transfer_transferred_size_changed_cb, row,
+                    "swapped-signal::notify::rate",
+                    on_file_transfer_rate_changed_cb, row,
+                    "swapped-signal::notify::eta",
+                    on_file_transfer_rate_changed_cb, row,
+                    "swapped-signal::notify::checksum",
+                    on_file_transfer_checksum_changed_cb, row,
                     NULL);
   g_object_bind_property (transfer, "file-name", priv->file_name_label, "label",
                           G_BINDING_SYNC_CREATE);
@@ -321,6 +478,7 @@ neuland_file_transfer_row_set_file_transfer (NeulandFileTransferRow *row,
   /* Set up widgets according to the properties of @transfer */
   on_file_transfer_state_changed_cb (G_OBJECT (row), NULL, transfer);
   on_file_transfer_transferred_size_changed_cb (G_OBJECT (row), NULL, transfer);
+  on_file_transfer_checksum_changed_cb (G_OBJECT (row), NULL, transfer);
 }
 
 NeulandFileTransfer *
@@ -331,6 +489,29 @@ neuland_file_transfer_row_get_file_transfer (NeulandFileTransferRow *row)
   return row->priv->file_transfer;
 }
 
+/* @update_rate is the maximum number of progress updates per second,
+   0 updates once per frame. */
+void
+neuland_file_transfer_row_set_update_rate (NeulandFileTransferRow *row,
+                                           guint update_rate)
+{
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER_ROW (row));
+
+  if (row->priv->update_rate == update_rate)
+    return;
+
+  row->priv->update_rate = update_rate;
+  g_object_notify_by_pspec (G_OBJECT (row), properties[PROP_UPDATE_RATE]);
+}
+
+guint
+neuland_file_transfer_row_get_update_rate (NeulandFileTransferRow *row)
+{
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER_ROW (row), 0);
+
+  return row->priv->update_rate;
+}
+
 static void
 neuland_file_transfer_row_set_property (GObject *object,
                                         guint property_id,
@@ -344,6 +525,9 @@ neuland_file_transfer_row_set_property (GObject *object,
     case PROP_FILE_TRANSFER:
       neuland_file_transfer_row_set_file_transfer (row, g_value_get_object (value));
       break;
+    case PROP_UPDATE_RATE:
+      neuland_file_transfer_row_set_update_rate (row, g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -363,6 +547,9 @@ neuland_file_transfer_row_get_property (GObject *object,
     case PROP_FILE_TRANSFER:
       g_value_set_object (value, neuland_file_transfer_row_get_file_transfer (row));
       break;
+    case PROP_UPDATE_RATE:
+      g_value_set_uint (value, neuland_file_transfer_row_get_update_rate (row));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -385,6 +572,7 @@ neuland_file_transfer_row_class_init (NeulandFileTransferRowClass *klass)
   gtk_widget_class_bind_template_child_private (widget_class, NeulandFileTransferRow, progress_bar);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandFileTransferRow, progress_label);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandFileTransferRow, state_label);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandFileTransferRow, checksum_label);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandFileTransferRow, direction_image);
 
   gtk_widget_class_bind_template_callback (widget_class, on_start_button_clicked);
@@ -404,6 +592,15 @@ neuland_file_transfer_row_class_init (NeulandFileTransferRowClass *klass)
                          G_PARAM_READWRITE |
                          G_PARAM_CONSTRUCT_ONLY);
 
+  properties[PROP_UPDATE_RATE] =
+    g_param_spec_uint ("update-rate",
+                       "Update rate",
+                       "Maximum number of progress updates per second, 0 for every frame",
+                       0, G_MAXUINT,
+                       DEFAULT_UPDATE_RATE,
+                       G_PARAM_READWRITE |
+                       G_PARAM_CONSTRUCT);
+
   g_object_class_install_properties (gobject_class,
                                      PROP_N,
                                      properties);
@@ -54,4 +54,10 @@ neuland_file_transfer_row_get_type (void);
 GtkWidget*
 neuland_file_transfer_row_new (NeulandFileTransfer *file_transfer);
 
+void
+neuland_file_transfer_row_set_update_rate (NeulandFileTransferRow *row, guint update_rate);
+
+guint
+neuland_file_transfer_row_get_update_rate (NeulandFileTransferRow *row);
+
 #endif /* __NEULAND_FILE_TRANSFER_ROW__ */
@@ -18,12 +18,31 @@
  * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include "neuland-enums.h"
 
 #include "neuland-file-transfer.h"
 
- /* How often do we want to get an update on the already transferred size? */
-#define TRANSFERRED_SIZE_NOTIFY_PARTS 200.0
+/* Smaller files are read ahead in a single block anyway. */
+#define MAP_MIN_FILE_SIZE (1024 * 1024)
+
+/* Block size for re-hashing the data of a restored transfer */
+#define RESTORE_BLOCK_SIZE (1024 * 1024)
+
+/* Time constant of the smoothed "rate", and how long a transfer in
+   progress may go without data before we count it as stalled. */
+#define RATE_TIME_CONSTANT (2 * G_USEC_PER_SEC)
+#define STALL_TIMEOUT (3 * G_USEC_PER_SEC)
 
 struct _NeulandFileTransferPrivate
 {
@@ -36,11 +55,39 @@ struct _NeulandFileTransferPrivate
   GFile *file;
   gchar *file_name;
   guint64 file_size;
+  /* Bytes sent or received are added to @unsampled_size by the tox
+     and writer threads; the main loop folds them into
+     @transferred_size when it samples the progress. */
   guint64 transferred_size;
-  guint64 last_notify_size;
+  volatile gsize unsampled_size;
+
+  /* Throughput, updated when sampling while in progress. Times are
+     monotonic, @last_sample_time is 0 while not in progress. */
+  gint64 last_sample_time;
+  gint64 last_data_time;
+  gint64 active_time;
+  guint64 active_size;
+  gdouble rate;
+  gint64 eta;
+  gboolean stalled;
+  NeulandFileTransferStats stats;
+
+  /* SHA-256 of the file, fed in file order by whichever thread does
+     the I/O of this transfer. @checksum is its hex digest, set once
+     the transfer is finished. @hash_mutex protects @hash and
+     @hashed_size, which the main loop reads for the transfer
+     journal. */
+  GChecksum *hash;
+  guint64 hashed_size;
+  GMutex hash_mutex;
+  gchar *checksum;
 
   GFileInputStream *input_stream;
-  GFileOutputStream *output_stream;
+  /* Receiving transfers are written to @part_path, which is renamed
+     to the real file once the transfer is confirmed. */
+  gchar *part_path;
+  gint fd;
+  guint64 written_size;
 
   GDateTime *creation_time;
 };
@@ -58,6 +105,9 @@ enum {
   PROP_TRANSFERRED_SIZE,
   PROP_STATE,
   PROP_REQUESTED_STATE,
+  PROP_RATE,
+  PROP_ETA,
+  PROP_CHECKSUM,
   PROP_N
 };
 
@@ -72,9 +122,16 @@ neuland_file_transfer_dispose (GObject *object)
   g_debug ("neuland_file_transfer_dispose (%p)", object);
 
   g_clear_object (&priv->file);
-  g_clear_object (&priv->output_stream);
   g_clear_object (&priv->input_stream);
 
+  /* Writes queued before a transfer got killed hold a reference, so
+     nothing can use the file descriptor anymore. */
+  if (priv->fd != -1)
+    {
+      close (priv->fd);
+      priv->fd = -1;
+    }
+
   G_OBJECT_CLASS (neuland_file_transfer_parent_class)->dispose (object);
 }
 
@@ -87,6 +144,11 @@ neuland_file_transfer_finalize (GObject *object)
   g_debug ("neuland_file_transfer_finalize (%p)", object);
 
   g_free (priv->file_name);
+  g_free (priv->part_path);
+  g_free (priv->checksum);
+  if (priv->hash != NULL)
+    g_checksum_free (priv->hash);
+  g_mutex_clear (&priv->hash_mutex);
   g_date_time_unref (priv->creation_time);
 
   G_OBJECT_CLASS (neuland_file_transfer_parent_class)->finalize (object);
@@ -137,35 +199,303 @@ neuland_file_transfer_get_file_size (NeulandFileTransfer *file_transfer)
   return file_transfer->priv->file_size;
 }
 
+/* This is called for every packet and may be called from any
+   thread. It doesn't notify "transferred-size", that only happens
+   when the main loop calls
+   neuland_file_transfer_sample_transferred_size(). */
 void
 neuland_file_transfer_add_transferred_size (NeulandFileTransfer *file_transfer,
                                             guint64 transferred_size)
 {
-  NeulandFileTransferPrivate *priv;
-
   g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
 
-  priv = file_transfer->priv;
-  priv->transferred_size += transferred_size;
+  g_atomic_pointer_add (&file_transfer->priv->unsampled_size, (gssize)transferred_size);
+}
+
+/* Updates "rate", "eta" and the stats with @size bytes transferred
+   since the last sample. */
+static void
+neuland_file_transfer_update_rate (NeulandFileTransfer *file_transfer,
+                                   gsize size,
+                                   gint64 now)
+{
+  NeulandFileTransferPrivate *priv = file_transfer->priv;
+  NeulandFileTransferStats *stats = &priv->stats;
+  gint64 elapsed = now - priv->last_sample_time;
+  guint64 transferred_size;
+  gint64 eta = -1;
+
+  if (elapsed <= 0)
+    return;
+
+  priv->last_sample_time = now;
+  priv->active_time += elapsed;
+  priv->active_size += size;
 
-  if ((priv->transferred_size - priv->last_notify_size) > (priv->file_size / TRANSFERRED_SIZE_NOTIFY_PARTS) ||
-      priv->transferred_size == priv->file_size)
+  /* Exponentially weighted, with the weight depending on how long
+     the sample took, so that the sampling rate doesn't matter. */
+  priv->rate += ((gdouble)size * G_USEC_PER_SEC / elapsed - priv->rate) *
+    elapsed / (RATE_TIME_CONSTANT + elapsed);
+
+  if (size > 0)
+    {
+      priv->last_data_time = now;
+      priv->stalled = FALSE;
+    }
+  else if (now - priv->last_data_time >= STALL_TIMEOUT)
+    {
+      if (!priv->stalled)
+        {
+          priv->stalled = TRUE;
+          stats->n_stalls++;
+          stats->stalled_time += now - priv->last_data_time;
+        }
+      else
+        stats->stalled_time += elapsed;
+    }
+
+  /* The smoothed rate needs a while to get going, don't take the
+     ramp up as the minimum. */
+  if (priv->active_time >= RATE_TIME_CONSTANT)
     {
-      g_debug ("[transfer %p '%s': %10i (%5.1f%%)]",
-               file_transfer, priv->file_name, priv->transferred_size,
-               (gdouble)priv->transferred_size / priv->file_size * 100);
-      priv->last_notify_size = priv->transferred_size;
-      g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_TRANSFERRED_SIZE]);
+      if (stats->min_rate < 0 || priv->rate < stats->min_rate)
+        stats->min_rate = priv->rate;
+      stats->max_rate = MAX (stats->max_rate, priv->rate);
+    }
+  stats->avg_rate = (gdouble)priv->active_size * G_USEC_PER_SEC / priv->active_time;
+
+  transferred_size = neuland_file_transfer_get_transferred_size (file_transfer);
+  if (priv->rate >= 1.0 && transferred_size <= priv->file_size)
+    eta = (gint64)((priv->file_size - transferred_size) / priv->rate);
+
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_RATE]);
+
+  if (eta != priv->eta)
+    {
+      priv->eta = eta;
+      g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_ETA]);
     }
 }
 
+/* Folds what was added since the last call into the
+   "transferred-size" property and notifies it if anything changed,
+   updating "rate" and "eta" on the way. Must be called from the main
+   loop; NeulandTox calls this once per second for transfers in
+   progress, so its cost doesn't depend on the packet rate. Returns
+   TRUE if the transferred size changed. */
+gboolean
+neuland_file_transfer_sample_transferred_size (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv;
+  gsize size;
+
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), FALSE);
+
+  priv = file_transfer->priv;
+  size = g_atomic_pointer_and (&priv->unsampled_size, 0);
+
+  priv->transferred_size += size;
+
+  if (priv->last_sample_time != 0)
+    neuland_file_transfer_update_rate (file_transfer, size, g_get_monotonic_time ());
+
+  if (size == 0)
+    return FALSE;
+
+  g_debug ("[transfer %p '%s': %10" G_GUINT64_FORMAT " (%5.1f%%)]",
+           file_transfer, priv->file_name, priv->transferred_size,
+           (gdouble)priv->transferred_size / priv->file_size * 100);
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_TRANSFERRED_SIZE]);
+
+  return TRUE;
+}
+
+/* Includes data not sampled yet, so this is up to date in any
+   thread. */
 guint64
 neuland_file_transfer_get_transferred_size (NeulandFileTransfer *file_transfer)
 {
+  NeulandFileTransferPrivate *priv;
+
   g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), 0);
 
+  priv = file_transfer->priv;
+
+  return priv->transferred_size + (gsize)g_atomic_pointer_get (&priv->unsampled_size);
+}
+
+/* Smoothed throughput in bytes per second, 0 if not in progress */
+gdouble
+neuland_file_transfer_get_rate (NeulandFileTransfer *file_transfer)
+{
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), 0);
+
+  return file_transfer->priv->rate;
+}
+
+/* Estimated seconds left at the current rate, -1 if unknown */
+gint64
+neuland_file_transfer_get_eta (NeulandFileTransfer *file_transfer)
+{
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), -1);
+
+  return file_transfer->priv->eta;
+}
+
+void
+neuland_file_transfer_get_stats (NeulandFileTransfer *file_transfer,
+                                 NeulandFileTransferStats *stats)
+{
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
+  g_return_if_fail (stats != NULL);
+
+  *stats = file_transfer->priv->stats;
+}
+
+/* Adds @length bytes of @data found at @offset in the file to the
+   checksum. Data is hashed as it goes through the transfer, so there
+   is no second pass over the file. Bytes we hashed before are
+   skipped, as they come again when a paused transfer is resumed.
+   Must only be called from the thread doing the transfer's I/O. */
+void
+neuland_file_transfer_update_checksum (NeulandFileTransfer *file_transfer,
+                                       guint64 offset,
+                                       const guint8 *data,
+                                       gsize length)
+{
+  NeulandFileTransferPrivate *priv;
+  gsize skip;
+
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
+
+  priv = file_transfer->priv;
+
+  g_mutex_lock (&priv->hash_mutex);
+
+  if (priv->hash != NULL && offset > priv->hashed_size)
+    {
+      g_warning ("Gap in the data of file transfer %p \"%s\", can't "
+                 "compute its checksum", file_transfer, priv->file_name);
+      g_checksum_free (priv->hash);
+      priv->hash = NULL;
+    }
+  else if (priv->hash != NULL && priv->hashed_size - offset < length)
+    {
+      skip = priv->hashed_size - offset;
+      g_checksum_update (priv->hash, data + skip, length - skip);
+      priv->hashed_size += length - skip;
+    }
+
+  g_mutex_unlock (&priv->hash_mutex);
+}
+
+/* Returns the hex digest of the SHA-256 of the data hashed so far and
+   stores its length in @size, or returns NULL and stores 0 if the
+   checksum can't be computed. For receiving transfers the hashed data
+   has been written to the ".part" file. Free the result with
+   g_free(). */
+gchar *
+neuland_file_transfer_dup_partial_checksum (NeulandFileTransfer *file_transfer,
+                                            guint64 *size)
+{
+  NeulandFileTransferPrivate *priv;
+  GChecksum *copy = NULL;
+  gchar *checksum = NULL;
+
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), NULL);
+  g_return_val_if_fail (size != NULL, NULL);
+
+  priv = file_transfer->priv;
+  *size = 0;
+
+  g_mutex_lock (&priv->hash_mutex);
+  if (priv->hash != NULL)
+    {
+      /* Getting the digest closes a GChecksum, so use a copy. */
+      copy = g_checksum_copy (priv->hash);
+      *size = priv->hashed_size;
+    }
+  g_mutex_unlock (&priv->hash_mutex);
+
+  if (copy != NULL)
+    {
+      checksum = g_strdup (g_checksum_get_string (copy));
+      g_checksum_free (copy);
+    }
 
-  return file_transfer->priv->transferred_size;
+  return checksum;
+}
+
+/* Hex digest of the SHA-256 of the file, NULL until the transfer is
+   finished or if it couldn't be computed. */
+const gchar *
+neuland_file_transfer_get_checksum (NeulandFileTransfer *file_transfer)
+{
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), NULL);
+
+  return file_transfer->priv->checksum;
+}
+
+/* All data went through the I/O threads before the transfer is
+   finished, so the hash is complete by now. */
+static void
+neuland_file_transfer_finish_checksum (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv = file_transfer->priv;
+
+  if (priv->checksum != NULL)
+    return;
+
+  g_mutex_lock (&priv->hash_mutex);
+  if (priv->hash != NULL && priv->hashed_size == priv->file_size)
+    priv->checksum = g_strdup (g_checksum_get_string (priv->hash));
+  else if (priv->hash != NULL)
+    g_warning ("Only hashed %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+               " bytes of file transfer %p \"%s\"",
+               priv->hashed_size, priv->file_size, file_transfer, priv->file_name);
+  g_mutex_unlock (&priv->hash_mutex);
+
+  if (priv->checksum == NULL)
+    return;
+
+  g_debug ("SHA-256 of file transfer %p \"%s\": %s",
+           file_transfer, priv->file_name, priv->checksum);
+
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_CHECKSUM]);
+}
+
+/* Starts or stops the throughput accounting when entering or leaving
+   NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS, so that time spent
+   paused or pending doesn't count. */
+static void
+neuland_file_transfer_update_accounting (NeulandFileTransfer *file_transfer,
+                                         NeulandFileTransferState state)
+{
+  NeulandFileTransferPrivate *priv = file_transfer->priv;
+  NeulandFileTransferStats *stats = &priv->stats;
+
+  if (state == NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS)
+    {
+      priv->last_sample_time = priv->last_data_time = g_get_monotonic_time ();
+      return;
+    }
+
+  if (priv->last_sample_time == 0)
+    return;
+
+  priv->last_sample_time = 0;
+  priv->stalled = FALSE;
+  priv->rate = 0;
+  priv->eta = -1;
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_RATE]);
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_ETA]);
+
+  g_debug ("Transfer %p \"%s\": %" G_GUINT64_FORMAT " bytes in %.1f s, "
+           "rate min/avg/max %.0f/%.0f/%.0f B/s, %u stalls (%.1f s)",
+           file_transfer, priv->file_name, priv->active_size,
+           (gdouble)priv->active_time / G_USEC_PER_SEC,
+           MAX (stats->min_rate, 0), stats->avg_rate, stats->max_rate,
+           stats->n_stalls, (gdouble)stats->stalled_time / G_USEC_PER_SEC);
 }
 
 static void
@@ -278,6 +608,66 @@ neuland_file_transfer_get_requested_state (NeulandFileTransfer *file_transfer)
   return file_transfer->priv->requested_state;
 }
 
+/* Creates the ".part" file next to the file of a receiving transfer
+   and preallocates it to the announced file size, so that big files
+   don't grow (and fragment) one write at a time. */
+static gboolean
+neuland_file_transfer_open_part_file (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv = file_transfer->priv;
+  gchar *path = g_file_get_path (priv->file);
+
+  if (path == NULL)
+    {
+      g_warning ("Can't receive file transfer %p \"%s\" into a non-local file, "
+                 "going to kill transfer.", file_transfer, priv->file_name);
+      return FALSE;
+    }
+
+  priv->part_path = g_strconcat (path, ".part", NULL);
+  g_free (path);
+
+  /* A restored transfer continues the data we already have. */
+  priv->fd = g_open (priv->part_path,
+                     O_WRONLY | O_CREAT | (priv->written_size == 0 ? O_TRUNC : 0),
+                     0666);
+
+  if (priv->fd == -1)
+    {
+      g_warning ("Opening file \"%s\" for writing failed, "
+                 "going to kill file transfer. Error was:\n%s",
+                 priv->part_path, g_strerror (errno));
+      return FALSE;
+    }
+
+#ifdef HAVE_FALLOCATE
+  /* Not all file systems support this, we do without then. */
+  if (priv->file_size > 0 && fallocate (priv->fd, 0, 0, priv->file_size) == -1)
+    g_debug ("Preallocating %" G_GUINT64_FORMAT " bytes for \"%s\" failed: %s",
+             priv->file_size, priv->part_path, g_strerror (errno));
+#endif
+
+  return TRUE;
+}
+
+/* Closes the ".part" file, cutting off preallocated space the contact
+   did not send data for. */
+static void
+neuland_file_transfer_close_part_file (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv = file_transfer->priv;
+
+  if (priv->fd == -1)
+    return;
+
+  if (priv->written_size < priv->file_size &&
+      ftruncate (priv->fd, priv->written_size) == -1)
+    g_warning ("Truncating \"%s\" failed: %s", priv->part_path, g_strerror (errno));
+
+  close (priv->fd);
+  priv->fd = -1;
+}
+
 void
 neuland_file_transfer_set_state (NeulandFileTransfer *file_transfer,
                                  NeulandFileTransferState state)
@@ -293,25 +683,58 @@ neuland_file_transfer_set_state (NeulandFileTransfer *file_transfer,
   if (state == priv->state)
     return;
 
+  /* Listeners of "state" should see the final transferred size. */
+  neuland_file_transfer_sample_transferred_size (file_transfer);
+
   priv->state = state;
+  neuland_file_transfer_update_accounting (file_transfer, state);
 
   ev = g_enum_get_value (eclass, state);
   g_debug ("Setting state of file transfer %p to:\n%s",
            file_transfer, ev->value_name);
 
+  if (state == NEULAND_FILE_TRANSFER_STATE_FINISHED ||
+      state == NEULAND_FILE_TRANSFER_STATE_FINISHED_CONFIRMED)
+    neuland_file_transfer_finish_checksum (file_transfer);
+
   if (priv->direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
     {
-      if (state == NEULAND_FILE_TRANSFER_STATE_FINISHED)
+      gchar *path;
+
+      switch (state)
         {
-          g_debug ("Closing output stream for transfer %p", file_transfer);
-          g_output_stream_close (G_OUTPUT_STREAM (priv->output_stream), NULL, NULL);
+        case NEULAND_FILE_TRANSFER_STATE_FINISHED:
+          g_debug ("Closing part file for transfer %p", file_transfer);
+          neuland_file_transfer_close_part_file (file_transfer);
+          break;
+
+        case NEULAND_FILE_TRANSFER_STATE_FINISHED_CONFIRMED:
+          neuland_file_transfer_close_part_file (file_transfer);
+          path = g_file_get_path (priv->file);
+          if (priv->part_path != NULL && path != NULL &&
+              g_rename (priv->part_path, path) == -1)
+            g_warning ("Renaming \"%s\" to \"%s\" failed: %s",
+                       priv->part_path, path, g_strerror (errno));
+          g_free (path);
+          break;
+
+        case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US: /* fall through */
+        case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_CONTACT:
+          /* A killed transfer can't be resumed, don't leave the
+             partial data around. After an error the data is kept,
+             a later restore checks it against the journal anyway. */
+          if (priv->part_path != NULL)
+            g_unlink (priv->part_path);
+          break;
+
+        default:
+          break;
         }
     }
 
   g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_STATE]);
 }
 
-
 NeulandFileTransferState
 neuland_file_transfer_get_state (NeulandFileTransfer *file_transfer)
 {
@@ -434,6 +857,15 @@ neuland_file_transfer_get_property (GObject *object,
     case PROP_STATE:
       g_value_set_enum (value, neuland_file_transfer_get_state (file_transfer));
       break;
+    case PROP_RATE:
+      g_value_set_double (value, neuland_file_transfer_get_rate (file_transfer));
+      break;
+    case PROP_ETA:
+      g_value_set_int64 (value, neuland_file_transfer_get_eta (file_transfer));
+      break;
+    case PROP_CHECKSUM:
+      g_value_set_string (value, neuland_file_transfer_get_checksum (file_transfer));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -528,6 +960,29 @@ neuland_file_transfer_class_init (NeulandFileTransferClass *klass)
                        G_PARAM_READWRITE |
                        G_PARAM_CONSTRUCT);
 
+  properties[PROP_RATE] =
+    g_param_spec_double ("rate",
+                         "Rate",
+                         "Smoothed throughput in bytes per second",
+                         0, G_MAXDOUBLE,
+                         0,
+                         G_PARAM_READABLE);
+
+  properties[PROP_ETA] =
+    g_param_spec_int64 ("eta",
+                        "ETA",
+                        "Estimated seconds until the transfer is done, -1 if unknown",
+                        -1, G_MAXINT64,
+                        -1,
+                        G_PARAM_READABLE);
+
+  properties[PROP_CHECKSUM] =
+    g_param_spec_string ("checksum",
+                         "Checksum",
+                         "Hex SHA-256 of the file, set once the transfer is finished",
+                         NULL,
+                         G_PARAM_READABLE);
+
   g_object_class_install_properties (gobject_class,
                                      PROP_N,
                                      properties);
@@ -539,58 +994,56 @@ neuland_file_transfer_init (NeulandFileTransfer *file_transfer)
   file_transfer->priv = neuland_file_transfer_get_instance_private (file_transfer);
 
   file_transfer->priv->creation_time = g_date_time_new_now_local ();
+  file_transfer->priv->fd = -1;
+  file_transfer->priv->eta = -1;
+  file_transfer->priv->stats.min_rate = -1;
+  file_transfer->priv->hash = g_checksum_new (G_CHECKSUM_SHA256);
+  g_mutex_init (&file_transfer->priv->hash_mutex);
 }
 
-/* Returns the number of appended bytes or -1 on error. This function
-   only runs in the main loop right now. */
+/* Writes @length bytes of @data at @offset into the ".part" file of a
+   receiving transfer, creating it on the first call. Returns the
+   number of written bytes or -1 on error. This function is called
+   from the writer thread of NeulandTox, with blocks of coalesced
+   packets. */
 gssize
-neuland_file_transfer_append_data (NeulandFileTransfer *file_transfer,
-                                   GByteArray *data_array)
+neuland_file_transfer_write_data (NeulandFileTransfer *file_transfer,
+                                  guint64 offset,
+                                  const guint8 *data,
+                                  gsize length)
 {
-  /* g_debug ("neuland_file_transfer_append_data"); */
   NeulandFileTransferPrivate *priv;
-  const gchar *name;
-  gchar *path;
-  GError *error = NULL;
-  gssize count;
+  gsize written = 0;
 
   g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), -1);
 
   priv = file_transfer->priv;
-  name = priv->file_name;
-  path = g_file_get_path (priv->file);
 
-  /* TODO: Check if file exists, don't just append! */
-  if (priv->output_stream == NULL)
-    priv->output_stream = g_file_append_to (priv->file, 0, NULL, &error);
+  if (priv->fd == -1 && !neuland_file_transfer_open_part_file (file_transfer))
+    return -1;
 
-  if (error != NULL)
-    g_warning ("Opening file \"%s\" for appending failed, "
-               "going to kill file transfer. Error was:\n"
-               "%s (error code: %i)",
-               path, error->message, error->code);
-  else
+  while (written < length)
     {
-      count = g_output_stream_write (G_OUTPUT_STREAM (priv->output_stream),
-                                     data_array->data,
-                                     data_array->len,
-                                     NULL, &error);
-      if (error != NULL)
-        g_warning ("Writing to file transfer %p \"%s\" failed, "
-                   "going to kill transfer. Error was:\n"
-                   "%s (error code: %i)",
-                   file_transfer, name, error->message, error->code);
-    }
+      gssize ret = pwrite (priv->fd, data + written, length - written, offset + written);
 
-  g_free (path);
+      if (ret == -1)
+        {
+          if (errno == EINTR)
+            continue;
 
-  if (error != NULL)
-    {
-      return -1;
-      g_error_free (error);
+          g_warning ("Writing to file transfer %p \"%s\" failed, "
+                     "going to kill transfer. Error was:\n%s",
+                     file_transfer, priv->file_name, g_strerror (errno));
+          return -1;
+        }
+
+      written += ret;
     }
 
-  return count;
+  priv->written_size = MAX (priv->written_size, offset + length);
+  neuland_file_transfer_update_checksum (file_transfer, offset, data, length);
+
+  return written;
 }
 
 /* Seek back to the point where the last fetched data was beginning,
@@ -604,14 +1057,300 @@ neuland_file_transfer_prepare_resume_sending (NeulandFileTransfer *file_transfer
 
   priv = file_transfer->priv;
   g_seekable_seek (G_SEEKABLE (priv->input_stream),
-                   (goffset)priv->transferred_size,
+                   (goffset)neuland_file_transfer_get_transferred_size (file_transfer),
                    G_SEEK_SET,
                    NULL, NULL);
 }
 
+typedef struct
+{
+  GFile *file;
+  guint64 offset;
+  gchar *checksum;
+} RestoreData;
+
+static void
+free_restore_data (RestoreData *data)
+{
+  g_object_unref (data->file);
+  g_free (data->checksum);
+  g_slice_free (RestoreData, data);
+}
+
+/* Runs in a GTask thread, hashes the first @offset bytes of the data
+   we have and compares them to the journaled checksum. */
+static void
+neuland_file_transfer_restore_thread (GTask *task,
+                                      gpointer source_object,
+                                      gpointer task_data,
+                                      GCancellable *cancellable)
+{
+  RestoreData *data = task_data;
+  GFileInputStream *stream;
+  GChecksum *hash;
+  GError *error = NULL;
+  guint8 *buffer;
+  guint64 left = data->offset;
+
+  hash = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* Nothing to check when starting from the beginning */
+  if (left == 0)
+    {
+      g_task_return_pointer (task, hash, (GDestroyNotify) g_checksum_free);
+      return;
+    }
+
+  stream = g_file_read (data->file, cancellable, &error);
+  if (stream == NULL)
+    {
+      g_checksum_free (hash);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  buffer = g_malloc (RESTORE_BLOCK_SIZE);
+
+  while (left > 0)
+    {
+      gssize count = g_input_stream_read (G_INPUT_STREAM (stream), buffer,
+                                          MIN (left, RESTORE_BLOCK_SIZE),
+                                          cancellable, &error);
+      if (count <= 0)
+        break;
+
+      g_checksum_update (hash, buffer, count);
+      left -= count;
+    }
+
+  g_free (buffer);
+  g_object_unref (stream);
+
+  if (error == NULL && left > 0)
+    error = g_error_new (G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                         "Only %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes left",
+                         data->offset - left, data->offset);
+
+  if (error == NULL && data->checksum != NULL)
+    {
+      /* Getting the digest closes a GChecksum, so use a copy. */
+      GChecksum *copy = g_checksum_copy (hash);
+
+      if (g_strcmp0 (data->checksum, g_checksum_get_string (copy)) != 0)
+        error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                     "The data changed since it was journaled");
+      g_checksum_free (copy);
+    }
+
+  if (error != NULL)
+    {
+      g_checksum_free (hash);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_return_pointer (task, hash, (GDestroyNotify) g_checksum_free);
+}
+
+/* Restores the progress of a transfer that was interrupted by a
+   restart, so that it continues at @offset: the first @offset bytes
+   of the file we send, or of the ".part" file of a receiving transfer,
+   are hashed again and, if @checksum is not NULL, compared to it. The
+   file of a receiving transfer must be set already. Call
+   neuland_file_transfer_restore_finish() from @callback. */
+void
+neuland_file_transfer_restore_async (NeulandFileTransfer *file_transfer,
+                                     guint64 offset,
+                                     const gchar *checksum,
+                                     GCancellable *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+  NeulandFileTransferPrivate *priv;
+  RestoreData *data;
+  GTask *task;
+
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
+  g_return_if_fail (G_IS_FILE (file_transfer->priv->file));
+
+  priv = file_transfer->priv;
+
+  data = g_slice_new0 (RestoreData);
+  data->offset = MIN (offset, priv->file_size);
+  data->checksum = g_strdup (checksum);
+
+  if (priv->direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
+    {
+      gchar *path = g_file_get_path (priv->file);
+      gchar *part_path = g_strconcat (path, ".part", NULL);
+
+      data->file = g_file_new_for_path (part_path);
+      g_free (part_path);
+      g_free (path);
+    }
+  else
+    data->file = g_object_ref (priv->file);
+
+  task = g_task_new (file_transfer, cancellable, callback, user_data);
+  g_task_set_task_data (task, data, (GDestroyNotify) free_restore_data);
+  g_task_run_in_thread (task, neuland_file_transfer_restore_thread);
+  g_object_unref (task);
+}
+
+/* Returns TRUE if the transfer now continues at the offset passed to
+   neuland_file_transfer_restore_async(). On error nothing changed and
+   the transfer has to start from the beginning. */
+gboolean
+neuland_file_transfer_restore_finish (NeulandFileTransfer *file_transfer,
+                                      GAsyncResult *result,
+                                      GError **error)
+{
+  NeulandFileTransferPrivate *priv;
+  RestoreData *data;
+  GChecksum *hash;
+  gchar *path;
+
+  g_return_val_if_fail (g_task_is_valid (result, file_transfer), FALSE);
+
+  priv = file_transfer->priv;
+  data = g_task_get_task_data (G_TASK (result));
+  path = g_file_get_path (data->file);
+
+  hash = g_task_propagate_pointer (G_TASK (result), error);
+  if (hash == NULL)
+    {
+      g_free (path);
+      return FALSE;
+    }
+
+  /* A restore runs before any data goes through the transfer. */
+  g_mutex_lock (&priv->hash_mutex);
+  if (priv->hash != NULL)
+    g_checksum_free (priv->hash);
+  priv->hash = hash;
+  priv->hashed_size = data->offset;
+  g_mutex_unlock (&priv->hash_mutex);
 
-/* This function is called from within neuland_tox_send_file_transfer()
-   which runs in a separate thread! */
+  priv->transferred_size = data->offset;
+  if (priv->direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
+    priv->written_size = data->offset;
+
+  g_message ("Restored file transfer %p \"%s\" at %" G_GUINT64_FORMAT
+             " of %" G_GUINT64_FORMAT " bytes from \"%s\"",
+             file_transfer, priv->file_name, data->offset, priv->file_size, path);
+  g_free (path);
+
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_TRANSFERRED_SIZE]);
+
+  return TRUE;
+}
+
+/* Throws away the restored data of a receiving transfer whose contact
+   sends from the beginning anyway: the ".part" file is truncated and
+   hashing starts over. Like neuland_file_transfer_write_data() this
+   is called from the writer thread of NeulandTox, before the first
+   new block is written. */
+void
+neuland_file_transfer_discard_part_file (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
+
+  priv = file_transfer->priv;
+
+  g_mutex_lock (&priv->hash_mutex);
+  if (priv->hash != NULL)
+    g_checksum_free (priv->hash);
+  priv->hash = g_checksum_new (G_CHECKSUM_SHA256);
+  priv->hashed_size = 0;
+  g_mutex_unlock (&priv->hash_mutex);
+
+  /* If the file isn't open yet, opening it truncates it now. */
+  priv->written_size = 0;
+  if (priv->fd != -1 && ftruncate (priv->fd, 0) == -1)
+    g_warning ("Truncating the \".part\" file of file transfer %p \"%s\" failed: %s",
+               file_transfer, priv->file_name, g_strerror (errno));
+}
+
+/* Main loop counterpart of neuland_file_transfer_discard_part_file():
+   takes the @restored_size bytes from the restore off the progress. */
+void
+neuland_file_transfer_discard_restored_size (NeulandFileTransfer *file_transfer,
+                                             guint64 restored_size)
+{
+  NeulandFileTransferPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
+
+  priv = file_transfer->priv;
+
+  priv->transferred_size -= MIN (restored_size, priv->transferred_size);
+
+  g_object_notify_by_pspec (G_OBJECT (file_transfer), properties[PROP_TRANSFERRED_SIZE]);
+}
+
+/* Maps the file of a sending transfer into memory, so that packets
+   can be sent straight from the mapping and resuming is just an
+   offset. Returns NULL if the file is not a local regular file, is
+   too small to bother or can't be mapped; the caller falls back to
+   neuland_file_transfer_get_next_data() then. Like with reading, the
+   file must not be truncated while it is being sent. Free the result
+   with g_mapped_file_unref(). */
+GMappedFile *
+neuland_file_transfer_map_for_sending (NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferPrivate *priv;
+  GMappedFile *mapped_file;
+  GError *error = NULL;
+  gchar *path;
+
+  g_return_val_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer), NULL);
+
+  priv = file_transfer->priv;
+
+  g_return_val_if_fail (priv->direction == NEULAND_FILE_TRANSFER_DIRECTION_SEND, NULL);
+
+  if (priv->file_size < MAP_MIN_FILE_SIZE)
+    return NULL;
+
+  /* NULL for files that are not local */
+  path = g_file_get_path (priv->file);
+  if (path == NULL)
+    return NULL;
+
+  if (!g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  mapped_file = g_mapped_file_new (path, FALSE, &error);
+
+  if (error != NULL)
+    {
+      g_debug ("Mapping file \"%s\" failed, going to read it instead. Error was:\n"
+               "%s (error code: %i)", path, error->message, error->code);
+      g_error_free (error);
+      g_free (path);
+      return NULL;
+    }
+
+#ifdef HAVE_MADVISE
+  madvise (g_mapped_file_get_contents (mapped_file),
+           g_mapped_file_get_length (mapped_file),
+           MADV_SEQUENTIAL);
+#endif
+
+  g_debug ("Mapped file \"%s\" (%" G_GSIZE_FORMAT " bytes) for sending",
+           path, g_mapped_file_get_length (mapped_file));
+  g_free (path);
+
+  return mapped_file;
+}
+
+/* This function is called from the reader thread of NeulandTox's
+   transfer scheduler, which reads ahead in large blocks! */
 gssize
 neuland_file_transfer_get_next_data (NeulandFileTransfer *file_transfer,
                                      gpointer buffer,
@@ -640,6 +1379,8 @@ neuland_file_transfer_get_next_data (NeulandFileTransfer *file_transfer,
                path, error->message, error->code);
   else
     {
+      goffset offset = g_seekable_tell (G_SEEKABLE (priv->input_stream));
+
       count = g_input_stream_read (G_INPUT_STREAM (priv->input_stream), buffer,
                                    data_size, NULL, &error);
 
@@ -650,6 +1391,8 @@ neuland_file_transfer_get_next_data (NeulandFileTransfer *file_transfer,
                    file_transfer, name, error->message, error->code);
       else
         {
+          neuland_file_transfer_update_checksum (file_transfer, offset, buffer, count);
+
           if (count == 0)
             {
               g_debug ("End of input stream for transfer %p \"%s\", closing input stream.",
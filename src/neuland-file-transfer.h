@@ -55,6 +55,18 @@ typedef enum
   NEULAND_FILE_TRANSFER_STATE_BROKEN,
 } NeulandFileTransferState;
 
+/* Throughput figures of a transfer, see
+   neuland_file_transfer_get_stats(). Rates are in bytes per second
+   and only time spent in progress counts. */
+typedef struct
+{
+  gdouble min_rate;      /* of the smoothed rate, -1 until known */
+  gdouble avg_rate;
+  gdouble max_rate;      /* of the smoothed rate */
+  guint n_stalls;        /* times no data came for a few seconds */
+  gint64 stalled_time;   /* microseconds */
+} NeulandFileTransferStats;
+
 struct _NeulandFileTransfer
 {
   GObject parent_instance;
@@ -109,11 +121,15 @@ const gchar *
 neuland_file_transfer_get_file_name (NeulandFileTransfer *file_transfer);
 
 gssize
-neuland_file_transfer_append_data (NeulandFileTransfer *file_transfer, GByteArray *data_array);
+neuland_file_transfer_write_data (NeulandFileTransfer *file_transfer, guint64 offset,
+                                  const guint8 *data, gsize length);
 
 gssize
 neuland_file_transfer_get_next_data (NeulandFileTransfer *file_transfer, gpointer buffer, gint data_size);
 
+GMappedFile *
+neuland_file_transfer_map_for_sending (NeulandFileTransfer *file_transfer);
+
 void
 neuland_file_transfer_prepare_resume_sending (NeulandFileTransfer *file_transfer);
 
@@ -132,4 +148,41 @@ neuland_file_transfer_get_state (NeulandFileTransfer *file_transfer);
 void
 neuland_file_transfer_add_transferred_size (NeulandFileTransfer *file_transfer, guint64 transferred_size);
 
+gboolean
+neuland_file_transfer_sample_transferred_size (NeulandFileTransfer *file_transfer);
+
+gdouble
+neuland_file_transfer_get_rate (NeulandFileTransfer *file_transfer);
+
+gint64
+neuland_file_transfer_get_eta (NeulandFileTransfer *file_transfer);
+
+void
+neuland_file_transfer_get_stats (NeulandFileTransfer *file_transfer, NeulandFileTransferStats *stats);
+
+void
+neuland_file_transfer_update_checksum (NeulandFileTransfer *file_transfer, guint64 offset,
+                                       const guint8 *data, gsize length);
+
+const gchar *
+neuland_file_transfer_get_checksum (NeulandFileTransfer *file_transfer);
+
+gchar *
+neuland_file_transfer_dup_partial_checksum (NeulandFileTransfer *file_transfer, guint64 *size);
+
+void
+neuland_file_transfer_restore_async (NeulandFileTransfer *file_transfer, guint64 offset,
+                                     const gchar *checksum, GCancellable *cancellable,
+                                     GAsyncReadyCallback callback, gpointer user_data);
+
+gboolean
+neuland_file_transfer_restore_finish (NeulandFileTransfer *file_transfer, GAsyncResult *result,
+                                      GError **error);
+
+void
+neuland_file_transfer_discard_part_file (NeulandFileTransfer *file_transfer);
+
+void
+neuland_file_transfer_discard_restored_size (NeulandFileTransfer *file_transfer, guint64 restored_size);
+
 #endif /* __NEULAND_FILE_TRANSFER__ */
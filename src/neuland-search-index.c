@@ -0,0 +1,1348 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A NeulandSearchIndex maps the words in the chat logs of all
+   contacts to the log entries they appear in. New postings are
+   collected in memory; once there are enough of them they are
+   written to an immutable segment file sorted by word, and segments
+   are merged into one when there are too many. Queries look at the
+   postings in memory and at the memory mapped segments.
+
+   Indexing runs in a background thread that reads the entries back
+   from the chat logs, so logging a message costs nothing extra and
+   entries logged before a crash or before the index existed are
+   picked up the same way. */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "neuland-search-index.h"
+
+#define MAX_TOKEN_LENGTH 32       /* chars, longer words are cut */
+#define MEMTABLE_FLUSH_SIZE 65536 /* postings in memory before a segment is written */
+#define MAX_SEGMENTS 8            /* more segments than this are merged into one */
+#define READ_BATCH 512            /* chat log entries read at a time */
+
+/* Segment files start with SEGMENT_MAGIC followed by the number of
+   tokens, the size of the token strings and the size of the
+   postings, as big endian guint32. Then comes a table of token
+   string offset, postings offset and number of postings for each
+   token, sorted by token, then the NUL terminated token strings and
+   then the postings. Each token's postings are sorted and stored as
+   varint encoded differences to the previous one. */
+#define SEGMENT_MAGIC "NLSIDX01"
+#define SEGMENT_HEADER_SIZE 20
+#define SEGMENT_TABLE_ENTRY_SIZE 12
+
+/* A posting is the log's id in the upper 24 bits and the number of
+   the entry in the lower 40 bits, so sorting postings sorts them by
+   log and entry. */
+#define ENTRY_BITS 40
+#define POSTING(log_id, entry) (((guint64) (log_id) << ENTRY_BITS) | (entry))
+#define POSTING_LOG_ID(posting) ((guint) ((posting) >> ENTRY_BITS))
+#define POSTING_ENTRY(posting) ((posting) & ((G_GUINT64_CONSTANT (1) << ENTRY_BITS) - 1))
+
+#define STATE_GROUP "index"
+
+typedef struct
+{
+  gint ref_count; /* atomic */
+  gchar *path;
+  guint number;
+  GMappedFile *map;
+  const guint8 *table;
+  const gchar *strings;
+  const guint8 *postings;
+  guint32 n_tokens;
+  guint32 strings_size;
+  guint32 postings_size;
+} Segment;
+
+typedef struct
+{
+  GByteArray *table;
+  GByteArray *strings;
+  GByteArray *postings;
+  guint32 n_tokens;
+} SegmentWriter;
+
+typedef struct
+{
+  gchar *name;
+  guint id;
+  NeulandChatLog *chat_log; /* NULL until added in this session */
+  guint64 indexed;          /* entries in segments */
+  guint64 queued;           /* entries in segments or in memory */
+  gboolean dirty;
+} IndexedLog;
+
+struct _NeulandSearchIndexPrivate
+{
+  gchar *directory;
+  gchar *state_path;
+
+  /* Protects everything below. Only the update thread changes
+     @segments and the indexed and queued counts of the logs. */
+  GMutex mutex;
+  GCond cond;
+  GHashTable *logs;             /* name -> IndexedLog */
+  GPtrArray *logs_by_id;
+  GHashTable *memtable;         /* token -> GArray of postings */
+  GHashTable *frozen_memtable;  /* being written to a segment */
+  guint n_memtable_postings;
+  GPtrArray *segments;          /* oldest first */
+  guint next_segment;
+  gboolean update_scheduled;
+  gboolean updating;
+  gboolean flush_requested;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (NeulandSearchIndex, neuland_search_index, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_DIRECTORY,
+  PROP_N
+};
+
+static GParamSpec *properties[PROP_N] = {NULL, };
+
+void
+neuland_search_hit_free (NeulandSearchHit *hit)
+{
+  g_free (hit->name);
+  g_slice_free (NeulandSearchHit, hit);
+}
+
+static void
+indexed_log_free (IndexedLog *log)
+{
+  g_free (log->name);
+  if (log->chat_log != NULL)
+    g_object_unref (log->chat_log);
+  g_slice_free (IndexedLog, log);
+}
+
+/* Splits @text into case folded words, this is done the same way
+   for indexing and for queries. */
+static GPtrArray *
+tokenize (const gchar *text)
+{
+  GPtrArray *tokens = g_ptr_array_new_with_free_func (g_free);
+  gchar *normalized = g_utf8_normalize (text, -1, G_NORMALIZE_ALL);
+  gchar *folded;
+  GString *token;
+  guint length = 0;
+  const gchar *p;
+
+  /* Not valid UTF-8 */
+  if (normalized == NULL)
+    return tokens;
+
+  folded = g_utf8_casefold (normalized, -1);
+  token = g_string_new (NULL);
+
+  for (p = folded; ; p = g_utf8_next_char (p))
+    {
+      gunichar c = g_utf8_get_char (p);
+
+      if (c != 0 && g_unichar_isalnum (c))
+        {
+          if (length < MAX_TOKEN_LENGTH)
+            {
+              g_string_append_unichar (token, c);
+              length++;
+            }
+          continue;
+        }
+
+      if (token->len > 0)
+        {
+          g_ptr_array_add (tokens, g_strndup (token->str, token->len));
+          g_string_truncate (token, 0);
+          length = 0;
+        }
+
+      if (c == 0)
+        break;
+    }
+
+  g_string_free (token, TRUE);
+  g_free (folded);
+  g_free (normalized);
+
+  return tokens;
+}
+
+static gboolean
+token_matches (const gchar *token,
+               const gchar *term,
+               NeulandSearchMatch match)
+{
+  if (match == NEULAND_SEARCH_MATCH_PREFIX)
+    return g_str_has_prefix (token, term);
+  else
+    return strstr (token, term) != NULL;
+}
+
+static gint
+compare_postings (gconstpointer a,
+                  gconstpointer b)
+{
+  guint64 posting_a = *(const guint64 *)a;
+  guint64 posting_b = *(const guint64 *)b;
+
+  return posting_a < posting_b ? -1 : posting_a > posting_b;
+}
+
+static void
+sort_postings (GArray *postings)
+{
+  guint i, j;
+
+  if (postings->len < 2)
+    return;
+
+  g_array_sort (postings, compare_postings);
+
+  for (i = 1, j = 1; i < postings->len; i++)
+    if (g_array_index (postings, guint64, i) != g_array_index (postings, guint64, j - 1))
+      g_array_index (postings, guint64, j++) = g_array_index (postings, guint64, i);
+
+  g_array_set_size (postings, j);
+}
+
+/* Keeps the postings in @a that are also in @b, both sorted. */
+static void
+intersect_postings (GArray *a,
+                    GArray *b)
+{
+  guint i = 0, j = 0, n = 0;
+
+  while (i < a->len && j < b->len)
+    {
+      guint64 posting_a = g_array_index (a, guint64, i);
+      guint64 posting_b = g_array_index (b, guint64, j);
+
+      if (posting_a < posting_b)
+        i++;
+      else if (posting_a > posting_b)
+        j++;
+      else
+        {
+          g_array_index (a, guint64, n++) = posting_a;
+          i++;
+          j++;
+        }
+    }
+
+  g_array_set_size (a, n);
+}
+
+static guint32
+read_uint32 (const guint8 *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, sizeof (value));
+
+  return GUINT32_FROM_BE (value);
+}
+
+static void
+append_uint32 (GByteArray *array,
+               guint32 value)
+{
+  value = GUINT32_TO_BE (value);
+  g_byte_array_append (array, (guint8 *)&value, sizeof (value));
+}
+
+static void
+append_varint (GByteArray *array,
+               guint64 value)
+{
+  guint8 byte;
+
+  while (value >= 0x80)
+    {
+      byte = (value & 0x7f) | 0x80;
+      g_byte_array_append (array, &byte, 1);
+      value >>= 7;
+    }
+
+  byte = value;
+  g_byte_array_append (array, &byte, 1);
+}
+
+static gboolean
+read_varint (const guint8 **data,
+             const guint8 *end,
+             guint64 *value)
+{
+  const guint8 *p = *data;
+  guint shift = 0;
+
+  *value = 0;
+
+  while (p < end && shift < 64)
+    {
+      *value |= (guint64) (*p & 0x7f) << shift;
+      if ((*p++ & 0x80) == 0)
+        {
+          *data = p;
+          return TRUE;
+        }
+      shift += 7;
+    }
+
+  return FALSE;
+}
+
+static Segment *
+segment_ref (Segment *segment)
+{
+  g_atomic_int_inc (&segment->ref_count);
+
+  return segment;
+}
+
+static void
+segment_unref (Segment *segment)
+{
+  if (!g_atomic_int_dec_and_test (&segment->ref_count))
+    return;
+
+  g_mapped_file_unref (segment->map);
+  g_free (segment->path);
+  g_slice_free (Segment, segment);
+}
+
+static const gchar *
+segment_get_token (Segment *segment,
+                   guint32 i)
+{
+  return segment->strings + read_uint32 (segment->table + i * SEGMENT_TABLE_ENTRY_SIZE);
+}
+
+/* Appends the postings of token number @i to @postings */
+static void
+segment_read_postings (Segment *segment,
+                       guint32 i,
+                       GArray *postings)
+{
+  const guint8 *entry = segment->table + i * SEGMENT_TABLE_ENTRY_SIZE;
+  const guint8 *p = segment->postings + read_uint32 (entry + 4);
+  const guint8 *end = segment->postings + segment->postings_size;
+  guint32 n_postings = read_uint32 (entry + 8);
+  guint64 posting = 0;
+  guint32 j;
+
+  for (j = 0; j < n_postings; j++)
+    {
+      guint64 delta;
+
+      if (!read_varint (&p, end, &delta))
+        {
+          g_warning ("Search index segment \"%s\" is corrupt", segment->path);
+          break;
+        }
+
+      posting += delta;
+      g_array_append_val (postings, posting);
+    }
+}
+
+/* Appends the postings of all tokens matching @term */
+static void
+segment_find (Segment *segment,
+              const gchar *term,
+              NeulandSearchMatch match,
+              GArray *postings)
+{
+  guint32 first = 0;
+  guint32 i;
+
+  if (match == NEULAND_SEARCH_MATCH_PREFIX)
+    {
+      /* Tokens are sorted, so all that start with @term follow the
+         first one that doesn't sort before it. */
+      guint32 last = segment->n_tokens;
+
+      while (first < last)
+        {
+          guint32 middle = first + (last - first) / 2;
+
+          if (strcmp (segment_get_token (segment, middle), term) < 0)
+            first = middle + 1;
+          else
+            last = middle;
+        }
+    }
+
+  for (i = first; i < segment->n_tokens; i++)
+    {
+      const gchar *token = segment_get_token (segment, i);
+
+      if (token_matches (token, term, match))
+        segment_read_postings (segment, i, postings);
+      else if (match == NEULAND_SEARCH_MATCH_PREFIX)
+        break;
+    }
+}
+
+static Segment *
+segment_open (const gchar *directory,
+              guint number)
+{
+  Segment *segment;
+  GMappedFile *map;
+  const guint8 *data;
+  gsize length;
+  guint64 expected_length;
+  gchar *path = g_strdup_printf ("%s/segment-%u", directory, number);
+  GError *error = NULL;
+  guint32 i;
+
+  map = g_mapped_file_new (path, FALSE, &error);
+  if (map == NULL)
+    {
+      g_warning ("Could not open search index segment: %s", error->message);
+      g_error_free (error);
+      g_free (path);
+      return NULL;
+    }
+
+  segment = g_slice_new0 (Segment);
+  segment->ref_count = 1;
+  segment->path = path;
+  segment->number = number;
+  segment->map = map;
+
+  data = (const guint8 *)g_mapped_file_get_contents (map);
+  length = g_mapped_file_get_length (map);
+
+  if (length < SEGMENT_HEADER_SIZE ||
+      memcmp (data, SEGMENT_MAGIC, strlen (SEGMENT_MAGIC)) != 0)
+    goto corrupt;
+
+  segment->n_tokens = read_uint32 (data + 8);
+  segment->strings_size = read_uint32 (data + 12);
+  segment->postings_size = read_uint32 (data + 16);
+
+  expected_length = SEGMENT_HEADER_SIZE +
+    (guint64) segment->n_tokens * SEGMENT_TABLE_ENTRY_SIZE +
+    segment->strings_size + segment->postings_size;
+  if (expected_length != length ||
+      (segment->strings_size > 0 &&
+       data[length - segment->postings_size - 1] != '\0'))
+    goto corrupt;
+
+  segment->table = data + SEGMENT_HEADER_SIZE;
+  segment->strings = (const gchar *)segment->table +
+    segment->n_tokens * SEGMENT_TABLE_ENTRY_SIZE;
+  segment->postings = (const guint8 *)segment->strings + segment->strings_size;
+
+  for (i = 0; i < segment->n_tokens; i++)
+    {
+      const guint8 *entry = segment->table + i * SEGMENT_TABLE_ENTRY_SIZE;
+
+      if (read_uint32 (entry) >= segment->strings_size ||
+          read_uint32 (entry + 4) > segment->postings_size)
+        goto corrupt;
+    }
+
+  return segment;
+
+ corrupt:
+  g_warning ("Search index segment \"%s\" is corrupt", path);
+  segment_unref (segment);
+
+  return NULL;
+}
+
+static SegmentWriter *
+segment_writer_new (void)
+{
+  SegmentWriter *writer = g_slice_new0 (SegmentWriter);
+
+  writer->table = g_byte_array_new ();
+  writer->strings = g_byte_array_new ();
+  writer->postings = g_byte_array_new ();
+
+  return writer;
+}
+
+/* Tokens must be added in strcmp() order, @postings sorted. */
+static void
+segment_writer_add (SegmentWriter *writer,
+                    const gchar *token,
+                    GArray *postings)
+{
+  guint64 previous = 0;
+  guint i;
+
+  append_uint32 (writer->table, writer->strings->len);
+  append_uint32 (writer->table, writer->postings->len);
+  append_uint32 (writer->table, postings->len);
+  g_byte_array_append (writer->strings, (const guint8 *)token, strlen (token) + 1);
+
+  for (i = 0; i < postings->len; i++)
+    {
+      guint64 posting = g_array_index (postings, guint64, i);
+
+      append_varint (writer->postings, posting - previous);
+      previous = posting;
+    }
+
+  writer->n_tokens++;
+}
+
+/* Writes and opens segment @number, frees @writer */
+static Segment *
+segment_writer_finish (SegmentWriter *writer,
+                       const gchar *directory,
+                       guint number)
+{
+  GByteArray *data = g_byte_array_sized_new (SEGMENT_HEADER_SIZE + writer->table->len +
+                                             writer->strings->len + writer->postings->len);
+  gchar *path = g_strdup_printf ("%s/segment-%u", directory, number);
+  Segment *segment = NULL;
+  GError *error = NULL;
+
+  g_byte_array_append (data, (const guint8 *)SEGMENT_MAGIC, strlen (SEGMENT_MAGIC));
+  append_uint32 (data, writer->n_tokens);
+  append_uint32 (data, writer->strings->len);
+  append_uint32 (data, writer->postings->len);
+  g_byte_array_append (data, writer->table->data, writer->table->len);
+  g_byte_array_append (data, writer->strings->data, writer->strings->len);
+  g_byte_array_append (data, writer->postings->data, writer->postings->len);
+
+  g_mkdir_with_parents (directory, 0700);
+
+  if (g_file_set_contents (path, (gchar *)data->data, data->len, &error))
+    segment = segment_open (directory, number);
+  else
+    {
+      g_warning ("Could not write search index segment: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_byte_array_unref (data);
+  g_byte_array_unref (writer->table);
+  g_byte_array_unref (writer->strings);
+  g_byte_array_unref (writer->postings);
+  g_slice_free (SegmentWriter, writer);
+  g_free (path);
+
+  return segment;
+}
+
+static GHashTable *
+memtable_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                (GDestroyNotify) g_array_unref);
+}
+
+/* Returns TRUE if @posting was new for @token */
+static gboolean
+memtable_add (GHashTable *memtable,
+              const gchar *token,
+              guint64 posting)
+{
+  GArray *postings = g_hash_table_lookup (memtable, token);
+
+  if (postings == NULL)
+    {
+      postings = g_array_new (FALSE, FALSE, sizeof (guint64));
+      g_hash_table_insert (memtable, g_strdup (token), postings);
+    }
+  else if (g_array_index (postings, guint64, postings->len - 1) == posting)
+    /* The word appears more than once in the same entry */
+    return FALSE;
+
+  g_array_append_val (postings, posting);
+
+  return TRUE;
+}
+
+static void
+memtable_find (GHashTable *memtable,
+               const gchar *term,
+               NeulandSearchMatch match,
+               GArray *postings)
+{
+  GHashTableIter iter;
+  gpointer token, token_postings;
+
+  g_hash_table_iter_init (&iter, memtable);
+  while (g_hash_table_iter_next (&iter, &token, &token_postings))
+    if (token_matches (token, term, match))
+      g_array_append_vals (postings, ((GArray *)token_postings)->data,
+                           ((GArray *)token_postings)->len);
+}
+
+/* Called with the mutex held */
+static gchar *
+neuland_search_index_build_state (NeulandSearchIndex *search_index,
+                                  gsize *length)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  GKeyFile *key_file = g_key_file_new ();
+  gint *numbers = g_new (gint, priv->segments->len + 1);
+  gchar *data;
+  guint i;
+
+  for (i = 0; i < priv->segments->len; i++)
+    numbers[i] = ((Segment *)g_ptr_array_index (priv->segments, i))->number;
+
+  g_key_file_set_integer (key_file, STATE_GROUP, "next-segment", priv->next_segment);
+  g_key_file_set_integer_list (key_file, STATE_GROUP, "segments", numbers, priv->segments->len);
+
+  for (i = 0; i < priv->logs_by_id->len; i++)
+    {
+      IndexedLog *log = g_ptr_array_index (priv->logs_by_id, i);
+
+      g_key_file_set_integer (key_file, log->name, "id", log->id);
+      g_key_file_set_uint64 (key_file, log->name, "indexed", log->indexed);
+    }
+
+  data = g_key_file_to_data (key_file, length, NULL);
+
+  g_key_file_free (key_file);
+  g_free (numbers);
+
+  return data;
+}
+
+static void
+neuland_search_index_save_state (NeulandSearchIndex *search_index,
+                                 gchar *data,
+                                 gsize length)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  GError *error = NULL;
+
+  if (!g_file_set_contents (priv->state_path, data, length, &error))
+    {
+      g_warning ("Could not save search index state \"%s\": %s",
+                 priv->state_path, error->message);
+      g_error_free (error);
+    }
+
+  g_free (data);
+}
+
+/* Forgets everything about the index, it is then rebuilt from the
+   chat logs. */
+static void
+neuland_search_index_reset (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+
+  g_ptr_array_set_size (priv->segments, 0);
+  g_ptr_array_set_size (priv->logs_by_id, 0);
+  g_hash_table_remove_all (priv->logs);
+}
+
+static void
+neuland_search_index_load_state (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  GKeyFile *key_file = g_key_file_new ();
+  gchar **groups;
+  gint *numbers;
+  gsize n_numbers = 0;
+  GDir *dir;
+  const gchar *file_name;
+  gboolean broken = FALSE;
+  GError *error = NULL;
+  gsize i;
+
+  if (!g_key_file_load_from_file (key_file, priv->state_path, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Could not load search index state \"%s\": %s",
+                   priv->state_path, error->message);
+      g_error_free (error);
+    }
+
+  priv->next_segment = g_key_file_get_integer (key_file, STATE_GROUP, "next-segment", NULL);
+
+  numbers = g_key_file_get_integer_list (key_file, STATE_GROUP, "segments", &n_numbers, NULL);
+  for (i = 0; i < n_numbers && !broken; i++)
+    {
+      Segment *segment = segment_open (priv->directory, numbers[i]);
+
+      if (segment != NULL)
+        g_ptr_array_add (priv->segments, segment);
+      else
+        broken = TRUE;
+    }
+  g_free (numbers);
+
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (i = 0; groups[i] != NULL && !broken; i++)
+    {
+      IndexedLog *log;
+      gint id;
+
+      if (g_strcmp0 (groups[i], STATE_GROUP) == 0)
+        continue;
+
+      id = g_key_file_get_integer (key_file, groups[i], "id", NULL);
+      if (id < 0 || id >= (1 << (64 - ENTRY_BITS)))
+        {
+          broken = TRUE;
+          break;
+        }
+
+      if (id >= priv->logs_by_id->len)
+        g_ptr_array_set_size (priv->logs_by_id, id + 1);
+      if (g_ptr_array_index (priv->logs_by_id, id) != NULL)
+        {
+          broken = TRUE;
+          break;
+        }
+
+      log = g_slice_new0 (IndexedLog);
+      log->name = g_strdup (groups[i]);
+      log->id = id;
+      log->indexed = log->queued =
+        g_key_file_get_uint64 (key_file, groups[i], "indexed", NULL);
+      g_ptr_array_index (priv->logs_by_id, id) = log;
+      g_hash_table_insert (priv->logs, log->name, log);
+    }
+
+  for (i = 0; i < priv->logs_by_id->len; i++)
+    broken |= g_ptr_array_index (priv->logs_by_id, i) == NULL;
+
+  /* Without all segments and logs, entries would silently be
+     missing from results. */
+  if (broken)
+    {
+      g_warning ("Search index state \"%s\" is broken, rebuilding the index",
+                 priv->state_path);
+      neuland_search_index_reset (search_index);
+    }
+
+  g_strfreev (groups);
+  g_key_file_free (key_file);
+
+  /* Segments written or merged away shortly before a crash */
+  dir = g_dir_open (priv->directory, 0, NULL);
+  while (dir != NULL && (file_name = g_dir_read_name (dir)) != NULL)
+    {
+      guint number;
+      gboolean used = FALSE;
+
+      if (sscanf (file_name, "segment-%u", &number) != 1)
+        continue;
+
+      for (i = 0; i < priv->segments->len; i++)
+        used |= ((Segment *)g_ptr_array_index (priv->segments, i))->number == number;
+
+      if (!used)
+        {
+          gchar *path = g_build_filename (priv->directory, file_name, NULL);
+
+          g_unlink (path);
+          g_free (path);
+        }
+    }
+  if (dir != NULL)
+    g_dir_close (dir);
+}
+
+/* Reads the new entries of @log and adds their words to the
+   memtable. Runs in the update thread. */
+static void
+neuland_search_index_index_log (NeulandSearchIndex *search_index,
+                                IndexedLog *log)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  guint64 n_entries = neuland_chat_log_get_n_entries (log->chat_log);
+
+  while (log->queued < n_entries)
+    {
+      GPtrArray *entries = neuland_chat_log_read (log->chat_log, log->queued, READ_BATCH);
+      GPtrArray *tokens = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+      guint i, j;
+
+      if (entries->len == 0)
+        {
+          g_ptr_array_unref (entries);
+          g_ptr_array_unref (tokens);
+          break;
+        }
+
+      for (i = 0; i < entries->len; i++)
+        g_ptr_array_add (tokens, tokenize (((NeulandChatLogEntry *)
+                                            g_ptr_array_index (entries, i))->text));
+
+      g_mutex_lock (&priv->mutex);
+
+      for (i = 0; i < tokens->len; i++)
+        {
+          GPtrArray *entry_tokens = g_ptr_array_index (tokens, i);
+          guint64 posting = POSTING (log->id, log->queued + i);
+
+          for (j = 0; j < entry_tokens->len; j++)
+            if (memtable_add (priv->memtable, g_ptr_array_index (entry_tokens, j), posting))
+              priv->n_memtable_postings++;
+        }
+      log->queued += entries->len;
+
+      g_mutex_unlock (&priv->mutex);
+
+      g_ptr_array_unref (tokens);
+      g_ptr_array_unref (entries);
+    }
+}
+
+/* Writes the memtable to a new segment. Runs in the update thread. */
+static void
+neuland_search_index_write_memtable (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  SegmentWriter *writer;
+  Segment *segment;
+  GHashTable *memtable;
+  GList *tokens, *l;
+  gchar *state;
+  gsize length;
+  guint number;
+  guint i;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (g_hash_table_size (priv->memtable) == 0)
+    {
+      g_mutex_unlock (&priv->mutex);
+      return;
+    }
+
+  /* Queries still see the frozen postings until the segment is
+     there. */
+  memtable = priv->frozen_memtable = priv->memtable;
+  priv->memtable = memtable_new ();
+  priv->n_memtable_postings = 0;
+  number = priv->next_segment++;
+
+  g_mutex_unlock (&priv->mutex);
+
+  writer = segment_writer_new ();
+  tokens = g_list_sort (g_hash_table_get_keys (memtable), (GCompareFunc) strcmp);
+  for (l = tokens; l != NULL; l = l->next)
+    {
+      GArray *postings = g_hash_table_lookup (memtable, l->data);
+
+      sort_postings (postings);
+      segment_writer_add (writer, l->data, postings);
+    }
+  g_list_free (tokens);
+
+  segment = segment_writer_finish (writer, priv->directory, number);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (segment != NULL)
+    {
+      g_ptr_array_add (priv->segments, segment);
+      for (i = 0; i < priv->logs_by_id->len; i++)
+        {
+          IndexedLog *log = g_ptr_array_index (priv->logs_by_id, i);
+
+          log->indexed = log->queued;
+        }
+    }
+  else
+    {
+      /* Keep the postings in memory and try again later */
+      GHashTableIter iter;
+      gpointer token, postings;
+
+      g_hash_table_iter_init (&iter, memtable);
+      while (g_hash_table_iter_next (&iter, &token, &postings))
+        for (i = 0; i < ((GArray *)postings)->len; i++)
+          if (memtable_add (priv->memtable, token, g_array_index (postings, guint64, i)))
+            priv->n_memtable_postings++;
+    }
+
+  priv->frozen_memtable = NULL;
+  state = neuland_search_index_build_state (search_index, &length);
+
+  g_mutex_unlock (&priv->mutex);
+
+  neuland_search_index_save_state (search_index, state, length);
+  g_hash_table_destroy (memtable);
+}
+
+/* Merges all segments into one. Runs in the update thread. */
+static void
+neuland_search_index_merge_segments (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  GPtrArray *segments;
+  SegmentWriter *writer;
+  Segment *merged;
+  guint32 *positions;
+  gchar *state;
+  gsize length;
+  guint number;
+  guint i;
+
+  g_mutex_lock (&priv->mutex);
+
+  segments = g_ptr_array_new_with_free_func ((GDestroyNotify) segment_unref);
+  for (i = 0; i < priv->segments->len; i++)
+    g_ptr_array_add (segments, segment_ref (g_ptr_array_index (priv->segments, i)));
+  number = priv->next_segment++;
+
+  g_mutex_unlock (&priv->mutex);
+
+  g_debug ("Merging %u search index segments", segments->len);
+
+  /* Go through the sorted tokens of all segments at once */
+  writer = segment_writer_new ();
+  positions = g_new0 (guint32, segments->len);
+  while (TRUE)
+    {
+      const gchar *token = NULL;
+      GArray *postings;
+
+      for (i = 0; i < segments->len; i++)
+        {
+          Segment *segment = g_ptr_array_index (segments, i);
+
+          if (positions[i] < segment->n_tokens &&
+              (token == NULL || strcmp (segment_get_token (segment, positions[i]), token) < 0))
+            token = segment_get_token (segment, positions[i]);
+        }
+
+      if (token == NULL)
+        break;
+
+      postings = g_array_new (FALSE, FALSE, sizeof (guint64));
+      for (i = 0; i < segments->len; i++)
+        {
+          Segment *segment = g_ptr_array_index (segments, i);
+
+          if (positions[i] < segment->n_tokens &&
+              strcmp (segment_get_token (segment, positions[i]), token) == 0)
+            segment_read_postings (segment, positions[i]++, postings);
+        }
+
+      sort_postings (postings);
+      segment_writer_add (writer, token, postings);
+      g_array_unref (postings);
+    }
+  g_free (positions);
+
+  merged = segment_writer_finish (writer, priv->directory, number);
+
+  g_mutex_lock (&priv->mutex);
+
+  /* Segments are only added at the end meanwhile */
+  if (merged != NULL)
+    {
+      g_ptr_array_remove_range (priv->segments, 0, segments->len);
+      g_ptr_array_insert (priv->segments, 0, merged);
+    }
+  state = neuland_search_index_build_state (search_index, &length);
+
+  g_mutex_unlock (&priv->mutex);
+
+  neuland_search_index_save_state (search_index, state, length);
+
+  if (merged != NULL)
+    for (i = 0; i < segments->len; i++)
+      g_unlink (((Segment *)g_ptr_array_index (segments, i))->path);
+
+  g_ptr_array_unref (segments);
+}
+
+static void
+neuland_search_index_update_func (gpointer data,
+                                  gpointer user_data)
+{
+  NeulandSearchIndex *search_index = data;
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+  GPtrArray *dirty_logs = g_ptr_array_new ();
+  gboolean flush;
+  guint i;
+
+  g_mutex_lock (&priv->mutex);
+
+  priv->update_scheduled = FALSE;
+  priv->updating = TRUE;
+
+  for (i = 0; i < priv->logs_by_id->len; i++)
+    {
+      IndexedLog *log = g_ptr_array_index (priv->logs_by_id, i);
+
+      if (log->dirty && log->chat_log != NULL)
+        g_ptr_array_add (dirty_logs, log);
+      log->dirty = FALSE;
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  for (i = 0; i < dirty_logs->len; i++)
+    neuland_search_index_index_log (search_index, g_ptr_array_index (dirty_logs, i));
+
+  g_mutex_lock (&priv->mutex);
+  flush = priv->flush_requested || priv->n_memtable_postings >= MEMTABLE_FLUSH_SIZE;
+  priv->flush_requested = FALSE;
+  g_mutex_unlock (&priv->mutex);
+
+  if (flush)
+    neuland_search_index_write_memtable (search_index);
+  if (priv->segments->len > MAX_SEGMENTS)
+    neuland_search_index_merge_segments (search_index);
+
+  g_mutex_lock (&priv->mutex);
+  priv->updating = FALSE;
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->mutex);
+
+  g_ptr_array_unref (dirty_logs);
+  g_object_unref (search_index);
+}
+
+static GThreadPool *
+get_update_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, (gsize) g_thread_pool_new (neuland_search_index_update_func, NULL,
+                                                         1, FALSE, NULL));
+
+  return (GThreadPool *) pool;
+}
+
+/* Called with the mutex held */
+static void
+neuland_search_index_schedule_update (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+
+  if (priv->update_scheduled)
+    return;
+
+  priv->update_scheduled = TRUE;
+  g_thread_pool_push (get_update_pool (), g_object_ref (search_index), NULL);
+}
+
+/* Adds @chat_log to the index under @name, which has to stay the
+   same between sessions. Entries not indexed yet are indexed in the
+   background. */
+void
+neuland_search_index_add_log (NeulandSearchIndex *search_index,
+                              const gchar *name,
+                              NeulandChatLog *chat_log)
+{
+  NeulandSearchIndexPrivate *priv;
+  IndexedLog *log;
+
+  g_return_if_fail (NEULAND_IS_SEARCH_INDEX (search_index));
+  g_return_if_fail (NEULAND_IS_CHAT_LOG (chat_log));
+
+  priv = search_index->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  log = g_hash_table_lookup (priv->logs, name);
+  if (log == NULL)
+    {
+      log = g_slice_new0 (IndexedLog);
+      log->name = g_strdup (name);
+      log->id = priv->logs_by_id->len;
+      g_ptr_array_add (priv->logs_by_id, log);
+      g_hash_table_insert (priv->logs, log->name, log);
+    }
+
+  if (log->chat_log == NULL)
+    log->chat_log = g_object_ref (chat_log);
+
+  log->dirty = TRUE;
+  neuland_search_index_schedule_update (search_index);
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/* Call after appending to the chat log added under @name. */
+void
+neuland_search_index_update (NeulandSearchIndex *search_index,
+                             const gchar *name)
+{
+  NeulandSearchIndexPrivate *priv;
+  IndexedLog *log;
+
+  g_return_if_fail (NEULAND_IS_SEARCH_INDEX (search_index));
+
+  priv = search_index->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  log = g_hash_table_lookup (priv->logs, name);
+  if (log != NULL && log->chat_log != NULL)
+    {
+      log->dirty = TRUE;
+      neuland_search_index_schedule_update (search_index);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/* Returns an array of NeulandSearchHit for the entries containing
+   all words of @query, either as the start of a word or anywhere in
+   a word, depending on @match. Hits are sorted by log, newest entry
+   first, and there are at most @max_hits of them. Entries logged in
+   the last moments may be missing. */
+GPtrArray *
+neuland_search_index_query (NeulandSearchIndex *search_index,
+                            const gchar *query,
+                            NeulandSearchMatch match,
+                            guint max_hits)
+{
+  NeulandSearchIndexPrivate *priv;
+  GPtrArray *hits;
+  GPtrArray *terms;
+  GPtrArray *term_postings;
+  GPtrArray *segments;
+  GArray *result = NULL;
+  guint i, j;
+
+  g_return_val_if_fail (NEULAND_IS_SEARCH_INDEX (search_index), NULL);
+  g_return_val_if_fail (query != NULL, NULL);
+
+  priv = search_index->priv;
+  hits = g_ptr_array_new_with_free_func ((GDestroyNotify) neuland_search_hit_free);
+  terms = tokenize (query);
+
+  if (terms->len == 0)
+    {
+      g_ptr_array_unref (terms);
+      return hits;
+    }
+
+  term_postings = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  segments = g_ptr_array_new_with_free_func ((GDestroyNotify) segment_unref);
+
+  g_mutex_lock (&priv->mutex);
+
+  for (i = 0; i < terms->len; i++)
+    {
+      GArray *postings = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+      memtable_find (priv->memtable, g_ptr_array_index (terms, i), match, postings);
+      if (priv->frozen_memtable != NULL)
+        memtable_find (priv->frozen_memtable, g_ptr_array_index (terms, i), match, postings);
+      g_ptr_array_add (term_postings, postings);
+    }
+
+  for (i = 0; i < priv->segments->len; i++)
+    g_ptr_array_add (segments, segment_ref (g_ptr_array_index (priv->segments, i)));
+
+  g_mutex_unlock (&priv->mutex);
+
+  for (i = 0; i < terms->len; i++)
+    {
+      GArray *postings = g_ptr_array_index (term_postings, i);
+
+      for (j = 0; j < segments->len; j++)
+        segment_find (g_ptr_array_index (segments, j), g_ptr_array_index (terms, i),
+                      match, postings);
+      sort_postings (postings);
+
+      if (result == NULL)
+        result = postings;
+      else
+        intersect_postings (result, postings);
+
+      if (result->len == 0)
+        break;
+    }
+
+  g_mutex_lock (&priv->mutex);
+
+  for (i = result->len; i > 0 && hits->len < max_hits; i--)
+    {
+      guint64 posting = g_array_index (result, guint64, i - 1);
+      NeulandSearchHit *hit;
+
+      if (POSTING_LOG_ID (posting) >= priv->logs_by_id->len)
+        continue;
+
+      hit = g_slice_new (NeulandSearchHit);
+
+      hit->name = g_strdup (((IndexedLog *)g_ptr_array_index (priv->logs_by_id,
+                                                              POSTING_LOG_ID (posting)))->name);
+      hit->entry = POSTING_ENTRY (posting);
+      g_ptr_array_add (hits, hit);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  g_ptr_array_unref (segments);
+  g_ptr_array_unref (term_postings);
+  g_ptr_array_unref (terms);
+
+  return hits;
+}
+
+/* Blocks until everything added so far is indexed and on disk */
+void
+neuland_search_index_flush (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_SEARCH_INDEX (search_index));
+
+  priv = search_index->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  priv->flush_requested = TRUE;
+  neuland_search_index_schedule_update (search_index);
+  while (priv->update_scheduled || priv->updating)
+    g_cond_wait (&priv->cond, &priv->mutex);
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+static void
+neuland_search_index_set_property (GObject *object,
+                                   guint property_id,
+                                   const GValue *value,
+                                   GParamSpec *pspec)
+{
+  NeulandSearchIndex *search_index = NEULAND_SEARCH_INDEX (object);
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+
+  switch (property_id)
+    {
+    case PROP_DIRECTORY:
+      priv->directory = g_value_dup_string (value);
+      priv->state_path = g_build_filename (priv->directory, "state", NULL);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+neuland_search_index_get_property (GObject *object,
+                                   guint property_id,
+                                   GValue *value,
+                                   GParamSpec *pspec)
+{
+  NeulandSearchIndex *search_index = NEULAND_SEARCH_INDEX (object);
+
+  switch (property_id)
+    {
+    case PROP_DIRECTORY:
+      g_value_set_string (value, search_index->priv->directory);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+neuland_search_index_constructed (GObject *object)
+{
+  neuland_search_index_load_state (NEULAND_SEARCH_INDEX (object));
+
+  G_OBJECT_CLASS (neuland_search_index_parent_class)->constructed (object);
+}
+
+static void
+neuland_search_index_finalize (GObject *object)
+{
+  NeulandSearchIndex *search_index = NEULAND_SEARCH_INDEX (object);
+  NeulandSearchIndexPrivate *priv = search_index->priv;
+
+  g_free (priv->directory);
+  g_free (priv->state_path);
+  g_ptr_array_unref (priv->segments);
+  g_ptr_array_unref (priv->logs_by_id);
+  g_hash_table_destroy (priv->logs);
+  g_hash_table_destroy (priv->memtable);
+  g_mutex_clear (&priv->mutex);
+  g_cond_clear (&priv->cond);
+
+  G_OBJECT_CLASS (neuland_search_index_parent_class)->finalize (object);
+}
+
+static void
+neuland_search_index_class_init (NeulandSearchIndexClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = neuland_search_index_set_property;
+  gobject_class->get_property = neuland_search_index_get_property;
+  gobject_class->constructed = neuland_search_index_constructed;
+  gobject_class->finalize = neuland_search_index_finalize;
+
+  properties[PROP_DIRECTORY] =
+    g_param_spec_string ("directory",
+                         "Directory",
+                         "Directory the index is stored in",
+                         NULL,
+                         G_PARAM_READWRITE |
+                         G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (gobject_class, PROP_N, properties);
+}
+
+static void
+neuland_search_index_init (NeulandSearchIndex *search_index)
+{
+  NeulandSearchIndexPrivate *priv;
+
+  search_index->priv = neuland_search_index_get_instance_private (search_index);
+  priv = search_index->priv;
+
+  g_mutex_init (&priv->mutex);
+  g_cond_init (&priv->cond);
+  priv->logs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                      (GDestroyNotify) indexed_log_free);
+  priv->logs_by_id = g_ptr_array_new ();
+  priv->memtable = memtable_new ();
+  priv->segments = g_ptr_array_new_with_free_func ((GDestroyNotify) segment_unref);
+}
+
+/* Nothing but the list of segments is read here. */
+NeulandSearchIndex *
+neuland_search_index_new (const gchar *directory)
+{
+  g_return_val_if_fail (directory != NULL, NULL);
+
+  return g_object_new (NEULAND_TYPE_SEARCH_INDEX,
+                       "directory", directory,
+                       NULL);
+}
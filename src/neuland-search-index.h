@@ -0,0 +1,84 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NEULAND_SEARCH_INDEX_H__
+#define __NEULAND_SEARCH_INDEX_H__
+
+#include <glib-object.h>
+
+#include "neuland-chat-log.h"
+
+#define NEULAND_TYPE_SEARCH_INDEX            (neuland_search_index_get_type ())
+#define NEULAND_SEARCH_INDEX(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), NEULAND_TYPE_SEARCH_INDEX, NeulandSearchIndex))
+#define NEULAND_SEARCH_INDEX_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), NEULAND_TYPE_SEARCH_INDEX, NeulandSearchIndexClass))
+#define NEULAND_IS_SEARCH_INDEX(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), NEULAND_TYPE_SEARCH_INDEX))
+#define NEULAND_IS_SEARCH_INDEX_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), NEULAND_TYPE_SEARCH_INDEX))
+#define NEULAND_SEARCH_INDEX_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), NEULAND_TYPE_SEARCH_INDEX, NeulandSearchIndexClass))
+
+typedef struct _NeulandSearchIndex        NeulandSearchIndex;
+typedef struct _NeulandSearchIndexPrivate NeulandSearchIndexPrivate;
+typedef struct _NeulandSearchIndexClass   NeulandSearchIndexClass;
+
+typedef enum {
+  NEULAND_SEARCH_MATCH_PREFIX,
+  NEULAND_SEARCH_MATCH_SUBSTRING
+} NeulandSearchMatch;
+
+typedef struct
+{
+  gchar *name;    /* as passed to neuland_search_index_add_log() */
+  guint64 entry;  /* number of the entry in the chat log */
+} NeulandSearchHit;
+
+struct _NeulandSearchIndex
+{
+  GObject parent_instance;
+
+  NeulandSearchIndexPrivate *priv;
+};
+
+struct _NeulandSearchIndexClass
+{
+  GObjectClass parent_class;
+};
+
+GType neuland_search_index_get_type (void) G_GNUC_CONST;
+
+NeulandSearchIndex *
+neuland_search_index_new (const gchar *directory);
+
+void
+neuland_search_index_add_log (NeulandSearchIndex *search_index, const gchar *name,
+                              NeulandChatLog *chat_log);
+
+void
+neuland_search_index_update (NeulandSearchIndex *search_index, const gchar *name);
+
+GPtrArray *
+neuland_search_index_query (NeulandSearchIndex *search_index, const gchar *query,
+                            NeulandSearchMatch match, guint max_hits);
+
+void
+neuland_search_index_flush (NeulandSearchIndex *search_index);
+
+void
+neuland_search_hit_free (NeulandSearchHit *hit);
+
+#endif /* __NEULAND_SEARCH_INDEX_H__ */
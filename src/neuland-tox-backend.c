@@ -0,0 +1,102 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "neuland-tox-backend.h"
+
+static Tox *
+toxcore_new (gpointer backend_data)
+{
+  return tox_new (NULL);
+}
+
+static void
+toxcore_set_callbacks (Tox *tox,
+                       const NeulandToxCallbacks *callbacks,
+                       gpointer user_data)
+{
+  tox_callback_connection_status (tox, callbacks->connection_status, user_data);
+  tox_callback_user_status (tox, callbacks->user_status, user_data);
+  tox_callback_name_change (tox, callbacks->name_change, user_data);
+  tox_callback_status_message (tox, callbacks->status_message, user_data);
+  tox_callback_friend_message (tox, callbacks->friend_message, user_data);
+  tox_callback_friend_action (tox, callbacks->friend_action, user_data);
+  tox_callback_typing_change (tox, callbacks->typing_change, user_data);
+  tox_callback_friend_request (tox, callbacks->friend_request, user_data);
+
+  tox_callback_file_send_request (tox, callbacks->file_send_request, user_data);
+  tox_callback_file_data (tox, callbacks->file_data, user_data);
+  tox_callback_file_control (tox, callbacks->file_control, user_data);
+
+  tox_callback_read_receipt (tox, callbacks->read_receipt, user_data);
+
+  /* TODO: */
+  /* tox_callback_group_invite (tox, NULL, user_data); */
+  /* tox_callback_group_message (tox, NULL, user_data); */
+  /* tox_callback_group_action (tox, NULL, user_data); */
+  /* tox_callback_group_namelist_change (tox, NULL, user_data); */
+}
+
+static const NeulandToxBackend toxcore_backend = {
+  "toxcore",
+  toxcore_new,
+  tox_kill,
+  toxcore_set_callbacks,
+  tox_do,
+  tox_do_interval,
+  tox_bootstrap_from_address,
+
+  tox_load,
+  tox_size,
+  tox_save,
+
+  tox_get_address,
+  tox_get_self_name,
+  tox_get_self_status_message,
+  tox_set_name,
+  tox_set_status_message,
+  tox_set_user_status,
+  tox_set_user_is_typing,
+
+  tox_count_friendlist,
+  tox_get_friendlist,
+  tox_get_client_id,
+  tox_get_last_online,
+  tox_get_name,
+  tox_get_status_message,
+  tox_add_friend,
+  tox_add_friend_norequest,
+  tox_del_friend,
+
+  tox_send_message,
+  tox_send_action,
+
+  tox_new_file_sender,
+  tox_file_send_control,
+  tox_file_send_data,
+  tox_file_data_size,
+};
+
+/* The backend NeulandTox uses unless told otherwise. */
+const NeulandToxBackend *
+neuland_tox_backend_get_toxcore (void)
+{
+  return &toxcore_backend;
+}
@@ -0,0 +1,120 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __NEULAND_TOX_BACKEND_H__
+#define __NEULAND_TOX_BACKEND_H__
+
+#include <glib.h>
+#include <tox/tox.h>
+
+/* The toxcore callbacks NeulandTox handles. A backend calls them from
+   its iterate function with the @user_data passed to
+   set_callbacks. */
+typedef struct
+{
+  void (* connection_status) (Tox *tox, int32_t friend_number, uint8_t status,
+                              void *user_data);
+  void (* user_status) (Tox *tox, int32_t friend_number, uint8_t status,
+                        void *user_data);
+  void (* name_change) (Tox *tox, int32_t friend_number, const uint8_t *name,
+                        uint16_t length, void *user_data);
+  void (* status_message) (Tox *tox, int32_t friend_number, const uint8_t *message,
+                           uint16_t length, void *user_data);
+  void (* friend_message) (Tox *tox, int32_t friend_number, const uint8_t *message,
+                           uint16_t length, void *user_data);
+  void (* friend_action) (Tox *tox, int32_t friend_number, const uint8_t *action,
+                          uint16_t length, void *user_data);
+  void (* typing_change) (Tox *tox, int32_t friend_number, uint8_t is_typing,
+                          void *user_data);
+  void (* friend_request) (Tox *tox, const uint8_t *public_key, const uint8_t *message,
+                           uint16_t length, void *user_data);
+  void (* file_send_request) (Tox *tox, int32_t friend_number, uint8_t file_number,
+                              uint64_t file_size, const uint8_t *file_name,
+                              uint16_t file_name_length, void *user_data);
+  void (* file_control) (Tox *tox, int32_t friend_number, uint8_t receive_send,
+                         uint8_t file_number, uint8_t control_type, const uint8_t *data,
+                         uint16_t length, void *user_data);
+  void (* file_data) (Tox *tox, int32_t friend_number, uint8_t file_number,
+                      const uint8_t *data, uint16_t length, void *user_data);
+  void (* read_receipt) (Tox *tox, int32_t friend_number, uint32_t receipt,
+                         void *user_data);
+} NeulandToxCallbacks;
+
+/* The part of the toxcore API that NeulandTox uses. Apart from new,
+   each function takes the Tox handle returned by new and behaves like
+   the toxcore function of the same name. Backends other than toxcore
+   may return any pointer from new, NeulandTox never looks into it. */
+typedef struct
+{
+  const gchar *name;
+
+  Tox *     (* new) (gpointer backend_data);
+  void      (* kill) (Tox *tox);
+  void      (* set_callbacks) (Tox *tox, const NeulandToxCallbacks *callbacks,
+                               gpointer user_data);
+  void      (* iterate) (Tox *tox); /* tox_do () */
+  uint32_t  (* do_interval) (Tox *tox);
+  int       (* bootstrap_from_address) (Tox *tox, const char *address, uint16_t port,
+                                        const uint8_t *public_key);
+
+  int       (* load) (Tox *tox, const uint8_t *data, uint32_t length);
+  uint32_t  (* size) (const Tox *tox);
+  void      (* save) (const Tox *tox, uint8_t *data);
+
+  void      (* get_address) (const Tox *tox, uint8_t *address);
+  uint16_t  (* get_self_name) (const Tox *tox, uint8_t *name);
+  int       (* get_self_status_message) (const Tox *tox, uint8_t *buf, uint32_t max_length);
+  int       (* set_name) (Tox *tox, const uint8_t *name, uint16_t length);
+  int       (* set_status_message) (Tox *tox, const uint8_t *status, uint16_t length);
+  int       (* set_user_status) (Tox *tox, uint8_t status);
+  int       (* set_user_is_typing) (Tox *tox, int32_t friend_number, uint8_t is_typing);
+
+  uint32_t  (* count_friendlist) (const Tox *tox);
+  uint32_t  (* get_friendlist) (const Tox *tox, int32_t *out_list, uint32_t list_size);
+  int       (* get_client_id) (const Tox *tox, int32_t friend_number, uint8_t *client_id);
+  uint64_t  (* get_last_online) (const Tox *tox, int32_t friend_number);
+  int       (* get_name) (const Tox *tox, int32_t friend_number, uint8_t *name);
+  int       (* get_status_message) (const Tox *tox, int32_t friend_number, uint8_t *buf,
+                                    uint32_t max_length);
+  int32_t   (* add_friend) (Tox *tox, const uint8_t *address, const uint8_t *data,
+                            uint16_t length);
+  int32_t   (* add_friend_norequest) (Tox *tox, const uint8_t *client_id);
+  int       (* del_friend) (Tox *tox, int32_t friend_number);
+
+  uint32_t  (* send_message) (Tox *tox, int32_t friend_number, const uint8_t *message,
+                              uint32_t length);
+  uint32_t  (* send_action) (Tox *tox, int32_t friend_number, const uint8_t *action,
+                             uint32_t length);
+
+  int       (* new_file_sender) (Tox *tox, int32_t friend_number, uint64_t file_size,
+                                 const uint8_t *file_name, uint16_t file_name_length);
+  int       (* file_send_control) (Tox *tox, int32_t friend_number, uint8_t send_receive,
+                                   uint8_t file_number, uint8_t control_type,
+                                   const uint8_t *data, uint16_t length);
+  int       (* file_send_data) (Tox *tox, int32_t friend_number, uint8_t file_number,
+                                const uint8_t *data, uint16_t length);
+  int       (* file_data_size) (const Tox *tox, int32_t friend_number);
+} NeulandToxBackend;
+
+const NeulandToxBackend *
+neuland_tox_backend_get_toxcore (void);
+
+#endif /* __NEULAND_TOX_BACKEND_H__ */
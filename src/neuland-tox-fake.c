@@ -0,0 +1,941 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* A NeulandToxBackend that needs no network. It pretends to have a
+   friend list of its own and makes up incoming events at the rates
+   given in a NeulandToxFakeConfig, so that NeulandTox and the UI can
+   be put under a reproducible load. Like toxcore it must only be used
+   from one thread at a time, and it calls the callbacks only from
+   its iterate function. */
+
+#include <string.h>
+
+#include "neuland-tox-fake.h"
+
+#define FAKE_DO_INTERVAL 10              /* milliseconds */
+#define FAKE_FILE_DATA_SIZE 1024         /* bytes per file data package */
+#define FAKE_MAX_FILE_BURST (1024 * 1024) /* bytes per file and iteration without a rate */
+
+static const gchar lorem_ipsum[] =
+  "Lorem ipsum dolor sit amet, consectetur adipisici elit, sed eiusmod "
+  "tempor incidunt ut labore et dolore magna aliqua. Ut enim ad minim "
+  "veniam, quis nostrud exercitation ullamco laboris nisi ut aliquid ex "
+  "ea commodi consequat. Quis aute iure reprehenderit in voluptate velit "
+  "esse cillum dolore eu fugiat nulla pariatur.";
+
+typedef struct
+{
+  gboolean used;
+  guint8 client_id[TOX_CLIENT_ID_SIZE];
+  gchar *name;
+  gchar *status_message;
+  guint8 status;
+  gboolean connected;
+  gboolean is_typing;
+  guint64 last_online;
+} FakeContact;
+
+typedef enum {
+  FAKE_TRANSFER_OFFERED,
+  FAKE_TRANSFER_RUNNING,
+  FAKE_TRANSFER_PAUSED,
+  FAKE_TRANSFER_DONE
+} FakeTransferState;
+
+typedef struct
+{
+  gint32 contact_number;
+  guint8 file_number;
+  gboolean sending;   /* TRUE if NeulandTox sends the file to us */
+  guint64 size;
+  guint64 position;
+  gdouble budget;     /* bytes we may send before waiting for the rate */
+  FakeTransferState state;
+} FakeTransfer;
+
+typedef struct
+{
+  gint32 contact_number;
+  guint8 receive_send;
+  guint8 file_number;
+  guint8 control_type;
+  guint8 data[sizeof (guint64)];
+  guint16 length;
+} FakeControl;
+
+typedef struct
+{
+  gint32 contact_number;
+  guint32 receipt;
+} FakeReceipt;
+
+typedef struct
+{
+  NeulandToxFakeConfig config;
+  GRand *rand;
+
+  NeulandToxCallbacks callbacks;
+  gpointer user_data;
+
+  guint8 address[TOX_FRIEND_ADDRESS_SIZE];
+  gchar *name;
+  gchar *status_message;
+  guint8 status;
+
+  GArray *contacts;       /* FakeContact, indexed by friend number */
+  GPtrArray *transfers;   /* FakeTransfer */
+  GQueue controls;        /* FakeControl, handed out on the next iteration */
+  GQueue receipts;        /* FakeReceipt, handed out on the next iteration */
+  guint8 next_file_number;
+  guint32 message_id;
+  guint8 file_data[FAKE_FILE_DATA_SIZE];
+
+  gboolean started;
+  gint64 last_iteration;
+  gdouble due_messages;
+  gdouble due_status_changes;
+  gdouble due_requests;
+  guint n_events;
+} NeulandToxFake;
+
+#define FAKE(tox) ((NeulandToxFake *)(tox))
+
+static void
+fill_random (GRand *rand,
+             guint8 *buffer,
+             gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    buffer[i] = g_rand_int_range (rand, 0, 256);
+}
+
+static FakeContact *
+fake_get_contact (const NeulandToxFake *fake,
+                  gint32 friend_number)
+{
+  FakeContact *contact;
+
+  if (friend_number < 0 || friend_number >= fake->contacts->len)
+    return NULL;
+
+  contact = &g_array_index (fake->contacts, FakeContact, friend_number);
+
+  return contact->used ? contact : NULL;
+}
+
+static gint32
+fake_add_contact (NeulandToxFake *fake,
+                  const guint8 *client_id)
+{
+  FakeContact contact = { 0, };
+
+  contact.used = TRUE;
+  memcpy (contact.client_id, client_id, TOX_CLIENT_ID_SIZE);
+  contact.name = g_strdup ("");
+  contact.status_message = g_strdup ("");
+  g_array_append_val (fake->contacts, contact);
+
+  return fake->contacts->len - 1;
+}
+
+static void
+clear_fake_contact (FakeContact *contact)
+{
+  g_free (contact->name);
+  g_free (contact->status_message);
+}
+
+static FakeTransfer *
+fake_get_transfer (NeulandToxFake *fake,
+                   gint32 friend_number,
+                   gboolean sending,
+                   guint8 file_number)
+{
+  guint i;
+
+  for (i = 0; i < fake->transfers->len; i++)
+    {
+      FakeTransfer *transfer = g_ptr_array_index (fake->transfers, i);
+
+      if (transfer->contact_number == friend_number &&
+          transfer->sending == sending &&
+          transfer->file_number == file_number)
+        return transfer;
+    }
+
+  return NULL;
+}
+
+static FakeTransfer *
+fake_add_transfer (NeulandToxFake *fake,
+                   gint32 friend_number,
+                   gboolean sending,
+                   guint64 size)
+{
+  FakeTransfer *transfer = g_new0 (FakeTransfer, 1);
+
+  transfer->contact_number = friend_number;
+  transfer->file_number = fake->next_file_number++;
+  transfer->sending = sending;
+  transfer->size = size;
+  g_ptr_array_add (fake->transfers, transfer);
+
+  return transfer;
+}
+
+static void
+fake_queue_control (NeulandToxFake *fake,
+                    FakeTransfer *transfer,
+                    guint8 control_type,
+                    const guint8 *data,
+                    guint16 length)
+{
+  FakeControl *control = g_slice_new0 (FakeControl);
+
+  control->contact_number = transfer->contact_number;
+  /* From NeulandTox's point of view: 1 if it is the sender */
+  control->receive_send = transfer->sending ? 1 : 0;
+  control->file_number = transfer->file_number;
+  control->control_type = control_type;
+  control->length = MIN (length, sizeof (control->data));
+  if (data != NULL)
+    memcpy (control->data, data, control->length);
+
+  g_queue_push_tail (&fake->controls, control);
+}
+
+/* Returns a random contact, or NULL if there is none. */
+static FakeContact *
+fake_get_random_contact (NeulandToxFake *fake,
+                         gint32 *friend_number)
+{
+  if (fake->contacts->len == 0)
+    return NULL;
+
+  *friend_number = g_rand_int_range (fake->rand, 0, fake->contacts->len);
+
+  return fake_get_contact (fake, *friend_number);
+}
+
+/* Returns how many events of @rate are due after @elapsed seconds,
+   keeping the fraction in @due for later. A stalled tox thread only
+   catches up by one second's worth of events. */
+static guint
+fake_take_due_events (gdouble *due,
+                      gdouble rate,
+                      gdouble elapsed)
+{
+  guint n;
+
+  *due = MIN (*due + rate * elapsed, MAX (rate, 1));
+  n = (guint) *due;
+  *due -= n;
+
+  return n;
+}
+
+static void
+fake_emit_message (NeulandToxFake *fake)
+{
+  FakeContact *contact;
+  gint32 friend_number;
+  gchar *message;
+  gint length;
+
+  contact = fake_get_random_contact (fake, &friend_number);
+  if (contact == NULL)
+    return;
+
+  length = g_rand_int_range (fake->rand, 1, sizeof (lorem_ipsum));
+  message = g_strdup_printf ("%u: %.*s", ++fake->n_events, length, lorem_ipsum);
+
+  /* Every tenth one is an action */
+  if (g_rand_int_range (fake->rand, 0, 10) == 0)
+    fake->callbacks.friend_action ((Tox *)fake, friend_number, (guint8 *)message,
+                                   strlen (message), fake->user_data);
+  else
+    fake->callbacks.friend_message ((Tox *)fake, friend_number, (guint8 *)message,
+                                    strlen (message), fake->user_data);
+
+  g_free (message);
+}
+
+static void
+fake_emit_status_change (NeulandToxFake *fake)
+{
+  FakeContact *contact;
+  gint32 friend_number;
+
+  contact = fake_get_random_contact (fake, &friend_number);
+  if (contact == NULL)
+    return;
+
+  switch (g_rand_int_range (fake->rand, 0, 5))
+    {
+    case 0:
+      g_free (contact->name);
+      contact->name = g_strdup_printf ("Fake contact %i (%u)", friend_number, ++fake->n_events);
+      fake->callbacks.name_change ((Tox *)fake, friend_number, (guint8 *)contact->name,
+                                   strlen (contact->name), fake->user_data);
+      break;
+
+    case 1:
+      g_free (contact->status_message);
+      contact->status_message = g_strdup_printf ("Status message %u", ++fake->n_events);
+      fake->callbacks.status_message ((Tox *)fake, friend_number,
+                                      (guint8 *)contact->status_message,
+                                      strlen (contact->status_message), fake->user_data);
+      break;
+
+    case 2:
+      contact->status = g_rand_int_range (fake->rand, TOX_USERSTATUS_NONE, TOX_USERSTATUS_BUSY + 1);
+      fake->callbacks.user_status ((Tox *)fake, friend_number, contact->status,
+                                   fake->user_data);
+      break;
+
+    case 3:
+      contact->is_typing = !contact->is_typing;
+      fake->callbacks.typing_change ((Tox *)fake, friend_number, contact->is_typing,
+                                     fake->user_data);
+      break;
+
+    default:
+      contact->connected = !contact->connected;
+      contact->last_online = g_get_real_time () / G_USEC_PER_SEC;
+      fake->callbacks.connection_status ((Tox *)fake, friend_number, contact->connected,
+                                         fake->user_data);
+      break;
+    }
+}
+
+static void
+fake_emit_request (NeulandToxFake *fake)
+{
+  guint8 public_key[TOX_CLIENT_ID_SIZE];
+  gchar *message = g_strdup_printf ("Fake contact request %u", ++fake->n_events);
+
+  fill_random (fake->rand, public_key, sizeof (public_key));
+  fake->callbacks.friend_request ((Tox *)fake, public_key, (guint8 *)message,
+                                  strlen (message), fake->user_data);
+  g_free (message);
+}
+
+static void
+fake_send_file_data (NeulandToxFake *fake,
+                     FakeTransfer *transfer,
+                     gdouble elapsed)
+{
+  guint64 rate = fake->config.incoming_file_rate;
+
+  if (rate > 0)
+    transfer->budget = MIN (transfer->budget + rate * elapsed, MAX (rate, FAKE_FILE_DATA_SIZE));
+  else
+    transfer->budget = FAKE_MAX_FILE_BURST;
+
+  while (transfer->position < transfer->size)
+    {
+      guint16 length = MIN (FAKE_FILE_DATA_SIZE, transfer->size - transfer->position);
+
+      if (transfer->budget < length)
+        return;
+
+      fake->callbacks.file_data ((Tox *)fake, transfer->contact_number,
+                                 transfer->file_number, fake->file_data, length,
+                                 fake->user_data);
+      transfer->position += length;
+      transfer->budget -= length;
+    }
+
+  /* NeulandTox confirms with a finished control of its own. */
+  transfer->state = FAKE_TRANSFER_DONE;
+  fake->callbacks.file_control ((Tox *)fake, transfer->contact_number, 0,
+                                transfer->file_number, TOX_FILECONTROL_FINISHED,
+                                NULL, 0, fake->user_data);
+}
+
+static void
+fake_start (NeulandToxFake *fake)
+{
+  guint i;
+
+  for (i = 0; i < fake->contacts->len; i++)
+    {
+      FakeContact *contact = &g_array_index (fake->contacts, FakeContact, i);
+
+      if (contact->connected)
+        fake->callbacks.connection_status ((Tox *)fake, i, TRUE, fake->user_data);
+    }
+
+  for (i = 0; i < fake->config.n_incoming_files; i++)
+    {
+      FakeTransfer *transfer;
+      FakeContact *contact;
+      gint32 friend_number;
+      gchar *file_name;
+
+      contact = fake_get_random_contact (fake, &friend_number);
+      if (contact == NULL)
+        break;
+
+      transfer = fake_add_transfer (fake, friend_number, FALSE,
+                                    fake->config.incoming_file_size);
+      file_name = g_strdup_printf ("fake-file-%u", i);
+      fake->callbacks.file_send_request ((Tox *)fake, friend_number, transfer->file_number,
+                                         transfer->size, (guint8 *)file_name,
+                                         strlen (file_name), fake->user_data);
+      g_free (file_name);
+    }
+}
+
+static Tox *
+fake_new (gpointer backend_data)
+{
+  NeulandToxFake *fake = g_new0 (NeulandToxFake, 1);
+  NeulandToxFakeConfig *config = backend_data;
+  guint i;
+
+  if (config != NULL)
+    fake->config = *config;
+
+  fake->rand = g_rand_new_with_seed (fake->config.seed);
+  fill_random (fake->rand, fake->address, sizeof (fake->address));
+  fill_random (fake->rand, fake->file_data, sizeof (fake->file_data));
+  fake->name = g_strdup ("");
+  fake->status_message = g_strdup ("");
+
+  fake->contacts = g_array_sized_new (FALSE, TRUE, sizeof (FakeContact),
+                                      fake->config.n_contacts);
+  g_array_set_clear_func (fake->contacts, (GDestroyNotify) clear_fake_contact);
+  for (i = 0; i < fake->config.n_contacts; i++)
+    {
+      guint8 client_id[TOX_CLIENT_ID_SIZE];
+      FakeContact *contact;
+
+      fill_random (fake->rand, client_id, sizeof (client_id));
+      contact = &g_array_index (fake->contacts, FakeContact, fake_add_contact (fake, client_id));
+
+      g_free (contact->name);
+      contact->name = g_strdup_printf ("Fake contact %u", i);
+      g_free (contact->status_message);
+      contact->status_message = g_strdup_printf ("Status message of fake contact %u", i);
+      contact->connected = g_rand_double (fake->rand) < fake->config.online_share;
+      contact->last_online = g_get_real_time () / G_USEC_PER_SEC;
+    }
+
+  fake->transfers = g_ptr_array_new_with_free_func (g_free);
+  g_queue_init (&fake->controls);
+  g_queue_init (&fake->receipts);
+
+  return (Tox *)fake;
+}
+
+static void
+free_fake_control (gpointer data)
+{
+  g_slice_free (FakeControl, data);
+}
+
+static void
+free_fake_receipt (gpointer data)
+{
+  g_slice_free (FakeReceipt, data);
+}
+
+static void
+fake_kill (Tox *tox)
+{
+  NeulandToxFake *fake = FAKE (tox);
+
+  g_rand_free (fake->rand);
+  g_free (fake->name);
+  g_free (fake->status_message);
+  g_array_free (fake->contacts, TRUE);
+  g_ptr_array_free (fake->transfers, TRUE);
+  g_queue_foreach (&fake->controls, (GFunc) free_fake_control, NULL);
+  g_queue_clear (&fake->controls);
+  g_queue_foreach (&fake->receipts, (GFunc) free_fake_receipt, NULL);
+  g_queue_clear (&fake->receipts);
+  g_free (fake);
+}
+
+static void
+fake_set_callbacks (Tox *tox,
+                    const NeulandToxCallbacks *callbacks,
+                    gpointer user_data)
+{
+  FAKE (tox)->callbacks = *callbacks;
+  FAKE (tox)->user_data = user_data;
+}
+
+static void
+fake_iterate (Tox *tox)
+{
+  NeulandToxFake *fake = FAKE (tox);
+  gint64 now = g_get_monotonic_time ();
+  gdouble elapsed;
+  FakeControl *control;
+  FakeReceipt *receipt;
+  FakeContact *contact;
+  guint n, i;
+
+  if (!fake->started)
+    {
+      fake->started = TRUE;
+      fake->last_iteration = now;
+      fake_start (fake);
+      return;
+    }
+
+  elapsed = (now - fake->last_iteration) / (gdouble) G_USEC_PER_SEC;
+  fake->last_iteration = now;
+
+  while ((control = g_queue_pop_head (&fake->controls)) != NULL)
+    {
+      fake->callbacks.file_control (tox, control->contact_number, control->receive_send,
+                                    control->file_number, control->control_type,
+                                    control->data, control->length, fake->user_data);
+      free_fake_control (control);
+    }
+
+  /* Messages sent to contacts that went offline since are lost, like
+     with toxcore */
+  while ((receipt = g_queue_pop_head (&fake->receipts)) != NULL)
+    {
+      contact = fake_get_contact (fake, receipt->contact_number);
+      if (contact != NULL && contact->connected)
+        fake->callbacks.read_receipt (tox, receipt->contact_number, receipt->receipt,
+                                      fake->user_data);
+      free_fake_receipt (receipt);
+    }
+
+  n = fake_take_due_events (&fake->due_messages, fake->config.message_rate, elapsed);
+  for (i = 0; i < n; i++)
+    fake_emit_message (fake);
+
+  n = fake_take_due_events (&fake->due_status_changes, fake->config.status_rate, elapsed);
+  for (i = 0; i < n; i++)
+    fake_emit_status_change (fake);
+
+  n = fake_take_due_events (&fake->due_requests, fake->config.request_rate, elapsed);
+  for (i = 0; i < n; i++)
+    fake_emit_request (fake);
+
+  for (i = 0; i < fake->transfers->len; i++)
+    {
+      FakeTransfer *transfer = g_ptr_array_index (fake->transfers, i);
+
+      if (!transfer->sending && transfer->state == FAKE_TRANSFER_RUNNING)
+        fake_send_file_data (fake, transfer, elapsed);
+    }
+}
+
+static uint32_t
+fake_do_interval (Tox *tox)
+{
+  return FAKE_DO_INTERVAL;
+}
+
+static int
+fake_bootstrap_from_address (Tox *tox,
+                             const char *address,
+                             uint16_t port,
+                             const uint8_t *public_key)
+{
+  return 1;
+}
+
+static int
+fake_load (Tox *tox,
+           const uint8_t *data,
+           uint32_t length)
+{
+  /* Nothing worth keeping is saved, see fake_size (). */
+  return 0;
+}
+
+static uint32_t
+fake_size (const Tox *tox)
+{
+  return 0;
+}
+
+static void
+fake_save (const Tox *tox,
+           uint8_t *data)
+{
+}
+
+static void
+fake_get_address (const Tox *tox,
+                  uint8_t *address)
+{
+  memcpy (address, FAKE (tox)->address, TOX_FRIEND_ADDRESS_SIZE);
+}
+
+static uint16_t
+fake_get_self_name (const Tox *tox,
+                    uint8_t *name)
+{
+  gsize length = strlen (FAKE (tox)->name);
+
+  memcpy (name, FAKE (tox)->name, length);
+
+  return length;
+}
+
+static int
+fake_get_self_status_message (const Tox *tox,
+                              uint8_t *buf,
+                              uint32_t max_length)
+{
+  gsize length = MIN (strlen (FAKE (tox)->status_message), max_length);
+
+  memcpy (buf, FAKE (tox)->status_message, length);
+
+  return length;
+}
+
+static int
+fake_set_name (Tox *tox,
+               const uint8_t *name,
+               uint16_t length)
+{
+  g_free (FAKE (tox)->name);
+  FAKE (tox)->name = g_strndup ((const gchar *)name, length);
+
+  return 0;
+}
+
+static int
+fake_set_status_message (Tox *tox,
+                         const uint8_t *status,
+                         uint16_t length)
+{
+  g_free (FAKE (tox)->status_message);
+  FAKE (tox)->status_message = g_strndup ((const gchar *)status, length);
+
+  return 0;
+}
+
+static int
+fake_set_user_status (Tox *tox,
+                      uint8_t status)
+{
+  FAKE (tox)->status = status;
+
+  return 0;
+}
+
+static int
+fake_set_user_is_typing (Tox *tox,
+                         int32_t friend_number,
+                         uint8_t is_typing)
+{
+  return fake_get_contact (FAKE (tox), friend_number) != NULL ? 0 : -1;
+}
+
+static uint32_t
+fake_count_friendlist (const Tox *tox)
+{
+  const NeulandToxFake *fake = FAKE (tox);
+  uint32_t count = 0;
+  guint i;
+
+  for (i = 0; i < fake->contacts->len; i++)
+    if (fake_get_contact (fake, i) != NULL)
+      count++;
+
+  return count;
+}
+
+static uint32_t
+fake_get_friendlist (const Tox *tox,
+                     int32_t *out_list,
+                     uint32_t list_size)
+{
+  const NeulandToxFake *fake = FAKE (tox);
+  uint32_t count = 0;
+  guint i;
+
+  for (i = 0; i < fake->contacts->len && count < list_size; i++)
+    if (fake_get_contact (fake, i) != NULL)
+      out_list[count++] = i;
+
+  return count;
+}
+
+static int
+fake_get_client_id (const Tox *tox,
+                    int32_t friend_number,
+                    uint8_t *client_id)
+{
+  FakeContact *contact = fake_get_contact (FAKE (tox), friend_number);
+
+  if (contact == NULL)
+    return -1;
+
+  memcpy (client_id, contact->client_id, TOX_CLIENT_ID_SIZE);
+
+  return 0;
+}
+
+static uint64_t
+fake_get_last_online (const Tox *tox,
+                      int32_t friend_number)
+{
+  FakeContact *contact = fake_get_contact (FAKE (tox), friend_number);
+
+  return contact != NULL ? contact->last_online : 0;
+}
+
+static int
+fake_get_name (const Tox *tox,
+               int32_t friend_number,
+               uint8_t *name)
+{
+  FakeContact *contact = fake_get_contact (FAKE (tox), friend_number);
+  gsize length;
+
+  if (contact == NULL)
+    return -1;
+
+  length = MIN (strlen (contact->name), TOX_MAX_NAME_LENGTH);
+  memcpy (name, contact->name, length);
+
+  return length;
+}
+
+static int
+fake_get_status_message (const Tox *tox,
+                         int32_t friend_number,
+                         uint8_t *buf,
+                         uint32_t max_length)
+{
+  FakeContact *contact = fake_get_contact (FAKE (tox), friend_number);
+  gsize length;
+
+  if (contact == NULL)
+    return -1;
+
+  length = MIN (strlen (contact->status_message), max_length);
+  memcpy (buf, contact->status_message, length);
+
+  return length;
+}
+
+static int32_t
+fake_add_friend (Tox *tox,
+                 const uint8_t *address,
+                 const uint8_t *data,
+                 uint16_t length)
+{
+  /* The client ID is the first part of the address. */
+  return fake_add_contact (FAKE (tox), address);
+}
+
+static int32_t
+fake_add_friend_norequest (Tox *tox,
+                           const uint8_t *client_id)
+{
+  return fake_add_contact (FAKE (tox), client_id);
+}
+
+static int
+fake_del_friend (Tox *tox,
+                 int32_t friend_number)
+{
+  FakeContact *contact = fake_get_contact (FAKE (tox), friend_number);
+
+  if (contact == NULL)
+    return -1;
+
+  clear_fake_contact (contact);
+  memset (contact, 0, sizeof (FakeContact));
+
+  return 0;
+}
+
+static uint32_t
+fake_send_message (Tox *tox,
+                   int32_t friend_number,
+                   const uint8_t *message,
+                   uint32_t length)
+{
+  NeulandToxFake *fake = FAKE (tox);
+  FakeContact *contact = fake_get_contact (fake, friend_number);
+  FakeReceipt *receipt;
+
+  if (contact == NULL || !contact->connected)
+    return 0;
+
+  /* Every message is read right away */
+  receipt = g_slice_new (FakeReceipt);
+  receipt->contact_number = friend_number;
+  receipt->receipt = ++fake->message_id;
+  g_queue_push_tail (&fake->receipts, receipt);
+
+  return receipt->receipt;
+}
+
+static int
+fake_new_file_sender (Tox *tox,
+                      int32_t friend_number,
+                      uint64_t file_size,
+                      const uint8_t *file_name,
+                      uint16_t file_name_length)
+{
+  NeulandToxFake *fake = FAKE (tox);
+  FakeTransfer *transfer;
+
+  if (fake_get_contact (fake, friend_number) == NULL)
+    return -1;
+
+  /* Everything we are offered is accepted right away. */
+  transfer = fake_add_transfer (fake, friend_number, TRUE, file_size);
+  transfer->state = FAKE_TRANSFER_RUNNING;
+  fake_queue_control (fake, transfer, TOX_FILECONTROL_ACCEPT, NULL, 0);
+
+  return transfer->file_number;
+}
+
+static int
+fake_file_send_control (Tox *tox,
+                        int32_t friend_number,
+                        uint8_t send_receive,
+                        uint8_t file_number,
+                        uint8_t control_type,
+                        const uint8_t *data,
+                        uint16_t length)
+{
+  NeulandToxFake *fake = FAKE (tox);
+  FakeTransfer *transfer;
+
+  /* send_receive is 0 if NeulandTox is the sender. */
+  transfer = fake_get_transfer (fake, friend_number, send_receive == 0, file_number);
+  if (transfer == NULL)
+    return -1;
+
+  switch (control_type)
+    {
+    case TOX_FILECONTROL_ACCEPT:
+      /* An offset to continue from has to be confirmed. */
+      if (!transfer->sending && length == sizeof (guint64))
+        {
+          guint64 offset;
+
+          memcpy (&offset, data, sizeof (offset));
+          transfer->position = MIN (GUINT64_FROM_BE (offset), transfer->size);
+          fake_queue_control (fake, transfer, TOX_FILECONTROL_ACCEPT, data, length);
+        }
+      transfer->state = FAKE_TRANSFER_RUNNING;
+      break;
+
+    case TOX_FILECONTROL_PAUSE:
+      transfer->state = FAKE_TRANSFER_PAUSED;
+      break;
+
+    case TOX_FILECONTROL_FINISHED:
+      if (transfer->sending)
+        fake_queue_control (fake, transfer, TOX_FILECONTROL_FINISHED, NULL, 0);
+      g_ptr_array_remove_fast (fake->transfers, transfer);
+      break;
+
+    default:
+      g_ptr_array_remove_fast (fake->transfers, transfer);
+      break;
+    }
+
+  return 0;
+}
+
+static int
+fake_file_send_data (Tox *tox,
+                     int32_t friend_number,
+                     uint8_t file_number,
+                     const uint8_t *data,
+                     uint16_t length)
+{
+  FakeTransfer *transfer = fake_get_transfer (FAKE (tox), friend_number, TRUE, file_number);
+
+  if (transfer == NULL || transfer->state != FAKE_TRANSFER_RUNNING)
+    return -1;
+
+  transfer->position += length;
+
+  return 0;
+}
+
+static int
+fake_file_data_size (const Tox *tox,
+                     int32_t friend_number)
+{
+  return FAKE_FILE_DATA_SIZE;
+}
+
+static const NeulandToxBackend fake_backend = {
+  "fake",
+  fake_new,
+  fake_kill,
+  fake_set_callbacks,
+  fake_iterate,
+  fake_do_interval,
+  fake_bootstrap_from_address,
+
+  fake_load,
+  fake_size,
+  fake_save,
+
+  fake_get_address,
+  fake_get_self_name,
+  fake_get_self_status_message,
+  fake_set_name,
+  fake_set_status_message,
+  fake_set_user_status,
+  fake_set_user_is_typing,
+
+  fake_count_friendlist,
+  fake_get_friendlist,
+  fake_get_client_id,
+  fake_get_last_online,
+  fake_get_name,
+  fake_get_status_message,
+  fake_add_friend,
+  fake_add_friend_norequest,
+  fake_del_friend,
+
+  fake_send_message,
+  fake_send_message, /* actions are just messages to us */
+
+  fake_new_file_sender,
+  fake_file_send_control,
+  fake_file_send_data,
+  fake_file_data_size,
+};
+
+/* Pass a NeulandToxFakeConfig as backend data, or NULL for a fake
+   without contacts or events. */
+const NeulandToxBackend *
+neuland_tox_fake_get_backend (void)
+{
+  return &fake_backend;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: c; indent-tabs-mode: nil; -*- */
+/*
+ * This file is part of Neuland.
+ *
+ * Copyright © 2014 Volker Sobek <reklov@live.com>
+ *
+ * Neuland is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Neuland is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __NEULAND_TOX_FAKE_H__
+#define __NEULAND_TOX_FAKE_H__
+
+#include "neuland-tox-backend.h"
+
+/* What the fake backend simulates. Rates are events per second over
+   all contacts together, 0 turns the kind of event off. */
+typedef struct
+{
+  guint n_contacts;                   /* contacts in the friend list */
+  gdouble online_share;               /* of the contacts, online from the start */
+  gdouble message_rate;               /* incoming messages and actions */
+  gdouble status_rate;                /* name, status, status message, typing and
+                                         connection changes */
+  gdouble request_rate;               /* incoming contact requests */
+  guint n_incoming_files;             /* file send requests at startup */
+  guint64 incoming_file_size;         /* bytes */
+  guint64 incoming_file_rate;         /* bytes per second and file, 0 for no limit */
+  guint32 seed;                       /* same seed, same events */
+} NeulandToxFakeConfig;
+
+const NeulandToxBackend *
+neuland_tox_fake_get_backend (void);
+
+#endif /* __NEULAND_TOX_FAKE_H__ */
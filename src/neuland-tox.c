@@ -19,6 +19,7 @@
  */
 
 #include <string.h>
+#include <glib/gstdio.h>
 
 #include "neuland-tox.h"
 #include "neuland-file-transfer.h"
@@ -28,10 +29,49 @@
 
 #define NEULAND_DEFAULT_STATUS_MESSAGE "I'm testing Neuland!"
 #define NEULAND_DEFAULT_NAME "Neuland User"
-#define MAX_SEND_DATA_ATTEMPTS 500
+#define MAX_SEND_PACKETS_PER_DISPATCH 64
+#define READ_AHEAD_BLOCK_SIZE (1024 * 1024)
+#define READ_AHEAD_BLOCKS 2
+#define MAX_FREE_READ_BLOCKS 8
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+#define FILE_NUMBER_SLOTS 256   /* toxcore file numbers are guint8 */
+/* Files below this size are sent before bigger ones */
+#define SMALL_FILE_SIZE (1024 * 1024)
+/* Upload limits allow this much of a burst, in microseconds worth of
+   the rate but at least MIN_TOKEN_BUCKET_SIZE bytes */
+#define TOKEN_BUCKET_BURST (G_USEC_PER_SEC / 10)
+#define MIN_TOKEN_BUCKET_SIZE 4096
+
+/* How often the transfer journal is saved while transfers are in
+   progress, see neuland_tox_save_transfer_journal(). */
+#define JOURNAL_SAVE_INTERVAL 5 /* seconds */
+#define SAMPLE_INTERVAL 1 /* seconds */
+/* Hex SHA-256 sent along with the offset when continuing a transfer */
+#define RESUME_CHECKSUM_LENGTH 64
+
+/* Messages queued while a contact was offline are sent this far
+   apart once it is online again */
+#define OUTGOING_QUEUE_INTERVAL 100 /* milliseconds */
+/* Changes to the outgoing queues are saved together this long after
+   the first one */
+#define OUTGOING_SAVE_DELAY 1 /* seconds */
+
+/* Limits a rate of bytes per second, 0 meaning no limit. Sending
+   may overdraw @tokens by one packet, after which the bucket has to
+   refill first. */
+typedef struct
+{
+  guint64 rate;
+  gdouble tokens;
+  gint64 last_refill;
+} TokenBucket;
 
 struct _NeulandToxPrivate
 {
+  /* All toxcore calls go through @backend, @tox_struct is what its
+     new function returned for @backend_data. */
+  const NeulandToxBackend *backend;
+  gpointer backend_data;
   Tox *tox_struct;
 
   gchar *data_path;
@@ -42,14 +82,98 @@ struct _NeulandToxPrivate
   NeulandContactStatus status;
   gint64 pending_requests;
   gboolean is_running;
+  gboolean use_public_nodes;
+  guint64 upload_limit;                 /* bytes per second, 0 for none */
+  guint64 contact_upload_limit_setting; /* same, per contact */
 
-  GHashTable *contacts_ht;  /* key: tox friend number -> value: contact*/
+  GPtrArray *contacts;  /* index: tox friend number -> contact, NULL for unused numbers */
   GHashTable *requests_ht;  /* key: contact -> value: contact  */
   GHashTable *file_transfers_sending_ht;
   GHashTable *file_transfers_receiving_ht;
   GHashTable *file_transfers_all_ht;
 
-  GMutex mutex;
+  /* Transfers that can be continued after a restart are journaled
+     to @journal_path. @journal holds the entries loaded at startup
+     that no transfer continues yet. */
+  gchar *journal_path;
+  GKeyFile *journal;
+  guint journal_timeout_id;
+
+  /* Samples the progress of transfers in progress, so that their
+     rate and stats are kept up to date whether they are shown or
+     not. */
+  guint sample_timeout_id;
+
+  /* Text queued while contacts were offline is saved to
+     @outgoing_path, by @outgoing_save_id once the queues changed.
+     Contacts whose queue is being sent have a timeout in
+     @outgoing_flushes_ht. */
+  gchar *outgoing_path;
+  guint outgoing_save_id;
+  GHashTable *outgoing_flushes_ht; /* key: contact -> value: source id */
+
+  /* Contacts with toxcore messages that have to be sent again, they
+     go out from the same timeout as queued text. */
+  GHashTable *resends_ht; /* key: contact number -> value: ResendState */
+
+  /* Indexes the chat logs of all contacts, NULL without a data
+     path. */
+  NeulandSearchIndex *search_index;
+
+  /* The tox thread iterates its own main context, tox_do() is run
+     from tox_do_source. Only code running in tox_context may use
+     tox_struct, see neuland_tox_invoke(). */
+  GThread *tox_thread;
+  GMainContext *tox_context;
+  GMainLoop *tox_loop;
+  GSource *tox_do_source;
+  gint wakeup_pending; /* atomic */
+  /* Signalled when the main thread releases tox_context, the tox
+     thread waits for that on startup. */
+  GMutex context_mutex;
+  GCond context_cond;
+
+  /* Outgoing file transfers, only used in the tox thread. Each
+     contact with active transfers has a SendQueue in @send_queues,
+     @send_source sends from them round-robin. File data is read
+     ahead in blocks by @reader_pool, spare blocks are kept in
+     @free_blocks. @upload_bucket limits all uploads together,
+     @contact_upload_limit is the rate of each SendQueue's bucket. */
+  GSource *send_source;
+  GQueue send_queues;
+  GHashTable *send_queues_ht;
+  guint n_send_transfers;
+  gboolean send_blocked;
+  TokenBucket upload_bucket;
+  guint64 contact_upload_limit;
+  GThreadPool *reader_pool;
+  GQueue free_blocks;
+
+  /* Incoming file transfers we accepted, only used in the tox
+     thread. Their data is written to disk by @writer_pool. Indexed
+     by friend number, each entry is NULL or an array of
+     FILE_NUMBER_SLOTS ReceiveTransfer pointers indexed by file
+     number, so that file data packages need no hashing. */
+  GPtrArray *receive_slots;
+  GThreadPool *writer_pool;
+
+  /* Outgoing text toxcore has no read receipt for yet, only used in
+     the tox thread. Indexed by friend number, each entry is NULL or
+     an InFlight. The counters are atomic, the rest of
+     @delivery_stats is only used in the main thread. */
+  GPtrArray *in_flight;
+  gint in_flight_chunks; /* atomic */
+  gint retransmitted;    /* atomic */
+  NeulandToxDeliveryStats delivery_stats;
+
+  /* Events from the tox thread are queued in @events and handled in
+     batches by @drain_source in the main context. */
+  GMainContext *main_context;
+  GAsyncQueue *events;
+  GSource *drain_source;
+  gint drain_scheduled; /* atomic */
+  gint events_pushed;   /* atomic */
+  NeulandToxEventStats event_stats;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (NeulandTox, neuland_tox, G_TYPE_OBJECT)
@@ -67,6 +191,35 @@ typedef enum {
   SEND_TYPE_ACTION
 } NeulandToxSendType;
 
+typedef enum {
+  EVENT_CONNECTION_STATUS,
+  EVENT_USER_STATUS,
+  EVENT_NAME_CHANGE,
+  EVENT_STATUS_MESSAGE,
+  EVENT_CONTACT_MESSAGE,
+  EVENT_CONTACT_ACTION,
+  EVENT_TYPING_CHANGE,
+  EVENT_FRIEND_REQUEST,
+  EVENT_FILE_SEND_REQUEST,
+  EVENT_FILE_CONTROL,
+  EVENT_UPDATE_FILE_TRANSFER,
+  EVENT_COMMAND_DONE,
+  EVENT_READ_RECEIPT,
+  EVENT_RESEND_PENDING,
+  EVENT_N
+} NeulandToxEventType;
+
+typedef struct
+{
+  NeulandToxEventType type;
+  gint64 push_time; /* monotonic time, for the drain latency */
+  gpointer data;    /* One of the Data* structs below */
+} NeulandToxEvent;
+
+/* Maximum number of events handled per main loop iteration, so that
+   a burst of events can't starve the rest of the main loop. */
+#define MAX_EVENTS_PER_DRAIN 256
+
 /* Possible errors returned by tox_add_friend  */
 const gchar *
 tox_faerr_to_string (gint32 error)
@@ -111,12 +264,16 @@ static NeulandToxDhtNode bootstrap_nodes[] = {
 
 enum {
   PROP_0,
+  PROP_BACKEND,
+  PROP_BACKEND_DATA,
   PROP_DATA_PATH,
   PROP_TOX_ID_HEX,
   PROP_NAME,
   PROP_STATUS,
   PROP_STATUS_MESSAGE,
   PROP_PENDING_REQUESTS,
+  PROP_UPLOAD_LIMIT,
+  PROP_CONTACT_UPLOAD_LIMIT,
   PROP_N
 };
 
@@ -169,18 +326,6 @@ free_data_friend_request (DataFriendRequest *data)
   g_free (data);
 }
 
-typedef struct
-{
-  NeulandTox *tox;
-  NeulandFileTransfer *file_transfer;
-} DataSendFileTransfer;
-
-static void
-free_data_send_file_transfer (DataSendFileTransfer *data)
-{
-  g_free (data);
-}
-
 typedef struct {
   gint32 contact_number;
   guint8 file_number;
@@ -196,21 +341,6 @@ free_data_file_send_request (DataFileSendRequest *data)
   g_free (data);
 }
 
-typedef struct
-{
-  NeulandTox *tox;
-  gint32 contact_number;
-  guint8 file_number;
-  GByteArray *data_array;
-} DataFileData;
-
-static void
-free_data_file_data (DataFileData *data)
-{
-  g_byte_array_free (data->data_array, TRUE);
-  g_free (data);
-}
-
 typedef struct
 {
   NeulandTox *tox;
@@ -231,27 +361,277 @@ free_data_file_control (DataFileControl *data)
 GList *
 neuland_tox_get_contacts (NeulandTox *tox)
 {
+  GPtrArray *contacts;
+  GList *list = NULL;
+  gint i;
+
   g_return_val_if_fail (NEULAND_IS_TOX (tox), NULL);
 
   g_debug ("neuland_tox_get_contacts ...");
-  return g_hash_table_get_values (tox->priv->contacts_ht);
+
+  contacts = tox->priv->contacts;
+  for (i = contacts->len - 1; i >= 0; i--)
+    if (g_ptr_array_index (contacts, i) != NULL)
+      list = g_list_prepend (list, g_ptr_array_index (contacts, i));
+
+  return list;
 }
 
 NeulandContact *
 neuland_tox_get_contact_by_number (NeulandTox *tox, gint64 number)
 {
+  GPtrArray *contacts;
+
   g_return_val_if_fail (NEULAND_IS_TOX (tox), NULL);
 
-  return  (g_hash_table_lookup (tox->priv->contacts_ht,
-                                GINT_TO_POINTER (number)));
+  contacts = tox->priv->contacts;
+  if (number < 0 || number >= contacts->len)
+    return NULL;
+
+  return g_ptr_array_index (contacts, number);
 }
 
 static void
-add_idle_with_data_string (GSourceFunc idle_func,
-                           gint32 contact_number,
-                           const guint8 *str,
-                           guint16 length,
-                           NeulandTox *tox)
+free_contact_slot (gpointer contact)
+{
+  if (contact != NULL)
+    g_object_unref (contact);
+}
+
+/* toxcore hands out friend numbers densely from 0 and reuses the
+   lowest free one, so they index @contacts directly. Takes over the
+   reference on @contact, which may be NULL to clear the slot. */
+static void
+neuland_tox_set_contact (NeulandTox *tox,
+                         gint64 number,
+                         NeulandContact *contact)
+{
+  GPtrArray *contacts = tox->priv->contacts;
+  NeulandContact *old;
+
+  g_return_if_fail (number >= 0 && number <= G_MAXINT32);
+
+  if (number >= contacts->len)
+    {
+      if (contact == NULL)
+        return;
+      g_ptr_array_set_size (contacts, number + 1);
+    }
+
+  old = g_ptr_array_index (contacts, number);
+  g_ptr_array_index (contacts, number) = contact;
+
+  /* Chat logs live next to the tox data, one per contact. Without a
+     data path, nothing is kept. */
+  if (contact != NULL && tox->priv->data_path != NULL &&
+      neuland_contact_get_chat_log (contact) == NULL)
+    {
+      gchar *path = g_strdup_printf ("%s.logs/%s.log", tox->priv->data_path,
+                                     neuland_contact_get_tox_id_hex (contact));
+      NeulandChatLog *chat_log = neuland_chat_log_new (path);
+
+      neuland_contact_set_chat_log (contact, chat_log);
+      if (tox->priv->search_index != NULL)
+        neuland_search_index_add_log (tox->priv->search_index,
+                                      neuland_contact_get_tox_id_hex (contact), chat_log);
+      g_object_unref (chat_log);
+      g_free (path);
+    }
+
+  if (old != NULL)
+    g_object_unref (old);
+}
+
+/* Makes the tox thread call tox_do() as soon as possible instead of
+   sleeping for the rest of the current tox_do_interval(). This is
+   safe to call from any thread. */
+static void
+neuland_tox_wakeup (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+
+  g_atomic_int_set (&priv->wakeup_pending, TRUE);
+  g_source_set_ready_time (priv->tox_do_source, 0);
+}
+
+typedef struct
+{
+  GSource source;
+  NeulandTox *tox;
+} NeulandToxSource;
+
+static gboolean
+neuland_tox_do_source_dispatch (GSource *source,
+                                GSourceFunc callback,
+                                gpointer user_data)
+{
+  NeulandTox *tox = ((NeulandToxSource *)source)->tox;
+  NeulandToxPrivate *priv = tox->priv;
+  guint32 interval;
+
+  /* Wakeups arriving while tox_do() runs must not be lost, so we
+     clear the flag before and check it again afterwards. */
+  g_atomic_int_set (&priv->wakeup_pending, FALSE);
+
+  priv->backend->iterate (priv->tox_struct);
+  interval = priv->backend->do_interval (priv->tox_struct);
+
+  /* tox_do() is what frees up room in toxcore's send queues, so this
+     is when a parked transfer scheduler gets to try again. */
+  if (priv->send_blocked)
+    {
+      priv->send_blocked = FALSE;
+      g_source_set_ready_time (priv->send_source, 0);
+    }
+
+  if (g_atomic_int_get (&priv->wakeup_pending))
+    g_source_set_ready_time (source, 0);
+  else
+    g_source_set_ready_time (source, g_get_monotonic_time () + (gint64) 1000 * interval);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs neuland_tox_do_source_funcs = {
+  NULL, /* prepare; we only use the ready time */
+  NULL, /* check */
+  neuland_tox_do_source_dispatch,
+  NULL, /* finalize */
+};
+
+/* Queues an event to be handled in the main loop by the handler for
+   @type, which also frees @data. Can be called from any thread. */
+static void
+neuland_tox_push_event (NeulandTox *tox,
+                        NeulandToxEventType type,
+                        gpointer data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  NeulandToxEvent *event = g_slice_new (NeulandToxEvent);
+
+  event->type = type;
+  event->push_time = g_get_monotonic_time ();
+  event->data = data;
+
+  g_async_queue_push (priv->events, event);
+  g_atomic_int_inc (&priv->events_pushed);
+
+  /* Only the first event after a drain has to wake up the main loop. */
+  if (g_atomic_int_compare_and_exchange (&priv->drain_scheduled, FALSE, TRUE))
+    g_source_set_ready_time (priv->drain_source, 0);
+}
+
+typedef gint (* NeulandToxCommandFunc) (NeulandTox *tox, gpointer data);
+typedef void (* NeulandToxCommandDoneFunc) (NeulandTox *tox, gint result, gpointer data);
+
+typedef struct
+{
+  NeulandTox *tox;
+  NeulandToxCommandFunc func;
+  NeulandToxCommandDoneFunc done_func;
+  gpointer data;
+  GDestroyNotify free_func;
+  gint result;
+} NeulandToxCommand;
+
+static void
+free_command (NeulandToxCommand *command)
+{
+  if (command->free_func != NULL)
+    command->free_func (command->data);
+
+  g_slice_free (NeulandToxCommand, command);
+}
+
+static gboolean
+on_command_done_idle (gpointer user_data)
+{
+  NeulandToxCommand *command = user_data;
+
+  command->done_func (command->tox, command->result, command->data);
+  free_command (command);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Runs in the tox thread */
+static gboolean
+neuland_tox_run_command (gpointer user_data)
+{
+  NeulandToxCommand *command = user_data;
+  NeulandTox *tox = command->tox;
+
+  command->result = command->func (tox, command->data);
+
+  /* Let toxcore send out whatever the command queued. */
+  neuland_tox_wakeup (tox);
+
+  if (command->done_func != NULL)
+    neuland_tox_push_event (tox, EVENT_COMMAND_DONE, command);
+  else
+    free_command (command);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Releases tox_context after the main thread ran something in it,
+   waking up the tox thread if it waits to start. */
+static void
+neuland_tox_release_context (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+
+  g_mutex_lock (&priv->context_mutex);
+  g_main_context_release (priv->tox_context);
+  g_cond_signal (&priv->context_cond);
+  g_mutex_unlock (&priv->context_mutex);
+}
+
+/* Queues @func to be run in the tox thread, which is the only thread
+   that may use priv->tox_struct while it is running. The return value
+   of @func is passed to @done_func (if not NULL) in the main loop
+   afterwards. @free_func is called for @data once the command is
+   done. This must only be called from the main thread.
+
+   Before the tox thread has been started, and after it has been
+   stopped, @func and @done_func are called right away. */
+static void
+neuland_tox_invoke (NeulandTox *tox,
+                    NeulandToxCommandFunc func,
+                    NeulandToxCommandDoneFunc done_func,
+                    gpointer data,
+                    GDestroyNotify free_func)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  NeulandToxCommand *command = g_slice_new0 (NeulandToxCommand);
+
+  command->tox = tox;
+  command->func = func;
+  command->done_func = done_func;
+  command->data = data;
+  command->free_func = free_func;
+
+  if (g_main_context_acquire (priv->tox_context))
+    {
+      command->result = func (tox, data);
+      neuland_tox_release_context (tox);
+
+      if (done_func != NULL)
+        done_func (tox, command->result, data);
+
+      free_command (command);
+    }
+  else
+    g_main_context_invoke_full (priv->tox_context, G_PRIORITY_DEFAULT,
+                                neuland_tox_run_command, command, NULL);
+}
+
+static void
+push_event_with_data_string (NeulandToxEventType type,
+                             gint32 contact_number,
+                             const guint8 *str,
+                             guint16 length,
+                             NeulandTox *tox)
 {
   DataStr *data = g_new0 (DataStr, 1);
 
@@ -259,14 +639,14 @@ add_idle_with_data_string (GSourceFunc idle_func,
   data->str = g_strndup ((gchar*)str, length);
   data->tox = tox;
 
-  g_idle_add (idle_func, data);
+  neuland_tox_push_event (tox, type, data);
 }
 
 static void
-add_idle_with_data_integer (GSourceFunc idle_func,
-                            gint32 contact_number,
-                            guint8 integer,
-                            NeulandTox *tox)
+push_event_with_data_integer (NeulandToxEventType type,
+                              gint32 contact_number,
+                              guint8 integer,
+                              NeulandTox *tox)
 {
   DataInt *data = g_new0 (DataInt, 1);
 
@@ -274,32 +654,274 @@ add_idle_with_data_integer (GSourceFunc idle_func,
   data->integer = integer;
   data->tox = tox;
 
-  g_idle_add (idle_func, data);
+  neuland_tox_push_event (tox, type, data);
+}
+
+/* A toxcore message that has no read receipt yet, only used in the
+   tox thread. Long text is sent as several of them, all with the
+   serial of the text. */
+typedef struct
+{
+  guint32 receipt;   /* 0 while it has to be sent (again) */
+  guint64 serial;
+  gboolean action;
+  gint64 sent_time;  /* monotonic time */
+  guint8 *data;
+  guint32 length;
+} InFlightChunk;
+
+/* The chunks in flight to one contact, in the order they were sent */
+typedef struct
+{
+  GQueue chunks;
+  GHashTable *chunks_ht; /* key: receipt -> value: chunk */
+  guint n_unsent;        /* chunks with receipt 0 */
+} InFlight;
+
+static void
+free_in_flight_chunk (InFlightChunk *chunk)
+{
+  g_free (chunk->data);
+  g_slice_free (InFlightChunk, chunk);
+}
+
+static void
+free_in_flight (gpointer data)
+{
+  InFlight *in_flight = data;
+
+  if (in_flight == NULL)
+    return;
+
+  g_queue_foreach (&in_flight->chunks, (GFunc) free_in_flight_chunk, NULL);
+  g_queue_clear (&in_flight->chunks);
+  g_hash_table_destroy (in_flight->chunks_ht);
+  g_slice_free (InFlight, in_flight);
+}
+
+/* Runs in the tox thread. Returns the chunks in flight to
+   @contact_number, or NULL if there are none and @create is FALSE. */
+static InFlight *
+neuland_tox_get_in_flight (NeulandTox *tox,
+                           gint32 contact_number,
+                           gboolean create)
+{
+  GPtrArray *in_flight_slots = tox->priv->in_flight;
+  InFlight *in_flight = NULL;
+
+  if (contact_number < 0)
+    return NULL;
+
+  if (contact_number < in_flight_slots->len)
+    in_flight = g_ptr_array_index (in_flight_slots, contact_number);
+
+  if (in_flight == NULL && create)
+    {
+      if (contact_number >= in_flight_slots->len)
+        g_ptr_array_set_size (in_flight_slots, contact_number + 1);
+      in_flight = g_slice_new0 (InFlight);
+      g_queue_init (&in_flight->chunks);
+      in_flight->chunks_ht = g_hash_table_new (NULL, NULL);
+      g_ptr_array_index (in_flight_slots, contact_number) = in_flight;
+    }
+
+  return in_flight;
 }
 
+/* Runs in the tox thread. Nothing of a removed contact will be
+   receipted anymore, and its number may be given to a new one. */
+static void
+neuland_tox_clear_in_flight (NeulandTox *tox,
+                             gint32 contact_number)
+{
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, FALSE);
+
+  if (in_flight == NULL)
+    return;
+
+  g_atomic_int_add (&tox->priv->in_flight_chunks, -(gint) in_flight->chunks.length);
+  free_in_flight (in_flight);
+  g_ptr_array_index (tox->priv->in_flight, contact_number) = NULL;
+}
+
+/* Runs in the tox thread. Returns: the message id toxcore uses for
+   the read receipt, 0 if sending failed. */
+static guint32
+neuland_tox_send_chunk (NeulandTox *tox,
+                        gint32 contact_number,
+                        gboolean action,
+                        const guint8 *data,
+                        guint32 length)
+{
+  const NeulandToxBackend *backend = tox->priv->backend;
+
+  if (action)
+    return backend->send_action (tox->priv->tox_struct, contact_number, data, length);
+  else
+    return backend->send_message (tox->priv->tox_struct, contact_number, data, length);
+}
+
+/* Runs in the tox thread. Chunks that failed to send are kept as
+   well, they are sent again with the others after reconnecting. */
+static void
+neuland_tox_track_chunk (NeulandTox *tox,
+                         gint32 contact_number,
+                         guint64 serial,
+                         gboolean action,
+                         const gchar *data,
+                         guint32 length,
+                         guint32 receipt)
+{
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, TRUE);
+  InFlightChunk *chunk;
+
+  if (in_flight == NULL)
+    return;
+
+  chunk = g_slice_new (InFlightChunk);
+  chunk->receipt = receipt;
+  chunk->serial = serial;
+  chunk->action = action;
+  chunk->sent_time = g_get_monotonic_time ();
+  chunk->data = g_memdup (data, length);
+  chunk->length = length;
+
+  g_queue_push_tail (&in_flight->chunks, chunk);
+  if (receipt != 0)
+    g_hash_table_insert (in_flight->chunks_ht, GUINT_TO_POINTER (receipt), chunk);
+  else
+    in_flight->n_unsent++;
+  g_atomic_int_inc (&tox->priv->in_flight_chunks);
+}
+
+/* Runs in the tox thread. Returns TRUE if chunks to @contact_number
+   are waiting to be sent again; new text has to wait behind them. */
 static gboolean
-on_connection_status_idle (gpointer user_data)
+neuland_tox_has_unsent (NeulandTox *tox,
+                        gint32 contact_number)
 {
-  DataInt *data = user_data;
-  NeulandTox *tox = data->tox;
-  NeulandContact *contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, FALSE);
 
-  if (contact != NULL)
-    neuland_contact_set_connected (contact, data->integer);
+  return in_flight != NULL && in_flight->n_unsent > 0;
+}
 
-  free_data_integer (data);
+/* Runs in the tox thread. Receipts for what was in flight when
+   @contact_number went offline won't come anymore, so all of it has
+   to be sent again; the contact may get some of it twice. The main
+   thread paces that, see neuland_tox_resend_func(). */
+static void
+neuland_tox_mark_unsent (NeulandTox *tox,
+                         gint32 contact_number)
+{
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, FALSE);
+  GList *l;
+
+  if (in_flight == NULL || g_queue_is_empty (&in_flight->chunks))
+    return;
+
+  g_debug ("Going to send %u unreceipted messages to contact %i again",
+           in_flight->chunks.length, contact_number);
+
+  g_hash_table_remove_all (in_flight->chunks_ht);
+  for (l = in_flight->chunks.head; l != NULL; l = l->next)
+    ((InFlightChunk *)l->data)->receipt = 0;
+  in_flight->n_unsent = in_flight->chunks.length;
+
+  push_event_with_data_integer (EVENT_RESEND_PENDING, contact_number, 0, tox);
+}
+
+typedef struct {
+  gint32 contact_number;
+  guint64 serial;
+  gint64 latency;     /* microseconds */
+  gboolean delivered; /* TRUE if it was the last chunk of its text */
+  NeulandTox *tox;
+} DataReceipt;
+
+static void
+free_data_receipt (DataReceipt *data)
+{
+  g_free (data);
+}
+
+static gboolean
+on_read_receipt_idle (gpointer user_data)
+{
+  DataReceipt *data = user_data;
+  NeulandToxDeliveryStats *stats = &data->tox->priv->delivery_stats;
+  NeulandContact *contact;
+  guint bucket;
+
+  bucket = data->latency < 1000 ? 0 : g_bit_storage (data->latency / 1000);
+  stats->latency_histogram[MIN (bucket, NEULAND_TOX_LATENCY_BUCKETS - 1)]++;
+
+  if (data->delivered)
+    {
+      stats->delivered++;
+
+      contact = neuland_tox_get_contact_by_number (data->tox, data->contact_number);
+      if (contact != NULL)
+        neuland_contact_signal_outgoing_delivered (contact, data->serial);
+    }
+
+  free_data_receipt (data);
 
   return G_SOURCE_REMOVE;
 }
 
+/* Runs in the tox thread */
+static void
+on_read_receipt (Tox *tox_struct,
+                 gint32 contact_number,
+                 guint32 receipt,
+                 gpointer user_data)
+{
+  NeulandTox *tox = NEULAND_TOX (user_data);
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, FALSE);
+  InFlightChunk *chunk;
+  DataReceipt *data;
+  GList *l;
+
+  if (in_flight == NULL ||
+      (chunk = g_hash_table_lookup (in_flight->chunks_ht, GUINT_TO_POINTER (receipt))) == NULL)
+    return;
+
+  g_hash_table_remove (in_flight->chunks_ht, GUINT_TO_POINTER (receipt));
+  g_queue_remove (&in_flight->chunks, chunk);
+  g_atomic_int_add (&tox->priv->in_flight_chunks, -1);
+
+  data = g_new0 (DataReceipt, 1);
+  data->contact_number = contact_number;
+  data->serial = chunk->serial;
+  data->latency = g_get_monotonic_time () - chunk->sent_time;
+  data->delivered = TRUE;
+  data->tox = tox;
+
+  /* The text is delivered once none of its chunks is left */
+  for (l = in_flight->chunks.head; l != NULL; l = l->next)
+    if (((InFlightChunk *)l->data)->serial == chunk->serial)
+      {
+        data->delivered = FALSE;
+        break;
+      }
+
+  free_in_flight_chunk (chunk);
+
+  neuland_tox_push_event (tox, EVENT_READ_RECEIPT, data);
+}
+
 static void
 on_connection_status (Tox *tox_struct,
                       gint32 contact_number,
                       guint8 status,
                       gpointer user_data)
 {
-  add_idle_with_data_integer (on_connection_status_idle, contact_number,
-                              status, NEULAND_TOX (user_data));
+  /* Before the status event, so that new text waits for them */
+  if (status)
+    neuland_tox_mark_unsent (NEULAND_TOX (user_data), contact_number);
+
+  push_event_with_data_integer (EVENT_CONNECTION_STATUS, contact_number,
+                                status, NEULAND_TOX (user_data));
 }
 
 static gboolean
@@ -322,8 +944,8 @@ on_user_status (Tox *tox_struct,
                 guint8 status,
                 void *user_data)
 {
-  add_idle_with_data_integer (on_user_status_idle, contact_number,
-                              status, NEULAND_TOX (user_data));
+  push_event_with_data_integer (EVENT_USER_STATUS, contact_number,
+                                status, NEULAND_TOX (user_data));
 }
 
 static gboolean
@@ -351,8 +973,8 @@ on_name_change (Tox *tox_struct,
                 gpointer user_data)
 {
 
-  add_idle_with_data_string (on_name_change_idle, contact_number,
-                             new_name, length, NEULAND_TOX (user_data));
+  push_event_with_data_string (EVENT_NAME_CHANGE, contact_number,
+                               new_name, length, NEULAND_TOX (user_data));
 }
 
 static gboolean
@@ -377,8 +999,27 @@ on_status_message (Tox *tox_struct,
                    guint16 length,
                    gpointer user_data)
 {
-  add_idle_with_data_string (on_status_message_idle, contact_number,
-                             new_message, length, NEULAND_TOX (user_data));
+  push_event_with_data_string (EVENT_STATUS_MESSAGE, contact_number,
+                               new_message, length, NEULAND_TOX (user_data));
+}
+
+/* Appends to the chat log of @contact, if it has one */
+static void
+neuland_tox_log_text (NeulandTox *tox,
+                      NeulandContact *contact,
+                      NeulandChatLogEntryType type,
+                      gboolean outgoing,
+                      const gchar *text)
+{
+  NeulandChatLog *chat_log = neuland_contact_get_chat_log (contact);
+
+  if (chat_log == NULL)
+    return;
+
+  neuland_chat_log_append (chat_log, type, outgoing, g_get_real_time (), text);
+  if (tox->priv->search_index != NULL)
+    neuland_search_index_update (tox->priv->search_index,
+                                 neuland_contact_get_tox_id_hex (contact));
 }
 
 static gboolean
@@ -389,6 +1030,11 @@ on_contact_message_idle (gpointer user_data)
   NeulandContact *contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
 
   neuland_contact_signal_incoming_message (contact, data->str);
+
+  /* Only queued here, and after the chat widget is set up, so that
+     a widget created for this message doesn't load it a second time
+     from the log. */
+  neuland_tox_log_text (tox, contact, NEULAND_CHAT_LOG_ENTRY_MESSAGE, FALSE, data->str);
   free_data_str (data);
 
   return G_SOURCE_REMOVE;
@@ -401,8 +1047,8 @@ on_contact_message (Tox *tox_struct,
                     guint16 length,
                     gpointer user_data)
 {
-  add_idle_with_data_string (on_contact_message_idle, contact_number,
-                             message, length, NEULAND_TOX (user_data));
+  push_event_with_data_string (EVENT_CONTACT_MESSAGE, contact_number,
+                               message, length, NEULAND_TOX (user_data));
 }
 
 static gboolean
@@ -413,6 +1059,9 @@ on_contact_action_idle (gpointer user_data)
   NeulandContact *contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
 
   neuland_contact_signal_incoming_action (contact, data->str);
+
+  /* See on_contact_message_idle() */
+  neuland_tox_log_text (tox, contact, NEULAND_CHAT_LOG_ENTRY_ACTION, FALSE, data->str);
   free_data_str (data);
 
   return G_SOURCE_REMOVE;
@@ -425,8 +1074,8 @@ on_contact_action (Tox *tox_struct,
                    guint16 length,
                    gpointer user_data)
 {
-  add_idle_with_data_string (on_contact_action_idle, contact_number,
-                             action, length, NEULAND_TOX (user_data));
+  push_event_with_data_string (EVENT_CONTACT_ACTION, contact_number,
+                               action, length, NEULAND_TOX (user_data));
 }
 
 static gboolean
@@ -450,49 +1099,42 @@ on_typing_change (Tox *tox_struct,
                   guint8 is_typing,
                   gpointer user_data)
 {
-  add_idle_with_data_integer (on_typing_change_idle, contact_number,
-                              is_typing, NEULAND_TOX (user_data));
+  push_event_with_data_integer (EVENT_TYPING_CHANGE, contact_number,
+                                is_typing, NEULAND_TOX (user_data));
 }
 
+typedef struct
+{
+  gint32 contact_number;
+  gchar *text;
+  NeulandToxSendType type;
+  guint64 serial;
+} DataSend;
+
 static void
-neuland_tox_send (NeulandTox *tox,
-                  NeulandContact *contact,
-                  gchar *text,
-                  NeulandToxSendType type)
+free_data_send (DataSend *data)
 {
-  NeulandToxPrivate *priv;
-  gint contact_number;
+  g_free (data->text);
+  g_free (data);
+}
+
+/* Runs in the tox thread */
+static gint
+neuland_tox_send_func (NeulandTox *tox,
+                       gpointer user_data)
+{
+  DataSend *data = user_data;
+  gchar *text = data->text;
+  gboolean held_back = neuland_tox_has_unsent (tox, data->contact_number);
   gint64 total_bytes = strlen (text);
-  gchar *preview;
-  gint preview_bytes;
-  gchar *format_string;
   gint64 sent_bytes;
 
-  g_return_if_fail (NEULAND_IS_TOX (tox));
-  g_return_if_fail (NEULAND_IS_CONTACT (contact));
-
-  priv = tox->priv;
-  contact_number = neuland_contact_get_number (contact);
-  preview = g_utf8_substring (text, 0, MIN (g_utf8_strlen (text, 40), 10));
-  preview_bytes = strlen (preview);
-
-  if (type == SEND_TYPE_MESSAGE)
-    format_string = "neuland_tox_send message to contact %p: \"%s%s\"";
-  else if (type == SEND_TYPE_ACTION)
-    format_string = "neuland_tox_send action to contact %p: \"%s%s\"";
-  else
-    {
-      g_warning ("Unknown NeulandToxSendType enum value: %i", type);
-      g_return_if_reached ();
-    }
-
-  g_debug (format_string, contact, preview, preview_bytes < total_bytes ? "..." : "");
-
   sent_bytes = 0;
   while (sent_bytes < total_bytes)
     {
       gint64 remaining_bytes = total_bytes - sent_bytes;
       gint64 bytes;
+      guint32 receipt;
       /* Start address of the first char we will be sending in *this* loop run */
       gchar *first_char = text + sent_bytes;
 
@@ -514,40 +1156,430 @@ neuland_tox_send (NeulandTox *tox,
       g_debug ("neuland_tox_send: Sending %i of %i bytes (bytes %i to %i)",
                bytes, total_bytes, sent_bytes + 1, sent_bytes + bytes);
 
-      g_mutex_lock (&priv->mutex);
-
-      if (type == SEND_TYPE_MESSAGE)
-        tox_send_message (priv->tox_struct, contact_number,
-                          (guint8*)first_char, bytes);
-      else if (type == SEND_TYPE_ACTION)
-        tox_send_action (priv->tox_struct, contact_number,
-                         (guint8*)first_char, bytes);
+      /* Once a chunk failed, the rest waits to keep the order */
+      receipt = 0;
+      if (!held_back)
+        receipt = neuland_tox_send_chunk (tox, data->contact_number,
+                                          data->type == SEND_TYPE_ACTION,
+                                          (guint8*)first_char, bytes);
+      if (receipt == 0)
+        held_back = TRUE;
 
-      g_mutex_unlock (&priv->mutex);
+      neuland_tox_track_chunk (tox, data->contact_number, data->serial,
+                               data->type == SEND_TYPE_ACTION,
+                               first_char, bytes, receipt);
 
       sent_bytes = sent_bytes + bytes;
     }
 
+  if (held_back)
+    push_event_with_data_integer (EVENT_RESEND_PENDING, data->contact_number, 0, tox);
+
+  return 0;
+}
+
+static void
+neuland_tox_send (NeulandTox *tox,
+                  NeulandContact *contact,
+                  gchar *text,
+                  NeulandToxSendType type,
+                  guint64 serial)
+{
+  DataSend *data;
+  gint64 total_bytes = strlen (text);
+  gchar *preview;
+  gint preview_bytes;
+  gchar *format_string;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (NEULAND_IS_CONTACT (contact));
+
+  preview = g_utf8_substring (text, 0, MIN (g_utf8_strlen (text, 40), 10));
+  preview_bytes = strlen (preview);
+
+  if (type == SEND_TYPE_MESSAGE)
+    format_string = "neuland_tox_send message to contact %p: \"%s%s\"";
+  else if (type == SEND_TYPE_ACTION)
+    format_string = "neuland_tox_send action to contact %p: \"%s%s\"";
+  else
+    {
+      g_warning ("Unknown NeulandToxSendType enum value: %i", type);
+      g_free (preview);
+      g_return_if_reached ();
+    }
+
+  g_debug (format_string, contact, preview, preview_bytes < total_bytes ? "..." : "");
+
+  data = g_new0 (DataSend, 1);
+  data->contact_number = neuland_contact_get_number (contact);
+  data->text = g_strdup (text);
+  data->type = type;
+  data->serial = serial;
+
+  neuland_tox_invoke (tox, neuland_tox_send_func, NULL,
+                      data, (GDestroyNotify) free_data_send);
+
   g_free (preview);
 }
 
+/* Writes the outgoing queues of all contacts next to the tox data,
+   one group per contact. */
+static void
+neuland_tox_save_outgoing_queues (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  GKeyFile *key_file;
+  gchar *data;
+  gsize length;
+  GError *error = NULL;
+  guint i;
+
+  if (priv->outgoing_path == NULL)
+    return;
+
+  key_file = g_key_file_new ();
+
+  for (i = 0; i < priv->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (priv->contacts, i);
+      GList *queued;
+      GList *l;
+      const gchar **texts;
+      gint *types;
+      gsize n;
+
+      if (contact == NULL || (queued = neuland_contact_get_outgoing (contact)) == NULL)
+        continue;
+
+      n = g_list_length (queued);
+      texts = g_new (const gchar *, n);
+      types = g_new (gint, n);
+      for (l = queued, n = 0; l != NULL; l = l->next, n++)
+        {
+          NeulandOutgoing *outgoing = l->data;
+
+          texts[n] = outgoing->text;
+          types[n] = outgoing->type;
+        }
+
+      g_key_file_set_integer_list (key_file, neuland_contact_get_tox_id_hex (contact),
+                                   "types", types, n);
+      g_key_file_set_string_list (key_file, neuland_contact_get_tox_id_hex (contact),
+                                  "texts", texts, n);
+      g_free (texts);
+      g_free (types);
+    }
+
+  data = g_key_file_to_data (key_file, &length, NULL);
+
+  if (length == 0)
+    g_unlink (priv->outgoing_path);
+  else if (!g_file_set_contents (priv->outgoing_path, data, length, &error))
+    {
+      g_warning ("Saving outgoing messages to \"%s\" failed: %s",
+                 priv->outgoing_path, error->message);
+      g_error_free (error);
+    }
+
+  g_free (data);
+  g_key_file_free (key_file);
+}
+
+static gboolean
+neuland_tox_save_outgoing_timeout (gpointer user_data)
+{
+  NeulandTox *tox = NEULAND_TOX (user_data);
+
+  tox->priv->outgoing_save_id = 0;
+  neuland_tox_save_outgoing_queues (tox);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Saves the outgoing queues a little later, so that a burst of queued
+   or sent messages only writes them once. neuland_tox_save_and_kill()
+   saves them if that is still pending. */
+static void
+neuland_tox_queue_save_outgoing (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+
+  if (priv->outgoing_path == NULL || priv->outgoing_save_id != 0)
+    return;
+
+  priv->outgoing_save_id = g_timeout_add_seconds (OUTGOING_SAVE_DELAY,
+                                                  neuland_tox_save_outgoing_timeout,
+                                                  tox);
+}
+
+/* Loads the messages that couldn't be sent in the last session */
+static void
+neuland_tox_load_outgoing_queues (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  GKeyFile *key_file;
+  GError *error = NULL;
+  guint i;
+
+  if (priv->data_path == NULL)
+    return;
+
+  priv->outgoing_path = g_strconcat (priv->data_path, ".outgoing", NULL);
+  key_file = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (key_file, priv->outgoing_path,
+                                  G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Loading outgoing messages \"%s\" failed: %s",
+                   priv->outgoing_path, error->message);
+      g_error_free (error);
+      g_key_file_free (key_file);
+      return;
+    }
+
+  for (i = 0; i < priv->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (priv->contacts, i);
+      const gchar *group;
+      gchar **texts;
+      gint *types;
+      gsize n_texts = 0;
+      gsize n_types = 0;
+      gsize j;
+
+      if (contact == NULL)
+        continue;
+
+      group = neuland_contact_get_tox_id_hex (contact);
+      texts = g_key_file_get_string_list (key_file, group, "texts", &n_texts, NULL);
+      types = g_key_file_get_integer_list (key_file, group, "types", &n_types, NULL);
+
+      /* Serials don't survive a restart, but the chunks of a message
+         that has to be sent again are told apart by them. */
+      for (j = 0; j < MIN (n_texts, n_types); j++)
+        neuland_contact_queue_outgoing (contact, types[j],
+                                        neuland_contact_next_outgoing_serial (contact),
+                                        texts[j]);
+
+      if (n_texts != n_types)
+        g_warning ("Outgoing messages for contact %s are damaged", group);
+
+      g_strfreev (texts);
+      g_free (types);
+    }
+
+  g_key_file_free (key_file);
+}
+
+typedef struct
+{
+  NeulandTox *tox;
+  NeulandContact *contact;
+} DataOutgoingFlush;
+
+static void
+free_data_outgoing_flush (DataOutgoingFlush *data)
+{
+  g_object_unref (data->contact);
+  g_free (data);
+}
+
+typedef enum {
+  RESEND_NONE,
+  RESEND_PENDING,
+  RESEND_RUNNING
+} ResendState;
+
+/* Runs in the tox thread. Sends the chunks of the oldest text that
+   has to be sent (again), stopping at the first that fails. Returns:
+   the number of chunks still waiting. */
+static gint
+neuland_tox_resend_func (NeulandTox *tox,
+                         gpointer user_data)
+{
+  gint32 contact_number = GPOINTER_TO_INT (user_data);
+  InFlight *in_flight = neuland_tox_get_in_flight (tox, contact_number, FALSE);
+  InFlightChunk *chunk = NULL;
+  guint64 serial = 0;
+  GList *l;
+
+  if (in_flight == NULL)
+    return 0;
+
+  for (l = in_flight->chunks.head; l != NULL; l = l->next)
+    if (((InFlightChunk *)l->data)->receipt == 0)
+      break;
+
+  if (l != NULL)
+    serial = ((InFlightChunk *)l->data)->serial;
+
+  for (; l != NULL && (chunk = l->data)->serial == serial; l = l->next)
+    {
+      if (chunk->receipt != 0)
+        continue;
+
+      chunk->receipt = neuland_tox_send_chunk (tox, contact_number, chunk->action,
+                                               chunk->data, chunk->length);
+      if (chunk->receipt == 0)
+        break;
+
+      chunk->sent_time = g_get_monotonic_time ();
+      g_hash_table_insert (in_flight->chunks_ht, GUINT_TO_POINTER (chunk->receipt), chunk);
+      in_flight->n_unsent--;
+      g_atomic_int_inc (&tox->priv->retransmitted);
+    }
+
+  return in_flight->n_unsent;
+}
+
+static void
+neuland_tox_resend_done (NeulandTox *tox,
+                         gint ret,
+                         gpointer user_data)
+{
+  if (ret == 0)
+    g_hash_table_remove (tox->priv->resends_ht, user_data);
+  else
+    g_hash_table_insert (tox->priv->resends_ht, user_data,
+                         GINT_TO_POINTER (RESEND_PENDING));
+}
+
+/* Sends one queued message per run, so that toxcore's send queue
+   isn't flooded after reconnecting. Messages that have to be sent
+   again go first, they are older. Stops once nothing is left or the
+   contact went offline again. */
+static gboolean
+neuland_tox_outgoing_timeout (gpointer user_data)
+{
+  DataOutgoingFlush *data = user_data;
+  NeulandTox *tox = data->tox;
+  NeulandContact *contact = data->contact;
+  NeulandOutgoing *outgoing = NULL;
+  gpointer number = GINT_TO_POINTER (neuland_contact_get_number (contact));
+  ResendState resend;
+
+  if (tox->priv->is_running && neuland_contact_get_connected (contact))
+    {
+      resend = GPOINTER_TO_INT (g_hash_table_lookup (tox->priv->resends_ht, number));
+
+      /* Wait for the running resend to tell what is left */
+      if (resend == RESEND_RUNNING)
+        return G_SOURCE_CONTINUE;
+
+      if (resend == RESEND_PENDING)
+        {
+          g_hash_table_insert (tox->priv->resends_ht, number,
+                               GINT_TO_POINTER (RESEND_RUNNING));
+          neuland_tox_invoke (tox, neuland_tox_resend_func, neuland_tox_resend_done,
+                              number, NULL);
+          return G_SOURCE_CONTINUE;
+        }
+
+      outgoing = neuland_contact_pop_outgoing (contact);
+    }
+
+  if (outgoing == NULL)
+    {
+      g_hash_table_remove (tox->priv->outgoing_flushes_ht, contact);
+      return G_SOURCE_REMOVE;
+    }
+
+  neuland_tox_send (tox, contact, outgoing->text,
+                    outgoing->type == NEULAND_CHAT_LOG_ENTRY_ACTION ?
+                    SEND_TYPE_ACTION : SEND_TYPE_MESSAGE,
+                    outgoing->serial);
+  neuland_outgoing_free (outgoing);
+  neuland_tox_queue_save_outgoing (tox);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Starts sending @contact's queued messages and those that have to
+   be sent again, unless that's already happening */
+static void
+neuland_tox_flush_outgoing_queue (NeulandTox *tox,
+                                  NeulandContact *contact)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  DataOutgoingFlush *data;
+  guint source_id;
+
+  if ((neuland_contact_get_outgoing (contact) == NULL &&
+       !g_hash_table_contains (priv->resends_ht,
+                               GINT_TO_POINTER (neuland_contact_get_number (contact)))) ||
+      g_hash_table_contains (priv->outgoing_flushes_ht, contact))
+    return;
+
+  data = g_new0 (DataOutgoingFlush, 1);
+  data->tox = tox;
+  data->contact = g_object_ref (contact);
+
+  source_id = g_timeout_add_full (G_PRIORITY_DEFAULT, OUTGOING_QUEUE_INTERVAL,
+                                  neuland_tox_outgoing_timeout,
+                                  data, (GDestroyNotify) free_data_outgoing_flush);
+  g_hash_table_insert (priv->outgoing_flushes_ht, contact, GUINT_TO_POINTER (source_id));
+}
+
+/* Text for an offline contact, or for one whose queue isn't empty
+   yet or who has messages to be sent again, is queued to keep the
+   order. It is logged right away, like everything shown in the
+   chat. */
+static void
+neuland_tox_send_or_queue (NeulandTox *tox,
+                           NeulandContact *contact,
+                           gchar *text,
+                           NeulandChatLogEntryType type,
+                           guint64 serial)
+{
+  if (neuland_contact_get_connected (contact) &&
+      neuland_contact_get_outgoing (contact) == NULL &&
+      !g_hash_table_contains (tox->priv->resends_ht,
+                              GINT_TO_POINTER (neuland_contact_get_number (contact))))
+    neuland_tox_send (tox, contact, text,
+                      type == NEULAND_CHAT_LOG_ENTRY_ACTION ?
+                      SEND_TYPE_ACTION : SEND_TYPE_MESSAGE,
+                      serial);
+  else
+    {
+      neuland_contact_queue_outgoing (contact, type, serial, text);
+      neuland_tox_queue_save_outgoing (tox);
+      if (neuland_contact_get_connected (contact))
+        neuland_tox_flush_outgoing_queue (tox, contact);
+    }
+
+  neuland_tox_log_text (tox, contact, type, TRUE, text);
+}
+
 static void
 on_outgoing_message_cb (NeulandContact *contact,
                         gchar *message,
+                        guint64 serial,
                         gpointer user_data)
 {
   NeulandTox *tox = NEULAND_TOX (user_data);
-  neuland_tox_send (tox, contact, message, SEND_TYPE_MESSAGE);
+  neuland_tox_send_or_queue (tox, contact, message, NEULAND_CHAT_LOG_ENTRY_MESSAGE, serial);
 }
 
-
 static void
 on_outgoing_action_cb (NeulandContact *contact,
                        gchar *action,
+                       guint64 serial,
                        gpointer user_data)
 {
   NeulandTox *tox = NEULAND_TOX (user_data);
-  neuland_tox_send (tox, contact, action, SEND_TYPE_ACTION);
+  neuland_tox_send_or_queue (tox, contact, action, NEULAND_CHAT_LOG_ENTRY_ACTION, serial);
+}
+
+/* Runs in the tox thread */
+static gint
+set_user_is_typing_func (NeulandTox *tox,
+                         gpointer user_data)
+{
+  DataInt *data = user_data;
+
+  return tox->priv->backend->set_user_is_typing (tox->priv->tox_struct,
+                                                 data->contact_number, data->integer);
 }
 
 static void
@@ -557,15 +1589,14 @@ on_show_typing_cb (GObject *obj,
 {
   NeulandContact *contact = NEULAND_CONTACT (obj);
   NeulandTox *tox = NEULAND_TOX (user_data);
-  NeulandToxPrivate *priv = tox->priv;
-
-  g_mutex_lock (&priv->mutex);
+  DataInt *data = g_new0 (DataInt, 1);
 
-  tox_set_user_is_typing (priv->tox_struct,
-                          neuland_contact_get_number (contact),
-                          neuland_contact_get_show_typing (contact));
+  data->contact_number = neuland_contact_get_number (contact);
+  data->integer = neuland_contact_get_show_typing (contact);
+  data->tox = tox;
 
-  g_mutex_unlock (&priv->mutex);
+  neuland_tox_invoke (tox, set_user_is_typing_func, NULL,
+                      data, (GDestroyNotify) free_data_integer);
 }
 
 static gboolean
@@ -614,16 +1645,23 @@ on_friend_request (Tox *tox_struct,
   data->message = g_strndup ((gchar*)message, length);
   data->tox = NEULAND_TOX (user_data);
 
-  g_idle_add (on_friend_request_idle, data);
+  neuland_tox_push_event (data->tox, EVENT_FRIEND_REQUEST, data);
 }
 
 typedef struct
 {
   NeulandFileTransfer *file_transfer;
   NeulandFileTransferState state;
-  guint64 transferred_size;
+  guint64 discarded_size;       /* restored bytes thrown away, if not 0 */
 } DataUpdateFileTransferIdle;
 
+static void
+free_data_update_file_transfer (DataUpdateFileTransferIdle *data)
+{
+  g_object_unref (data->file_transfer);
+  g_free (data);
+}
+
 /* This GSourceFunc is used to make the desired property changes for
    file_transfer inside the main loop. */
 static gboolean
@@ -632,10 +1670,6 @@ neuland_tox_update_file_transfer_idle (gpointer user_data)
   DataUpdateFileTransferIdle *data = (DataUpdateFileTransferIdle *)user_data;
   NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (data->file_transfer);
   NeulandFileTransferState state = data->state;
-  guint64 transferred_size = data->transferred_size;
-
-  if (transferred_size)
-    neuland_file_transfer_add_transferred_size (file_transfer, transferred_size);
 
   if (state) /*  The enum has: NEULAND_FILE_TRANSFER_STATE_NONE = 0 */
     {
@@ -647,145 +1681,1086 @@ neuland_tox_update_file_transfer_idle (gpointer user_data)
       neuland_file_transfer_set_requested_state (file_transfer, state);
     }
 
-  g_object_unref (file_transfer);
-  g_free (user_data);
+  if (data->discarded_size > 0)
+    neuland_file_transfer_discard_restored_size (file_transfer, data->discarded_size);
+
+  free_data_update_file_transfer (data);
 
   return G_SOURCE_REMOVE;
 }
 
-gpointer
-neuland_tox_send_file_transfer (gpointer user_data)
+/* A block of file data read ahead for an outgoing transfer. Packets
+   are sent straight from @data, @offset is where the next one
+   starts. */
+typedef struct
 {
-  DataSendFileTransfer *data = (DataSendFileTransfer*)user_data;
-  NeulandTox *tox = NEULAND_TOX (data->tox);
-  NeulandToxPrivate *priv = tox->priv;
-  NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (data->file_transfer);
-
-  gint64 contact_number = neuland_file_transfer_get_contact_number (file_transfer);
-  guint8 file_number = neuland_file_transfer_get_file_number (file_transfer);
-  const gchar *name = neuland_file_transfer_get_file_name (file_transfer);
-  guint64 total_file_size = neuland_file_transfer_get_file_size (file_transfer);
-  gboolean resuming = neuland_file_transfer_get_transferred_size (file_transfer) > 0;
-  DataUpdateFileTransferIdle *idle_out_data = g_new0 (DataUpdateFileTransferIdle, 1);
+  guint8 *data;
+  gsize length;
+  gsize offset;
+} ReadBlock;
+
+/* An outgoing transfer in the transfer scheduler. Its data comes
+   either from @mapped_file, starting at @position, or from the blocks
+   read ahead into @blocks. @packet points into either and holds
+   @count bytes that toxcore did not take yet. A transfer is
+   referenced by the scheduler and by a read in flight. */
+typedef struct
+{
+  gint ref_count;
+  NeulandFileTransfer *file_transfer;
+  guint8 file_number;
+  GMappedFile *mapped_file;
+  guint64 position;
+  GQueue blocks;
+  guint8 *packet;
   gsize count;
-  gpointer data_buffer = NULL;
+  gboolean small;
+  gboolean reading;
+  gboolean resuming;
+  gboolean eof;
+  gboolean failed;
+  gboolean removed;
+} SendTransfer;
+
+/* The active outgoing transfers of one contact, small ones first. */
+typedef struct
+{
+  NeulandTox *tox;
+  gint32 contact_number;
+  GQueue transfers;
+  TokenBucket bucket;
+} SendQueue;
 
-  g_debug ("Starting thread for file transfer %p \"%s\"", file_transfer, name);
+typedef struct
+{
+  NeulandTox *tox;
+  SendTransfer *transfer;
+  ReadBlock *block;
+  gboolean seek;
+  gssize count;
+} ReadJob;
 
-  idle_out_data->file_transfer = g_object_ref (file_transfer);
+typedef enum {
+  SEND_RESULT_SENT,
+  SEND_RESULT_BLOCKED,
+  SEND_RESULT_WAITING,
+  SEND_RESULT_DONE
+} SendResult;
 
-  if (resuming)
-    neuland_file_transfer_prepare_resume_sending (file_transfer);
+static void
+token_bucket_set_rate (TokenBucket *bucket,
+                       guint64 rate)
+{
+  bucket->rate = rate;
+  bucket->tokens = 0;
+  bucket->last_refill = g_get_monotonic_time ();
+}
 
-  while (TRUE)
-    {
-      gsize data_size;
+static void
+token_bucket_refill (TokenBucket *bucket,
+                     gint64 now)
+{
+  gdouble size;
+
+  if (bucket->rate == 0)
+    return;
 
-      g_mutex_lock (&priv->mutex);
-      data_size = (gsize)tox_file_data_size (priv->tox_struct, contact_number);
-      g_mutex_unlock (&priv->mutex);
+  size = MAX ((gdouble)bucket->rate * TOKEN_BUCKET_BURST / G_USEC_PER_SEC,
+              MIN_TOKEN_BUCKET_SIZE);
+  bucket->tokens = MIN (bucket->tokens +
+                        (gdouble)bucket->rate * (now - bucket->last_refill) / G_USEC_PER_SEC,
+                        size);
+  bucket->last_refill = now;
+}
 
-      g_assert (data_size > 0);
+/* Returns the microseconds until @bucket allows sending again, 0 if
+   it does now. */
+static gint64
+token_bucket_get_wait (TokenBucket *bucket)
+{
+  if (bucket->rate == 0 || bucket->tokens >= 0)
+    return 0;
 
-      g_clear_pointer (&data_buffer, g_free);
-      data_buffer = g_malloc0 (data_size);
+  return (gint64)(-bucket->tokens * G_USEC_PER_SEC / bucket->rate) + 1;
+}
 
-      count = neuland_file_transfer_get_next_data (file_transfer, data_buffer, data_size);
+static void
+token_bucket_consume (TokenBucket *bucket,
+                      gsize size)
+{
+  if (bucket->rate != 0)
+    bucket->tokens -= size;
+}
 
-      if (count == -1)
-        {
-          g_debug ("Failed to get next data for file transfer %p \"%s\", "
-                   "going to kill transfer.", file_transfer, name);
-          idle_out_data->state = NEULAND_FILE_TRANSFER_STATE_ERROR;
-          goto out;
-        }
+/* Runs in the tox thread, like everything handling ReadBlocks and
+   SendTransfers below unless noted otherwise. */
+static ReadBlock *
+neuland_tox_get_read_block (NeulandTox *tox)
+{
+  ReadBlock *block = g_queue_pop_head (&tox->priv->free_blocks);
 
-      if (count != 0)
-        {
-          gint fails = 0;
-          while (TRUE)
-            {
-              gint ret;
-              switch (neuland_file_transfer_get_state (file_transfer))
-                {
-                case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US:
-                  g_debug ("File transfer %p \"%s\" has been killed by us, "
-                           "going to leave sending thread", file_transfer, name);
-                  goto out;
-                  break;
-
-                case NEULAND_FILE_TRANSFER_STATE_KILLED_BY_CONTACT:
-                  g_debug ("File transfer %p \"%s\" has been killed by contact, "
-                           "going to leave sending thread", file_transfer, name);
-                  goto out;
-                  break;
-
-                case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US:
-                  g_debug ("File transfer %p \"%s\" has been paused by us, "
-                           "going to leave sending thread", file_transfer, name);
-                  goto out;
-                  break;
-
-                case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT:
-                  g_debug ("File transfer %p \"%s\" has been paused by contact, "
-                           "going to leave sending thread", file_transfer, name);
-                  goto out;
-                  break;
-
-                default:
-                  break;
-                }
+  if (block == NULL)
+    {
+      block = g_slice_new0 (ReadBlock);
+      block->data = g_malloc (READ_AHEAD_BLOCK_SIZE);
+    }
 
-              g_mutex_lock (&priv->mutex);
-              ret = tox_file_send_data (priv->tox_struct, contact_number,
-                                        file_number, data_buffer, (gint)count);
-              g_mutex_unlock (&priv->mutex);
+  block->length = 0;
+  block->offset = 0;
 
-              if (ret == 0)
-                {
-                  /* Set "transferred-size" property in the main loop. */
-                  DataUpdateFileTransferIdle *data = g_new0 (DataUpdateFileTransferIdle, 1);
-                  data->file_transfer = g_object_ref (file_transfer);
-                  data->transferred_size = count;
-                  g_idle_add (neuland_tox_update_file_transfer_idle, data);
-                  break; /* for loop */
-                }
-              else
-                {
-                  if (++fails >= MAX_SEND_DATA_ATTEMPTS)
-                    {
-                      g_warning ("Going to stop sending transfer %p \"%s\" after "
-                                 "%i failed tox_file_send_data() calls.",
-                                 file_transfer, name, fails);
-                      idle_out_data->state = NEULAND_FILE_TRANSFER_STATE_ERROR;
-                      goto out;
-                    }
+  return block;
+}
 
-                  /* g_debug ("tox_file_send_data() failed, trying again later"); */
-                  g_usleep (1000);
-                }
-            }
-        }
-      else /* count == 0 */
-        {
-          g_debug ("Thread for file transfer %p \"%s\" finished transferring data",
-                   file_transfer, name);
-          idle_out_data->state = NEULAND_FILE_TRANSFER_STATE_FINISHED;
-          goto out;
-        }
-    }
+static void
+free_read_block (ReadBlock *block)
+{
+  g_free (block->data);
+  g_slice_free (ReadBlock, block);
+}
 
- out:
-  /* Apply the changes to @file_transfer in the main loop */
-  g_idle_add (neuland_tox_update_file_transfer_idle, idle_out_data);
+static void
+neuland_tox_release_read_block (NeulandTox *tox,
+                                ReadBlock *block)
+{
+  GQueue *free_blocks = &tox->priv->free_blocks;
+
+  if (g_queue_get_length (free_blocks) < MAX_FREE_READ_BLOCKS)
+    g_queue_push_head (free_blocks, block);
+  else
+    free_read_block (block);
+}
+
+static SendTransfer *
+send_transfer_ref (SendTransfer *transfer)
+{
+  transfer->ref_count++;
+
+  return transfer;
+}
+
+static void
+send_transfer_unref (SendTransfer *transfer)
+{
+  if (--transfer->ref_count > 0)
+    return;
+
+  if (transfer->mapped_file != NULL)
+    g_mapped_file_unref (transfer->mapped_file);
+  g_object_unref (transfer->file_transfer);
+  g_slice_free (SendTransfer, transfer);
+}
+
+/* Takes @transfer out of service and drops the scheduler's reference.
+   Blocks read ahead go back to the pool, resuming reads from the
+   transferred size again. */
+static void
+neuland_tox_release_send_transfer (NeulandTox *tox,
+                                   SendTransfer *transfer)
+{
+  ReadBlock *block;
+
+  transfer->removed = TRUE;
+  transfer->packet = NULL;
+  transfer->count = 0;
+
+  while ((block = g_queue_pop_head (&transfer->blocks)) != NULL)
+    neuland_tox_release_read_block (tox, block);
+
+  send_transfer_unref (transfer);
+}
+
+static void
+free_send_queue (SendQueue *queue)
+{
+  while (!g_queue_is_empty (&queue->transfers))
+    neuland_tox_release_send_transfer (queue->tox, g_queue_pop_head (&queue->transfers));
+
+  g_slice_free (SendQueue, queue);
+}
+
+static void
+neuland_tox_finish_send_transfer (NeulandTox *tox,
+                                  SendTransfer *transfer,
+                                  NeulandFileTransferState state)
+{
+  DataUpdateFileTransferIdle *data = g_new0 (DataUpdateFileTransferIdle, 1);
+
+  /* Apply the state change to the transfer in the main loop */
+  data->file_transfer = g_object_ref (transfer->file_transfer);
+  data->state = state;
+  neuland_tox_push_event (tox, EVENT_UPDATE_FILE_TRANSFER, data);
+
+  neuland_tox_release_send_transfer (tox, transfer);
+}
+
+static gboolean
+neuland_tox_read_block_done (gpointer user_data)
+{
+  ReadJob *job = user_data;
+  SendTransfer *transfer = job->transfer;
+  NeulandTox *tox = job->tox;
+
+  transfer->reading = FALSE;
+
+  if (transfer->removed || job->count <= 0)
+    {
+      neuland_tox_release_read_block (tox, job->block);
+
+      if (job->count == 0)
+        transfer->eof = TRUE;
+      else if (job->count < 0)
+        transfer->failed = TRUE;
+    }
+  else
+    {
+      job->block->length = job->count;
+      g_queue_push_tail (&transfer->blocks, job->block);
+    }
+
+  if (!transfer->removed)
+    g_source_set_ready_time (tox->priv->send_source, 0);
+
+  send_transfer_unref (transfer);
+  g_slice_free (ReadJob, job);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Runs in the reader thread. There is only one, so reads (and seeks)
+   on a file transfer's input stream never overlap, even when an old
+   read of a paused transfer is still queued after it was resumed. */
+static void
+neuland_tox_read_block_func (gpointer data,
+                             gpointer user_data)
+{
+  ReadJob *job = data;
+  NeulandFileTransfer *file_transfer = job->transfer->file_transfer;
+
+  if (job->seek)
+    neuland_file_transfer_prepare_resume_sending (file_transfer);
+
+  job->count = neuland_file_transfer_get_next_data (file_transfer, job->block->data,
+                                                    READ_AHEAD_BLOCK_SIZE);
+
+  g_main_context_invoke (job->tox->priv->tox_context, neuland_tox_read_block_done, job);
+}
+
+/* Starts reading the next block of @transfer if there is room for it
+   and no read is in flight already. */
+static void
+neuland_tox_read_ahead (NeulandTox *tox,
+                        SendTransfer *transfer)
+{
+  ReadJob *job;
+
+  if (transfer->mapped_file != NULL ||
+      transfer->reading || transfer->eof || transfer->failed ||
+      g_queue_get_length (&transfer->blocks) >= READ_AHEAD_BLOCKS ||
+      tox->priv->reader_pool == NULL)
+    return;
+
+  job = g_slice_new0 (ReadJob);
+  job->tox = tox;
+  job->transfer = send_transfer_ref (transfer);
+  job->block = neuland_tox_get_read_block (tox);
+  job->seek = transfer->resuming;
+
+  transfer->resuming = FALSE;
+  transfer->reading = TRUE;
+
+  g_thread_pool_push (tox->priv->reader_pool, job, NULL);
+}
+
+/* Tries to hand the next packet of @transfer to toxcore. Sets @sent
+   to its size if it did. */
+static SendResult
+neuland_tox_send_packet (NeulandTox *tox,
+                         gint32 contact_number,
+                         SendTransfer *transfer,
+                         gsize *sent)
+{
+  const NeulandToxBackend *backend = tox->priv->backend;
+  Tox *tox_struct = tox->priv->tox_struct;
+  NeulandFileTransfer *file_transfer = transfer->file_transfer;
+  const gchar *name = neuland_file_transfer_get_file_name (file_transfer);
+  ReadBlock *block;
+
+  neuland_tox_read_ahead (tox, transfer);
+
+  block = g_queue_peek_head (&transfer->blocks);
+
+  if (transfer->count == 0)
+    {
+      const guint8 *next;
+      gsize available;
+      gint data_size;
+
+      if (transfer->mapped_file != NULL)
+        {
+          available = g_mapped_file_get_length (transfer->mapped_file) - transfer->position;
+          next = (const guint8 *)g_mapped_file_get_contents (transfer->mapped_file)
+            + transfer->position;
+
+          if (available == 0)
+            {
+              g_debug ("File transfer %p \"%s\" finished transferring data",
+                       file_transfer, name);
+              neuland_tox_finish_send_transfer (tox, transfer, NEULAND_FILE_TRANSFER_STATE_FINISHED);
+              return SEND_RESULT_DONE;
+            }
+        }
+      else if (block == NULL)
+        {
+          if (transfer->failed)
+            {
+              g_debug ("Failed to get next data for file transfer %p \"%s\", "
+                       "going to kill transfer.", file_transfer, name);
+              neuland_tox_finish_send_transfer (tox, transfer, NEULAND_FILE_TRANSFER_STATE_ERROR);
+              return SEND_RESULT_DONE;
+            }
+
+          if (transfer->eof)
+            {
+              g_debug ("File transfer %p \"%s\" finished transferring data",
+                       file_transfer, name);
+              neuland_tox_finish_send_transfer (tox, transfer, NEULAND_FILE_TRANSFER_STATE_FINISHED);
+              return SEND_RESULT_DONE;
+            }
+
+          return SEND_RESULT_WAITING;
+        }
+      else
+        {
+          available = block->length - block->offset;
+          next = block->data + block->offset;
+        }
+
+      data_size = backend->file_data_size (tox_struct, contact_number);
+
+      if (data_size <= 0)
+        {
+          g_debug ("Failed to get data size for file transfer %p \"%s\", "
+                   "going to kill transfer.", file_transfer, name);
+          neuland_tox_finish_send_transfer (tox, transfer, NEULAND_FILE_TRANSFER_STATE_ERROR);
+          return SEND_RESULT_DONE;
+        }
+
+      transfer->packet = (guint8 *)next;
+      transfer->count = MIN ((gsize)data_size, available);
+    }
+
+  /* A failure only means toxcore's send queue for this contact is
+     full, so we keep the packet and try again later. */
+  if (backend->file_send_data (tox_struct, contact_number, transfer->file_number,
+                               transfer->packet, (gint)transfer->count) != 0)
+    return SEND_RESULT_BLOCKED;
+
+  /* The main loop picks this up when it samples the progress. */
+  neuland_file_transfer_add_transferred_size (file_transfer, transfer->count);
+  *sent = transfer->count;
+
+  if (transfer->mapped_file != NULL)
+    {
+      /* Blocks read ahead are hashed by the reader thread */
+      neuland_file_transfer_update_checksum (file_transfer, transfer->position,
+                                             transfer->packet, transfer->count);
+      transfer->position += transfer->count;
+    }
+  else
+    {
+      block->offset += transfer->count;
+
+      if (block->offset == block->length)
+        {
+          neuland_tox_release_read_block (tox, g_queue_pop_head (&transfer->blocks));
+          neuland_tox_read_ahead (tox, transfer);
+        }
+    }
+
+  transfer->packet = NULL;
+  transfer->count = 0;
+
+  return SEND_RESULT_SENT;
+}
+
+static gboolean
+send_transfer_is_small (gconstpointer data)
+{
+  return ((const SendTransfer *)data)->small;
+}
+
+static gboolean
+send_queue_is_small (gconstpointer data)
+{
+  const SendQueue *queue = data;
+
+  return send_transfer_is_small (g_queue_peek_head ((GQueue *)&queue->transfers));
+}
+
+/* Puts @data back into @queue, ahead of the first item that is not
+   small if @data is small, at the end otherwise. */
+static void
+queue_push_by_class (GQueue *queue,
+                     gpointer data,
+                     gboolean (*is_small) (gconstpointer data))
+{
+  GList *l;
+
+  if (is_small (data))
+    for (l = queue->head; l; l = l->next)
+      if (!is_small (l->data))
+        {
+          g_queue_insert_before (queue, l, data);
+          return;
+        }
+
+  g_queue_push_tail (queue, data);
+}
+
+/* Sends one packet per contact in turn, and within a contact one
+   packet per transfer in turn, so that neither a contact nor a
+   transfer can starve the others. Small files go first though, both
+   within a contact and across contacts. Since toxcore's send queue
+   is per contact, a blocked transfer means the whole contact is
+   blocked for now, while a transfer waiting for its next block lets
+   the other transfers of the contact go first. Contacts over their
+   upload limit are skipped, and everything stops when the global
+   limit is reached, until the buckets have refilled.
+
+   Chat messages don't go through here; @send_source has a lower
+   priority than the commands sending them, so they always go
+   first. */
+static gboolean
+neuland_tox_send_source_dispatch (GSource *source,
+                                  GSourceFunc callback,
+                                  gpointer user_data)
+{
+  NeulandTox *tox = ((NeulandToxSource *)source)->tox;
+  NeulandToxPrivate *priv = tox->priv;
+  gint64 now = g_get_monotonic_time ();
+  gint64 wait = G_MAXINT64;
+  guint packets = 0;
+  guint idle = 0;
+  gboolean blocked = FALSE;
+
+  g_source_set_ready_time (source, -1);
+
+  token_bucket_refill (&priv->upload_bucket, now);
+
+  while (packets < MAX_SEND_PACKETS_PER_DISPATCH &&
+         !g_queue_is_empty (&priv->send_queues) &&
+         idle <= priv->n_send_transfers)
+    {
+      SendQueue *queue;
+      SendTransfer *transfer;
+      gint64 bucket_wait;
+      gsize sent = 0;
+
+      bucket_wait = token_bucket_get_wait (&priv->upload_bucket);
+      if (bucket_wait > 0)
+        {
+          wait = bucket_wait;
+          break;
+        }
+
+      queue = g_queue_pop_head (&priv->send_queues);
+      token_bucket_refill (&queue->bucket, now);
+
+      bucket_wait = token_bucket_get_wait (&queue->bucket);
+      if (bucket_wait > 0)
+        {
+          wait = MIN (wait, bucket_wait);
+          idle += g_queue_get_length (&queue->transfers);
+          g_queue_push_tail (&priv->send_queues, queue);
+          continue;
+        }
+
+      transfer = g_queue_pop_head (&queue->transfers);
+
+      switch (neuland_tox_send_packet (tox, queue->contact_number, transfer, &sent))
+        {
+        case SEND_RESULT_SENT:
+          packets++;
+          idle = 0;
+          token_bucket_consume (&priv->upload_bucket, sent);
+          token_bucket_consume (&queue->bucket, sent);
+          queue_push_by_class (&queue->transfers, transfer, send_transfer_is_small);
+          break;
+
+        case SEND_RESULT_BLOCKED:
+          idle++;
+          blocked = TRUE;
+          g_queue_push_head (&queue->transfers, transfer);
+          break;
+
+        case SEND_RESULT_WAITING:
+          idle++;
+          g_queue_push_tail (&queue->transfers, transfer);
+          break;
+
+        case SEND_RESULT_DONE:
+          priv->n_send_transfers--;
+          break;
+        }
+
+      if (g_queue_is_empty (&queue->transfers))
+        g_hash_table_remove (priv->send_queues_ht, GINT_TO_POINTER (queue->contact_number));
+      else
+        queue_push_by_class (&priv->send_queues, queue, send_queue_is_small);
+    }
+
+  if (packets > 0)
+    neuland_tox_wakeup (tox);
+
+  if (g_queue_is_empty (&priv->send_queues))
+    return G_SOURCE_CONTINUE;
+
+  if (packets == MAX_SEND_PACKETS_PER_DISPATCH)
+    g_source_set_ready_time (source, 0);
+  else
+    {
+      if (blocked)
+        /* Park until the next tox_do(), see
+           neuland_tox_do_source_dispatch(). Finished reads wake us
+           up as well. */
+        priv->send_blocked = TRUE;
+
+      /* Come back once a bucket we ran dry has refilled */
+      if (wait != G_MAXINT64)
+        g_source_set_ready_time (source, now + wait);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs neuland_tox_send_source_funcs = {
+  NULL,
+  NULL,
+  neuland_tox_send_source_dispatch,
+  NULL
+};
+
+static void
+neuland_tox_scheduler_add (NeulandTox *tox,
+                           NeulandFileTransfer *file_transfer,
+                           gboolean resuming)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  gint32 contact_number = neuland_file_transfer_get_contact_number (file_transfer);
+  guint8 file_number = neuland_file_transfer_get_file_number (file_transfer);
+  SendTransfer *transfer;
+  SendQueue *queue;
+  GList *l;
+
+  queue = g_hash_table_lookup (priv->send_queues_ht, GINT_TO_POINTER (contact_number));
+  if (queue != NULL)
+    {
+      for (l = queue->transfers.head; l; l = l->next)
+        if (((SendTransfer *)l->data)->file_number == file_number)
+          return;
+    }
+  else
+    {
+      queue = g_slice_new0 (SendQueue);
+      queue->tox = tox;
+      queue->contact_number = contact_number;
+      token_bucket_set_rate (&queue->bucket, priv->contact_upload_limit);
+      g_hash_table_insert (priv->send_queues_ht, GINT_TO_POINTER (contact_number), queue);
+      g_queue_push_tail (&priv->send_queues, queue);
+    }
+
+  g_debug ("Scheduling file transfer %p \"%s\" for sending", file_transfer,
+           neuland_file_transfer_get_file_name (file_transfer));
+
+  transfer = g_slice_new0 (SendTransfer);
+  transfer->ref_count = 1;
+  transfer->file_transfer = g_object_ref (file_transfer);
+  transfer->file_number = file_number;
+  transfer->small = neuland_file_transfer_get_file_size (file_transfer) < SMALL_FILE_SIZE;
+  transfer->mapped_file = neuland_file_transfer_map_for_sending (file_transfer);
+
+  if (transfer->mapped_file != NULL)
+    {
+      /* Resuming only means starting further into the mapping. */
+      if (resuming)
+        transfer->position = neuland_file_transfer_get_transferred_size (file_transfer);
+
+      if (transfer->position > g_mapped_file_get_length (transfer->mapped_file))
+        transfer->position = g_mapped_file_get_length (transfer->mapped_file);
+    }
+  else
+    transfer->resuming = resuming;
+
+  queue_push_by_class (&queue->transfers, transfer, send_transfer_is_small);
+  priv->n_send_transfers++;
+
+  /* A new small transfer may move its contact ahead */
+  if (transfer->small && g_queue_peek_head (&queue->transfers) == transfer)
+    {
+      g_queue_remove (&priv->send_queues, queue);
+      queue_push_by_class (&priv->send_queues, queue, send_queue_is_small);
+    }
+
+  neuland_tox_read_ahead (tox, transfer);
+  g_source_set_ready_time (priv->send_source, 0);
+}
+
+static void
+neuland_tox_scheduler_remove (NeulandTox *tox,
+                              gint32 contact_number,
+                              guint8 file_number)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  SendQueue *queue;
+  GList *l;
+
+  queue = g_hash_table_lookup (priv->send_queues_ht, GINT_TO_POINTER (contact_number));
+  if (queue == NULL)
+    return;
+
+  for (l = queue->transfers.head; l; l = l->next)
+    {
+      SendTransfer *transfer = l->data;
+
+      if (transfer->file_number == file_number)
+        {
+          g_debug ("Unscheduling file transfer %p", transfer->file_transfer);
+          g_queue_delete_link (&queue->transfers, l);
+          neuland_tox_release_send_transfer (tox, transfer);
+          priv->n_send_transfers--;
+          break;
+        }
+    }
+
+  if (g_queue_is_empty (&queue->transfers))
+    {
+      g_queue_remove (&priv->send_queues, queue);
+      g_hash_table_remove (priv->send_queues_ht, GINT_TO_POINTER (contact_number));
+    }
+}
+
+typedef struct
+{
+  guint64 upload_limit;
+  guint64 contact_upload_limit;
+} DataUploadLimits;
+
+/* Runs in the tox thread */
+static gint
+set_upload_limits_func (NeulandTox *tox,
+                        gpointer user_data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  DataUploadLimits *data = user_data;
+  GList *l;
+
+  token_bucket_set_rate (&priv->upload_bucket, data->upload_limit);
+
+  priv->contact_upload_limit = data->contact_upload_limit;
+  for (l = priv->send_queues.head; l; l = l->next)
+    token_bucket_set_rate (&((SendQueue *)l->data)->bucket, data->contact_upload_limit);
+
+  g_source_set_ready_time (priv->send_source, 0);
+
+  return 0;
+}
+
+static void
+neuland_tox_update_upload_limits (NeulandTox *tox)
+{
+  DataUploadLimits *data = g_new0 (DataUploadLimits, 1);
+
+  data->upload_limit = tox->priv->upload_limit;
+  data->contact_upload_limit = tox->priv->contact_upload_limit_setting;
+
+  neuland_tox_invoke (tox, set_upload_limits_func, NULL, data, g_free);
+}
+
+/* Limits the upload rate of all file transfers together to
+   @upload_limit bytes per second, 0 meaning no limit. */
+void
+neuland_tox_set_upload_limit (NeulandTox *tox,
+                              guint64 upload_limit)
+{
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+
+  if (tox->priv->upload_limit == upload_limit)
+    return;
+
+  g_debug ("Setting upload limit to %" G_GUINT64_FORMAT " B/s", upload_limit);
+  tox->priv->upload_limit = upload_limit;
+  neuland_tox_update_upload_limits (tox);
+
+  g_object_notify_by_pspec (G_OBJECT (tox), properties[PROP_UPLOAD_LIMIT]);
+}
+
+guint64
+neuland_tox_get_upload_limit (NeulandTox *tox)
+{
+  g_return_val_if_fail (NEULAND_IS_TOX (tox), 0);
+
+  return tox->priv->upload_limit;
+}
+
+/* Limits the upload rate of the file transfers to each contact to
+   @upload_limit bytes per second, 0 meaning no limit. */
+void
+neuland_tox_set_contact_upload_limit (NeulandTox *tox,
+                                      guint64 upload_limit)
+{
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+
+  if (tox->priv->contact_upload_limit_setting == upload_limit)
+    return;
+
+  g_debug ("Setting upload limit per contact to %" G_GUINT64_FORMAT " B/s", upload_limit);
+  tox->priv->contact_upload_limit_setting = upload_limit;
+  neuland_tox_update_upload_limits (tox);
+
+  g_object_notify_by_pspec (G_OBJECT (tox), properties[PROP_CONTACT_UPLOAD_LIMIT]);
+}
+
+guint64
+neuland_tox_get_contact_upload_limit (NeulandTox *tox)
+{
+  g_return_val_if_fail (NEULAND_IS_TOX (tox), 0);
+
+  return tox->priv->contact_upload_limit_setting;
+}
+
+/* An incoming transfer we accepted. Only used in the tox thread.
+   Received data is collected in @pending and written out by the
+   writer thread in large blocks. */
+typedef struct
+{
+  NeulandFileTransfer *file_transfer;
+  GByteArray *pending;
+  guint64 offset;               /* of the first pending byte in the file */
+  gboolean awaiting_offset;     /* until the contact confirms @offset */
+  gboolean restart;             /* the next write job starts over at 0 */
+} ReceiveTransfer;
+
+typedef struct
+{
+  NeulandTox *tox;
+  NeulandFileTransfer *file_transfer;
+  guint64 offset;
+  GByteArray *data;             /* may be NULL */
+  DataFileControl *control;     /* pushed once @data is written, may be NULL */
+  gboolean restart;             /* discard the ".part" file before writing */
+} WriteJob;
+
+static void
+free_receive_transfer (ReceiveTransfer *transfer)
+{
+  g_object_unref (transfer->file_transfer);
+  if (transfer->pending != NULL)
+    g_byte_array_unref (transfer->pending);
+  g_slice_free (ReceiveTransfer, transfer);
+}
+
+static void
+free_receive_slots (gpointer data)
+{
+  ReceiveTransfer **slots = data;
+  gint i;
+
+  if (slots == NULL)
+    return;
+
+  for (i = 0; i < FILE_NUMBER_SLOTS; i++)
+    if (slots[i] != NULL)
+      free_receive_transfer (slots[i]);
+  g_free (slots);
+}
+
+/* Runs in the tox thread. Returns the slot for @file_number of
+   @contact_number, or NULL if there is none and @create is FALSE. */
+static ReceiveTransfer **
+neuland_tox_get_receive_slot (NeulandTox *tox,
+                              gint32 contact_number,
+                              guint8 file_number,
+                              gboolean create)
+{
+  GPtrArray *receive_slots = tox->priv->receive_slots;
+  ReceiveTransfer **slots = NULL;
+
+  if (contact_number < 0)
+    return NULL;
+
+  if (contact_number < receive_slots->len)
+    slots = g_ptr_array_index (receive_slots, contact_number);
+
+  if (slots == NULL)
+    {
+      if (!create)
+        return NULL;
+      if (contact_number >= receive_slots->len)
+        g_ptr_array_set_size (receive_slots, contact_number + 1);
+      slots = g_new0 (ReceiveTransfer *, FILE_NUMBER_SLOTS);
+      g_ptr_array_index (receive_slots, contact_number) = slots;
+    }
+
+  return &slots[file_number];
+}
+
+/* Runs in the tox thread */
+static ReceiveTransfer *
+neuland_tox_lookup_receive_transfer (NeulandTox *tox,
+                                     gint32 contact_number,
+                                     guint8 file_number)
+{
+  ReceiveTransfer **slot =
+    neuland_tox_get_receive_slot (tox, contact_number, file_number, FALSE);
+
+  return slot != NULL ? *slot : NULL;
+}
+
+/* Runs in the writer thread. There is only one, so the blocks of a
+   transfer are written before its control package is passed on. */
+static void
+neuland_tox_write_block_func (gpointer data,
+                              gpointer user_data)
+{
+  WriteJob *job = data;
+
+  if (job->restart)
+    neuland_file_transfer_discard_part_file (job->file_transfer);
+
+  if (job->data != NULL)
+    {
+      if (neuland_file_transfer_write_data (job->file_transfer, job->offset,
+                                            job->data->data, job->data->len) == -1)
+        {
+          DataUpdateFileTransferIdle *update = g_new0 (DataUpdateFileTransferIdle, 1);
+
+          g_warning ("Failed to append incoming data to file "
+                     "transfer %p, going to kill transfer", job->file_transfer);
+          update->file_transfer = g_object_ref (job->file_transfer);
+          update->state = NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US;
+          neuland_tox_push_event (job->tox, EVENT_UPDATE_FILE_TRANSFER, update);
+        }
+
+      g_byte_array_unref (job->data);
+    }
+
+  /* Everything received before the control package is on disk now. */
+  if (job->control != NULL)
+    neuland_tox_push_event (job->tox, EVENT_FILE_CONTROL, job->control);
+
+  g_object_unref (job->file_transfer);
+  g_slice_free (WriteJob, job);
+}
+
+/* Runs in the tox thread. Hands the pending data of @transfer, and
+   @control if not NULL, to the writer thread. */
+static void
+neuland_tox_flush_receive_transfer (NeulandTox *tox,
+                                    ReceiveTransfer *transfer,
+                                    DataFileControl *control)
+{
+  WriteJob *job;
+
+  if (transfer->pending != NULL && transfer->pending->len == 0)
+    g_clear_pointer (&transfer->pending, g_byte_array_unref);
+
+  if (transfer->pending == NULL && control == NULL)
+    return;
+
+  /* Shutting down, see neuland_tox_save_and_kill(). */
+  if (tox->priv->writer_pool == NULL)
+    {
+      g_clear_pointer (&transfer->pending, g_byte_array_unref);
+      if (control != NULL)
+        free_data_file_control (control);
+      return;
+    }
+
+  job = g_slice_new0 (WriteJob);
+  job->tox = tox;
+  job->file_transfer = g_object_ref (transfer->file_transfer);
+  job->offset = transfer->offset;
+  job->data = transfer->pending;
+  job->control = control;
+  job->restart = transfer->restart;
+
+  transfer->restart = FALSE;
+  if (transfer->pending != NULL)
+    transfer->offset += transfer->pending->len;
+  transfer->pending = NULL;
+
+  g_thread_pool_push (tox->priv->writer_pool, job, NULL);
+}
+
+/* Runs in the tox thread. Data is written starting at @offset, which
+   is not 0 for restored transfers. */
+static void
+neuland_tox_receiver_add (NeulandTox *tox,
+                          NeulandFileTransfer *file_transfer,
+                          guint64 offset)
+{
+  ReceiveTransfer **slot;
+  ReceiveTransfer *transfer;
+
+  slot = neuland_tox_get_receive_slot (tox,
+                                       neuland_file_transfer_get_contact_number (file_transfer),
+                                       neuland_file_transfer_get_file_number (file_transfer),
+                                       TRUE);
+  if (slot == NULL)
+    return;
+
+  /* Resuming keeps the entry we have since pausing, but the file
+     number may belong to a new transfer by now. */
+  if (*slot != NULL)
+    {
+      if ((*slot)->file_transfer == file_transfer)
+        return;
+      free_receive_transfer (*slot);
+    }
+
+  transfer = g_slice_new0 (ReceiveTransfer);
+  transfer->file_transfer = g_object_ref (file_transfer);
+  transfer->offset = offset;
+  transfer->awaiting_offset = offset > 0;
+  *slot = transfer;
+}
+
+/* Runs in the tox thread. Any data still pending is dropped unless
+   @flush is TRUE. */
+static void
+neuland_tox_receiver_remove (NeulandTox *tox,
+                             gint32 contact_number,
+                             guint8 file_number,
+                             gboolean flush)
+{
+  ReceiveTransfer **slot =
+    neuland_tox_get_receive_slot (tox, contact_number, file_number, FALSE);
+
+  if (slot == NULL || *slot == NULL)
+    return;
+
+  if (flush)
+    neuland_tox_flush_receive_transfer (tox, *slot, NULL);
+
+  free_receive_transfer (*slot);
+  *slot = NULL;
+}
+
+/* Runs in the tox thread */
+static gint
+start_sending_func (NeulandTox *tox,
+                    gpointer user_data)
+{
+  neuland_tox_scheduler_add (tox, NEULAND_FILE_TRANSFER (user_data), FALSE);
+
+  return 0;
+}
+
+typedef struct
+{
+  NeulandFileTransfer *file_transfer;
+  gint32 contact_number;
+  guint8 send_receive;
+  guint8 file_number;
+  guint8 control_type;
+  NeulandFileTransferState requested_state;
+  gboolean start_sending;
+  guint64 offset;               /* sent along if not 0, see below */
+  gchar *checksum;              /* of the data before @offset, may be NULL */
+} DataSendFileControl;
+
+static void
+free_data_send_file_control (DataSendFileControl *data)
+{
+  g_object_unref (data->file_transfer);
+  g_free (data->checksum);
+  g_free (data);
+}
+
+/* Runs in the tox thread */
+static gint
+send_file_control_func (NeulandTox *tox,
+                        gpointer user_data)
+{
+  DataSendFileControl *data = user_data;
+  guint64 offset = GUINT64_TO_BE (data->offset);
+  guint8 buffer[sizeof (offset) + RESUME_CHECKSUM_LENGTH];
+  gsize length = 0;
+  gint ret;
+
+  /* Pausing, killing and finishing all stop the sending of data. */
+  if (data->send_receive == 0 && data->control_type != TOX_FILECONTROL_ACCEPT)
+    neuland_tox_scheduler_remove (tox, data->contact_number, data->file_number);
+
+  /* For incoming transfers, pausing writes out what we have, while
+     killing throws it away. */
+  if (data->send_receive == 1)
+    {
+      if (data->control_type == TOX_FILECONTROL_PAUSE)
+        {
+          ReceiveTransfer *transfer =
+            neuland_tox_lookup_receive_transfer (tox, data->contact_number,
+                                                 data->file_number);
+          if (transfer != NULL)
+            neuland_tox_flush_receive_transfer (tox, transfer, NULL);
+        }
+      else if (data->control_type != TOX_FILECONTROL_ACCEPT)
+        neuland_tox_receiver_remove (tox, data->contact_number, data->file_number,
+                                     data->control_type == TOX_FILECONTROL_FINISHED);
+    }
+
+  if (data->offset > 0)
+    {
+      memcpy (buffer, &offset, sizeof (offset));
+      length = sizeof (offset);
+
+      if (data->checksum != NULL && strlen (data->checksum) == RESUME_CHECKSUM_LENGTH)
+        {
+          memcpy (buffer + length, data->checksum, RESUME_CHECKSUM_LENGTH);
+          length += RESUME_CHECKSUM_LENGTH;
+        }
+    }
+
+  ret = tox->priv->backend->file_send_control (tox->priv->tox_struct,
+                                               data->contact_number,
+                                               data->send_receive,
+                                               data->file_number,
+                                               data->control_type,
+                                               length > 0 ? buffer : NULL,
+                                               length);
+
+  /* When we resume, the accept package has to go out before the data. */
+  if (ret == 0 && data->start_sending)
+    neuland_tox_scheduler_add (tox, data->file_transfer, TRUE);
+
+  /* Data can only arrive during tox_do(), which runs in this thread
+     as well, so there is no hurry to add the transfer before. */
+  if (ret == 0 && data->send_receive == 1 && data->control_type == TOX_FILECONTROL_ACCEPT)
+    neuland_tox_receiver_add (tox, data->file_transfer, data->offset);
+
+  return ret;
+}
+
+static void
+send_file_control_done (NeulandTox *tox,
+                        gint ret,
+                        gpointer user_data)
+{
+  DataSendFileControl *data = user_data;
+  NeulandFileTransfer *file_transfer = data->file_transfer;
 
-  g_object_unref (file_transfer);
-  free_data_send_file_transfer (data);
-  g_clear_pointer (&data_buffer, g_free);
+  if (ret != 0)
+    {
+      g_warning ("Error on calling tox_file_send_control() with %s "
+                 "for transfer %p, setting state to NEULAND_FILE_TRANSFER_STATE_ERROR",
+                 tox_filecontrol_type_to_string (data->control_type), file_transfer);
 
-  g_debug ("Leaving thread for file transfer %p \"%s\"", file_transfer, name);
+      neuland_file_transfer_set_state (file_transfer, NEULAND_FILE_TRANSFER_STATE_ERROR);
+      return;
+    }
 
-  return NULL;
+  /* Change the real state property if sending control package succeeded */
+  neuland_file_transfer_set_state (file_transfer, data->requested_state);
 }
 
 /* This callback is responsible for sanity checking the state
@@ -800,21 +2775,25 @@ on_file_transfer_requested_state_changed_cb (GObject *gobject,
 {
   NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (gobject);
   NeulandTox *tox = NEULAND_TOX (user_data);
-  NeulandToxPrivate *priv = tox->priv;
   NeulandFileTransferState requested_state =
     neuland_file_transfer_get_requested_state (file_transfer);
   NeulandFileTransferDirection direction = neuland_file_transfer_get_direction (file_transfer);
   gint64 contact_number = neuland_file_transfer_get_contact_number (file_transfer);
   guint8 file_number = neuland_file_transfer_get_file_number (file_transfer);
   guint64 file_size = neuland_file_transfer_get_file_size (file_transfer);
-  gboolean resuming = neuland_file_transfer_get_transferred_size (file_transfer) > 0;
+  guint64 transferred_size = neuland_file_transfer_get_transferred_size (file_transfer);
+  gboolean resuming = transferred_size > 0;
+  /* A transfer restored after a restart starts with data. */
+  gboolean restored =
+    neuland_file_transfer_get_state (file_transfer) == NEULAND_FILE_TRANSFER_STATE_PENDING &&
+    transferred_size > 0;
   gchar *info = neuland_file_transfer_get_info_string (file_transfer);
   GEnumClass *eclass = g_type_class_peek (NEULAND_TYPE_FILE_TRANSFER_STATE);
   GEnumValue *ev;
 
   gint control_type = -100;     /* -100 for unset */
   gint send_receive = -1;       /*   -1 for unset */
-  gboolean start_sending_thread = FALSE;
+  gboolean start_sending = FALSE;
 
   g_debug ("on_file_transfer_requested_state_changed_cb: %s", info);
   g_free (info);
@@ -832,7 +2811,7 @@ on_file_transfer_requested_state_changed_cb (GObject *gobject,
              before starting to send again. */
           if (resuming)
             control_type = TOX_FILECONTROL_ACCEPT;
-          start_sending_thread = TRUE;
+          start_sending = TRUE;
           break;
 
         case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US:
@@ -908,7 +2887,8 @@ on_file_transfer_requested_state_changed_cb (GObject *gobject,
   /* Send a control package if necessary */
   if (control_type != -100)
     {
-      gint ret;
+      DataSendFileControl *data = g_new0 (DataSendFileControl, 1);
+
       g_debug ("\n"
                "< Outgoing file control package for transfer %p >\n"
                "  contact_number: %i\n"
@@ -921,39 +2901,524 @@ on_file_transfer_requested_state_changed_cb (GObject *gobject,
                file_number,
                tox_filecontrol_type_to_string(control_type));
 
-      g_mutex_lock (&priv->mutex);
-      ret = tox_file_send_control (priv->tox_struct,
-                                   contact_number,
-                                   send_receive,
-                                   file_number,
-                                   control_type,
-                                   NULL, 0);
-      g_mutex_unlock (&priv->mutex);
+      data->file_transfer = g_object_ref (file_transfer);
+      data->contact_number = contact_number;
+      data->send_receive = send_receive;
+      data->file_number = file_number;
+      data->control_type = control_type;
+      data->requested_state = requested_state;
+      data->start_sending = start_sending;
+
+      /* The accept package of a restored transfer tells the contact
+         where we continue, see neuland_tox_restore_file_transfer(). */
+      if (restored && control_type == TOX_FILECONTROL_ACCEPT)
+        {
+          data->offset = transferred_size;
+
+          /* The receiving side lets the contact check our data. */
+          if (send_receive == 1)
+            {
+              guint64 hashed_size;
+
+              data->checksum = neuland_file_transfer_dup_partial_checksum (file_transfer,
+                                                                           &hashed_size);
+              if (hashed_size != transferred_size)
+                g_clear_pointer (&data->checksum, g_free);
+            }
+        }
+
+      /* The state is changed once toxcore has taken the control
+         package, see send_file_control_done(). */
+      neuland_tox_invoke (tox, send_file_control_func, send_file_control_done,
+                          data, (GDestroyNotify) free_data_send_file_control);
+      return;
+    }
+
+  /* Change the real state */
+  neuland_file_transfer_set_state (file_transfer, requested_state);
+
+  /* Hand the transfer to the transfer scheduler if necessary */
+  if (start_sending)
+    neuland_tox_invoke (tox, start_sending_func, NULL,
+                        g_object_ref (file_transfer), g_object_unref);
+}
+
+typedef struct
+{
+  NeulandFileTransfer *file_transfer;
+  gint32 contact_number;
+  guint64 file_size;
+  gchar *file_name;
+} DataNewFileSender;
+
+static void
+free_data_new_file_sender (DataNewFileSender *data)
+{
+  g_object_unref (data->file_transfer);
+  g_free (data->file_name);
+  g_free (data);
+}
+
+/* Runs in the tox thread */
+static gint
+new_file_sender_func (NeulandTox *tox,
+                      gpointer user_data)
+{
+  DataNewFileSender *data = user_data;
+
+  return tox->priv->backend->new_file_sender (tox->priv->tox_struct,
+                                              data->contact_number,
+                                              data->file_size,
+                                              (guint8*)data->file_name,
+                                              strlen (data->file_name));
+}
+
+static void
+new_file_sender_done (NeulandTox *tox,
+                      gint file_number,
+                      gpointer user_data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  DataNewFileSender *data = user_data;
+  NeulandFileTransfer *file_transfer = data->file_transfer;
+  NeulandContact *contact;
+
+  if (file_number < 0)
+    {
+      g_warning ("Error when calling_new_file_sender() for transfer %s", data->file_name);
+      return;
+    }
+
+  contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
+  if (contact == NULL)
+    return;
+
+  neuland_file_transfer_set_file_number (file_transfer, file_number);
+
+  g_hash_table_insert (priv->file_transfers_sending_ht, file_transfer, file_transfer);
+  g_hash_table_insert (priv->file_transfers_all_ht, file_transfer, file_transfer);
+
+  neuland_contact_add_file_transfer (contact, file_transfer);
+  /* Now we have to wait for TOX_FILECONTROL_ACCEPT ... */
+}
+
+/* Transfers interrupted by a restart, or dropped by toxcore when a
+   contact goes offline, are continued by a new transfer of the same
+   file. The receiving side accepts the new transfer with the offset
+   to continue at and the hex SHA-256 of the data before it as data
+   of TOX_FILECONTROL_ACCEPT. If its own data matches, the sending
+   side confirms with an accept package carrying just the offset
+   before it sends data from there on. Otherwise it sends from the
+   beginning, and the receiving side starts over once data arrives
+   that it didn't get a confirmation for. TOX_FILECONTROL_RESUME_BROKEN
+   can't be used for this, toxcore only accepts it for transfers of
+   the same session. */
+
+/* Returns the journal group of @file_transfer, or NULL if its contact
+   is gone. Free with g_free(). */
+static gchar *
+neuland_tox_get_journal_group (NeulandTox *tox,
+                               NeulandFileTransfer *file_transfer)
+{
+  NeulandContact *contact;
+  gchar *name_hash;
+  gchar *group;
+
+  contact = neuland_tox_get_contact_by_number
+    (tox, neuland_file_transfer_get_contact_number (file_transfer));
+  if (contact == NULL)
+    return NULL;
+
+  /* File names may contain anything, group names may not. */
+  name_hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+                                             neuland_file_transfer_get_file_name (file_transfer),
+                                             -1);
+  group = g_strdup_printf ("%s %s %" G_GUINT64_FORMAT " %s",
+                           neuland_file_transfer_get_direction (file_transfer) ==
+                           NEULAND_FILE_TRANSFER_DIRECTION_SEND ? "send" : "receive",
+                           neuland_contact_get_tox_id_hex (contact),
+                           neuland_file_transfer_get_file_size (file_transfer),
+                           name_hash);
+  g_free (name_hash);
+
+  return group;
+}
+
+/* Adds @file_transfer to @key_file if it can be continued later */
+static void
+neuland_tox_journal_file_transfer (NeulandTox *tox,
+                                   GKeyFile *key_file,
+                                   NeulandFileTransfer *file_transfer)
+{
+  NeulandFileTransferDirection direction = neuland_file_transfer_get_direction (file_transfer);
+  GFile *file = neuland_file_transfer_get_file (file_transfer);
+  gchar *group;
+  gchar *path;
+  gchar *checksum;
+  guint64 offset;
+
+  switch (neuland_file_transfer_get_state (file_transfer))
+    {
+    case NEULAND_FILE_TRANSFER_STATE_PENDING:
+      /* Offers we got are made again by the contact. */
+      if (direction != NEULAND_FILE_TRANSFER_DIRECTION_SEND)
+        return;
+      break;
+
+    case NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS: /* fall through */
+    case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US: /* fall through */
+    case NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT:
+      break;
+
+    default:
+      return;
+    }
+
+  if (file == NULL || (path = g_file_get_path (file)) == NULL)
+    return;
+
+  group = neuland_tox_get_journal_group (tox, file_transfer);
+  if (group == NULL)
+    {
+      g_free (path);
+      return;
+    }
+
+  checksum = neuland_file_transfer_dup_partial_checksum (file_transfer, &offset);
+
+  g_key_file_set_string (key_file, group, "file-name",
+                         neuland_file_transfer_get_file_name (file_transfer));
+  g_key_file_set_string (key_file, group, "path", path);
+  g_key_file_set_uint64 (key_file, group, "file-size",
+                         neuland_file_transfer_get_file_size (file_transfer));
+  g_key_file_set_uint64 (key_file, group, "offset", offset);
+  if (checksum != NULL)
+    g_key_file_set_string (key_file, group, "checksum", checksum);
+
+  /* We only offer a file again if it didn't change. */
+  if (direction == NEULAND_FILE_TRANSFER_DIRECTION_SEND)
+    {
+      GFileInfo *info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                           G_FILE_QUERY_INFO_NONE, NULL, NULL);
+      if (info != NULL)
+        {
+          g_key_file_set_uint64 (key_file, group, "modified",
+                                 g_file_info_get_attribute_uint64
+                                 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+          g_object_unref (info);
+        }
+    }
+
+  g_free (checksum);
+  g_free (group);
+  g_free (path);
+}
+
+/* Writes the transfer journal next to the tox data. For receiving
+   transfers the journaled offset only covers data that went through
+   the writer thread, and it is checked against the ".part" file
+   before a transfer is continued. */
+static void
+neuland_tox_save_transfer_journal (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  GKeyFile *key_file;
+  GHashTableIter iter;
+  gpointer file_transfer;
+  gchar **groups;
+  gchar *data;
+  gsize length;
+  GError *error = NULL;
+  gint i, j;
+
+  if (priv->journal_path == NULL)
+    return;
+
+  key_file = g_key_file_new ();
+
+  /* Keep entries waiting for their contact to come online */
+  groups = g_key_file_get_groups (priv->journal, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      gchar **keys = g_key_file_get_keys (priv->journal, groups[i], NULL, NULL);
 
-      if (ret != 0)
+      for (j = 0; keys != NULL && keys[j] != NULL; j++)
         {
-          g_warning ("Error on calling tox_file_send_control() with %s "
-                     "for transfer %p, setting state to NEULAND_FILE_TRANSFER_STATE_ERROR",
-                     tox_filecontrol_type_to_string (control_type), file_transfer);
+          gchar *value = g_key_file_get_value (priv->journal, groups[i], keys[j], NULL);
 
-          neuland_file_transfer_set_state (file_transfer, NEULAND_FILE_TRANSFER_STATE_ERROR);
+          g_key_file_set_value (key_file, groups[i], keys[j], value);
+          g_free (value);
         }
-      else
-        /* Change the real state property if sending control package succeeded */
-        neuland_file_transfer_set_state (file_transfer, requested_state);
+      g_strfreev (keys);
+    }
+  g_strfreev (groups);
+
+  g_hash_table_iter_init (&iter, priv->file_transfers_all_ht);
+  while (g_hash_table_iter_next (&iter, &file_transfer, NULL))
+    neuland_tox_journal_file_transfer (tox, key_file, file_transfer);
+
+  data = g_key_file_to_data (key_file, &length, NULL);
+
+  if (length == 0)
+    g_unlink (priv->journal_path);
+  else if (!g_file_set_contents (priv->journal_path, data, length, &error))
+    {
+      g_warning ("Saving transfer journal to \"%s\" failed: %s",
+                 priv->journal_path, error->message);
+      g_error_free (error);
+    }
+
+  g_free (data);
+  g_key_file_free (key_file);
+}
+
+/* Loads the transfer journal saved by the last session */
+static void
+neuland_tox_load_transfer_journal (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  GError *error = NULL;
+
+  if (priv->data_path == NULL)
+    return;
+
+  priv->journal_path = g_strconcat (priv->data_path, ".transfers", NULL);
+
+  if (!g_key_file_load_from_file (priv->journal, priv->journal_path,
+                                  G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Loading transfer journal \"%s\" failed: %s",
+                   priv->journal_path, error->message);
+      g_error_free (error);
+    }
+}
+
+static gboolean
+neuland_tox_journal_timeout (gpointer user_data)
+{
+  NeulandTox *tox = NEULAND_TOX (user_data);
+  NeulandToxPrivate *priv = tox->priv;
+  GHashTableIter iter;
+  gpointer file_transfer;
+
+  neuland_tox_save_transfer_journal (tox);
+
+  g_hash_table_iter_init (&iter, priv->file_transfers_all_ht);
+  while (g_hash_table_iter_next (&iter, &file_transfer, NULL))
+    if (neuland_file_transfer_get_state (file_transfer) ==
+        NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS)
+      return G_SOURCE_CONTINUE;
+
+  priv->journal_timeout_id = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+neuland_tox_sample_timeout (gpointer user_data)
+{
+  NeulandTox *tox = NEULAND_TOX (user_data);
+  NeulandToxPrivate *priv = tox->priv;
+  GHashTableIter iter;
+  gpointer file_transfer;
+  gboolean in_progress = FALSE;
+
+  g_hash_table_iter_init (&iter, priv->file_transfers_all_ht);
+  while (g_hash_table_iter_next (&iter, &file_transfer, NULL))
+    if (neuland_file_transfer_get_state (file_transfer) ==
+        NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS)
+      {
+        neuland_file_transfer_sample_transferred_size (file_transfer);
+        in_progress = TRUE;
+      }
+
+  if (in_progress)
+    return G_SOURCE_CONTINUE;
+
+  priv->sample_timeout_id = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_file_transfer_state_changed_cb (GObject *gobject,
+                                   GParamSpec *pspec,
+                                   gpointer user_data)
+{
+  NeulandTox *tox = NEULAND_TOX (user_data);
+  NeulandToxPrivate *priv = tox->priv;
+  gboolean in_progress = neuland_file_transfer_get_state (NEULAND_FILE_TRANSFER (gobject)) ==
+    NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS;
+
+  neuland_tox_save_transfer_journal (tox);
+
+  if (in_progress && priv->sample_timeout_id == 0)
+    priv->sample_timeout_id = g_timeout_add_seconds (SAMPLE_INTERVAL,
+                                                     neuland_tox_sample_timeout,
+                                                     tox);
+
+  /* The offsets of transfers in progress are saved now and then. */
+  if (priv->journal_path != NULL && priv->journal_timeout_id == 0 && in_progress)
+    priv->journal_timeout_id = g_timeout_add_seconds (JOURNAL_SAVE_INTERVAL,
+                                                      neuland_tox_journal_timeout,
+                                                      tox);
+}
+
+static void
+on_file_transfer_restored (GObject *source_object,
+                           GAsyncResult *result,
+                           gpointer user_data)
+{
+  NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (source_object);
+  NeulandTox *tox = NEULAND_TOX (user_data);
+  GError *error = NULL;
+
+  if (neuland_file_transfer_restore_finish (file_transfer, result, &error))
+    neuland_file_transfer_set_requested_state (file_transfer,
+                                               NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS);
+  else
+    {
+      g_message ("Can't continue file transfer %p \"%s\": %s",
+                 file_transfer, neuland_file_transfer_get_file_name (file_transfer),
+                 error->message);
+      g_error_free (error);
+
+      /* The contact is waiting for us, so we send from the beginning
+         without confirming its offset, and it starts over as well.
+         Offers we got can still be accepted from the beginning. */
+      if (neuland_file_transfer_get_direction (file_transfer) ==
+          NEULAND_FILE_TRANSFER_DIRECTION_SEND)
+        neuland_file_transfer_set_requested_state (file_transfer,
+                                                   NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS);
     }
+
+  g_object_unref (tox);
+}
+
+/* Continues @file_transfer at @offset once the data before it is
+   hashed again, the accept package then carries the offset, see
+   on_file_transfer_requested_state_changed_cb(). */
+static void
+neuland_tox_restore_file_transfer (NeulandTox *tox,
+                                   NeulandFileTransfer *file_transfer,
+                                   guint64 offset,
+                                   const gchar *checksum)
+{
+  g_debug ("Restoring file transfer %p at offset %" G_GUINT64_FORMAT,
+           file_transfer, offset);
+
+  neuland_file_transfer_restore_async (file_transfer, offset, checksum, NULL,
+                                       on_file_transfer_restored, g_object_ref (tox));
+}
+
+/* Runs in the tox thread */
+static gint
+break_file_transfer_func (NeulandTox *tox,
+                          gpointer user_data)
+{
+  NeulandFileTransfer *file_transfer = NEULAND_FILE_TRANSFER (user_data);
+  gint32 contact_number = neuland_file_transfer_get_contact_number (file_transfer);
+  guint8 file_number = neuland_file_transfer_get_file_number (file_transfer);
+
+  if (neuland_file_transfer_get_direction (file_transfer) == NEULAND_FILE_TRANSFER_DIRECTION_SEND)
+    neuland_tox_scheduler_remove (tox, contact_number, file_number);
   else
-    /* Change the real state */
-    neuland_file_transfer_set_state (file_transfer, requested_state);
+    {
+      ReceiveTransfer *transfer =
+        neuland_tox_lookup_receive_transfer (tox, contact_number, file_number);
 
-  /* Start sending thread if necessary */
-  if (start_sending_thread)
+      /* The file number may belong to a new transfer by now. */
+      if (transfer != NULL && transfer->file_transfer == file_transfer)
+        neuland_tox_receiver_remove (tox, contact_number, file_number, TRUE);
+    }
+
+  return 0;
+}
+
+/* Gives up @file_transfer, which a new transfer continues. toxcore
+   already forgot about it, so no control package is sent. */
+static void
+neuland_tox_break_file_transfer (NeulandTox *tox,
+                                 NeulandFileTransfer *file_transfer)
+{
+  g_debug ("Breaking file transfer %p", file_transfer);
+
+  neuland_file_transfer_set_state (file_transfer, NEULAND_FILE_TRANSFER_STATE_BROKEN);
+  neuland_tox_invoke (tox, break_file_transfer_func, NULL,
+                      g_object_ref (file_transfer), g_object_unref);
+}
+
+/* Looks for an interrupted transfer of the same file as the offer
+   @file_transfer, either in the journal or among the transfers
+   toxcore dropped, and continues it with @file_transfer. */
+static void
+neuland_tox_continue_file_transfer (NeulandTox *tox,
+                                    NeulandFileTransfer *file_transfer)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  GHashTableIter iter;
+  gpointer other;
+  gchar *group;
+  gchar *path = NULL;
+  gchar *checksum = NULL;
+  guint64 offset = 0;
+  GFile *file;
+
+  group = neuland_tox_get_journal_group (tox, file_transfer);
+  if (group == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, priv->file_transfers_receiving_ht);
+  while (path == NULL && g_hash_table_iter_next (&iter, &other, NULL))
     {
-      DataSendFileTransfer *data = g_new (DataSendFileTransfer, 1);
-      data->tox = tox;
-      data->file_transfer = g_object_ref (file_transfer);
-      g_thread_new ("file-transfer", neuland_tox_send_file_transfer, data);
+      NeulandFileTransferState state = neuland_file_transfer_get_state (other);
+      gchar *other_group;
+
+      if (other == file_transfer || neuland_file_transfer_get_file (other) == NULL ||
+          (state != NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS &&
+           state != NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US &&
+           state != NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT &&
+           state != NEULAND_FILE_TRANSFER_STATE_ERROR))
+        continue;
+
+      other_group = neuland_tox_get_journal_group (tox, other);
+      if (g_strcmp0 (group, other_group) == 0)
+        {
+          path = g_file_get_path (neuland_file_transfer_get_file (other));
+          checksum = neuland_file_transfer_dup_partial_checksum (other, &offset);
+          neuland_tox_break_file_transfer (tox, other);
+        }
+      g_free (other_group);
+    }
+
+  if (path == NULL && g_key_file_has_group (priv->journal, group))
+    {
+      path = g_key_file_get_string (priv->journal, group, "path", NULL);
+      offset = g_key_file_get_uint64 (priv->journal, group, "offset", NULL);
+      checksum = g_key_file_get_string (priv->journal, group, "checksum", NULL);
+      g_key_file_remove_group (priv->journal, group, NULL);
+    }
+
+  /* Without a checksum we can't tell if the data is intact. */
+  if (checksum == NULL)
+    offset = 0;
+
+  if (path != NULL)
+    {
+      g_message ("Continuing file transfer %p \"%s\" into \"%s\"",
+                 file_transfer, neuland_file_transfer_get_file_name (file_transfer), path);
+
+      file = g_file_new_for_path (path);
+      neuland_file_transfer_set_file (file_transfer, file);
+      g_object_unref (file);
+
+      neuland_tox_restore_file_transfer (tox, file_transfer, offset, checksum);
     }
+
+  g_free (checksum);
+  g_free (path);
+  g_free (group);
 }
 
 /* Connects the @file_transfer signals to this tox session and adds
@@ -981,52 +3446,161 @@ neuland_tox_add_file_transfer (NeulandTox *tox,
 
   g_signal_connect (file_transfer, "notify::requested-state",
                     G_CALLBACK (on_file_transfer_requested_state_changed_cb), tox);
+  g_signal_connect (file_transfer, "notify::state",
+                    G_CALLBACK (on_file_transfer_state_changed_cb), tox);
 
   if (direction == NEULAND_FILE_TRANSFER_DIRECTION_SEND)
     {
-      gint file_number;
+      DataNewFileSender *data;
 
       g_return_if_fail (neuland_file_transfer_get_file_number (file_transfer) == -1);
       g_debug ("Adding new file transfer - sending: (%p)", file_transfer);
 
       /* Before we can add the transfer to the contacts file_transfers_sending_ht hash
-         table we need to know the file number. */
-      g_mutex_lock (&priv->mutex);
+         table we need to know the file number, see new_file_sender_done(). */
+      data = g_new0 (DataNewFileSender, 1);
+      data->file_transfer = g_object_ref (file_transfer);
+      data->contact_number = contact_number;
+      data->file_size = file_size;
+      data->file_name = file_name;
+      file_name = NULL;
+
+      neuland_tox_invoke (tox, new_file_sender_func, new_file_sender_done,
+                          data, (GDestroyNotify) free_data_new_file_sender);
+    }
+  else if (direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
+    {
+      g_debug ("Adding new file transfer - receiving: (%p)", file_transfer);
+      /* We got the file number with the send request. */
+      g_return_if_fail (neuland_file_transfer_get_file_number (file_transfer) != -1);
+
+      g_hash_table_insert (priv->file_transfers_receiving_ht, file_transfer, file_transfer);
+      g_hash_table_insert (priv->file_transfers_all_ht, file_transfer, file_transfer);
+
+      neuland_contact_add_file_transfer (contact, file_transfer);
+    }
+
+  g_free (file_name);
+}
+
+/* toxcore drops the transfers of a contact going offline, and the
+   ones journaled before a restart are gone as well. When @contact
+   comes online we offer their files again, a contact running Neuland
+   continues them, see neuland_tox_continue_file_transfer(). */
+static void
+neuland_tox_offer_file_transfers_again (NeulandTox *tox,
+                                        NeulandContact *contact)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  gint64 contact_number = neuland_contact_get_number (contact);
+  GHashTableIter iter;
+  gpointer file_transfer;
+  GList *files = NULL;
+  GList *l;
+  gchar **groups;
+  gchar *prefix;
+  gint i;
+
+  g_hash_table_iter_init (&iter, priv->file_transfers_sending_ht);
+  while (g_hash_table_iter_next (&iter, &file_transfer, NULL))
+    {
+      NeulandFileTransferState state = neuland_file_transfer_get_state (file_transfer);
+
+      if (neuland_file_transfer_get_contact_number (file_transfer) != contact_number ||
+          (state != NEULAND_FILE_TRANSFER_STATE_PENDING &&
+           state != NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS &&
+           state != NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT))
+        continue;
+
+      files = g_list_prepend (files, g_object_ref (neuland_file_transfer_get_file (file_transfer)));
+      neuland_tox_break_file_transfer (tox, file_transfer);
+    }
+
+  prefix = g_strdup_printf ("send %s ", neuland_contact_get_tox_id_hex (contact));
+  groups = g_key_file_get_groups (priv->journal, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      gchar *path;
+      GFile *file;
+      GFileInfo *info;
+
+      if (!g_str_has_prefix (groups[i], prefix))
+        continue;
+
+      path = g_key_file_get_string (priv->journal, groups[i], "path", NULL);
+      file = path != NULL ? g_file_new_for_path (path) : NULL;
+      info = file != NULL ? g_file_query_info (file,
+                                               G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                               G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                               G_FILE_QUERY_INFO_NONE, NULL, NULL) : NULL;
+
+      if (info != NULL &&
+          g_file_info_get_size (info) ==
+          g_key_file_get_uint64 (priv->journal, groups[i], "file-size", NULL) &&
+          g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) ==
+          g_key_file_get_uint64 (priv->journal, groups[i], "modified", NULL))
+        files = g_list_prepend (files, g_object_ref (file));
+      else
+        g_message ("Not offering \"%s\" again, it changed or is gone", path);
+
+      g_key_file_remove_group (priv->journal, groups[i], NULL);
+
+      g_clear_object (&info);
+      g_clear_object (&file);
+      g_free (path);
+    }
+
+  g_strfreev (groups);
+  g_free (prefix);
+
+  for (l = files; l != NULL; l = l->next)
+    neuland_tox_add_file_transfer (tox, neuland_file_transfer_new_sending (contact_number,
+                                                                           l->data));
+  g_list_free_full (files, g_object_unref);
+}
 
-      file_number = tox_new_file_sender (priv->tox_struct,
-                                              contact_number,
-                                              file_size,
-                                              (guint8*)file_name,
-                                              strlen (file_name));
+static gboolean
+on_connection_status_idle (gpointer user_data)
+{
+  DataInt *data = user_data;
+  NeulandTox *tox = data->tox;
+  NeulandContact *contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
 
-      g_mutex_unlock (&priv->mutex);
+  if (contact != NULL)
+    {
+      neuland_contact_set_connected (contact, data->integer);
 
-      if (file_number > -1)
+      if (data->integer)
         {
-          neuland_file_transfer_set_file_number (file_transfer, file_number);
+          neuland_tox_offer_file_transfers_again (tox, contact);
+          neuland_tox_flush_outgoing_queue (tox, contact);
+        }
+    }
+
+  free_data_integer (data);
 
-          g_hash_table_insert (priv->file_transfers_sending_ht, file_transfer, file_transfer);
-          g_hash_table_insert (priv->file_transfers_all_ht, file_transfer, file_transfer);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_resend_pending_idle (gpointer user_data)
+{
+  DataInt *data = user_data;
+  NeulandTox *tox = data->tox;
+  gpointer number = GINT_TO_POINTER (data->contact_number);
+  NeulandContact *contact = neuland_tox_get_contact_by_number (tox, data->contact_number);
 
-          neuland_contact_add_file_transfer (contact, file_transfer);
-          /* Now we have to wait for TOX_FILECONTROL_ACCEPT ... */
-        }
-      else
-        g_warning ("Error when calling_new_file_sender() for transfer %s", file_name);
-    }
-  else if (direction == NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE)
-    {
-      g_debug ("Adding new file transfer - receiving: (%p)", file_transfer);
-      /* We got the file number with the send request. */
-      g_return_if_fail (neuland_file_transfer_get_file_number (file_transfer) != -1);
+  /* A running resend reports what is left when it is done */
+  if (!g_hash_table_contains (tox->priv->resends_ht, number))
+    g_hash_table_insert (tox->priv->resends_ht, number, GINT_TO_POINTER (RESEND_PENDING));
 
-      g_hash_table_insert (priv->file_transfers_receiving_ht, file_transfer, file_transfer);
-      g_hash_table_insert (priv->file_transfers_all_ht, file_transfer, file_transfer);
+  if (contact != NULL && neuland_contact_get_connected (contact))
+    neuland_tox_flush_outgoing_queue (tox, contact);
 
-      neuland_contact_add_file_transfer (contact, file_transfer);
-    }
+  free_data_integer (data);
 
-  g_free (file_name);
+  return G_SOURCE_REMOVE;
 }
 
 static gboolean
@@ -1060,6 +3634,7 @@ on_file_send_request_idle (gpointer user_data)
   g_warn_if_fail (NEULAND_IS_FILE_TRANSFER (file_transfer));
 
   neuland_tox_add_file_transfer (data->tox, file_transfer);
+  neuland_tox_continue_file_transfer (data->tox, file_transfer);
 
   free_data_file_send_request (data);
 
@@ -1083,7 +3658,7 @@ on_file_send_request (Tox *tox_struct,
   data->file_name = g_strndup ((gchar*)file_name, file_name_length);
   data->tox = NEULAND_TOX (user_data);
 
-  g_idle_add (on_file_send_request_idle, data);
+  neuland_tox_push_event (data->tox, EVENT_FILE_SEND_REQUEST, data);
 }
 
 static NeulandFileTransfer *
@@ -1097,60 +3672,13 @@ neuland_tox_get_file_transfer (NeulandTox *tox,
   g_return_val_if_fail (NEULAND_IS_TOX (tox), NULL);
 
   contact = neuland_tox_get_contact_by_number (tox, contact_number);
+  if (contact == NULL)
+    return NULL;
 
   return neuland_contact_get_file_transfer (contact, direction, file_number);
 }
 
-static gboolean
-on_file_data_idle (gpointer user_data)
-{
-  /* g_debug ("on_file_data_idle"); */
-  DataFileData *data = user_data;
-  NeulandTox *tox = data->tox;
-  GByteArray *data_array = data->data_array;
-  NeulandFileTransfer *file_transfer =
-    neuland_tox_get_file_transfer (tox, data->contact_number,
-                                   NEULAND_FILE_TRANSFER_DIRECTION_RECEIVE,
-                                   data->file_number);
-  NeulandFileTransferState state = neuland_file_transfer_get_state (file_transfer);
-
-  if (file_transfer != NULL)
-    {
-      if (state == NEULAND_FILE_TRANSFER_STATE_KILLED_BY_CONTACT ||
-          state == NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US)
-        /* We do NOT ignore packages for PAUSED transfers here,
-           because this is an idle function and some data can still
-           arrive here after the pause control package has
-           arrived/been sent. */
-        {
-          GEnumClass *eclass = g_type_class_peek (NEULAND_TYPE_FILE_TRANSFER_STATE);
-          GEnumValue *ev = g_enum_get_value (eclass, state);
-
-          g_debug ("Ignoring incoming data package for file transfer %p with state \"%s\"",
-                   file_transfer, ev->value_nick);
-        }
-      else
-        {
-          gssize count =  neuland_file_transfer_append_data (file_transfer, data_array);
-          if (count == -1)
-            {
-              g_warning ("Failed to append incoming data to file "
-                         "transfer %p, going to kill transfer");
-              neuland_file_transfer_set_requested_state
-                (file_transfer, NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US);
-            }
-          else
-            neuland_file_transfer_add_transferred_size (file_transfer, count);
-        }
-    }
-  else
-    g_debug ("Got data package for non-existent file transfer");
-
-  free_data_file_data (data);
-
-  return G_SOURCE_REMOVE;
-}
-
+/* Runs in the tox thread */
 static void
 on_file_data (Tox *tox_struct,
               gint32 contact_number,
@@ -1160,15 +3688,50 @@ on_file_data (Tox *tox_struct,
               gpointer user_data)
 {
   NeulandTox *tox = NEULAND_TOX (user_data);
-  DataFileData *data = g_new0 (DataFileData, 1);
+  ReceiveTransfer *transfer;
 
-  data->tox = tox;
-  data->contact_number = contact_number;
-  data->file_number = file_number;
-  data->data_array = g_byte_array_new_take (g_memdup (file_data, file_data_length),
-                                            file_data_length);
+  transfer = neuland_tox_lookup_receive_transfer (tox, contact_number, file_number);
 
-  g_idle_add (on_file_data_idle, data);
+  /* Data can still arrive for paused transfers, since the contact
+     might have sent it before our pause control package arrived, so
+     those keep their entry. Killed ones don't. */
+  if (transfer == NULL)
+    {
+      g_debug ("Ignoring data package for unknown or killed file transfer");
+      return;
+    }
+
+  /* A contact that did not confirm the offset we asked for sends
+     from the beginning, so we start over as well: the writer thread
+     throws away the ".part" file before it writes this data, and the
+     main loop the restored progress. */
+  if (transfer->awaiting_offset)
+    {
+      DataUpdateFileTransferIdle *update = g_new0 (DataUpdateFileTransferIdle, 1);
+
+      g_message ("Contact can't continue file transfer %p, starting over",
+                 transfer->file_transfer);
+      update->file_transfer = g_object_ref (transfer->file_transfer);
+      update->discarded_size = transfer->offset;
+      neuland_tox_push_event (tox, EVENT_UPDATE_FILE_TRANSFER, update);
+
+      g_clear_pointer (&transfer->pending, g_byte_array_unref);
+      transfer->awaiting_offset = FALSE;
+      transfer->restart = TRUE;
+      transfer->offset = 0;
+    }
+
+  if (transfer->pending != NULL &&
+      transfer->pending->len + file_data_length > WRITE_BLOCK_SIZE)
+    neuland_tox_flush_receive_transfer (tox, transfer, NULL);
+
+  if (transfer->pending == NULL)
+    transfer->pending = g_byte_array_sized_new (WRITE_BLOCK_SIZE);
+
+  g_byte_array_append (transfer->pending, file_data, file_data_length);
+
+  /* The main loop picks this up when it samples the progress. */
+  neuland_file_transfer_add_transferred_size (transfer->file_transfer, file_data_length);
 }
 
 static gboolean
@@ -1196,6 +3759,30 @@ on_file_control_idle (gpointer user_data)
           switch (data->control_type)
             {
             case TOX_FILECONTROL_ACCEPT:
+              /* A contact continuing a transfer we offered again tells
+                 us where, along with the checksum of the data it has,
+                 see neuland_tox_continue_file_transfer(). We only
+                 continue there if our data is the same. */
+              if (data->data_array->len == sizeof (guint64) + RESUME_CHECKSUM_LENGTH &&
+                  neuland_file_transfer_get_state (file_transfer) ==
+                  NEULAND_FILE_TRANSFER_STATE_PENDING)
+                {
+                  guint64 offset;
+
+                  memcpy (&offset, data->data_array->data, sizeof (offset));
+                  if (offset > 0)
+                    {
+                      gchar *checksum =
+                        g_strndup ((gchar *)data->data_array->data + sizeof (offset),
+                                   RESUME_CHECKSUM_LENGTH);
+
+                      neuland_tox_restore_file_transfer (tox, file_transfer,
+                                                         GUINT64_FROM_BE (offset), checksum);
+                      g_free (checksum);
+                      break;
+                    }
+                }
+
               /* PENDING -> IN_PROGRESS */
               neuland_file_transfer_set_requested_state
                 (file_transfer, NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS);
@@ -1305,44 +3892,219 @@ on_file_control (Tox *tox_struct,
   data_struct->control_type = control_type;
   data_struct->data_array = g_byte_array_new_take (g_memdup (data, length), length);
 
-  g_idle_add (on_file_control_idle, data_struct);
+  /* Stop sending right away if the contact paused or killed one of
+     our outgoing transfers. */
+  if (receive_send == 1 &&
+      (control_type == TOX_FILECONTROL_PAUSE || control_type == TOX_FILECONTROL_KILL))
+    neuland_tox_scheduler_remove (tox, contact_number, file_number);
+
+  if (receive_send == 0)
+    {
+      ReceiveTransfer *transfer =
+        neuland_tox_lookup_receive_transfer (tox, contact_number, file_number);
+
+      if (transfer != NULL)
+        switch (control_type)
+          {
+          case TOX_FILECONTROL_FINISHED:
+            /* The main loop may only confirm once all data is
+               written, so the control package goes through the
+               writer thread. */
+            neuland_tox_flush_receive_transfer (tox, transfer, data_struct);
+            neuland_tox_receiver_remove (tox, contact_number, file_number, FALSE);
+            return;
+
+          case TOX_FILECONTROL_PAUSE:
+            neuland_tox_flush_receive_transfer (tox, transfer, NULL);
+            break;
+
+          case TOX_FILECONTROL_KILL:
+            neuland_tox_receiver_remove (tox, contact_number, file_number, FALSE);
+            break;
+
+          case TOX_FILECONTROL_ACCEPT:
+            /* The contact confirms where a restored transfer continues. */
+            if (transfer->awaiting_offset && length == sizeof (guint64))
+              {
+                guint64 offset;
+
+                memcpy (&offset, data, sizeof (offset));
+                transfer->awaiting_offset = GUINT64_FROM_BE (offset) != transfer->offset;
+              }
+            break;
+
+          default:
+            break;
+          }
+    }
+
+  neuland_tox_push_event (tox, EVENT_FILE_CONTROL, data_struct);
 }
 
-static void
-neuland_tox_connect_callbacks (NeulandTox *tox)
+static const struct
+{
+  GSourceFunc handler;      /* frees the event data */
+  GDestroyNotify free_func; /* for discarding unhandled events */
+} event_funcs[EVENT_N] = {
+  [EVENT_CONNECTION_STATUS]    = { on_connection_status_idle, (GDestroyNotify) free_data_integer },
+  [EVENT_USER_STATUS]          = { on_user_status_idle, (GDestroyNotify) free_data_integer },
+  [EVENT_NAME_CHANGE]          = { on_name_change_idle, (GDestroyNotify) free_data_str },
+  [EVENT_STATUS_MESSAGE]       = { on_status_message_idle, (GDestroyNotify) free_data_str },
+  [EVENT_CONTACT_MESSAGE]      = { on_contact_message_idle, (GDestroyNotify) free_data_str },
+  [EVENT_CONTACT_ACTION]       = { on_contact_action_idle, (GDestroyNotify) free_data_str },
+  [EVENT_TYPING_CHANGE]        = { on_typing_change_idle, (GDestroyNotify) free_data_integer },
+  [EVENT_FRIEND_REQUEST]       = { on_friend_request_idle, (GDestroyNotify) free_data_friend_request },
+  [EVENT_FILE_SEND_REQUEST]    = { on_file_send_request_idle, (GDestroyNotify) free_data_file_send_request },
+  [EVENT_FILE_CONTROL]         = { on_file_control_idle, (GDestroyNotify) free_data_file_control },
+  [EVENT_UPDATE_FILE_TRANSFER] = { neuland_tox_update_file_transfer_idle,
+                                   (GDestroyNotify) free_data_update_file_transfer },
+  [EVENT_COMMAND_DONE]         = { on_command_done_idle, (GDestroyNotify) free_command },
+  [EVENT_READ_RECEIPT]         = { on_read_receipt_idle, (GDestroyNotify) free_data_receipt },
+  [EVENT_RESEND_PENDING]       = { on_resend_pending_idle, (GDestroyNotify) free_data_integer },
+};
+
+static gboolean
+neuland_tox_drain_source_dispatch (GSource *source,
+                                   GSourceFunc callback,
+                                   gpointer user_data)
 {
+  NeulandTox *tox = ((NeulandToxSource *)source)->tox;
   NeulandToxPrivate *priv = tox->priv;
-  Tox *tox_struct = priv->tox_struct;
+  NeulandToxEventStats *stats = &priv->event_stats;
+  NeulandToxEvent *event;
+  gint64 now = g_get_monotonic_time ();
+  gint depth;
+  gint i;
+
+  /* Clear the flag before popping, so that events pushed from now on
+     schedule another dispatch. */
+  g_source_set_ready_time (source, -1);
+  g_atomic_int_set (&priv->drain_scheduled, FALSE);
+
+  depth = g_async_queue_length (priv->events);
+  stats->max_depth = MAX (stats->max_depth, depth);
+
+  for (i = 0; i < MAX_EVENTS_PER_DRAIN; i++)
+    {
+      gint64 latency;
+
+      event = g_async_queue_try_pop (priv->events);
+      if (event == NULL)
+        break;
+
+      latency = now - event->push_time;
+      stats->last_latency = latency;
+      stats->max_latency = MAX (stats->max_latency, latency);
+      stats->total_latency += latency;
+      stats->drained++;
+
+      event_funcs[event->type].handler (event->data);
+      g_slice_free (NeulandToxEvent, event);
+    }
+
+  /* Leave the rest of the batch for the next main loop iteration. */
+  if (i == MAX_EVENTS_PER_DRAIN && g_async_queue_length (priv->events) > 0)
+    {
+      g_atomic_int_set (&priv->drain_scheduled, TRUE);
+      g_source_set_ready_time (source, 0);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs neuland_tox_drain_source_funcs = {
+  NULL, /* prepare; we only use the ready time */
+  NULL, /* check */
+  neuland_tox_drain_source_dispatch,
+  NULL, /* finalize */
+};
+
+/* Discards all events that have not been handled yet. */
+static void
+neuland_tox_clear_events (NeulandTox *tox)
+{
+  NeulandToxEvent *event;
+
+  while ((event = g_async_queue_try_pop (tox->priv->events)) != NULL)
+    {
+      event_funcs[event->type].free_func (event->data);
+      g_slice_free (NeulandToxEvent, event);
+    }
+}
+
+/* Fills @stats with the counters of the event queue. Latencies are
+   in microseconds, measured from queuing an event in the tox thread
+   to handling it in the main loop. */
+void
+neuland_tox_get_event_stats (NeulandTox *tox,
+                             NeulandToxEventStats *stats)
+{
+  NeulandToxPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (stats != NULL);
+
+  priv = tox->priv;
+
+  *stats = priv->event_stats;
+  stats->pushed = (guint) g_atomic_int_get (&priv->events_pushed);
+  stats->depth = g_async_queue_length (priv->events);
+}
+
+/* Fills @stats with the counters of outgoing text. In flight and
+   retransmitted count toxcore messages, so a long text that had to
+   be split counts more than once there. */
+void
+neuland_tox_get_delivery_stats (NeulandTox *tox,
+                                NeulandToxDeliveryStats *stats)
+{
+  NeulandToxPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (stats != NULL);
 
-  g_mutex_lock (&priv->mutex);
+  priv = tox->priv;
 
-  tox_callback_connection_status (tox_struct, on_connection_status, tox);
-  tox_callback_user_status (tox_struct, on_user_status, tox);
-  tox_callback_name_change (tox_struct, on_name_change, tox);
-  tox_callback_status_message (tox_struct, on_status_message, tox);
-  tox_callback_friend_message (tox_struct, on_contact_message, tox);
-  tox_callback_friend_action (tox_struct, on_contact_action, tox);
-  tox_callback_typing_change (tox_struct, on_typing_change, tox);
-  tox_callback_friend_request (tox_struct, on_friend_request, tox);
+  *stats = priv->delivery_stats;
+  stats->in_flight = (guint) g_atomic_int_get (&priv->in_flight_chunks);
+  stats->retransmitted = (guint) g_atomic_int_get (&priv->retransmitted);
+}
 
-  tox_callback_file_send_request (tox_struct, on_file_send_request, tox);
-  tox_callback_file_data (tox_struct, on_file_data, tox);
-  tox_callback_file_control (tox_struct, on_file_control, tox);
+static const NeulandToxCallbacks tox_callbacks = {
+  on_connection_status,
+  on_user_status,
+  on_name_change,
+  on_status_message,
+  on_contact_message,
+  on_contact_action,
+  on_typing_change,
+  on_friend_request,
+  on_file_send_request,
+  on_file_control,
+  on_file_data,
+  on_read_receipt,
+};
 
-  g_mutex_unlock (&priv->mutex);
+static void
+neuland_tox_connect_callbacks (NeulandTox *tox)
+{
+  NeulandToxPrivate *priv = tox->priv;
 
-  /* TODO: */
-  /* tox_callback_group_invite (tox_struct, NULL, tox); */
-  /* tox_callback_group_message (tox_struct, NULL, tox); */
-  /* tox_callback_group_action (tox_struct, NULL, tox); */
-  /* tox_callback_group_namelist_change (tox_struct, NULL, tox); */
+  /* Called before the tox thread is started, so we may still use
+     tox_struct directly here. */
+  priv->backend->set_callbacks (priv->tox_struct, &tox_callbacks, tox);
 }
 
+/* Loads the tox data file the "data-path" property was set to, if
+   any. @priv->data_path is set again afterwards if we can save to
+   it on exit. */
 static void
-neuland_tox_set_data_path (NeulandTox *tox, const gchar *data_path)
+neuland_tox_load_data (NeulandTox *tox)
 {
   NeulandToxPrivate *priv;
+  const NeulandToxBackend *backend;
   Tox *tox_struct;
+  gchar *data_path;
   gchar *data;
   gsize length;
   GError *error = NULL;
@@ -1355,19 +4117,23 @@ neuland_tox_set_data_path (NeulandTox *tox, const gchar *data_path)
   g_return_if_fail (NEULAND_IS_TOX (tox));
 
   priv = tox->priv;
+  backend = priv->backend;
   tox_struct = priv->tox_struct;
+  data_path = priv->data_path;
+  priv->data_path = NULL;
 
   g_message ("Setting data path for tox instance %p to \"%s\".", tox, data_path);
 
+  /* We are called while constructing, so the tox thread is not
+     running yet and we may use tox_struct directly. */
+
   if (data_path != NULL)
     {
       if (g_file_get_contents (data_path, &data, &length, &error))
         {
           gint ret;
 
-          g_mutex_lock (&priv->mutex);
-          ret = tox_load (tox_struct, (guint8*)data, length);
-          g_mutex_unlock (&priv->mutex);
+          ret = backend->load (tox_struct, (guint8*)data, length);
 
           if (ret == -1)
             g_message ("tox_load () for data path \"%s\" returned -1; "
@@ -1403,11 +4169,7 @@ neuland_tox_set_data_path (NeulandTox *tox, const gchar *data_path)
         }
     }
 
-  g_mutex_lock (&priv->mutex);
-
-  tox_get_address (tox_struct, address);
-
-  g_mutex_unlock (&priv->mutex);
+  backend->get_address (tox_struct, address);
 
   neuland_bin_to_hex_string (address, hex_string, TOX_FRIEND_ADDRESS_SIZE);
   priv->tox_id_hex = g_strndup (hex_string, TOX_FRIEND_ADDRESS_SIZE * 2);
@@ -1424,132 +4186,198 @@ neuland_tox_set_data_path (NeulandTox *tox, const gchar *data_path)
     {
       guint16 l;
 
-      g_mutex_lock (&priv->mutex);
-
-      l = tox_get_self_name (tox_struct, name);
+      l = backend->get_self_name (tox_struct, name);
       priv->name = g_strndup ((gchar*)name, l);
 
-      l = tox_get_self_status_message (tox_struct, status_message, TOX_MAX_STATUSMESSAGE_LENGTH);
+      l = backend->get_self_status_message (tox_struct, status_message, TOX_MAX_STATUSMESSAGE_LENGTH);
       priv->status_message = g_strndup ((gchar*)status_message, l);
 
-      g_mutex_unlock (&priv->mutex);
-
       g_debug ("Setting our name from tox data file: \"%s\"", priv->name);
       g_debug ("Setting our status message from tox data file: \"%s\"", priv->status_message);
     }
+
+  g_free (data_path);
+}
+
+typedef struct
+{
+  gint32 contact_number;
+  guint8 client_id[TOX_CLIENT_ID_SIZE];
+  guint64 last_online;
+  gchar *name;
+  gchar *status_message;
+} DataContactInfo;
+
+static void
+clear_data_contact_info (DataContactInfo *info)
+{
+  g_clear_pointer (&info->name, g_free);
+  g_clear_pointer (&info->status_message, g_free);
+}
+
+/* Runs in the tox thread */
+static void
+neuland_tox_get_contact_info (NeulandTox *tox,
+                              gint32 contact_number,
+                              DataContactInfo *info)
+{
+  const NeulandToxBackend *backend = tox->priv->backend;
+  Tox *tox_struct = tox->priv->tox_struct;
+  guint8 tox_name[TOX_MAX_NAME_LENGTH];
+  guint8 status_message[TOX_MAX_STATUSMESSAGE_LENGTH];
+  gint l;
+
+  info->contact_number = contact_number;
+  backend->get_client_id (tox_struct, contact_number, info->client_id);
+  info->last_online = backend->get_last_online (tox_struct, contact_number);
+
+  l = backend->get_name (tox_struct, contact_number, tox_name);
+  info->name = g_strndup ((gchar*)tox_name, l);
+  l = backend->get_status_message (tox_struct, contact_number,
+                                   status_message, TOX_MAX_STATUSMESSAGE_LENGTH);
+  info->status_message = g_strndup ((gchar*)status_message, l);
+}
+
+/* Creates a NeulandContact from @info and adds it to this NeulandTox
+   instance. */
+static NeulandContact *
+neuland_tox_add_contact_from_info (NeulandTox *tox,
+                                   DataContactInfo *info)
+{
+  NeulandContact *contact;
+
+  g_debug ("  adding contact with number %i", info->contact_number);
+
+  contact = neuland_contact_new (info->client_id, info->contact_number, info->last_online);
+
+  g_object_set (contact,
+                "name", info->name,
+                "status-message", info->status_message,
+                NULL);
+
+  g_object_connect (contact,
+                    "signal::outgoing-message", on_outgoing_message_cb, tox,
+                    "signal::outgoing-action", on_outgoing_action_cb, tox,
+                    "signal::notify::show-typing", on_show_typing_cb, tox,
+                    NULL);
+  neuland_tox_set_contact (tox, info->contact_number, contact);
+
+  return contact;
 }
 
+/* Called before the tox thread is started, so we may still use
+   tox_struct directly here. */
 static void
 neuland_tox_load_contacts (NeulandTox *tox)
 {
   NeulandToxPrivate *priv = tox->priv;
+  const NeulandToxBackend *backend = priv->backend;
   Tox *tox_struct = priv->tox_struct;
-  GHashTable *contacts_ht = tox->priv->contacts_ht;
   guint32 n_contacts;
   gint32 *contact_list;
   int i;
 
   g_debug ("Loading contacts ...");
 
-  g_mutex_lock (&priv->mutex);
-
-  n_contacts = tox_count_friendlist (tox_struct);
+  n_contacts = backend->count_friendlist (tox_struct);
   contact_list = g_malloc0 (n_contacts * sizeof (gint32));
-  tox_get_friendlist (tox_struct, contact_list, n_contacts);
+  backend->get_friendlist (tox_struct, contact_list, n_contacts);
 
   for (i = 0; i < n_contacts; i++)
     {
       gint contact_number = contact_list[i];
-      guint8 client_id[TOX_CLIENT_ID_SIZE] = {0};
-      NeulandContact *contact;
-      guint8 tox_name[TOX_MAX_NAME_LENGTH];
-      guint8 status_message[TOX_MAX_STATUSMESSAGE_LENGTH];
-      gchar *new_tox_name;
-      gchar *new_status_message;
-      gint l;
+      DataContactInfo info = { 0, };
 
       /* Skip contacts that we already have NeulandContact objects for */
-      if (g_hash_table_contains (contacts_ht, GINT_TO_POINTER (contact_number)))
+      if (neuland_tox_get_contact_by_number (tox, contact_number) != NULL)
         {
           g_debug ("  skipping contact with number %i; already added", contact_number);
           continue;
         }
 
       /* Create NeulandContacts and add them to this NeulandTox instance. */
-      g_debug ("  adding contact with number %i", contact_number);
-
-      tox_get_client_id (tox_struct, contact_number, client_id);
+      neuland_tox_get_contact_info (tox, contact_number, &info);
+      neuland_tox_add_contact_from_info (tox, &info);
+      clear_data_contact_info (&info);
+    }
 
-      contact =  neuland_contact_new
-        (client_id, contact_number, tox_get_last_online (tox_struct, contact_number));
+  g_free (contact_list);
+}
 
-      l = tox_get_name (tox_struct, contact_number, tox_name);
-      new_tox_name = g_strndup ((gchar*)tox_name, l);
-      l = tox_get_status_message (tox_struct, contact_number,
-                                  status_message, TOX_MAX_STATUSMESSAGE_LENGTH);
-      new_status_message = g_strndup ((gchar*)status_message, l);
+typedef struct
+{
+  guint8 address[TOX_FRIEND_ADDRESS_SIZE];
+  gchar *hex_address;
+  gchar *message;
+  DataContactInfo info;
+} DataAddContact;
 
-      g_object_set (contact,
-                    "name", new_tox_name,
-                    "status-message", new_status_message,
-                    NULL);
+static void
+free_data_add_contact (DataAddContact *data)
+{
+  g_free (data->hex_address);
+  g_free (data->message);
+  clear_data_contact_info (&data->info);
+  g_free (data);
+}
 
-      g_object_connect (contact,
-                        "signal::outgoing-message", on_outgoing_message_cb, tox,
-                        "signal::outgoing-action", on_outgoing_action_cb, tox,
-                        "signal::notify::show-typing", on_show_typing_cb, tox,
-                        NULL);
-      g_hash_table_insert (contacts_ht, GINT_TO_POINTER (contact_number), contact);
+/* Runs in the tox thread */
+static gint
+add_contact_func (NeulandTox *tox,
+                  gpointer user_data)
+{
+  DataAddContact *data = user_data;
+  gint32 friend_number;
 
-      g_free (new_tox_name);
-      g_free (new_status_message);
-    }
+  friend_number = tox->priv->backend->add_friend (tox->priv->tox_struct, data->address,
+                                                  (guint8*)data->message,
+                                                  strlen (data->message));
 
-  g_mutex_unlock (&priv->mutex);
+  if (friend_number >= 0)
+    neuland_tox_get_contact_info (tox, friend_number, &data->info);
 
-  g_free (contact_list);
+  return friend_number;
 }
 
-void
-neuland_tox_add_contact_from_hex_address (NeulandTox *tox,
-                                          const gchar *hex_address,
-                                          const gchar *message)
+static void
+add_contact_done (NeulandTox *tox,
+                  gint friend_number,
+                  gpointer user_data)
 {
-  /* Tox wants at least one byte for the message, so in case the
-     message entry is empty we send one space. */
-  gchar *tmp_message = g_strdup (g_strcmp0 (message, "") == 0 ? " " : message);
-  NeulandToxPrivate *priv = tox->priv;
-  guint8 bin_address[TOX_FRIEND_ADDRESS_SIZE] = {0,};
-  gint32 friend_number;
+  DataAddContact *data = user_data;
   NeulandContact *contact;
-  gboolean valid_hex = neuland_hex_string_to_bin (hex_address,
-                                                  bin_address,
-                                                  TOX_FRIEND_ADDRESS_SIZE);
-
-  g_debug ("neuland_tox_add_contact_from_hex_address %s", hex_address);
-
-  g_mutex_lock (&priv->mutex);
-  friend_number = tox_add_friend (priv->tox_struct, bin_address,
-                                  (guint8*)tmp_message, strlen (tmp_message));
-  g_mutex_unlock (&priv->mutex);
-
-  g_free (tmp_message);
 
   if (friend_number < 0)
     {
       g_warning ("Failed to add contact from hex address \"%s\". Tox error number: %i (%s)",
-                 hex_address, friend_number, tox_faerr_to_string (friend_number));
+                 data->hex_address, friend_number, tox_faerr_to_string (friend_number));
       return;
     }
 
-  neuland_tox_load_contacts (tox);
-
-  contact =
-    g_hash_table_lookup (priv->contacts_ht, GINT_TO_POINTER (friend_number));
+  contact = neuland_tox_add_contact_from_info (tox, &data->info);
 
   g_signal_emit (tox, signals[CONTACT_ADD], 0, contact);
 }
 
+void
+neuland_tox_add_contact_from_hex_address (NeulandTox *tox,
+                                          const gchar *hex_address,
+                                          const gchar *message)
+{
+  DataAddContact *data = g_new0 (DataAddContact, 1);
+
+  g_debug ("neuland_tox_add_contact_from_hex_address %s", hex_address);
+
+  neuland_hex_string_to_bin (hex_address, data->address, TOX_FRIEND_ADDRESS_SIZE);
+  data->hex_address = g_strdup (hex_address);
+  /* Tox wants at least one byte for the message, so in case the
+     message entry is empty we send one space. */
+  data->message = g_strdup (g_strcmp0 (message, "") == 0 ? " " : message);
+
+  neuland_tox_invoke (tox, add_contact_func, add_contact_done,
+                      data, (GDestroyNotify) free_data_add_contact);
+}
+
 void
 remove_contacts (NeulandTox *tox,
                  GList *removed_contacts,
@@ -1565,55 +4393,98 @@ remove_contacts (NeulandTox *tox,
 
       if (number < 0)
         {
-          g_debug ("Removing contact %p from requests hash table");
+          g_debug ("Removing contact %p from requests hash table", contact);
           g_hash_table_remove (priv->requests_ht, contact);
         }
       else
         {
-          g_debug ("Removing contact %p from contacts hash table");
-          g_hash_table_remove (priv->contacts_ht,
-                               GINT_TO_POINTER (neuland_contact_get_number (contact)));
+          g_debug ("Removing contact %p from contacts array", contact);
+          neuland_tox_set_contact (tox, number, NULL);
         }
     }
 }
 
-void
-neuland_tox_remove_contacts (NeulandTox *tox, GList *contacts)
+typedef struct
 {
-  NeulandToxPrivate *priv;
-  GList *removed_contacts = NULL;
-  gboolean pending_requests_changed = FALSE;
+  GPtrArray *contacts;          /* holds a reference on each contact */
+  GArray *results;              /* one gint32 per contact, set in the tox thread */
+} DataContacts;
+
+static DataContacts *
+data_contacts_new (GList *contacts)
+{
+  DataContacts *data = g_new0 (DataContacts, 1);
   GList *l;
 
-  g_return_if_fail (NEULAND_IS_TOX (tox));
-  g_return_if_fail (contacts != NULL);
-  g_return_if_fail (NEULAND_IS_CONTACT (contacts->data));
+  data->contacts = g_ptr_array_new_with_free_func (g_object_unref);
+  for (l = contacts; l; l = l->next)
+    g_ptr_array_add (data->contacts, g_object_ref (l->data));
 
-  g_debug ("neuland_tox_remove_contact");
+  data->results = g_array_sized_new (FALSE, TRUE, sizeof (gint32), data->contacts->len);
+  g_array_set_size (data->results, data->contacts->len);
 
-  priv = tox->priv;
+  return data;
+}
 
-  for (l = contacts; l; l = l->next)
+static void
+free_data_contacts (DataContacts *data)
+{
+  g_ptr_array_unref (data->contacts);
+  g_array_unref (data->results);
+  g_free (data);
+}
+
+/* Runs in the tox thread. The contacts are referenced by @user_data
+   and the number of a contact only changes in the main thread when
+   accepting a request, which does not happen for contacts we remove
+   here. */
+static gint
+remove_contacts_func (NeulandTox *tox,
+                      gpointer user_data)
+{
+  DataContacts *data = user_data;
+  guint i;
+
+  for (i = 0; i < data->contacts->len; i++)
     {
-      NeulandContact *contact  = l->data;
+      NeulandContact *contact = g_ptr_array_index (data->contacts, i);
 
       if (neuland_contact_is_request (contact))
+        g_array_index (data->results, gint32, i) = 0;
+      else
         {
-          removed_contacts = g_list_prepend (removed_contacts, contact);
-          pending_requests_changed = TRUE;
+          neuland_tox_clear_in_flight (tox, neuland_contact_get_number (contact));
+          g_array_index (data->results, gint32, i) =
+            tox->priv->backend->del_friend (tox->priv->tox_struct,
+                                            neuland_contact_get_number (contact));
         }
+    }
+
+  return 0;
+}
+
+static void
+remove_contacts_done (NeulandTox *tox,
+                      gint ret,
+                      gpointer user_data)
+{
+  DataContacts *data = user_data;
+  GList *removed_contacts = NULL;
+  gboolean pending_requests_changed = FALSE;
+  guint i;
+
+  for (i = 0; i < data->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (data->contacts, i);
+
+      if (g_array_index (data->results, gint32, i) == -1)
+        g_warning ("Calling tox_del_friend failed for contact %p", contact);
       else
         {
-          gint ret;
+          if (neuland_contact_is_request (contact))
+            pending_requests_changed = TRUE;
 
-          g_mutex_lock (&priv->mutex);
-          ret = tox_del_friend (priv->tox_struct, neuland_contact_get_number (contact));
-          g_mutex_unlock (&priv->mutex);
-
-          if (ret == -1)
-            g_warning ("Calling tox_del_friend failed for contact %p", contact);
-          else
-            removed_contacts = g_list_prepend (removed_contacts, contact);
+          removed_contacts = g_list_prepend (removed_contacts, contact);
         }
     }
 
@@ -1623,41 +4494,60 @@ neuland_tox_remove_contacts (NeulandTox *tox, GList *contacts)
   if (pending_requests_changed)
     g_object_notify_by_pspec (G_OBJECT (tox), properties[PROP_PENDING_REQUESTS]);
 
-  g_list_free (removed_contacts);
-}
+  g_list_free (removed_contacts);
+}
+
+void
+neuland_tox_remove_contacts (NeulandTox *tox, GList *contacts)
+{
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (contacts != NULL);
+  g_return_if_fail (NEULAND_IS_CONTACT (contacts->data));
+
+  g_debug ("neuland_tox_remove_contact");
 
+  neuland_tox_invoke (tox, remove_contacts_func, remove_contacts_done,
+                      data_contacts_new (contacts), (GDestroyNotify) free_data_contacts);
+}
 
-/* Add each contact in the @contacts list. Notice that we update each
-   contact in place from a 'request' contact with a friend number of
-   -1 to a normal contact with the new friend number given by
-   tox_add_friend_norequest. */
-void
-neuland_tox_accept_contact_requests (NeulandTox *tox,
-                                     GList *contacts)
+/* Runs in the tox thread. The Tox ID of a contact never changes. */
+static gint
+accept_contact_requests_func (NeulandTox *tox,
+                              gpointer user_data)
 {
-  NeulandToxPrivate *priv;
-  GList *accepted_contacts = NULL;
-  GList *l;
+  DataContacts *data = user_data;
+  guint i;
 
-  g_return_if_fail (NEULAND_IS_TOX (tox));
+  for (i = 0; i < data->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (data->contacts, i);
 
-  priv = tox->priv;
+      g_array_index (data->results, gint32, i) =
+        tox->priv->backend->add_friend_norequest (tox->priv->tox_struct,
+                                                  neuland_contact_get_tox_id (contact));
+    }
 
-  for (l = contacts; l; l = l->next)
-    {
-      NeulandContact *contact = l->data;
-      gint32 number;
+  return 0;
+}
 
-      g_return_if_fail (neuland_contact_is_request (contact));
+static void
+accept_contact_requests_done (NeulandTox *tox,
+                              gint ret,
+                              gpointer user_data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  DataContacts *data = user_data;
+  GList *accepted_contacts = NULL;
+  guint i;
 
-      g_mutex_lock (&priv->mutex);
-      number = tox_add_friend_norequest (priv->tox_struct,
-                                         neuland_contact_get_tox_id (contact));
-      g_mutex_unlock (&priv->mutex);
+  for (i = 0; i < data->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (data->contacts, i);
+      gint32 number = g_array_index (data->results, gint32, i);
 
       if (number < 0)
         g_warning ("Failed to add contact request from Tox ID %s",
-                   neuland_contact_get_tox_id (contact));
+                   neuland_contact_get_tox_id_hex (contact));
       else
         {
           /* contact has a tox friend number now, so override the -1 with that new number. */
@@ -1668,7 +4558,7 @@ neuland_tox_accept_contact_requests (NeulandTox *tox,
              g_object_ref() beforehand, or @contact would be destroyed. */
           g_object_ref (contact);
           g_hash_table_remove (priv->requests_ht, contact);
-          g_hash_table_insert (priv->contacts_ht, GINT_TO_POINTER (number), contact);
+          neuland_tox_set_contact (tox, number, contact);
 
           g_message ("Added contact \"%s\" (%p) from request as number %i",
                      neuland_contact_get_preferred_name (contact), contact, number);
@@ -1685,28 +4575,133 @@ neuland_tox_accept_contact_requests (NeulandTox *tox,
   g_list_free (accepted_contacts);
 }
 
+/* Add each contact in the @contacts list. Notice that we update each
+   contact in place from a 'request' contact with a friend number of
+   -1 to a normal contact with the new friend number given by
+   tox_add_friend_norequest. */
+void
+neuland_tox_accept_contact_requests (NeulandTox *tox,
+                                     GList *contacts)
+{
+  GList *l;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+
+  for (l = contacts; l; l = l->next)
+    g_return_if_fail (neuland_contact_is_request (l->data));
+
+  neuland_tox_invoke (tox, accept_contact_requests_func, accept_contact_requests_done,
+                      data_contacts_new (contacts), (GDestroyNotify) free_data_contacts);
+}
+
+static gboolean
+neuland_tox_quit_loop_idle (gpointer user_data)
+{
+  g_main_loop_quit ((GMainLoop *)user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
 void
 neuland_tox_save_and_kill (NeulandTox *tox)
 {
   NeulandToxPrivate *priv;
+  GHashTableIter iter;
+  gpointer source_id;
+  guint i;
 
   g_return_if_fail (NEULAND_IS_TOX (tox));
 
   priv = tox->priv;
 
+  g_debug ("Stopping tox thread ...");
+
+  priv->is_running = FALSE;
+
+  /* Queued messages that weren't sent yet stay saved */
+  g_hash_table_iter_init (&iter, priv->outgoing_flushes_ht);
+  while (g_hash_table_iter_next (&iter, NULL, &source_id))
+    g_source_remove (GPOINTER_TO_UINT (source_id));
+  g_hash_table_remove_all (priv->outgoing_flushes_ht);
+
+  if (priv->outgoing_save_id != 0)
+    {
+      g_source_remove (priv->outgoing_save_id);
+      priv->outgoing_save_id = 0;
+      neuland_tox_save_outgoing_queues (tox);
+    }
+
+  if (priv->tox_thread != NULL)
+    {
+      /* Quitting from inside the tox context ensures the loop has
+         actually started running before we wait for the thread. The
+         idle priority lets already queued commands run first. */
+      GSource *quit_source = g_idle_source_new ();
+
+      g_source_set_callback (quit_source, neuland_tox_quit_loop_idle, priv->tox_loop, NULL);
+      g_source_attach (quit_source, priv->tox_context);
+      g_source_unref (quit_source);
+
+      g_thread_join (priv->tox_thread);
+      priv->tox_thread = NULL;
+    }
+
+  /* Let outstanding reads finish, their results are handed back
+     below. Received data that is still pending goes to disk. */
+  if (priv->reader_pool != NULL)
+    {
+      g_thread_pool_free (priv->reader_pool, FALSE, TRUE);
+      priv->reader_pool = NULL;
+    }
+
+  if (priv->writer_pool != NULL)
+    {
+      guint j;
+
+      for (i = 0; i < priv->receive_slots->len; i++)
+        {
+          ReceiveTransfer **slots = g_ptr_array_index (priv->receive_slots, i);
+
+          for (j = 0; slots != NULL && j < FILE_NUMBER_SLOTS; j++)
+            if (slots[j] != NULL)
+              neuland_tox_flush_receive_transfer (tox, slots[j], NULL);
+        }
+
+      g_thread_pool_free (priv->writer_pool, FALSE, TRUE);
+      priv->writer_pool = NULL;
+    }
+
+  /* Chat logs are written in the background, make sure nothing is
+     left behind. */
+  for (i = 0; priv->contacts != NULL && i < priv->contacts->len; i++)
+    {
+      NeulandContact *contact = g_ptr_array_index (priv->contacts, i);
+
+      if (contact != NULL && neuland_contact_get_chat_log (contact) != NULL)
+        neuland_chat_log_flush (neuland_contact_get_chat_log (contact));
+    }
+
+  if (priv->search_index != NULL)
+    neuland_search_index_flush (priv->search_index);
+
+  /* The tox thread is gone, from now on we own tox_struct. Run what
+     is left in its context, so that no synchronous caller waits
+     forever. */
+  if (g_main_context_acquire (priv->tox_context))
+    {
+      while (g_main_context_iteration (priv->tox_context, FALSE));
+      neuland_tox_release_context (tox);
+    }
+
   if (priv->data_path)
     {
       gsize size;
       guint8 *contents;
       GError *e = NULL;
 
-      g_mutex_lock (&priv->mutex);
-
-      size = tox_size (priv->tox_struct);
+      size = priv->backend->size (priv->tox_struct);
       contents = g_malloc0 (size);
-      tox_save (priv->tox_struct, contents);
-
-      g_mutex_unlock (&priv->mutex);
+      priv->backend->save (priv->tox_struct, contents);
 
       g_message ("Saving tox data (size: %i bytes) to '%s' ...", size, priv->data_path);
 
@@ -1720,34 +4715,27 @@ neuland_tox_save_and_kill (NeulandTox *tox)
 
   g_debug ("Killing tox ...");
 
-  priv->is_running = FALSE;
-  g_mutex_lock (&priv->mutex);
-  tox_kill (priv->tox_struct);
-  g_mutex_unlock (&priv->mutex);
+  priv->backend->kill (priv->tox_struct);
 }
 
-void
-neuland_tox_set_name (NeulandTox *tox,
-                      const gchar *name)
+/* Runs in the tox thread */
+static gint
+set_name_func (NeulandTox *tox,
+               gpointer user_data)
 {
-  NeulandToxPrivate *priv;
-  gint ret;
-
-  g_return_if_fail (NEULAND_IS_TOX (tox));
-
-  priv = tox->priv;
-
-  g_return_if_fail (name != NULL);
-
-  if (g_strcmp0 (name, priv->name) == 0)
-    return;
-
-  g_mutex_lock (&priv->mutex);
+  gchar *name = user_data;
 
-  ret = tox_set_name (priv->tox_struct, (guint8*)name,
-                      MIN (strlen (name), TOX_MAX_NAME_LENGTH));
+  return tox->priv->backend->set_name (tox->priv->tox_struct, (guint8*)name,
+                                       MIN (strlen (name), TOX_MAX_NAME_LENGTH));
+}
 
-  g_mutex_unlock (&priv->mutex);
+static void
+set_name_done (NeulandTox *tox,
+               gint ret,
+               gpointer user_data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  gchar *name = user_data;
 
   if (ret == 0)
     {
@@ -1764,6 +4752,24 @@ neuland_tox_set_name (NeulandTox *tox,
   g_object_notify_by_pspec (G_OBJECT (tox), properties[PROP_NAME]);
 }
 
+void
+neuland_tox_set_name (NeulandTox *tox,
+                      const gchar *name)
+{
+  NeulandToxPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+
+  priv = tox->priv;
+
+  g_return_if_fail (name != NULL);
+
+  if (g_strcmp0 (name, priv->name) == 0)
+    return;
+
+  neuland_tox_invoke (tox, set_name_func, set_name_done, g_strdup (name), g_free);
+}
+
 const gchar *
 neuland_tox_get_name (NeulandTox *tox)
 {
@@ -1772,6 +4778,15 @@ neuland_tox_get_name (NeulandTox *tox)
   return tox->priv->name;
 }
 
+/* Runs in the tox thread */
+static gint
+set_user_status_func (NeulandTox *tox,
+                      gpointer user_data)
+{
+  return tox->priv->backend->set_user_status (tox->priv->tox_struct,
+                                              (guint8)GPOINTER_TO_INT (user_data));
+}
+
 void
 neuland_tox_set_status (NeulandTox *tox, NeulandContactStatus status)
 {
@@ -1784,9 +4799,10 @@ neuland_tox_set_status (NeulandTox *tox, NeulandContactStatus status)
   g_return_if_fail (NEULAND_IS_TOX (tox));
   priv = tox->priv;
 
-  g_mutex_lock (&priv->mutex);
-  tox_set_user_status (priv->tox_struct, (guint8)status);
-  g_mutex_unlock (&priv->mutex);
+  /* The "status" construct property is set before there is a
+     tox_struct, neuland_tox_constructed () passes it on then. */
+  if (priv->tox_struct != NULL)
+    neuland_tox_invoke (tox, set_user_status_func, NULL, GINT_TO_POINTER (status), NULL);
 
   priv->status = status;
 
@@ -1801,28 +4817,25 @@ neuland_tox_get_status (NeulandTox *tox)
   return tox->priv->status;
 }
 
-void
-neuland_tox_set_status_message (NeulandTox *tox,
-                                const gchar *status_message)
+/* Runs in the tox thread */
+static gint
+set_status_message_func (NeulandTox *tox,
+                         gpointer user_data)
 {
-  NeulandToxPrivate *priv;
-  gint ret;
+  gchar *status_message = user_data;
 
-  g_return_if_fail (NEULAND_IS_TOX (tox));
-  g_return_if_fail (status_message != NULL);
-
-  priv = tox->priv;
-
-  if (g_strcmp0 (status_message, priv->status_message) == 0)
-    return;
-
-  g_mutex_lock (&priv->mutex);
-
-  ret = tox_set_status_message (priv->tox_struct, (guint8*)status_message,
-                                     MIN (strlen (status_message),
-                                          TOX_MAX_STATUSMESSAGE_LENGTH));
+  return tox->priv->backend->set_status_message (tox->priv->tox_struct, (guint8*)status_message,
+                                                 MIN (strlen (status_message),
+                                                      TOX_MAX_STATUSMESSAGE_LENGTH));
+}
 
-  g_mutex_unlock (&priv->mutex);
+static void
+set_status_message_done (NeulandTox *tox,
+                         gint ret,
+                         gpointer user_data)
+{
+  NeulandToxPrivate *priv = tox->priv;
+  gchar *status_message = user_data;
 
   if (ret == 0)
     {
@@ -1843,6 +4856,24 @@ neuland_tox_set_status_message (NeulandTox *tox,
   g_object_notify_by_pspec (G_OBJECT (tox), properties[PROP_STATUS_MESSAGE]);
 }
 
+void
+neuland_tox_set_status_message (NeulandTox *tox,
+                                const gchar *status_message)
+{
+  NeulandToxPrivate *priv;
+
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (status_message != NULL);
+
+  priv = tox->priv;
+
+  if (g_strcmp0 (status_message, priv->status_message) == 0)
+    return;
+
+  neuland_tox_invoke (tox, set_status_message_func, set_status_message_done,
+                      g_strdup (status_message), g_free);
+}
+
 const gchar *
 neuland_tox_get_status_message (NeulandTox *tox)
 {
@@ -1878,8 +4909,15 @@ neuland_tox_set_property (GObject *object,
 
   switch (property_id)
     {
+    case PROP_BACKEND:
+      priv->backend = g_value_get_pointer (value);
+      break;
+    case PROP_BACKEND_DATA:
+      priv->backend_data = g_value_get_pointer (value);
+      break;
     case PROP_DATA_PATH:
-      neuland_tox_set_data_path (nt, g_value_get_string (value));
+      /* Loaded in neuland_tox_constructed () */
+      priv->data_path = g_value_dup_string (value);
       break;
     case PROP_NAME:
       neuland_tox_set_name (nt, g_value_get_string (value));
@@ -1890,6 +4928,12 @@ neuland_tox_set_property (GObject *object,
     case PROP_STATUS_MESSAGE:
       neuland_tox_set_status_message (nt, g_value_get_string (value));
       break;
+    case PROP_UPLOAD_LIMIT:
+      neuland_tox_set_upload_limit (nt, g_value_get_uint64 (value));
+      break;
+    case PROP_CONTACT_UPLOAD_LIMIT:
+      neuland_tox_set_contact_upload_limit (nt, g_value_get_uint64 (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -1922,38 +4966,85 @@ neuland_tox_get_property (GObject *object,
     case PROP_PENDING_REQUESTS:
       g_value_set_int64 (value, neuland_tox_get_pending_requests (nt));
       break;
+    case PROP_UPLOAD_LIMIT:
+      g_value_set_uint64 (value, neuland_tox_get_upload_limit (nt));
+      break;
+    case PROP_CONTACT_UPLOAD_LIMIT:
+      g_value_set_uint64 (value, neuland_tox_get_contact_upload_limit (nt));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
+/* Transfers are journaled and paused rather than killed when there
+   is a journal, so that neither we nor the contact throw away the
+   data transferred so far. */
 static void
-neuland_tox_kill_all_transfers (NeulandTox *tox)
+neuland_tox_stop_all_transfers (NeulandTox *tox)
 {
   NeulandToxPrivate *priv;
+  NeulandFileTransferState stop_state;
   GList *transfers;
   GList *l;
 
-  g_debug ("neuland_tox_kill_all_transfers");
+  g_debug ("neuland_tox_stop_all_transfers");
   g_return_if_fail (NEULAND_IS_TOX (tox));
 
   priv = tox->priv;
   transfers = g_hash_table_get_values (priv->file_transfers_all_ht);
 
+  if (priv->journal_timeout_id != 0)
+    {
+      g_source_remove (priv->journal_timeout_id);
+      priv->journal_timeout_id = 0;
+    }
+  if (priv->sample_timeout_id != 0)
+    {
+      g_source_remove (priv->sample_timeout_id);
+      priv->sample_timeout_id = 0;
+    }
+  neuland_tox_save_transfer_journal (tox);
+
+  stop_state = priv->journal_path != NULL ?
+    NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US :
+    NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US;
+
   for (l = transfers; l != NULL; l = l->next)
     {
       NeulandFileTransfer *transfer = l->data;
       NeulandFileTransferState state = neuland_file_transfer_get_state (transfer);
+
+      /* The journal must not change anymore. */
+      g_signal_handlers_disconnect_by_func (transfer, on_file_transfer_state_changed_cb, tox);
+
       if (state == NEULAND_FILE_TRANSFER_STATE_IN_PROGRESS
           || state == NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_CONTACT
           || state == NEULAND_FILE_TRANSFER_STATE_PAUSED_BY_US)
-        neuland_file_transfer_set_requested_state (transfer,
-                                                   NEULAND_FILE_TRANSFER_STATE_KILLED_BY_US);
+        neuland_file_transfer_set_requested_state (transfer, stop_state);
     }
 
   g_list_free (transfers);
 }
 
+static void
+neuland_tox_constructed (GObject *object)
+{
+  NeulandTox *nt = NEULAND_TOX (object);
+  NeulandToxPrivate *priv = nt->priv;
+
+  if (priv->backend == NULL)
+    priv->backend = neuland_tox_backend_get_toxcore ();
+
+  g_debug ("Using the %s backend for tox instance %p", priv->backend->name, nt);
+
+  priv->tox_struct = priv->backend->new (priv->backend_data);
+  priv->backend->set_user_status (priv->tox_struct, priv->status);
+  neuland_tox_load_data (nt);
+
+  G_OBJECT_CLASS (neuland_tox_parent_class)->constructed (object);
+}
+
 static void
 neuland_tox_dispose (GObject *object)
 {
@@ -1962,9 +5053,8 @@ neuland_tox_dispose (GObject *object)
 
   g_debug ("neuland_tox_dispose %p", object);
 
-  neuland_tox_kill_all_transfers (nt);
+  neuland_tox_stop_all_transfers (nt);
 
-  g_hash_table_destroy (priv->contacts_ht);
   g_hash_table_destroy (priv->requests_ht);
   g_hash_table_destroy (priv->file_transfers_sending_ht);
   g_hash_table_destroy (priv->file_transfers_receiving_ht);
@@ -1981,13 +5071,43 @@ neuland_tox_finalize (GObject *object)
 
   g_debug ("neuland_tox_finalize %p", object);
 
+  /* Still needed to flush the chat logs */
   neuland_tox_save_and_kill (nt);
+  g_clear_pointer (&priv->contacts, g_ptr_array_unref);
 
   g_free (priv->tox_id_hex);
   g_free (priv->data_path);
+  g_free (priv->journal_path);
+  g_key_file_free (priv->journal);
+  g_free (priv->outgoing_path);
+  g_hash_table_destroy (priv->outgoing_flushes_ht);
+  g_hash_table_destroy (priv->resends_ht);
+  g_clear_object (&priv->search_index);
   g_free (priv->name);
   g_free (priv->status_message);
 
+  g_source_destroy (priv->send_source);
+  g_source_unref (priv->send_source);
+  g_hash_table_destroy (priv->send_queues_ht);
+  g_queue_clear (&priv->send_queues);
+  while (!g_queue_is_empty (&priv->free_blocks))
+    free_read_block (g_queue_pop_head (&priv->free_blocks));
+  g_ptr_array_free (priv->receive_slots, TRUE);
+  g_ptr_array_free (priv->in_flight, TRUE);
+
+  g_source_destroy (priv->drain_source);
+  g_source_unref (priv->drain_source);
+  neuland_tox_clear_events (nt);
+  g_async_queue_unref (priv->events);
+  g_main_context_unref (priv->main_context);
+
+  g_source_destroy (priv->tox_do_source);
+  g_source_unref (priv->tox_do_source);
+  g_main_loop_unref (priv->tox_loop);
+  g_main_context_unref (priv->tox_context);
+  g_mutex_clear (&priv->context_mutex);
+  g_cond_clear (&priv->context_cond);
+
   G_OBJECT_CLASS (neuland_tox_parent_class)->finalize (object);
 }
 
@@ -1996,6 +5116,7 @@ neuland_tox_class_init (NeulandToxClass *klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+  gobject_class->constructed = neuland_tox_constructed;
   gobject_class->set_property = neuland_tox_set_property;
   gobject_class->get_property = neuland_tox_get_property;
   gobject_class->dispose = neuland_tox_dispose;
@@ -2003,6 +5124,20 @@ neuland_tox_class_init (NeulandToxClass *klass)
 
   klass->remove_contacts = remove_contacts;
 
+  properties[PROP_BACKEND] =
+    g_param_spec_pointer ("backend",
+                          "Backend",
+                          "The NeulandToxBackend to use, NULL for toxcore",
+                          G_PARAM_CONSTRUCT_ONLY |
+                          G_PARAM_WRITABLE);
+
+  properties[PROP_BACKEND_DATA] =
+    g_param_spec_pointer ("backend-data",
+                          "Backend data",
+                          "Passed to the new function of the backend",
+                          G_PARAM_CONSTRUCT_ONLY |
+                          G_PARAM_WRITABLE);
+
   properties[PROP_DATA_PATH] =
     g_param_spec_string ("data-path",
                          "Data path",
@@ -2050,6 +5185,23 @@ neuland_tox_class_init (NeulandToxClass *klass)
                         0,
                         G_PARAM_READABLE);
 
+  properties[PROP_UPLOAD_LIMIT] =
+    g_param_spec_uint64 ("upload-limit",
+                         "Upload limit",
+                         "Upload rate of all file transfers in bytes per second, 0 for no limit",
+                         0, G_MAXUINT64,
+                         0,
+                         G_PARAM_READWRITE);
+
+  properties[PROP_CONTACT_UPLOAD_LIMIT] =
+    g_param_spec_uint64 ("contact-upload-limit",
+                         "Contact upload limit",
+                         "Upload rate of the file transfers to each contact in "
+                         "bytes per second, 0 for no limit",
+                         0, G_MAXUINT64,
+                         0,
+                         G_PARAM_READWRITE);
+
   g_object_class_install_properties (gobject_class,
                                      PROP_N,
                                      properties);
@@ -2096,10 +5248,7 @@ neuland_tox_init (NeulandTox *tox)
   tox->priv = neuland_tox_get_instance_private (tox);
   priv = tox->priv;
 
-  priv->tox_struct = tox_new (NULL);
-
-  priv->contacts_ht = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                             NULL, g_object_unref);
+  priv->contacts = g_ptr_array_new_with_free_func (free_contact_slot);
   priv->requests_ht = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                              NULL, g_object_unref);
 
@@ -2107,8 +5256,47 @@ neuland_tox_init (NeulandTox *tox)
                                                        NULL, g_object_unref);
   priv->file_transfers_sending_ht = g_hash_table_new (NULL, NULL);
   priv->file_transfers_receiving_ht = g_hash_table_new (NULL, NULL);
-
-  g_mutex_init (&priv->mutex);
+  priv->journal = g_key_file_new ();
+  priv->outgoing_flushes_ht = g_hash_table_new (NULL, NULL);
+  priv->resends_ht = g_hash_table_new (NULL, NULL);
+
+  priv->tox_context = g_main_context_new ();
+  g_mutex_init (&priv->context_mutex);
+  g_cond_init (&priv->context_cond);
+  priv->tox_loop = g_main_loop_new (priv->tox_context, FALSE);
+  priv->tox_do_source = g_source_new (&neuland_tox_do_source_funcs,
+                                      sizeof (NeulandToxSource));
+  ((NeulandToxSource *)priv->tox_do_source)->tox = tox;
+  g_source_set_name (priv->tox_do_source, "NeulandToxDoSource");
+  g_source_set_ready_time (priv->tox_do_source, 0);
+  g_source_attach (priv->tox_do_source, priv->tox_context);
+
+  g_queue_init (&priv->send_queues);
+  priv->send_queues_ht = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                NULL, (GDestroyNotify) free_send_queue);
+  priv->send_source = g_source_new (&neuland_tox_send_source_funcs,
+                                    sizeof (NeulandToxSource));
+  ((NeulandToxSource *)priv->send_source)->tox = tox;
+  g_source_set_name (priv->send_source, "NeulandToxSendSource");
+  g_source_set_priority (priv->send_source, G_PRIORITY_LOW);
+  g_source_attach (priv->send_source, priv->tox_context);
+  g_queue_init (&priv->free_blocks);
+  priv->reader_pool = g_thread_pool_new (neuland_tox_read_block_func, NULL,
+                                         1, FALSE, NULL);
+
+  priv->receive_slots = g_ptr_array_new_with_free_func (free_receive_slots);
+  priv->in_flight = g_ptr_array_new_with_free_func (free_in_flight);
+  priv->writer_pool = g_thread_pool_new (neuland_tox_write_block_func, NULL,
+                                         1, FALSE, NULL);
+
+  priv->main_context = g_main_context_ref_thread_default ();
+  priv->events = g_async_queue_new ();
+  priv->drain_source = g_source_new (&neuland_tox_drain_source_funcs,
+                                     sizeof (NeulandToxSource));
+  ((NeulandToxSource *)priv->drain_source)->tox = tox;
+  g_source_set_name (priv->drain_source, "NeulandToxDrainSource");
+  g_source_set_priority (priv->drain_source, G_PRIORITY_DEFAULT_IDLE);
+  g_source_attach (priv->drain_source, priv->main_context);
 }
 
 static void
@@ -2122,6 +5310,13 @@ neuland_tox_bootstrap (NeulandTox *tox)
 
   priv = tox->priv;
 
+  if (!priv->use_public_nodes)
+    {
+      g_debug ("Not bootstrapping from public nodes");
+      g_free (pub_key_bin);
+      return;
+    }
+
   for (i = 0; i < G_N_ELEMENTS (bootstrap_nodes); i++)
     {
       NeulandToxDhtNode node = bootstrap_nodes[i];
@@ -2133,82 +5328,185 @@ neuland_tox_bootstrap (NeulandTox *tox)
         g_warning ("Ignoring invalid key: %s", node.pub_key);
       else
         {
-          int ret;
-
-          g_mutex_lock (&priv->mutex);
-          ret = tox_bootstrap_from_address (priv->tox_struct,
-                                            node.address,
-                                            node.port,
-                                            pub_key_bin);
-          g_mutex_unlock (&priv->mutex);
+          priv->backend->bootstrap_from_address (priv->tox_struct,
+                                                 node.address,
+                                                 node.port,
+                                                 pub_key_bin);
         }
     }
 
   g_free (pub_key_bin);
 }
 
-static void
+/* This is the function of the tox thread. It iterates the thread's
+   own main context, which runs tox_do() whenever tox_do_interval()
+   has passed or neuland_tox_wakeup() has been called. */
+static gpointer
 neuland_tox_start (NeulandTox *tox)
 {
   NeulandToxPrivate *priv;
-  Tox *tox_struct;
-  gint connected;
 
-  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_val_if_fail (NEULAND_IS_TOX (tox), NULL);
 
   priv = tox->priv;
-  tox_struct = priv->tox_struct;
 
-  g_mutex_lock (&priv->mutex);
-  connected = tox_isconnected (tox_struct);
-  g_mutex_unlock (&priv->mutex);
+  /* Owning the context is what gives us exclusive access to
+     tox_struct, see neuland_tox_invoke(). The main thread only holds
+     it for the duration of a single command. */
+  g_mutex_lock (&priv->context_mutex);
+  while (!g_main_context_acquire (priv->tox_context))
+    g_cond_wait (&priv->context_cond, &priv->context_mutex);
+  g_mutex_unlock (&priv->context_mutex);
 
-  if (connected == 1)
-    return;
+  g_main_context_push_thread_default (priv->tox_context);
 
   neuland_tox_bootstrap (tox);
+  g_main_loop_run (priv->tox_loop);
 
-  while (priv->is_running)
-    {
-      guint32 interval;
+  g_main_context_pop_thread_default (priv->tox_context);
+  g_main_context_release (priv->tox_context);
+
+  g_debug ("Leaving tox_do thread");
+
+  return NULL;
+}
+
+typedef struct
+{
+  gchar *address;
+  guint16 port;
+  guint8 pub_key[TOX_CLIENT_ID_SIZE];
+} DataBootstrapNode;
+
+static void
+free_data_bootstrap_node (DataBootstrapNode *data)
+{
+  g_free (data->address);
+  g_free (data);
+}
+
+/* Runs in the tox thread */
+static gint
+add_bootstrap_node_func (NeulandTox *tox,
+                         gpointer user_data)
+{
+  DataBootstrapNode *data = user_data;
 
-      /* /\* Debugging *\/ */
-      /* if (!g_mutex_trylock (&priv->mutex)) */
-      /*   g_message ("tox_do thread has to wait!"); */
-      /* else */
-      /*   g_mutex_unlock (&priv->mutex); */
+  return tox->priv->backend->bootstrap_from_address (tox->priv->tox_struct,
+                                                     data->address,
+                                                     data->port,
+                                                     data->pub_key);
+}
 
-      g_mutex_lock (&priv->mutex);
+/* Bootstraps from the DHT node at @address and @port, in addition
+   to the public nodes if those are used. */
+void
+neuland_tox_add_bootstrap_node (NeulandTox *tox,
+                                const gchar *address,
+                                guint16 port,
+                                const gchar *pub_key_hex)
+{
+  DataBootstrapNode *data;
 
-      tox_do (tox_struct);
-      interval = tox_do_interval (tox_struct);
+  g_return_if_fail (NEULAND_IS_TOX (tox));
+  g_return_if_fail (address != NULL);
+  g_return_if_fail (pub_key_hex != NULL);
 
-      g_mutex_unlock (&priv->mutex);
+  data = g_new0 (DataBootstrapNode, 1);
 
-      //g_debug ("tox_do, new interval: %i", interval * 1000);
-      g_usleep ((gulong) 1000 * interval);
+  if (!neuland_hex_string_to_bin (pub_key_hex, data->pub_key, TOX_CLIENT_ID_SIZE))
+    {
+      g_warning ("Ignoring invalid key: %s", pub_key_hex);
+      g_free (data);
+      return;
     }
 
-  g_debug ("Leaving tox_do thread");
+  g_debug ("Bootstrapping from %s:%u %s", address, port, pub_key_hex);
+  data->address = g_strdup (address);
+  data->port = port;
+
+  neuland_tox_invoke (tox, add_bootstrap_node_func, NULL,
+                      data, (GDestroyNotify) free_data_bootstrap_node);
 }
 
-NeulandTox *
-neuland_tox_new (gchar *data_path)
+static NeulandTox *
+neuland_tox_new_internal (const NeulandToxBackend *backend,
+                          gpointer backend_data,
+                          gchar *data_path,
+                          gboolean use_public_nodes)
 {
   NeulandTox *tox;
-  GThread *thread;
 
   g_debug ("neuland_tox_new for data: %s", data_path);
 
   tox = NEULAND_TOX (g_object_new (NEULAND_TYPE_TOX,
+                                   "backend", backend,
+                                   "backend-data", backend_data,
                                    "data-path", data_path,
                                    NULL));
+
+  /* The index lives next to the chat logs, see
+     neuland_tox_set_contact(). */
+  if (tox->priv->data_path != NULL)
+    {
+      gchar *directory = g_strconcat (tox->priv->data_path, ".logs/search", NULL);
+
+      tox->priv->search_index = neuland_search_index_new (directory);
+      g_free (directory);
+    }
+
+  /* Without a data file toxcore has no contacts, but other backends
+     may come with some. */
+  neuland_tox_load_contacts (tox);
   if (data_path != NULL)
-    neuland_tox_load_contacts (tox);
+    {
+      neuland_tox_load_transfer_journal (tox);
+      neuland_tox_load_outgoing_queues (tox);
+    }
 
   neuland_tox_connect_callbacks (tox);
+  tox->priv->use_public_nodes = use_public_nodes;
   tox->priv->is_running = TRUE;
-  thread = g_thread_new(NULL, (GThreadFunc) neuland_tox_start, tox);
+  tox->priv->tox_thread = g_thread_new ("tox", (GThreadFunc) neuland_tox_start, tox);
 
   return tox;
 }
+
+/* Like neuland_tox_new(), but only bootstraps from the public DHT
+   nodes if @use_public_nodes is TRUE; otherwise nodes have to be
+   added with neuland_tox_add_bootstrap_node(). */
+NeulandTox *
+neuland_tox_new_full (gchar *data_path,
+                      gboolean use_public_nodes)
+{
+  return neuland_tox_new_internal (NULL, NULL, data_path, use_public_nodes);
+}
+
+/* Creates a NeulandTox without a data file that makes all its
+   toxcore calls through @backend, see neuland-tox-fake.h for a
+   backend to test with. @backend_data is passed to the backend's new
+   function and must stay valid until then. */
+NeulandTox *
+neuland_tox_new_with_backend (const NeulandToxBackend *backend,
+                              gpointer backend_data)
+{
+  g_return_val_if_fail (backend != NULL, NULL);
+
+  return neuland_tox_new_internal (backend, backend_data, NULL, FALSE);
+}
+
+/* Returns the index over the chat logs of all contacts, or NULL if
+   no chat logs are kept. */
+NeulandSearchIndex *
+neuland_tox_get_search_index (NeulandTox *tox)
+{
+  g_return_val_if_fail (NEULAND_IS_TOX (tox), NULL);
+
+  return tox->priv->search_index;
+}
+
+NeulandTox *
+neuland_tox_new (gchar *data_path)
+{
+  return neuland_tox_new_full (data_path, TRUE);
+}
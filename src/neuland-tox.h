@@ -25,6 +25,8 @@
 #include <tox/tox.h>
 
 #include "neuland-contact.h"
+#include "neuland-search-index.h"
+#include "neuland-tox-backend.h"
 
 #define NEULAND_TYPE_TOX            (neuland_tox_get_type ())
 #define NEULAND_TOX(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), NEULAND_TYPE_TOX, NeulandTox))
@@ -54,11 +56,53 @@ struct _NeulandToxClass
   void (* remove_contacts) (NeulandTox *tox, GList *contacts, gpointer user_data);
 };
 
+/* Counters of the queue that hands toxcore events to the main loop,
+   see neuland_tox_get_event_stats(). */
+typedef struct
+{
+  guint pushed;          /* events queued so far */
+  guint64 drained;       /* events handled so far */
+  gint depth;            /* events currently queued */
+  gint max_depth;        /* largest depth seen when draining */
+  gint64 last_latency;   /* microseconds */
+  gint64 max_latency;    /* microseconds */
+  gint64 total_latency;  /* microseconds, divide by drained for the average */
+} NeulandToxEventStats;
+
+#define NEULAND_TOX_LATENCY_BUCKETS 16
+
+/* Delivery of outgoing messages and actions, see
+   neuland_tox_get_delivery_stats(). Long text is sent as several
+   toxcore messages, each has its own read receipt. */
+typedef struct
+{
+  guint in_flight;       /* toxcore messages without a read receipt yet */
+  guint retransmitted;   /* toxcore messages sent again */
+  guint64 delivered;     /* texts whose messages all have been receipted */
+  /* Times from sending a toxcore message to its read receipt. Bucket
+     0 counts those below 1 ms, bucket i those below 2^i ms, and the
+     last bucket all longer ones. */
+  guint64 latency_histogram[NEULAND_TOX_LATENCY_BUCKETS];
+} NeulandToxDeliveryStats;
+
 GType neuland_tox_get_type (void) G_GNUC_CONST;
 
 NeulandTox *
 neuland_tox_new (gchar *data_file);
 
+NeulandTox *
+neuland_tox_new_full (gchar *data_file, gboolean use_public_nodes);
+
+NeulandTox *
+neuland_tox_new_with_backend (const NeulandToxBackend *backend, gpointer backend_data);
+
+NeulandSearchIndex *
+neuland_tox_get_search_index (NeulandTox *tox);
+
+void
+neuland_tox_add_bootstrap_node (NeulandTox *tox, const gchar *address, guint16 port,
+                                const gchar *pub_key_hex);
+
 GList *
 neuland_tox_get_contacts (NeulandTox *tox);
 
@@ -99,6 +143,24 @@ const char *
 neuland_tox_get_tox_id_hex (NeulandTox *tox);
 
 void
-neuland_tox_add_file_transfer_sending (NeulandTox *tox, NeulandFileTransfer *file_transfer);
+neuland_tox_add_file_transfer (NeulandTox *tox, NeulandFileTransfer *file_transfer);
+
+void
+neuland_tox_get_event_stats (NeulandTox *tox, NeulandToxEventStats *stats);
+
+void
+neuland_tox_get_delivery_stats (NeulandTox *tox, NeulandToxDeliveryStats *stats);
+
+void
+neuland_tox_set_upload_limit (NeulandTox *tox, guint64 upload_limit);
+
+guint64
+neuland_tox_get_upload_limit (NeulandTox *tox);
+
+void
+neuland_tox_set_contact_upload_limit (NeulandTox *tox, guint64 upload_limit);
+
+guint64
+neuland_tox_get_contact_upload_limit (NeulandTox *tox);
 
 #endif /* __NEULAND_TOX_H__ */
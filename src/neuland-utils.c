@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <gio/gio.h>
+#include <glib/gi18n.h>
 
 /* Returns: TRUE if the hex string is valid, FALSE otherwise */
 gboolean
@@ -53,12 +54,29 @@ neuland_bin_to_hex_string (guint8 *bin, gchar *hex_string, guint bin_size)
 }
 
 
+/* The clock format is read once and then kept up to date by
+   listening to the setting, timestamps are formatted for every
+   message and every last seen update. */
+static GSettings *interface_settings = NULL;
+static gboolean use_24h_time_format;
+static gboolean locale_has_am_pm;
+
+static void
+on_clock_format_changed (GSettings *settings,
+                         const gchar *key,
+                         gpointer user_data)
+{
+  gchar *clock_format = g_settings_get_string (settings, "clock-format");
+
+  use_24h_time_format = g_strcmp0 (clock_format, "24h") == 0 || !locale_has_am_pm;
+  g_debug ("use_24h_time_format: %s", use_24h_time_format ? "YES" : "NO");
+
+  g_free (clock_format);
+}
+
 gboolean
 neuland_use_24h_time_format (void)
 {
-  static GSettings *interface_settings = NULL;
-  static gboolean locale_has_am_pm;
-
   if (interface_settings == NULL)
     {
       interface_settings = g_settings_new ("org.gnome.desktop.interface");
@@ -68,16 +86,124 @@ neuland_use_24h_time_format (void)
 
       g_date_time_unref (some_time);
       g_free (am_pm);
+
+      g_signal_connect (interface_settings, "changed::clock-format",
+                        G_CALLBACK (on_clock_format_changed), NULL);
+      on_clock_format_changed (interface_settings, "clock-format", NULL);
     }
 
-  gchar *clock_format = g_settings_get_string (interface_settings, "clock-format");
-  gboolean use_24h_time_format = g_strcmp0 (clock_format, "24h") == 0 || !locale_has_am_pm;
+  return use_24h_time_format;
+}
 
-  g_free (clock_format);
+/* Returns: the hour and minute of @time (seconds since the epoch) in
+   the user's clock format. The string is owned by this function and
+   only valid until the next call; it is only formatted again when
+   the minute or the clock format changed. */
+const gchar *
+neuland_format_time_of_day (gint64 time)
+{
+  static gint64 cached_minute = -1;
+  static gboolean cached_24h;
+  static gchar cached_string[32];
+  gboolean use_24h = neuland_use_24h_time_format ();
+  GDateTime *date_time;
+  gchar *string;
+
+  if (time / 60 == cached_minute && use_24h == cached_24h)
+    return cached_string;
+
+  date_time = g_date_time_new_from_unix_local (time);
+  if (use_24h)
+    /* Translators: This is the hour and minute in 24h format */
+    string = g_date_time_format (date_time, _("%H:%M"));
+  else
+    /* Translators: This is the hour and minute in 12h format */
+    string = g_date_time_format (date_time, _("%l:%M %p"));
+
+  g_strlcpy (cached_string, string != NULL ? string : "", sizeof (cached_string));
+  cached_minute = time / 60;
+  cached_24h = use_24h;
+
+  g_date_time_unref (date_time);
+  g_free (string);
+
+  return cached_string;
+}
 
-  g_debug ("use_24h_time_format: %s", use_24h_time_format ? "YES" : "NO");
+/* Start of some days in seconds since the epoch, only computed again
+   once the day changed */
+static gint64 start_tomorrow = G_MININT64;
+static gint64 start_today;
+static gint64 start_yesterday;
+static gint64 start_6_days_ago;
+static gint64 start_year;
 
-  return use_24h_time_format;
+static void
+update_day_boundaries (void)
+{
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (now >= start_tomorrow || now < start_today)
+    {
+      gint y_now, m_now, d_now;  /* year, month, day */
+      GDateTime *date_now = g_date_time_new_now_local ();
+      GDateTime *date_today;
+      GDateTime *date_other;
+
+      g_date_time_get_ymd (date_now, &y_now, &m_now, &d_now);
+      date_today = g_date_time_new_local (y_now, m_now, d_now, 0, 0, 0);
+      start_today = g_date_time_to_unix (date_today);
+
+      date_other = g_date_time_add_days (date_today, 1);
+      start_tomorrow = g_date_time_to_unix (date_other);
+      g_date_time_unref (date_other);
+
+      date_other = g_date_time_add_days (date_today, -1);
+      start_yesterday = g_date_time_to_unix (date_other);
+      g_date_time_unref (date_other);
+
+      date_other = g_date_time_add_days (date_today, -6);
+      start_6_days_ago = g_date_time_to_unix (date_other);
+      g_date_time_unref (date_other);
+
+      date_other = g_date_time_new_local (y_now, 1, 1, 0, 0, 0);
+      start_year = g_date_time_to_unix (date_other);
+      g_date_time_unref (date_other);
+
+      g_date_time_unref (date_today);
+      g_date_time_unref (date_now);
+    }
+}
+
+/* Returns: the start of the current day in seconds since the epoch,
+   it changes at midnight (local time). */
+gint64
+neuland_get_start_of_today (void)
+{
+  update_day_boundaries ();
+
+  return start_today;
+}
+
+/* Returns: how long ago @time (seconds since the epoch) was, in
+   calendar terms of the local time zone. */
+NeulandTimeAge
+neuland_get_time_age (gint64 time)
+{
+  update_day_boundaries ();
+
+  if (time >= start_today)
+    return NEULAND_TIME_AGE_TODAY;
+  else if (time >= start_yesterday)
+    return NEULAND_TIME_AGE_YESTERDAY;
+  else if (time >= start_6_days_ago)
+    /* 6 or less days ago (not 7 days ago, because we don't want to
+       show Monday 10:12 when today is Monday, too). */
+    return NEULAND_TIME_AGE_WEEK;
+  else if (time >= start_year)
+    return NEULAND_TIME_AGE_YEAR;
+  else
+    return NEULAND_TIME_AGE_OLDER;
 }
 
 void
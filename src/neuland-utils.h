@@ -18,9 +18,20 @@
  * along with Neuland.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __NEULAND_UTILS_H__
+#define __NEULAND_UTILS_H__
+
 #include <glib.h>
 #include <gtk/gtk.h>
 
+typedef enum {
+  NEULAND_TIME_AGE_TODAY,
+  NEULAND_TIME_AGE_YESTERDAY,
+  NEULAND_TIME_AGE_WEEK,     /* within the last 6 days */
+  NEULAND_TIME_AGE_YEAR,     /* this calendar year */
+  NEULAND_TIME_AGE_OLDER
+} NeulandTimeAge;
+
 void
 neuland_bin_to_hex_string (guint8 *bin, gchar *hex_string, guint bin_size);
 
@@ -30,5 +41,16 @@ neuland_hex_string_to_bin (const gchar *hex_string, guint8 *bin, guint bin_size)
 gboolean
 neuland_use_24h_time_format (void);
 
+const gchar *
+neuland_format_time_of_day (gint64 time);
+
+gint64
+neuland_get_start_of_today (void);
+
+NeulandTimeAge
+neuland_get_time_age (gint64 time);
+
 void
 list_box_header_func (GtkListBoxRow *row, GtkListBoxRow *before, gpointer user_data);
+
+#endif /* __NEULAND_UTILS_H__ */
@@ -29,6 +29,8 @@
 #include "neuland-me-popover.h"
 #include "neuland-file-transfer.h"
 
+#define MAX_SEARCH_HITS 100
+
 struct _NeulandWindowPrivate
 {
   NeulandTox      *tox;
@@ -36,8 +38,12 @@ struct _NeulandWindowPrivate
   GtkWidget       *me_widget;
   GtkWidget       *scrolled_window_contacts;
   GtkWidget       *scrolled_window_requests;
+  GtkWidget       *scrolled_window_search;
   GtkListBox      *contacts_list_box;
   GtkListBox      *requests_list_box;
+  GtkListBox      *search_list_box;
+  GtkSearchBar    *search_bar;
+  GtkSearchEntry  *search_entry;
   GtkHeaderBar    *right_header_bar;
   GtkHeaderBar    *left_header_bar;
   GtkStack        *chat_stack;
@@ -84,6 +90,9 @@ struct _NeulandWindowPrivate
 
   GtkActionBar    *action_bar;
   GtkButton       *action_bar_accept_button;
+
+  /* Of the search that is running, if any */
+  GCancellable    *search_cancellable;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (NeulandWindow, neuland_window, GTK_TYPE_APPLICATION_WINDOW)
@@ -768,6 +777,11 @@ neuland_window_set_tox (NeulandWindow *window, NeulandTox *tox)
                                           neuland_tox_get_status_message (tox));
 
   gtk_menu_button_set_popover (GTK_MENU_BUTTON (priv->me_button), neuland_me_popover_new (priv->tox));
+
+  /* Without a data path there are no chat logs to search */
+  if (neuland_tox_get_search_index (tox) == NULL)
+    g_simple_action_set_enabled
+      (G_SIMPLE_ACTION (g_action_map_lookup_action (G_ACTION_MAP (window), "search")), FALSE);
 }
 
 NeulandTox *
@@ -925,6 +939,32 @@ neuland_window_status_state_changed (GSimpleAction *action,
   g_simple_action_set_state (action, parameter);
 }
 
+/* The upload limit actions have the limit in KiB/s as their state,
+   0 meaning no limit. */
+static void
+neuland_window_upload_limit_state_changed (GSimpleAction *action,
+                                           GVariant      *parameter,
+                                           gpointer       user_data)
+{
+  NeulandWindow *window = NEULAND_WINDOW (user_data);
+  guint64 limit = (guint64)MAX (g_variant_get_int32 (parameter), 0) * 1024;
+
+  neuland_tox_set_upload_limit (window->priv->tox, limit);
+  g_simple_action_set_state (action, parameter);
+}
+
+static void
+neuland_window_contact_upload_limit_state_changed (GSimpleAction *action,
+                                                   GVariant      *parameter,
+                                                   gpointer       user_data)
+{
+  NeulandWindow *window = NEULAND_WINDOW (user_data);
+  guint64 limit = (guint64)MAX (g_variant_get_int32 (parameter), 0) * 1024;
+
+  neuland_tox_set_contact_upload_limit (window->priv->tox, limit);
+  g_simple_action_set_state (action, parameter);
+}
+
 /* static void
  * on_add_dialog_response (GtkDialog *dialog,
  *                         gint response_id,
@@ -1205,6 +1245,9 @@ neuland_window_show_requests_state_changed (GSimpleAction *action,
      on this being already set. */
   g_simple_action_set_state (action, parameter);
 
+  g_action_group_change_action_state (G_ACTION_GROUP (window), "search",
+                                      g_variant_new_boolean (FALSE));
+
   /* Show or hide widgets */
   gtk_widget_set_visible (GTK_WIDGET (priv->header_button_accept), show_requests);
   gtk_widget_set_visible (GTK_WIDGET (priv->header_button_reject), show_requests);
@@ -1242,6 +1285,263 @@ neuland_window_show_requests_state_changed (GSimpleAction *action,
     }
 }
 
+static void
+neuland_window_search_state_changed (GSimpleAction *action,
+                                     GVariant *parameter,
+                                     gpointer user_data)
+{
+  NeulandWindow *window = NEULAND_WINDOW (user_data);
+  NeulandWindowPrivate *priv = window->priv;
+  gboolean search = g_variant_get_boolean (parameter);
+
+  g_simple_action_set_state (action, parameter);
+  gtk_search_bar_set_search_mode (priv->search_bar, search);
+
+  if (search)
+    {
+      gtk_stack_set_visible_child (priv->side_pane_stack, priv->scrolled_window_search);
+      gtk_widget_grab_focus (GTK_WIDGET (priv->search_entry));
+    }
+  else
+    {
+      GVariant *variant = g_action_group_get_action_state (G_ACTION_GROUP (window),
+                                                           "show-requests");
+
+      gtk_stack_set_visible_child (priv->side_pane_stack,
+                                   g_variant_get_boolean (variant) ?
+                                   priv->scrolled_window_requests :
+                                   priv->scrolled_window_contacts);
+      g_variant_unref (variant);
+    }
+}
+
+static GtkWidget *
+neuland_window_create_search_row (NeulandContact *contact,
+                                  NeulandChatLogEntry *entry)
+{
+  GtkWidget *row = gtk_list_box_row_new ();
+  GtkWidget *label = gtk_label_new (NULL);
+  GDateTime *time = g_date_time_new_from_unix_local (entry->time / G_USEC_PER_SEC);
+  gchar *time_string = g_date_time_format (time, "%x");
+  gchar *markup = g_markup_printf_escaped ("<b>%s</b> <small>%s</small>\n%s",
+                                           neuland_contact_get_preferred_name (contact),
+                                           time_string, entry->text);
+
+  gtk_label_set_markup (GTK_LABEL (label), markup);
+  gtk_label_set_ellipsize (GTK_LABEL (label), PANGO_ELLIPSIZE_END);
+  gtk_label_set_lines (GTK_LABEL (label), 2);
+  gtk_label_set_xalign (GTK_LABEL (label), 0);
+  g_object_set (label, "margin", 6, NULL);
+  gtk_container_add (GTK_CONTAINER (row), label);
+  gtk_widget_show_all (row);
+
+  /* The contact may be deleted while the row is still around. */
+  g_object_set_data_full (G_OBJECT (row), "contact",
+                          g_object_ref (contact), g_object_unref);
+
+  g_free (markup);
+  g_free (time_string);
+  g_date_time_unref (time);
+
+  return row;
+}
+
+typedef struct
+{
+  NeulandContact *contact;
+  NeulandChatLog *chat_log;
+} SearchLog;
+
+typedef struct
+{
+  NeulandSearchIndex *search_index;
+  gchar *query;
+  GHashTable *logs_by_id;       /* tox id hex -> SearchLog */
+} SearchData;
+
+typedef struct
+{
+  NeulandContact *contact;
+  NeulandChatLogEntry *entry;
+} SearchResult;
+
+static void
+free_search_log (SearchLog *log)
+{
+  g_object_unref (log->contact);
+  g_object_unref (log->chat_log);
+  g_slice_free (SearchLog, log);
+}
+
+static void
+free_search_data (SearchData *data)
+{
+  g_object_unref (data->search_index);
+  g_free (data->query);
+  g_hash_table_destroy (data->logs_by_id);
+  g_slice_free (SearchData, data);
+}
+
+static void
+free_search_result (SearchResult *result)
+{
+  g_object_unref (result->contact);
+  neuland_chat_log_entry_free (result->entry);
+  g_slice_free (SearchResult, result);
+}
+
+/* Runs in a GTask thread, returns an array of SearchResult. Words are
+   matched by prefix, if nothing matches we look for them anywhere in
+   words. */
+static void
+neuland_window_search_thread (GTask *task,
+                              gpointer source_object,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+  SearchData *data = task_data;
+  GPtrArray *results;
+  GPtrArray *hits;
+  guint i;
+
+  hits = neuland_search_index_query (data->search_index, data->query,
+                                     NEULAND_SEARCH_MATCH_PREFIX, MAX_SEARCH_HITS);
+  if (hits->len == 0 && !g_cancellable_is_cancelled (cancellable))
+    {
+      g_ptr_array_unref (hits);
+      hits = neuland_search_index_query (data->search_index, data->query,
+                                         NEULAND_SEARCH_MATCH_SUBSTRING, MAX_SEARCH_HITS);
+    }
+
+  results = g_ptr_array_new_with_free_func ((GDestroyNotify) free_search_result);
+
+  for (i = 0; i < hits->len && !g_cancellable_is_cancelled (cancellable); i++)
+    {
+      NeulandSearchHit *hit = g_ptr_array_index (hits, i);
+      SearchLog *log = g_hash_table_lookup (data->logs_by_id, hit->name);
+      GPtrArray *entries;
+
+      /* Hits for deleted contacts */
+      if (log == NULL)
+        continue;
+
+      entries = neuland_chat_log_read (log->chat_log, hit->entry, 1);
+      if (entries->len == 1)
+        {
+          SearchResult *result = g_slice_new (SearchResult);
+
+          result->contact = g_object_ref (log->contact);
+          result->entry = g_ptr_array_index (entries, 0);
+          g_ptr_array_set_free_func (entries, NULL);
+          g_ptr_array_add (results, result);
+        }
+      g_ptr_array_unref (entries);
+    }
+
+  g_ptr_array_unref (hits);
+
+  /* If a newer search replaced this one, the task reports that it was
+     cancelled and frees the results with itself. */
+  g_task_return_pointer (task, results, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+on_search_done (GObject *source_object,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+  NeulandWindow *window = NEULAND_WINDOW (source_object);
+  NeulandWindowPrivate *priv = window->priv;
+  GPtrArray *results;
+  guint i;
+
+  results = g_task_propagate_pointer (G_TASK (result), NULL);
+  if (results == NULL)
+    return;
+
+  for (i = 0; i < results->len; i++)
+    {
+      SearchResult *search_result = g_ptr_array_index (results, i);
+
+      gtk_container_add (GTK_CONTAINER (priv->search_list_box),
+                         neuland_window_create_search_row (search_result->contact,
+                                                           search_result->entry));
+    }
+
+  g_clear_object (&priv->search_cancellable);
+  g_ptr_array_unref (results);
+}
+
+/* GtkSearchEntry already waits for typing to pause before emitting
+   this. The index and the chat logs are read in a thread, a search
+   still running when the query changes again is cancelled. */
+static void
+search_entry_changed_cb (NeulandWindow *window,
+                         GtkSearchEntry *search_entry)
+{
+  NeulandWindowPrivate *priv = window->priv;
+  NeulandSearchIndex *search_index = neuland_tox_get_search_index (priv->tox);
+  SearchData *data;
+  GList *children, *contacts, *l;
+  GTask *task;
+
+  if (priv->search_cancellable != NULL)
+    {
+      g_cancellable_cancel (priv->search_cancellable);
+      g_clear_object (&priv->search_cancellable);
+    }
+
+  children = gtk_container_get_children (GTK_CONTAINER (priv->search_list_box));
+  for (l = children; l != NULL; l = l->next)
+    gtk_widget_destroy (l->data);
+  g_list_free (children);
+
+  if (search_index == NULL)
+    return;
+
+  data = g_slice_new0 (SearchData);
+  data->search_index = g_object_ref (search_index);
+  data->query = g_strdup (gtk_entry_get_text (GTK_ENTRY (search_entry)));
+  data->logs_by_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) free_search_log);
+
+  contacts = neuland_tox_get_contacts (priv->tox);
+  for (l = contacts; l != NULL; l = l->next)
+    {
+      NeulandChatLog *chat_log = neuland_contact_get_chat_log (l->data);
+      SearchLog *log;
+
+      if (chat_log == NULL)
+        continue;
+
+      log = g_slice_new (SearchLog);
+      log->contact = g_object_ref (l->data);
+      log->chat_log = g_object_ref (chat_log);
+      g_hash_table_insert (data->logs_by_id,
+                           g_strdup (neuland_contact_get_tox_id_hex (l->data)), log);
+    }
+  g_list_free (contacts);
+
+  priv->search_cancellable = g_cancellable_new ();
+
+  task = g_task_new (window, priv->search_cancellable, on_search_done, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify) free_search_data);
+  g_task_run_in_thread (task, neuland_window_search_thread);
+  g_object_unref (task);
+}
+
+static void
+search_list_box_row_activated_cb (NeulandWindow *window,
+                                  GtkListBoxRow *row,
+                                  gpointer user_data)
+{
+  NeulandContact *contact = g_object_get_data (G_OBJECT (row), "contact");
+
+  /* Hits of contacts deleted since the search have no row anymore. */
+  if (neuland_window_get_row_for_contact (window, contact) != NULL)
+    neuland_window_activate_contact (window, contact);
+}
+
 static GActionEntry win_entries[] = {
   { "send-file", send_file_activated },
   { "accept-selected", accept_selected_activated },
@@ -1252,8 +1552,11 @@ static GActionEntry win_entries[] = {
   { "send-request", send_request_activated },
   { "cancel-request", cancel_request_activated },
   { "change-status", NULL, "i", "0", neuland_window_status_state_changed },
+  { "upload-limit", NULL, "i", "0", neuland_window_upload_limit_state_changed },
+  { "contact-upload-limit", NULL, "i", "0", neuland_window_contact_upload_limit_state_changed },
   { "show-requests", NULL, NULL, "false", neuland_window_show_requests_state_changed },
   { "selection", NULL, NULL, "false", neuland_window_selection_state_changed },
+  { "search", NULL, NULL, "false", neuland_window_search_state_changed },
 };
 
 static void
@@ -1263,6 +1566,12 @@ neuland_window_dispose (GObject *object)
 
   g_debug ("neuland_window_dispose (%p)", window);
 
+  if (window->priv->search_cancellable != NULL)
+    {
+      g_cancellable_cancel (window->priv->search_cancellable);
+      g_clear_object (&window->priv->search_cancellable);
+    }
+
   g_clear_object (&window->priv->tox);
 
   G_OBJECT_CLASS (neuland_window_parent_class)->dispose (object);
@@ -1300,6 +1609,10 @@ neuland_window_class_init (NeulandWindowClass *klass)
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, side_pane_stack);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, scrolled_window_contacts);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, scrolled_window_requests);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, scrolled_window_search);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, search_list_box);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, search_bar);
+  gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, search_entry);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, right_header_bar);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, left_header_bar);
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, header_button_send_file);
@@ -1317,6 +1630,8 @@ neuland_window_class_init (NeulandWindowClass *klass)
   gtk_widget_class_bind_template_child_private (widget_class, NeulandWindow, add_button_box);
 
   gtk_widget_class_bind_template_callback(widget_class, contacts_list_box_row_activated_cb);
+  gtk_widget_class_bind_template_callback(widget_class, search_list_box_row_activated_cb);
+  gtk_widget_class_bind_template_callback(widget_class, search_entry_changed_cb);
 
   gobject_class->set_property = neuland_window_set_property;
   gobject_class->get_property = neuland_window_get_property;